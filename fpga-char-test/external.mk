@@ -1,15 +1,24 @@
 FPGA_CHAR_TEST_VERSION = 1.0
 FPGA_CHAR_TEST_SITE = $(BR2_EXTERNAL_FPGA_CHAR_TEST_PATH)
 FPGA_CHAR_TEST_SITE_METHOD = local
+FPGA_CHAR_TEST_DEPENDENCIES = libvirtinefpga
 
 define FPGA_CHAR_TEST_BUILD_CMDS
-	$(MAKE) $(TARGET_CONFIGURE_OPTS) -C $(@D) all
+	$(MAKE) $(TARGET_CONFIGURE_OPTS) -C $(@D) \
+		UAPI_DIR=$(BR2_EXTERNAL_FPGA_CHAR_PATH)/uapi \
+		VFPGA_CFLAGS= VFPGA_LIBS=-lvirtinefpga all
 endef
 
 define FPGA_CHAR_TEST_INSTALL_TARGET_CMDS
 	$(INSTALL) -m 0755 -D $(@D)/test-addrs $(TARGET_DIR)/usr/bin/test-addrs
 	$(INSTALL) -m 0755 -D $(@D)/test-ioctls $(TARGET_DIR)/usr/bin/test-ioctls
 	$(INSTALL) -m 0755 -D $(@D)/test-give-virtine $(TARGET_DIR)/usr/bin/test-give-virtine
+	$(INSTALL) -m 0755 -D $(@D)/test-pool $(TARGET_DIR)/usr/bin/test-pool
+	$(INSTALL) -m 0755 -D $(@D)/fpga-bench $(TARGET_DIR)/usr/bin/fpga-bench
+	$(INSTALL) -m 0755 -D $(@D)/fpga-loadgen $(TARGET_DIR)/usr/bin/fpga-loadgen
+	$(INSTALL) -m 0755 -D $(@D)/fpga-replay $(TARGET_DIR)/usr/bin/fpga-replay
+	$(INSTALL) -m 0755 -D $(@D)/fpga-stages $(TARGET_DIR)/usr/bin/fpga-stages
+	$(INSTALL) -m 0755 -D $(@D)/virtine-top $(TARGET_DIR)/usr/bin/virtine-top
 endef
 
 $(eval $(generic-package))
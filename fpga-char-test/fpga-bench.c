@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libvirtinefpga.h"
+#include "histogram.h"
+
+#define MAX_SWEEP 16
+
+/* Invoke with fpga-bench [options], see usage() */
+
+enum output_format { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON };
+
+// One point of the sweep
+struct bench_config {
+    unsigned long snapshot_size;
+    unsigned long batch_factor;
+    unsigned long queue_depth;
+    unsigned long threads;
+};
+
+struct bench_thread {
+    pthread_t thread;
+    const struct bench_config *config;
+    struct histogram *hist; // Submit-to-complete latency, in ns
+    struct histogram *service; // The card's own started-to-finished time, in ns
+    uint64_t completed;
+    uint64_t errors; // Virtines that completed with a bad status
+    int ret;
+};
+
+struct sweep {
+    unsigned long values[MAX_SWEEP];
+    unsigned int nr;
+};
+
+static const char *device_path; // NULL is the aggregate device
+static unsigned long virtines_per_thread = 10000;
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(void)
+{
+    printf("Invoke with fpga-bench [options]\n");
+    printf("  -p <path>    Device to benchmark (default: the aggregate device)\n");
+    printf("  -n <count>   Virtines each thread cleans per run (default: 10000)\n");
+    printf("  -s <sizes>   Snapshot sizes to sweep, e.g. 4k,64k,1m (default: 4k)\n");
+    printf("  -b <factors> Batch factors to sweep, 0 is adaptive (default: 0)\n");
+    printf("  -d <depths>  Queue depths per thread to sweep (default: 1,8,32)\n");
+    printf("  -t <threads> Submitter thread counts to sweep (default: 1)\n");
+    printf("  -f <format>  text, csv, or json (default: text)\n");
+}
+
+// Parse a number with an optional k/m/g suffix
+static int parse_size(const char *str, unsigned long *value)
+{
+    char *end;
+    errno = 0;
+    *value = strtoul(str, &end, 0);
+    if(errno || end == str) {
+        return -EINVAL;
+    }
+    switch(*end) {
+    case 'k': case 'K': *value <<= 10; end++; break;
+    case 'm': case 'M': *value <<= 20; end++; break;
+    case 'g': case 'G': *value <<= 30; end++; break;
+    }
+    return *end ? -EINVAL : 0;
+}
+
+// Parse a comma-separated list of sizes
+static int parse_sweep(const char *str, struct sweep *sweep)
+{
+    char *copy = strdup(str), *saveptr, *tok;
+    int ret = 0;
+
+    sweep->nr = 0;
+    for(tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        if(sweep->nr == MAX_SWEEP || parse_size(tok, &sweep->values[sweep->nr]) < 0) {
+            ret = -EINVAL;
+            break;
+        }
+        sweep->nr++;
+    }
+    free(copy);
+    return sweep->nr ? ret : -EINVAL;
+}
+
+// Keep submitting until all NR are in, because a blocking submit only stops early on errors
+static int submit_all(struct vfpga *dev, void **virtines, unsigned int nr)
+{
+    while(nr) {
+        int ret = vfpga_submit(dev, virtines, nr);
+        if(ret <= 0) {
+            return ret ? ret : -EIO;
+        }
+        virtines += ret;
+        nr -= ret;
+    }
+    return 0;
+}
+
+/* Each thread is its own tenant with QUEUE_DEPTH virtines of its own. It
+ * keeps all of them in flight, resubmitting each one as soon as it is
+ * reaped, until it has seen virtines_per_thread of them cleaned. */
+static void *bench_thread(void *arg)
+{
+    struct bench_thread *t = arg;
+    const struct bench_config *config = t->config;
+    unsigned long depth = config->queue_depth;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t stride = (config->snapshot_size + page_size - 1) & ~(page_size - 1);
+    uint64_t submitted = 0, handle;
+    unsigned int nr;
+
+    struct vfpga *dev = vfpga_open(device_path, 0);
+    int open_errno = errno;
+    uint8_t *virtines = aligned_alloc(page_size, stride * depth);
+    uint64_t *submit_ns = calloc(depth, sizeof(*submit_ns));
+    void **batch = calloc(depth, sizeof(*batch));
+    struct virtine_completion_ts *completions = calloc(depth, sizeof(*completions));
+    if(!dev || !virtines || !submit_ns || !batch || !completions) {
+        t->ret = dev ? -ENOMEM : -open_errno;
+        pthread_barrier_wait(&start_barrier);
+        goto out;
+    }
+
+    t->ret = vfpga_register(dev, virtines, stride * depth, &handle);
+    pthread_barrier_wait(&start_barrier);
+    if(t->ret < 0) {
+        goto out;
+    }
+
+    // Fill the queue
+    for(nr = 0; nr < depth && submitted < virtines_per_thread; nr++, submitted++) {
+        batch[nr] = virtines + nr * stride;
+        submit_ns[nr] = now_ns();
+    }
+    t->ret = submit_all(dev, batch, nr);
+
+    while(!t->ret && t->completed < virtines_per_thread) {
+        int reaped = vfpga_reap_ts(dev, completions, depth, 1);
+        if(reaped < 0) {
+            t->ret = reaped;
+            break;
+        }
+
+        uint64_t now = now_ns();
+        nr = 0;
+        for(int i = 0; i < reaped; i++) {
+            size_t idx = (completions[i].virtine - (uintptr_t) virtines) / stride;
+            hist_record(t->hist, now - submit_ns[idx]);
+            if(completions[i].flags & VIRTINE_COMPLETION_TIMESTAMPS) {
+                hist_record(t->service, completions[i].finished_ns - completions[i].started_ns);
+            }
+            t->completed++;
+            if(completions[i].status) {
+                t->errors++;
+            }
+
+            if(submitted < virtines_per_thread) {
+                batch[nr++] = virtines + idx * stride;
+                submit_ns[idx] = now;
+                submitted++;
+            }
+        }
+        if(nr) {
+            t->ret = submit_all(dev, batch, nr);
+        }
+    }
+
+out:
+    free(completions);
+    free(batch);
+    free(submit_ns);
+    vfpga_close(dev); // Unregisters the virtines too
+    free(virtines);
+    return NULL;
+}
+
+static void print_header(enum output_format format)
+{
+    switch(format) {
+    case FORMAT_TEXT:
+        printf("%10s %6s %6s %7s %12s %9s %10s %10s %10s %10s %12s %12s %7s\n", "snapshot",
+               "batch", "depth", "threads", "cleanups/s", "GB/s", "p50(us)", "p99(us)",
+               "p99.9(us)", "max(us)", "svc p50(us)", "svc p99(us)", "errors");
+        break;
+    case FORMAT_CSV:
+        printf("snapshot_size,batch_factor,queue_depth,threads,virtines,errors,seconds,"
+               "cleanups_per_sec,gb_per_sec,min_ns,mean_ns,p50_ns,p99_ns,p999_ns,max_ns,"
+               "service_mean_ns,service_p50_ns,service_p99_ns\n");
+        break;
+    case FORMAT_JSON:
+        printf("[");
+        break;
+    }
+}
+
+/* HIST is the submit-to-complete latency, and SERVICE is how long the card
+ * itself spent on each virtine, from the completions' timestamps. */
+static void print_result(enum output_format format, const struct bench_config *config,
+                         const struct histogram *hist, const struct histogram *service,
+                         uint64_t errors, double seconds, int first)
+{
+    double rate = hist->total / seconds;
+    double gbps = rate * config->snapshot_size / 1e9;
+    uint64_t p50 = hist_percentile(hist, 50.0);
+    uint64_t p99 = hist_percentile(hist, 99.0);
+    uint64_t p999 = hist_percentile(hist, 99.9);
+    uint64_t service_p50 = hist_percentile(service, 50.0);
+    uint64_t service_p99 = hist_percentile(service, 99.0);
+
+    switch(format) {
+    case FORMAT_TEXT:
+        printf("%10lu %6lu %6lu %7lu %12.0f %9.3f %10.1f %10.1f %10.1f %10.1f %12.1f %12.1f %7llu\n",
+               config->snapshot_size, config->batch_factor, config->queue_depth,
+               config->threads, rate, gbps, p50 / 1e3, p99 / 1e3, p999 / 1e3,
+               hist->max / 1e3, service_p50 / 1e3, service_p99 / 1e3,
+               (unsigned long long) errors);
+        break;
+    case FORMAT_CSV:
+        printf("%lu,%lu,%lu,%lu,%llu,%llu,%.6f,%.1f,%.6f,%llu,%.1f,%llu,%llu,%llu,%llu,"
+               "%.1f,%llu,%llu\n",
+               config->snapshot_size, config->batch_factor, config->queue_depth,
+               config->threads, (unsigned long long) hist->total,
+               (unsigned long long) errors, seconds, rate, gbps,
+               (unsigned long long) hist->min, hist_mean(hist), (unsigned long long) p50,
+               (unsigned long long) p99, (unsigned long long) p999,
+               (unsigned long long) hist->max, hist_mean(service),
+               (unsigned long long) service_p50, (unsigned long long) service_p99);
+        break;
+    case FORMAT_JSON:
+        printf("%s\n  {\"snapshot_size\": %lu, \"batch_factor\": %lu, \"queue_depth\": %lu, "
+               "\"threads\": %lu, \"virtines\": %llu, \"errors\": %llu, \"seconds\": %.6f, "
+               "\"cleanups_per_sec\": %.1f, \"gb_per_sec\": %.6f, \"latency_ns\": "
+               "{\"min\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p99\": %llu, "
+               "\"p999\": %llu, \"max\": %llu}, \"service_ns\": {\"mean\": %.1f, "
+               "\"p50\": %llu, \"p99\": %llu}}",
+               first ? "" : ",", config->snapshot_size, config->batch_factor,
+               config->queue_depth, config->threads, (unsigned long long) hist->total,
+               (unsigned long long) errors, seconds, rate, gbps,
+               (unsigned long long) hist->min, hist_mean(hist), (unsigned long long) p50,
+               (unsigned long long) p99, (unsigned long long) p999,
+               (unsigned long long) hist->max, hist_mean(service),
+               (unsigned long long) service_p50, (unsigned long long) service_p99);
+        break;
+    }
+    fflush(stdout);
+}
+
+/* Run one point of the sweep. The snapshot and batch factor are set through
+ * CONTROL before any of the threads start. */
+static int run_bench(struct vfpga *control, const struct bench_config *config,
+                     const uint8_t *snapshot, struct histogram *hist,
+                     struct histogram *service, uint64_t *errors, double *seconds)
+{
+    struct bench_thread *threads = calloc(config->threads, sizeof(*threads));
+    unsigned long i, started;
+    uint64_t start;
+    int ret;
+
+    if(!threads) {
+        return -ENOMEM;
+    }
+    if(!config->snapshot_size || !config->queue_depth || !config->threads) {
+        fprintf(stderr, "Snapshot size, queue depth and thread count must not be 0\n");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = vfpga_set_snapshot(control, snapshot, config->snapshot_size);
+    if(ret < 0) {
+        fprintf(stderr, "Could not set a %lu byte snapshot: %s\n",
+                config->snapshot_size, strerror(-ret));
+        goto out;
+    }
+    ret = vfpga_set_batch_factor(control, config->batch_factor);
+    if(ret < 0) {
+        fprintf(stderr, "Could not set batch factor %lu: %s\n",
+                config->batch_factor, strerror(-ret));
+        goto out;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, config->threads + 1);
+    for(started = 0; started < config->threads; started++) {
+        threads[started].config = config;
+        threads[started].hist = hist_alloc();
+        threads[started].service = hist_alloc();
+        if(!threads[started].hist || !threads[started].service ||
+           pthread_create(&threads[started].thread, NULL, bench_thread, &threads[started])) {
+            // The threads that did start are stuck on the barrier
+            fprintf(stderr, "Could not start thread %lu\n", started);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    start = now_ns();
+    for(i = 0; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    *seconds = (now_ns() - start) / 1e9;
+    pthread_barrier_destroy(&start_barrier);
+
+    hist_reset(hist);
+    hist_reset(service);
+    *errors = 0;
+    for(i = 0; i < started; i++) {
+        if(threads[i].ret < 0 && !ret) {
+            ret = threads[i].ret;
+            fprintf(stderr, "Thread %lu failed: %s\n", i, strerror(-ret));
+        }
+        hist_merge(hist, threads[i].hist);
+        hist_merge(service, threads[i].service);
+        *errors += threads[i].errors;
+        free(threads[i].hist);
+        free(threads[i].service);
+    }
+
+out:
+    free(threads);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    struct sweep sizes = { .values = { 4096 }, .nr = 1 };
+    struct sweep batch_factors = { .values = { 0 }, .nr = 1 };
+    struct sweep depths = { .values = { 1, 8, 32 }, .nr = 3 };
+    struct sweep thread_counts = { .values = { 1 }, .nr = 1 };
+    enum output_format format = FORMAT_TEXT;
+    int opt, ret = 0, first = 1;
+
+    while((opt = getopt(argc, argv, "p:n:s:b:d:t:f:h")) != -1) {
+        switch(opt) {
+        case 'p': device_path = optarg; break;
+        case 'n': ret = parse_size(optarg, &virtines_per_thread); break;
+        case 's': ret = parse_sweep(optarg, &sizes); break;
+        case 'b': ret = parse_sweep(optarg, &batch_factors); break;
+        case 'd': ret = parse_sweep(optarg, &depths); break;
+        case 't': ret = parse_sweep(optarg, &thread_counts); break;
+        case 'f':
+            if(!strcmp(optarg, "text")) {
+                format = FORMAT_TEXT;
+            } else if(!strcmp(optarg, "csv")) {
+                format = FORMAT_CSV;
+            } else if(!strcmp(optarg, "json")) {
+                format = FORMAT_JSON;
+            } else {
+                ret = -EINVAL;
+            }
+            break;
+        default:
+            usage();
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if(ret < 0) {
+            printf("Bad argument to -%c: %s\n", opt, optarg);
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct vfpga *control = vfpga_open(device_path, 0);
+    if(!control) {
+        perror("Could not open Virtine FPGA character device");
+        printf("Are you sure you loaded the fpga_char kernel module?\n");
+        return EXIT_FAILURE;
+    }
+
+    // The biggest snapshot, filled with something other than the virtines' zeroes
+    unsigned long max_size = 0;
+    for(unsigned int i = 0; i < sizes.nr; i++) {
+        if(sizes.values[i] > max_size) {
+            max_size = sizes.values[i];
+        }
+    }
+    uint8_t *snapshot = malloc(max_size);
+    struct histogram *hist = hist_alloc();
+    struct histogram *service = hist_alloc();
+    if(!snapshot || !hist || !service) {
+        printf("Out of memory!\n");
+        return EXIT_FAILURE;
+    }
+    memset(snapshot, 0xa5, max_size);
+
+    print_header(format);
+    for(unsigned int s = 0; s < sizes.nr && !ret; s++) {
+        for(unsigned int b = 0; b < batch_factors.nr && !ret; b++) {
+            for(unsigned int d = 0; d < depths.nr && !ret; d++) {
+                for(unsigned int t = 0; t < thread_counts.nr && !ret; t++) {
+                    struct bench_config config = {
+                        .snapshot_size = sizes.values[s],
+                        .batch_factor = batch_factors.values[b],
+                        .queue_depth = depths.values[d],
+                        .threads = thread_counts.values[t],
+                    };
+                    uint64_t errors;
+                    double seconds;
+
+                    ret = run_bench(control, &config, snapshot, hist, service, &errors,
+                                    &seconds);
+                    if(!ret) {
+                        print_result(format, &config, hist, service, errors, seconds, first);
+                        first = 0;
+                    }
+                }
+            }
+        }
+    }
+    if(format == FORMAT_JSON) {
+        printf("\n]\n");
+    }
+
+    // Hand interrupt moderation back to the driver
+    vfpga_set_batch_factor(control, 0);
+    vfpga_close(control);
+    free(hist);
+    free(service);
+    free(snapshot);
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
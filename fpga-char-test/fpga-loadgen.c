@@ -0,0 +1,535 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <math.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libvirtinefpga.h"
+#include "histogram.h"
+
+/* Invoke with fpga-loadgen [options], see usage()
+ *
+ * An open-loop load generator. Requests for a virtine arrive on a schedule
+ * that does not care how far behind the device is, the way they do in
+ * production. Each arrival takes a clean virtine from the set, dirties some of
+ * its pages like a run would, and hands it back to be cleaned. Once it is
+ * clean, it goes back into the set for the next arrival. Arrivals that find
+ * no clean virtine wait in a backlog, and their latency is counted from when
+ * they ARRIVED, not from when a virtine freed up for them, so that a device
+ * which cannot keep up shows it. */
+
+enum output_format { FORMAT_TEXT, FORMAT_CSV };
+
+struct arrival {
+    uint64_t ns; // When the request arrived, relative to the start
+    double dirty_fraction;
+};
+
+struct loadgen {
+    struct vfpga *dev;
+    uint8_t *virtines;
+    size_t stride;
+    size_t page_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // Clean virtines, by index
+    unsigned int *free;
+    unsigned int nr_free;
+
+    // Arrivals with no virtine yet, oldest first
+    struct arrival *backlog;
+    size_t backlog_head, backlog_tail, backlog_size;
+
+    // When the request each virtine is serving arrived, and was submitted
+    uint64_t *arrived_ns;
+    uint64_t *submitted_ns;
+    double *dirty_fraction;
+
+    unsigned int in_flight;
+    int done; // No more arrivals are coming
+    int error;
+
+    // Since the last report
+    uint64_t interval_arrivals;
+    uint64_t interval_completions;
+    struct histogram *interval_latency;
+
+    // For the whole run
+    uint64_t arrivals;
+    uint64_t completions;
+    uint64_t errors;
+    struct histogram *latency; // Arrival to clean
+    struct histogram *service; // Submission to clean
+};
+
+static uint64_t start_ns;
+static uint64_t seed = 0x9e3779b97f4a7c15ull;
+static enum output_format format = FORMAT_TEXT;
+static double report_interval = 1.0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t ns)
+{
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* xorshift64*, so runs can be repeated with -S. Each thread has its own
+ * STATE. */
+static uint64_t rng_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dull;
+}
+
+// Uniform in (0, 1]
+static double rng_unit(uint64_t *state)
+{
+    return ((rng_next(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static void usage(void)
+{
+    printf("Invoke with fpga-loadgen [options]\n");
+    printf("  -p <path>      Device to load (default: the aggregate device)\n");
+    printf("  -r <rate>      Mean arrivals per second, Poisson distributed (default: 1000)\n");
+    printf("  -T <seconds>   How long requests keep arriving (default: 10)\n");
+    printf("  -i <trace>     Replay arrivals from a file instead of -r and -T.\n");
+    printf("                 Each line is \"<microseconds since start> [dirty fraction]\"\n");
+    printf("  -N <virtines>  Size of the virtine set (default: 256)\n");
+    printf("  -s <bytes>     Size of each virtine and the snapshot (default: 65536)\n");
+    printf("  -D <fraction>  Fraction of each virtine's pages a run dirties (default: 0.25)\n");
+    printf("  -P <seconds>   Report interval (default: 1)\n");
+    printf("  -S <seed>      Seed for the arrival schedule and dirtied pages\n");
+    printf("  -f <format>    text or csv (default: text)\n");
+}
+
+/* Dirty FRACTION of virtine IDX's pages, picked at random, the way a run of
+ * the virtine would before it is handed back. */
+static void dirty_virtine(struct loadgen *lg, unsigned int idx, uint64_t *rng)
+{
+    size_t nr_pages = lg->stride / lg->page_size;
+    size_t nr_dirty = lg->dirty_fraction[idx] * nr_pages + 0.5;
+    uint8_t *virtine = lg->virtines + idx * lg->stride;
+
+    if(nr_dirty >= nr_pages) {
+        for(size_t i = 0; i < nr_pages; i++) {
+            virtine[i * lg->page_size] = 0xff;
+        }
+        return;
+    }
+    for(size_t i = 0; i < nr_dirty; i++) {
+        virtine[(rng_next(rng) % nr_pages) * lg->page_size] = 0xff;
+    }
+}
+
+/* Give virtine IDX to ARRIVAL. Called with LOCK held, and the caller runs
+ * and submits IDX with run_virtine once it drops LOCK. */
+static void start_request(struct loadgen *lg, unsigned int idx, const struct arrival *arrival)
+{
+    lg->arrived_ns[idx] = arrival->ns;
+    lg->dirty_fraction[idx] = arrival->dirty_fraction;
+    lg->in_flight++;
+    pthread_cond_signal(&lg->cond);
+}
+
+static int run_virtine(struct loadgen *lg, unsigned int idx, uint64_t *rng)
+{
+    void *virtine = lg->virtines + idx * lg->stride;
+
+    dirty_virtine(lg, idx, rng);
+    lg->submitted_ns[idx] = now_ns() - start_ns;
+    int ret = vfpga_submit(lg->dev, &virtine, 1);
+    return ret == 1 ? 0 : (ret < 0 ? ret : -EIO);
+}
+
+static int backlog_push(struct loadgen *lg, const struct arrival *arrival)
+{
+    if(lg->backlog_tail == lg->backlog_size) {
+        size_t len = lg->backlog_tail - lg->backlog_head;
+        if(lg->backlog_head > len) {
+            // Mostly drained, slide what is left down instead of growing
+            memmove(lg->backlog, lg->backlog + lg->backlog_head, len * sizeof(*lg->backlog));
+        } else {
+            size_t size = lg->backlog_size ? 2 * lg->backlog_size : 1024;
+            struct arrival *backlog = realloc(lg->backlog, size * sizeof(*backlog));
+            if(!backlog) {
+                return -ENOMEM;
+            }
+            lg->backlog = backlog;
+            lg->backlog_size = size;
+            memmove(lg->backlog, lg->backlog + lg->backlog_head, len * sizeof(*lg->backlog));
+        }
+        lg->backlog_head = 0;
+        lg->backlog_tail = len;
+    }
+    lg->backlog[lg->backlog_tail++] = *arrival;
+    return 0;
+}
+
+static size_t backlog_len(const struct loadgen *lg)
+{
+    return lg->backlog_tail - lg->backlog_head;
+}
+
+/* A request arrived. Start it on a clean virtine, or queue it if there are
+ * none. */
+static int arrive(struct loadgen *lg, const struct arrival *arrival, uint64_t *rng)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&lg->lock);
+    lg->arrivals++;
+    lg->interval_arrivals++;
+    if(!lg->nr_free) {
+        ret = backlog_push(lg, arrival);
+        pthread_mutex_unlock(&lg->lock);
+        return ret;
+    }
+    unsigned int idx = lg->free[--lg->nr_free];
+    start_request(lg, idx, arrival);
+    pthread_mutex_unlock(&lg->lock);
+
+    return run_virtine(lg, idx, rng);
+}
+
+/* Reap cleaned virtines, and hand each straight to the oldest request in the
+ * backlog, or put it back in the set. */
+static void *reaper_thread(void *arg)
+{
+    struct loadgen *lg = arg;
+    struct virtine_completion completions[64];
+    unsigned int resubmit[64];
+    uint64_t rng = seed ^ 0xda942042e4dd58b5ull;
+
+    for(;;) {
+        pthread_mutex_lock(&lg->lock);
+        while(!lg->in_flight && !lg->done && !lg->error) {
+            pthread_cond_wait(&lg->cond, &lg->lock);
+        }
+        if(!lg->in_flight || lg->error) {
+            pthread_mutex_unlock(&lg->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&lg->lock);
+
+        int reaped = vfpga_reap(lg->dev, completions, 64, 1);
+        if(reaped < 0) {
+            pthread_mutex_lock(&lg->lock);
+            lg->error = reaped;
+            pthread_mutex_unlock(&lg->lock);
+            return NULL;
+        }
+
+        uint64_t now = now_ns() - start_ns;
+        unsigned int nr_resubmit = 0;
+        pthread_mutex_lock(&lg->lock);
+        for(int i = 0; i < reaped; i++) {
+            unsigned int idx = (completions[i].virtine - (uintptr_t) lg->virtines) / lg->stride;
+            hist_record(lg->latency, now - lg->arrived_ns[idx]);
+            hist_record(lg->interval_latency, now - lg->arrived_ns[idx]);
+            hist_record(lg->service, now - lg->submitted_ns[idx]);
+            lg->in_flight--;
+            lg->completions++;
+            lg->interval_completions++;
+            if(completions[i].status) {
+                lg->errors++;
+            }
+
+            if(backlog_len(lg)) {
+                start_request(lg, idx, &lg->backlog[lg->backlog_head++]);
+                resubmit[nr_resubmit++] = idx;
+            } else {
+                lg->free[lg->nr_free++] = idx;
+            }
+        }
+        pthread_mutex_unlock(&lg->lock);
+
+        for(unsigned int i = 0; i < nr_resubmit; i++) {
+            int ret = run_virtine(lg, resubmit[i], &rng);
+            if(ret < 0) {
+                pthread_mutex_lock(&lg->lock);
+                lg->error = ret;
+                pthread_mutex_unlock(&lg->lock);
+                return NULL;
+            }
+        }
+    }
+}
+
+static void print_header(void)
+{
+    if(format == FORMAT_CSV) {
+        printf("seconds,offered_per_sec,achieved_per_sec,backlog,in_flight,"
+               "p50_ns,p99_ns,p999_ns\n");
+    } else {
+        printf("%8s %12s %12s %10s %9s %10s %10s %10s\n", "time(s)", "offered/s",
+               "achieved/s", "backlog", "in-flight", "p50(ms)", "p99(ms)", "p99.9(ms)");
+    }
+}
+
+// Print and reset the interval counters. Called with LOCK held.
+static void report_interval_locked(struct loadgen *lg, double elapsed, double interval)
+{
+    double offered = lg->interval_arrivals / interval;
+    double achieved = lg->interval_completions / interval;
+    uint64_t p50 = hist_percentile(lg->interval_latency, 50.0);
+    uint64_t p99 = hist_percentile(lg->interval_latency, 99.0);
+    uint64_t p999 = hist_percentile(lg->interval_latency, 99.9);
+
+    if(format == FORMAT_CSV) {
+        printf("%.3f,%.1f,%.1f,%zu,%u,%llu,%llu,%llu\n", elapsed, offered, achieved,
+               backlog_len(lg), lg->in_flight, (unsigned long long) p50,
+               (unsigned long long) p99, (unsigned long long) p999);
+    } else {
+        printf("%8.1f %12.0f %12.0f %10zu %9u %10.3f %10.3f %10.3f\n", elapsed, offered,
+               achieved, backlog_len(lg), lg->in_flight, p50 / 1e6, p99 / 1e6, p999 / 1e6);
+    }
+    fflush(stdout);
+
+    lg->interval_arrivals = 0;
+    lg->interval_completions = 0;
+    hist_reset(lg->interval_latency);
+}
+
+static void *reporter_thread(void *arg)
+{
+    struct loadgen *lg = arg;
+    uint64_t interval_ns = report_interval * 1e9;
+    uint64_t next = interval_ns;
+
+    for(;;) {
+        sleep_until_ns(start_ns + next);
+        pthread_mutex_lock(&lg->lock);
+        if(lg->done && !lg->in_flight && !backlog_len(lg)) {
+            pthread_mutex_unlock(&lg->lock);
+            return NULL;
+        }
+        report_interval_locked(lg, next / 1e9, report_interval);
+        pthread_mutex_unlock(&lg->lock);
+        next += interval_ns;
+    }
+}
+
+/* Read a whole trace of arrivals. Lines that do not start with a number, like
+ * comments, are skipped. */
+static struct arrival *read_trace(const char *path, double default_dirty, size_t *nr)
+{
+    FILE *trace = fopen(path, "r");
+    struct arrival *arrivals = NULL;
+    size_t size = 0;
+    char line[256];
+
+    if(!trace) {
+        return NULL;
+    }
+    *nr = 0;
+    while(fgets(line, sizeof(line), trace)) {
+        double us, dirty = default_dirty;
+        int fields = sscanf(line, "%lf %lf", &us, &dirty);
+        if(fields < 1) {
+            continue;
+        }
+        if(*nr == size) {
+            size = size ? 2 * size : 1024;
+            struct arrival *grown = realloc(arrivals, size * sizeof(*arrivals));
+            if(!grown) {
+                free(arrivals);
+                fclose(trace);
+                errno = ENOMEM;
+                return NULL;
+            }
+            arrivals = grown;
+        }
+        arrivals[*nr].ns = us * 1e3;
+        arrivals[*nr].dirty_fraction = dirty;
+        (*nr)++;
+    }
+    fclose(trace);
+    if(!*nr) {
+        errno = EINVAL;
+    }
+    return arrivals;
+}
+
+int main(int argc, char **argv) {
+    const char *device_path = NULL, *trace_path = NULL;
+    unsigned long nr_virtines = 256, virtine_size = 65536;
+    double rate = 1000.0, duration = 10.0, dirty_fraction = 0.25;
+    struct arrival *trace = NULL;
+    size_t trace_len = 0;
+    struct loadgen lg = { 0 };
+    pthread_t reaper, reporter;
+    uint64_t handle;
+    int opt, ret;
+
+    while((opt = getopt(argc, argv, "p:r:T:i:N:s:D:P:S:f:h")) != -1) {
+        switch(opt) {
+        case 'p': device_path = optarg; break;
+        case 'r': rate = strtod(optarg, NULL); break;
+        case 'T': duration = strtod(optarg, NULL); break;
+        case 'i': trace_path = optarg; break;
+        case 'N': nr_virtines = strtoul(optarg, NULL, 0); break;
+        case 's': virtine_size = strtoul(optarg, NULL, 0); break;
+        case 'D': dirty_fraction = strtod(optarg, NULL); break;
+        case 'P': report_interval = strtod(optarg, NULL); break;
+        case 'S': seed = strtoull(optarg, NULL, 0) | 1; break;
+        case 'f':
+            if(!strcmp(optarg, "csv")) {
+                format = FORMAT_CSV;
+            } else if(strcmp(optarg, "text")) {
+                usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage();
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if(rate <= 0 || duration <= 0 || report_interval <= 0 || !nr_virtines ||
+       !virtine_size || dirty_fraction < 0 || dirty_fraction > 1) {
+        printf("Rate, duration, interval, virtines and size must be positive, "
+               "and the dirty fraction in [0, 1]\n");
+        return EXIT_FAILURE;
+    }
+
+    if(trace_path) {
+        trace = read_trace(trace_path, dirty_fraction, &trace_len);
+        if(!trace) {
+            perror("Could not read the arrival trace");
+            return EXIT_FAILURE;
+        }
+    }
+
+    lg.dev = vfpga_open(device_path, 0);
+    if(!lg.dev) {
+        perror("Could not open Virtine FPGA character device");
+        printf("Are you sure you loaded the fpga_char kernel module?\n");
+        return EXIT_FAILURE;
+    }
+
+    lg.page_size = sysconf(_SC_PAGESIZE);
+    lg.stride = (virtine_size + lg.page_size - 1) & ~(lg.page_size - 1);
+    lg.virtines = aligned_alloc(lg.page_size, lg.stride * nr_virtines);
+    lg.free = calloc(nr_virtines, sizeof(*lg.free));
+    lg.arrived_ns = calloc(nr_virtines, sizeof(*lg.arrived_ns));
+    lg.submitted_ns = calloc(nr_virtines, sizeof(*lg.submitted_ns));
+    lg.dirty_fraction = calloc(nr_virtines, sizeof(*lg.dirty_fraction));
+    lg.latency = hist_alloc();
+    lg.service = hist_alloc();
+    lg.interval_latency = hist_alloc();
+    uint8_t *snapshot = malloc(virtine_size);
+    if(!lg.virtines || !lg.free || !lg.arrived_ns || !lg.submitted_ns ||
+       !lg.dirty_fraction || !lg.latency || !lg.service || !lg.interval_latency ||
+       !snapshot) {
+        printf("Out of memory!\n");
+        return EXIT_FAILURE;
+    }
+    memset(snapshot, 0xa5, virtine_size);
+    pthread_mutex_init(&lg.lock, NULL);
+    pthread_cond_init(&lg.cond, NULL);
+
+    ret = vfpga_set_snapshot(lg.dev, snapshot, virtine_size);
+    if(ret < 0) {
+        printf("Could not set the snapshot: %s\n", strerror(-ret));
+        return EXIT_FAILURE;
+    }
+    ret = vfpga_register(lg.dev, lg.virtines, lg.stride * nr_virtines, &handle);
+    if(ret < 0) {
+        printf("Could not register the virtines: %s\n", strerror(-ret));
+        return EXIT_FAILURE;
+    }
+
+    // Every virtine starts out clean, but make sure each page is faulted in
+    for(unsigned long i = 0; i < nr_virtines; i++) {
+        memcpy(lg.virtines + i * lg.stride, snapshot, virtine_size);
+        lg.free[lg.nr_free++] = nr_virtines - 1 - i;
+    }
+
+    print_header();
+    start_ns = now_ns();
+    pthread_create(&reaper, NULL, reaper_thread, &lg);
+    pthread_create(&reporter, NULL, reporter_thread, &lg);
+
+    // The arrivals, on the schedule, regardless of how the device is doing
+    uint64_t end_ns = duration * 1e9, next_ns = 0, rng = seed;
+    for(size_t i = 0; ; i++) {
+        struct arrival arrival = { .dirty_fraction = dirty_fraction };
+        if(trace) {
+            if(i == trace_len) {
+                break;
+            }
+            arrival = trace[i];
+        } else {
+            next_ns += -log(rng_unit(&rng)) / rate * 1e9;
+            if(next_ns >= end_ns) {
+                break;
+            }
+            arrival.ns = next_ns;
+        }
+
+        sleep_until_ns(start_ns + arrival.ns);
+        ret = arrive(&lg, &arrival, &rng);
+        if(ret < 0) {
+            printf("Could not submit a virtine: %s\n", strerror(-ret));
+            break;
+        }
+        if(lg.error) { // Racy, but it is only there to stop early
+            break;
+        }
+    }
+    uint64_t arrivals_end_ns = now_ns() - start_ns;
+    size_t backlog_at_end;
+
+    pthread_mutex_lock(&lg.lock);
+    lg.done = 1;
+    backlog_at_end = backlog_len(&lg);
+    pthread_cond_signal(&lg.cond);
+    pthread_mutex_unlock(&lg.lock);
+
+    // Let everything that arrived be cleaned
+    pthread_join(reaper, NULL);
+    uint64_t drained_ns = now_ns() - start_ns;
+    pthread_join(reporter, NULL);
+
+    double seconds = arrivals_end_ns / 1e9;
+    const char *prefix = format == FORMAT_CSV ? "# " : "";
+    printf("%soffered:   %llu virtines in %.3fs (%.1f/s)\n", prefix,
+           (unsigned long long) lg.arrivals, seconds, lg.arrivals / seconds);
+    printf("%sachieved:  %llu virtines in %.3fs (%.1f/s), %llu with errors\n", prefix,
+           (unsigned long long) lg.completions, drained_ns / 1e9,
+           lg.completions / (drained_ns / 1e9), (unsigned long long) lg.errors);
+    printf("%sbacklog:   %zu when arrivals stopped, growing %.1f/s, drained in %.3fs\n",
+           prefix, backlog_at_end, backlog_at_end / seconds,
+           (drained_ns - arrivals_end_ns) / 1e9);
+    printf("%slatency:   p50 %.3fms p99 %.3fms p99.9 %.3fms max %.3fms (arrival to clean)\n",
+           prefix, hist_percentile(lg.latency, 50.0) / 1e6,
+           hist_percentile(lg.latency, 99.0) / 1e6, hist_percentile(lg.latency, 99.9) / 1e6,
+           lg.latency->max / 1e6);
+    printf("%sservice:   p50 %.3fms p99 %.3fms p99.9 %.3fms max %.3fms (submit to clean)\n",
+           prefix, hist_percentile(lg.service, 50.0) / 1e6,
+           hist_percentile(lg.service, 99.0) / 1e6, hist_percentile(lg.service, 99.9) / 1e6,
+           lg.service->max / 1e6);
+    if(lg.error) {
+        printf("%sstopped early: %s\n", prefix, strerror(-lg.error));
+    }
+
+    vfpga_close(lg.dev);
+    return lg.error || ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <endian.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libvirtinefpga.h"
+#include "histogram.h"
+
+/* Invoke with fpga-replay [options] <trace>...
+ *
+ * Re-issue traces recorded by libvirtinefpga (see vfpga_trace.h) against the
+ * device, at the speed they were recorded or scaled, and report the
+ * submit-to-complete latencies they see. Each trace was one tenant, so each is
+ * replayed through its own device handle, all of them at once.
+ *
+ * The virtines are not the recorded ones. Every distinct address in a trace
+ * is given its own slot in a region of ours, so the device sees the same
+ * pattern of reuse, and a slot that is still being cleaned when the trace
+ * reuses it is waited for, like the original program must have. */
+
+#define MAX_TRACES 16
+#define MAX_BATCH 64
+
+static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9, 99.99, 100.0 };
+#define NR_PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
+
+struct replay {
+    const char *path;
+    struct vfpga_trace_record *records;
+    size_t nr_records;
+
+    // Distinct virtine addresses to slots
+    uint64_t *slot_addrs;
+    unsigned int *slot_ids; // In the order each address was first seen
+    size_t slot_map_size; // A power of 2
+    unsigned int nr_addrs;
+    unsigned int nr_slots;
+
+    struct vfpga *dev;
+    uint8_t *slots;
+    size_t stride;
+    uint64_t *scheduled_ns; // When each slot's current cleanup should have been issued
+    uint8_t *in_flight;
+    unsigned int nr_in_flight;
+    int done;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    pthread_t issuer, reaper;
+    struct histogram *recorded; // What the trace saw
+    struct histogram *replayed;
+    uint64_t waits; // Submissions held up because their slot was still in flight
+};
+
+static const char *device_path;
+static double speed = 1.0;
+static unsigned int max_slots = 4096;
+static uint64_t start_ns;
+static uint8_t *snapshot;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t ns)
+{
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void usage(void)
+{
+    printf("Invoke with fpga-replay [options] <trace>...\n");
+    printf("  -p <path>   Device to replay against (default: the aggregate device)\n");
+    printf("  -x <speed>  Replay this many times faster than recorded, 0 for\n");
+    printf("              as fast as possible (default: 1)\n");
+    printf("  -m <slots>  Most distinct virtines to give slots to per trace (default: 4096)\n");
+    printf("  -o <file>   Save the replayed latency distribution to FILE\n");
+    printf("  -c <file>   Compare the replayed latencies to ones saved with -o\n");
+}
+
+/* Traces are little-endian on disk, whatever recorded them. */
+static void record_from_le(struct vfpga_trace_record *record)
+{
+    record->ns = le64toh(record->ns);
+    record->virtine = le64toh(record->virtine);
+    record->size = le32toh(record->size);
+    record->submitter = le32toh(record->submitter);
+    record->snapshot = le16toh(record->snapshot);
+    record->status = (int32_t) le32toh((uint32_t) record->status);
+}
+
+static int read_trace(struct replay *replay)
+{
+    struct vfpga_trace_header header;
+    FILE *trace = fopen(replay->path, "r");
+    size_t size = 0;
+    int ret = 0;
+
+    if(!trace) {
+        return -errno;
+    }
+    if(fread(&header, sizeof(header), 1, trace) != 1 ||
+       memcmp(header.magic, VFPGA_TRACE_MAGIC, sizeof(header.magic)) ||
+       le32toh(header.version) != VFPGA_TRACE_VERSION ||
+       le32toh(header.record_size) != sizeof(struct vfpga_trace_record)) {
+        fclose(trace);
+        return -EINVAL;
+    }
+
+    for(;;) {
+        if(replay->nr_records == size) {
+            size = size ? 2 * size : 4096;
+            struct vfpga_trace_record *records = realloc(replay->records,
+                                                         size * sizeof(*records));
+            if(!records) {
+                ret = -ENOMEM;
+                break;
+            }
+            replay->records = records;
+        }
+        if(fread(&replay->records[replay->nr_records], sizeof(*replay->records), 1,
+                 trace) != 1) {
+            break;
+        }
+        record_from_le(&replay->records[replay->nr_records]);
+        replay->nr_records++;
+    }
+    fclose(trace);
+    return ret;
+}
+
+/* Find ADDR's entry in the slot map, adding it if it is not there yet and
+ * INSERT is set. Returns SIZE_MAX if it is not there. */
+static size_t map_entry(struct replay *replay, uint64_t addr, int insert)
+{
+    size_t mask = replay->slot_map_size - 1;
+    size_t i = (addr * 0x9e3779b97f4a7c15ull >> 17) & mask;
+
+    while(replay->slot_addrs[i] && replay->slot_addrs[i] != addr) {
+        i = (i + 1) & mask;
+    }
+    if(!replay->slot_addrs[i]) {
+        if(!insert) {
+            return SIZE_MAX;
+        }
+        replay->slot_addrs[i] = addr;
+        replay->slot_ids[i] = replay->nr_addrs++;
+    }
+    return i;
+}
+
+/* Addresses get slots in the order they first show up. Past nr_slots of
+ * them, addresses share slots. Every address that is submitted was added by
+ * prepare_replay. */
+static unsigned int slot_of(struct replay *replay, uint64_t addr)
+{
+    return replay->slot_ids[map_entry(replay, addr, 0)] % replay->nr_slots;
+}
+
+/* Give every address a slot, and work out the largest snapshot and the
+ * latencies the recording saw, by pairing each submit with the next
+ * completion of the same virtine. */
+static int prepare_replay(struct replay *replay, size_t *max_snapshot)
+{
+    size_t nr_submits = 0;
+    uint64_t *submitted_ns;
+
+    for(size_t i = 0; i < replay->nr_records; i++) {
+        nr_submits += replay->records[i].type == VFPGA_TRACE_SUBMIT;
+    }
+    for(replay->slot_map_size = 64; replay->slot_map_size < 2 * nr_submits;
+        replay->slot_map_size *= 2);
+
+    replay->slot_addrs = calloc(replay->slot_map_size, sizeof(*replay->slot_addrs));
+    replay->slot_ids = calloc(replay->slot_map_size, sizeof(*replay->slot_ids));
+    submitted_ns = calloc(replay->slot_map_size, sizeof(*submitted_ns));
+    replay->recorded = hist_alloc();
+    replay->replayed = hist_alloc();
+    if(!replay->slot_addrs || !replay->slot_ids || !submitted_ns || !replay->recorded ||
+       !replay->replayed) {
+        free(submitted_ns);
+        return -ENOMEM;
+    }
+
+    for(size_t i = 0; i < replay->nr_records; i++) {
+        struct vfpga_trace_record *record = &replay->records[i];
+        size_t entry;
+
+        switch(record->type) {
+        case VFPGA_TRACE_SNAPSHOT:
+            if(record->size > *max_snapshot) {
+                *max_snapshot = record->size;
+            }
+            break;
+        case VFPGA_TRACE_SUBMIT:
+            entry = map_entry(replay, record->virtine, 1);
+            submitted_ns[entry] = record->ns + 1; // 0 is not submitted
+            break;
+        case VFPGA_TRACE_COMPLETE:
+            // Completions of virtines submitted before recording started are skipped
+            entry = map_entry(replay, record->virtine, 0);
+            if(entry != SIZE_MAX && submitted_ns[entry]) {
+                hist_record(replay->recorded, record->ns + 1 - submitted_ns[entry]);
+                submitted_ns[entry] = 0;
+            }
+            break;
+        }
+    }
+    free(submitted_ns);
+
+    replay->nr_slots = replay->nr_addrs < max_slots ? replay->nr_addrs : max_slots;
+    if(!replay->nr_slots) {
+        replay->nr_slots = 1;
+    }
+    if(replay->nr_addrs > max_slots) {
+        fprintf(stderr, "%s: %u distinct virtines share %u slots (see -m)\n",
+                replay->path, replay->nr_addrs, max_slots);
+    }
+    return 0;
+}
+
+static int setup_replay(struct replay *replay, size_t max_snapshot)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    unsigned int nr_slots = replay->nr_slots;
+    uint64_t handle;
+
+    replay->stride = (max_snapshot + page_size - 1) & ~(page_size - 1);
+    if(!replay->stride) {
+        replay->stride = page_size;
+    }
+    replay->dev = vfpga_open(device_path, 0);
+    if(!replay->dev) {
+        return -errno;
+    }
+    replay->slots = aligned_alloc(page_size, replay->stride * nr_slots);
+    replay->scheduled_ns = calloc(nr_slots, sizeof(*replay->scheduled_ns));
+    replay->in_flight = calloc(nr_slots, sizeof(*replay->in_flight));
+    if(!replay->slots || !replay->scheduled_ns || !replay->in_flight) {
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&replay->lock, NULL);
+    pthread_cond_init(&replay->cond, NULL);
+    return vfpga_register(replay->dev, replay->slots, replay->stride * nr_slots, &handle);
+}
+
+/* Issue the trace's submissions on its schedule. Submissions recorded at the
+ * same instant came from one batch, and are issued as one again. */
+static void *issuer_thread(void *arg)
+{
+    struct replay *replay = arg;
+    void *batch[MAX_BATCH];
+    unsigned int nr = 0;
+    int ret = 0;
+
+    for(size_t i = 0; i < replay->nr_records && !ret; i++) {
+        struct vfpga_trace_record *record = &replay->records[i];
+        uint64_t scheduled = start_ns + (speed > 0 ? record->ns / speed : 0);
+
+        if(record->type == VFPGA_TRACE_SNAPSHOT) {
+            sleep_until_ns(scheduled);
+            ret = vfpga_set_snapshot(replay->dev, snapshot, record->size);
+            continue;
+        }
+        if(record->type != VFPGA_TRACE_SUBMIT) {
+            continue;
+        }
+
+        unsigned int slot = slot_of(replay, record->virtine);
+        sleep_until_ns(scheduled);
+
+        pthread_mutex_lock(&replay->lock);
+        if(replay->in_flight[slot]) {
+            replay->waits++;
+        }
+        while(replay->in_flight[slot] && !replay->error) {
+            pthread_cond_wait(&replay->cond, &replay->lock);
+        }
+        replay->in_flight[slot] = 1;
+        replay->nr_in_flight++;
+        // As fast as possible has no schedule, so count from when it is issued
+        replay->scheduled_ns[slot] = speed > 0 ? scheduled : now_ns();
+        pthread_cond_broadcast(&replay->cond);
+        pthread_mutex_unlock(&replay->lock);
+        batch[nr++] = replay->slots + slot * replay->stride;
+
+        // Keep batching while the next record is part of the same submit
+        struct vfpga_trace_record *next = i + 1 < replay->nr_records ? record + 1 : NULL;
+        if(nr < MAX_BATCH && next && next->type == VFPGA_TRACE_SUBMIT &&
+           next->ns == record->ns) {
+            continue;
+        }
+        for(unsigned int done = 0; done < nr && !ret; ) {
+            ret = vfpga_submit(replay->dev, batch + done, nr - done);
+            done += ret > 0 ? ret : 0;
+            ret = ret > 0 ? 0 : (ret ? ret : -EIO);
+        }
+        nr = 0;
+    }
+
+    pthread_mutex_lock(&replay->lock);
+    replay->done = 1;
+    if(ret && !replay->error) {
+        replay->error = ret;
+    }
+    pthread_cond_broadcast(&replay->cond);
+    pthread_mutex_unlock(&replay->lock);
+    return NULL;
+}
+
+static void *reaper_thread(void *arg)
+{
+    struct replay *replay = arg;
+    struct virtine_completion completions[MAX_BATCH];
+
+    for(;;) {
+        pthread_mutex_lock(&replay->lock);
+        while(!replay->nr_in_flight && !replay->done && !replay->error) {
+            pthread_cond_wait(&replay->cond, &replay->lock);
+        }
+        if(!replay->nr_in_flight || replay->error) {
+            pthread_mutex_unlock(&replay->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&replay->lock);
+
+        int reaped = vfpga_reap(replay->dev, completions, MAX_BATCH, 1);
+        uint64_t now = now_ns();
+
+        pthread_mutex_lock(&replay->lock);
+        if(reaped < 0) {
+            replay->error = reaped;
+            pthread_cond_broadcast(&replay->cond);
+            pthread_mutex_unlock(&replay->lock);
+            return NULL;
+        }
+        for(int i = 0; i < reaped; i++) {
+            size_t slot = (completions[i].virtine - (uintptr_t) replay->slots) / replay->stride;
+            hist_record(replay->replayed, now - replay->scheduled_ns[slot]);
+            replay->in_flight[slot] = 0;
+            replay->nr_in_flight--;
+        }
+        pthread_cond_broadcast(&replay->cond);
+        pthread_mutex_unlock(&replay->lock);
+    }
+}
+
+static int save_distribution(const char *path, const struct histogram *hist)
+{
+    FILE *file = fopen(path, "w");
+    if(!file) {
+        return -errno;
+    }
+    fprintf(file, "percentile,latency_ns\n");
+    for(unsigned int i = 0; i < NR_PERCENTILES; i++) {
+        fprintf(file, "%g,%llu\n", percentiles[i],
+                (unsigned long long) hist_percentile(hist, percentiles[i]));
+    }
+    return fclose(file) ? -errno : 0;
+}
+
+static int load_distribution(const char *path, uint64_t *latencies)
+{
+    FILE *file = fopen(path, "r");
+    char line[128];
+    unsigned int found = 0;
+
+    if(!file) {
+        return -errno;
+    }
+    while(fgets(line, sizeof(line), file)) {
+        double percentile;
+        unsigned long long ns;
+        if(sscanf(line, "%lf,%llu", &percentile, &ns) != 2) {
+            continue;
+        }
+        for(unsigned int i = 0; i < NR_PERCENTILES; i++) {
+            if(percentile == percentiles[i]) {
+                latencies[i] = ns;
+                found++;
+            }
+        }
+    }
+    fclose(file);
+    return found == NR_PERCENTILES ? 0 : -EINVAL;
+}
+
+int main(int argc, char **argv) {
+    const char *save_path = NULL, *compare_path = NULL;
+    struct replay replays[MAX_TRACES] = { 0 };
+    unsigned int nr_replays, i;
+    size_t max_snapshot = 0;
+    uint64_t baseline[NR_PERCENTILES];
+    int opt, ret = 0;
+
+    while((opt = getopt(argc, argv, "p:x:m:o:c:h")) != -1) {
+        switch(opt) {
+        case 'p': device_path = optarg; break;
+        case 'x': speed = strtod(optarg, NULL); break;
+        case 'm': max_slots = strtoul(optarg, NULL, 0); break;
+        case 'o': save_path = optarg; break;
+        case 'c': compare_path = optarg; break;
+        default:
+            usage();
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    nr_replays = argc - optind;
+    if(!nr_replays || nr_replays > MAX_TRACES || speed < 0 || !max_slots) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if(compare_path && load_distribution(compare_path, baseline) < 0) {
+        printf("Could not read a latency distribution from %s\n", compare_path);
+        return EXIT_FAILURE;
+    }
+
+    for(i = 0; i < nr_replays; i++) {
+        replays[i].path = argv[optind + i];
+        ret = read_trace(&replays[i]);
+        if(!ret) {
+            ret = prepare_replay(&replays[i], &max_snapshot);
+        }
+        if(ret < 0) {
+            printf("Could not read trace %s: %s\n", replays[i].path, strerror(-ret));
+            return EXIT_FAILURE;
+        }
+    }
+
+    snapshot = calloc(1, max_snapshot ? max_snapshot : 1);
+    for(i = 0; i < nr_replays; i++) {
+        ret = setup_replay(&replays[i], max_snapshot);
+        if(ret < 0) {
+            printf("Could not set up replay of %s: %s\n", replays[i].path, strerror(-ret));
+            printf("Are you sure you loaded the fpga_char kernel module?\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    start_ns = now_ns();
+    for(i = 0; i < nr_replays; i++) {
+        pthread_create(&replays[i].reaper, NULL, reaper_thread, &replays[i]);
+        pthread_create(&replays[i].issuer, NULL, issuer_thread, &replays[i]);
+    }
+
+    struct histogram *recorded = hist_alloc(), *replayed = hist_alloc();
+    uint64_t waits = 0;
+    for(i = 0; i < nr_replays; i++) {
+        pthread_join(replays[i].issuer, NULL);
+        pthread_join(replays[i].reaper, NULL);
+        if(replays[i].error) {
+            printf("Replay of %s failed: %s\n", replays[i].path,
+                   strerror(-replays[i].error));
+            ret = replays[i].error;
+        }
+        hist_merge(recorded, replays[i].recorded);
+        hist_merge(replayed, replays[i].replayed);
+        waits += replays[i].waits;
+        vfpga_close(replays[i].dev);
+    }
+    double seconds = (now_ns() - start_ns) / 1e9;
+
+    printf("Replayed %llu virtines from %u trace(s) in %.3fs at %gx, %llu waited for their slot\n",
+           (unsigned long long) replayed->total, nr_replays, seconds, speed,
+           (unsigned long long) waits);
+    printf("%10s %14s %14s", "percentile", "recorded(us)", "replayed(us)");
+    if(compare_path) {
+        printf(" %14s %8s", "baseline(us)", "change");
+    }
+    printf("\n");
+    for(i = 0; i < NR_PERCENTILES; i++) {
+        uint64_t now = hist_percentile(replayed, percentiles[i]);
+        printf("%10g %14.1f %14.1f", percentiles[i],
+               hist_percentile(recorded, percentiles[i]) / 1e3, now / 1e3);
+        if(compare_path) {
+            printf(" %14.1f %+7.1f%%", baseline[i] / 1e3,
+                   baseline[i] ? 100.0 * ((double) now - baseline[i]) / baseline[i] : 0.0);
+        }
+        printf("\n");
+    }
+
+    if(save_path && save_distribution(save_path, replayed) < 0) {
+        printf("Could not save the latency distribution to %s\n", save_path);
+        ret = -EIO;
+    }
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
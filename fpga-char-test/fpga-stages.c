@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#include "histogram.h"
+
+/* Invoke with fpga-stages [options] [trace]...
+ *
+ * Stitch the fpga_request_stages tracepoint's events back together into where
+ * each request's latency went, and print a histogram of every stage. Capture
+ * the events while the workload runs with
+ *
+ *   echo 1 > /sys/kernel/tracing/events/fpga_char/fpga_request_stages/enable
+ *   cat /sys/kernel/tracing/trace_pipe > stages.txt
+ *
+ * and then run fpga-stages stages.txt. With no traces, stdin is read.
+ *
+ * The driver's stamps and the card's are in different clocks, so a stage is
+ * only ever measured between two stamps from the same one. What the card
+ * cannot see, the doorbell's MMIO exit and the MSI getting to the IRQ
+ * handler, is what is left of the driver's doorbell-to-reap time once the
+ * card's own doorbell-to-MSI time is taken out of it. */
+
+struct stamps {
+    int card;
+    int status;
+    int64_t submit, flush, doorbell, reap, done, user;
+    uint64_t card_enqueue, card_doorbell, card_dequeue;
+    uint64_t card_dma_start, card_dma_end, card_msi;
+};
+
+// Elapsed time from A to B, or -1 if either one never happened
+static int64_t span(int64_t a, int64_t b)
+{
+    return (a && b && b >= a) ? b - a : -1;
+}
+
+static int64_t stage_queued(const struct stamps *s) { return span(s->submit, s->flush); }
+static int64_t stage_doorbell(const struct stamps *s) { return span(s->flush, s->doorbell); }
+
+// Only the doorbell that announced a virtine lets it be dequeued
+static int64_t stage_rq(const struct stamps *s)
+{
+    return span(s->card_doorbell ? s->card_doorbell : s->card_enqueue, s->card_dma_start);
+}
+
+static int64_t stage_dma(const struct stamps *s) { return span(s->card_dma_start, s->card_dma_end); }
+static int64_t stage_coalesce(const struct stamps *s) { return span(s->card_dma_end, s->card_msi); }
+
+static int64_t stage_exit_msi(const struct stamps *s)
+{
+    int64_t host = span(s->doorbell, s->reap);
+    int64_t card = span(s->card_doorbell, s->card_msi);
+
+    if(host < 0 || card < 0) {
+        return -1;
+    }
+    // The clocks tick at the same rate, but not in lockstep
+    return host > card ? host - card : 0;
+}
+
+static int64_t stage_reap(const struct stamps *s) { return span(s->reap, s->done); }
+static int64_t stage_deliver(const struct stamps *s) { return span(s->done, s->user); }
+static int64_t stage_total(const struct stamps *s) { return span(s->submit, s->user); }
+
+static const struct stage {
+    const char *name;
+    const char *what;
+    int64_t (*measure)(const struct stamps *s);
+} stages[] = {
+    { "queued", "submit to being put on the RQ", stage_queued },
+    { "doorbell", "put on the RQ to the doorbell", stage_doorbell },
+    { "rq", "doorbell to the card starting its DMA", stage_rq },
+    { "dma", "the card's DMA of the snapshot", stage_dma },
+    { "coalesce", "DMA done to the card raising its MSI", stage_coalesce },
+    { "exit+msi", "MMIO exit and MSI delivery", stage_exit_msi },
+    { "reap", "IRQ, or poll, to completing the request", stage_reap },
+    { "deliver", "completed to handed back to userspace", stage_deliver },
+    { "total", "submit to handed back to userspace", stage_total },
+};
+#define NR_STAGES (sizeof(stages) / sizeof(stages[0]))
+
+static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+#define NR_PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
+
+static struct histogram *hists[NR_STAGES];
+static unsigned long long nr_stitched, nr_failed, nr_card;
+static int card_filter = -1;
+
+static void usage(void)
+{
+    printf("Invoke with fpga-stages [options] [trace]...\n");
+    printf("  -c <card>    Only count requests that went to this card's minor\n");
+    printf("  -f <format>  text or csv (default: text)\n");
+    printf("Traces are the text of the fpga_request_stages tracepoint, as read\n");
+    printf("out of /sys/kernel/tracing/trace_pipe. With none, stdin is read.\n");
+}
+
+/* Pull the stamps out of one line of trace text. Returns 0 if the line is not
+ * an fpga_request_stages event. */
+static int parse_line(const char *line, struct stamps *s)
+{
+    unsigned long long virtine;
+
+    line = strstr(line, "fpga_request_stages: ");
+    if(!line) {
+        return 0;
+    }
+    line += strlen("fpga_request_stages: ");
+
+    return sscanf(line, "card=%d virtine=0x%llx status=%d submit=%" SCNd64 " flush=%" SCNd64
+                  " doorbell=%" SCNd64 " reap=%" SCNd64 " done=%" SCNd64 " user=%" SCNd64
+                  " card_enqueue=%" SCNu64 " card_doorbell=%" SCNu64 " card_dequeue=%" SCNu64
+                  " card_dma_start=%" SCNu64 " card_dma_end=%" SCNu64 " card_msi=%" SCNu64,
+                  &s->card, &virtine, &s->status, &s->submit, &s->flush, &s->doorbell,
+                  &s->reap, &s->done, &s->user, &s->card_enqueue, &s->card_doorbell,
+                  &s->card_dequeue, &s->card_dma_start, &s->card_dma_end,
+                  &s->card_msi) == 15;
+}
+
+static void stitch(FILE *file)
+{
+    char line[1024];
+    struct stamps s;
+    unsigned int i;
+    int64_t elapsed;
+
+    while(fgets(line, sizeof(line), file)) {
+        if(!parse_line(line, &s) || (card_filter >= 0 && s.card != card_filter)) {
+            continue;
+        }
+        if(s.status) { // Failed requests did not go through every stage
+            nr_failed++;
+            continue;
+        }
+        nr_stitched++;
+        if(s.card_dma_end) {
+            nr_card++;
+        }
+        for(i = 0; i < NR_STAGES; i++) {
+            elapsed = stages[i].measure(&s);
+            if(elapsed >= 0) {
+                hist_record(hists[i], elapsed);
+            }
+        }
+    }
+}
+
+static void report_text(void)
+{
+    double total = hist_mean(hists[NR_STAGES - 1]);
+    unsigned int i, j;
+
+    printf("Stitched %llu requests, %llu with the card's stamps, %llu failed ones skipped\n",
+           nr_stitched, nr_card, nr_failed);
+    printf("%-9s %10s %10s", "stage", "count", "mean(us)");
+    for(j = 0; j < NR_PERCENTILES; j++) {
+        printf("   p%-5g", percentiles[j]);
+    }
+    printf(" %10s %7s  %s\n", "max(us)", "share", "from");
+
+    for(i = 0; i < NR_STAGES; i++) {
+        const struct histogram *hist = hists[i];
+        printf("%-9s %10llu %10.1f", stages[i].name, (unsigned long long) hist->total,
+               hist_mean(hist) / 1e3);
+        for(j = 0; j < NR_PERCENTILES; j++) {
+            printf(" %8.1f", hist_percentile(hist, percentiles[j]) / 1e3);
+        }
+        printf(" %10.1f", hist->max / 1e3);
+        if(total > 0 && hist->total) {
+            printf(" %6.1f%%", 100.0 * hist_mean(hist) / total);
+        } else {
+            printf(" %7s", "-");
+        }
+        printf("  %s\n", stages[i].what);
+    }
+}
+
+static void report_csv(void)
+{
+    unsigned int i, j;
+
+    printf("stage,count,mean_ns");
+    for(j = 0; j < NR_PERCENTILES; j++) {
+        printf(",p%g_ns", percentiles[j]);
+    }
+    printf(",max_ns\n");
+
+    for(i = 0; i < NR_STAGES; i++) {
+        const struct histogram *hist = hists[i];
+        printf("%s,%llu,%.0f", stages[i].name, (unsigned long long) hist->total,
+               hist_mean(hist));
+        for(j = 0; j < NR_PERCENTILES; j++) {
+            printf(",%llu", (unsigned long long) hist_percentile(hist, percentiles[j]));
+        }
+        printf(",%llu\n", (unsigned long long) hist->max);
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt, csv = 0;
+    unsigned int i;
+    FILE *file;
+
+    while((opt = getopt(argc, argv, "c:f:h")) != -1) {
+        switch(opt) {
+        case 'c': card_filter = atoi(optarg); break;
+        case 'f':
+            if(!strcmp(optarg, "csv")) {
+                csv = 1;
+            } else if(strcmp(optarg, "text")) {
+                usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage();
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    for(i = 0; i < NR_STAGES; i++) {
+        hists[i] = hist_alloc();
+        if(!hists[i]) {
+            printf("Could not allocate histograms\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(optind == argc) {
+        stitch(stdin);
+    }
+    for(; optind < argc; optind++) {
+        file = fopen(argv[optind], "r");
+        if(!file) {
+            perror(argv[optind]);
+            return EXIT_FAILURE;
+        }
+        stitch(file);
+        fclose(file);
+    }
+
+    if(!nr_stitched) {
+        printf("No fpga_request_stages events found. Is the tracepoint enabled?\n");
+        return EXIT_FAILURE;
+    }
+
+    if(csv) {
+        report_csv();
+    } else {
+        report_text();
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "histogram.h"
+
+/* Values below 2 * HIST_SUB_BUCKETS get a bucket each. Above that, a value
+ * with its top bit at MSB keeps its top HIST_SUB_BITS + 1 bits, and the rest
+ * are shifted away. */
+static unsigned int hist_index(uint64_t value)
+{
+    if(value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+    unsigned int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return shift * HIST_SUB_BUCKETS + (value >> shift);
+}
+
+// The largest value that lands in bucket IDX
+static uint64_t hist_value_at(unsigned int idx)
+{
+    if(idx < 2 * HIST_SUB_BUCKETS) {
+        return idx;
+    }
+    unsigned int shift = idx / HIST_SUB_BUCKETS - 1;
+    uint64_t mantissa = idx - shift * HIST_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+struct histogram *hist_alloc(void)
+{
+    struct histogram *hist = malloc(sizeof(*hist));
+    if(hist) {
+        hist_reset(hist);
+    }
+    return hist;
+}
+
+void hist_reset(struct histogram *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+    hist->min = UINT64_MAX;
+}
+
+void hist_record(struct histogram *hist, uint64_t value)
+{
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    hist->sum += value;
+    if(value < hist->min) {
+        hist->min = value;
+    }
+    if(value > hist->max) {
+        hist->max = value;
+    }
+}
+
+void hist_merge(struct histogram *into, const struct histogram *from)
+{
+    for(unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if(from->min < into->min) {
+        into->min = from->min;
+    }
+    if(from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+uint64_t hist_percentile(const struct histogram *hist, double percentile)
+{
+    if(!hist->total) {
+        return 0;
+    }
+
+    uint64_t target = ceil(percentile / 100.0 * hist->total);
+    uint64_t seen = 0;
+    if(target < 1) {
+        target = 1;
+    }
+    for(unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if(seen >= target) {
+            uint64_t value = hist_value_at(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+double hist_mean(const struct histogram *hist)
+{
+    return hist->total ? hist->sum / hist->total : 0.0;
+}
@@ -0,0 +1,31 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/* A log-linear histogram in the style of HdrHistogram. Every power of two is
+ * split into HIST_SUB_BUCKETS buckets, so any recorded value is reported
+ * within 1/HIST_SUB_BUCKETS (< 1%) of what it really was, from 1ns up to
+ * centuries, in a fixed ~58KiB of counters. */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct histogram {
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+    uint64_t counts[HIST_BUCKETS];
+};
+
+struct histogram *hist_alloc(void);
+void hist_reset(struct histogram *hist);
+void hist_record(struct histogram *hist, uint64_t value);
+// Add everything recorded in FROM to INTO
+void hist_merge(struct histogram *into, const struct histogram *from);
+// PERCENTILE is in [0, 100]. Returns 0 if nothing was recorded.
+uint64_t hist_percentile(const struct histogram *hist, double percentile);
+double hist_mean(const struct histogram *hist);
+
+#endif
@@ -1,13 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
 #include <unistd.h>
-#include <errno.h>
 #include <stdint.h>
 
-#include "ioctls.h"
+#include "libvirtinefpga.h"
 
 /* Invoke with test-give-virtine */
 int main(int argc, char **argv) {
@@ -17,43 +14,55 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    // Heap alloc, so we can write address of pointer, and for lifetime.
-    uint64_t *virtine_to_clean = malloc(sizeof(uint64_t));
+    // Page-aligned heap alloc, so the region we pin is just this "virtine".
+    uint64_t *virtine_to_clean = aligned_alloc(sysconf(_SC_PAGESIZE),
+                                               sysconf(_SC_PAGESIZE));
     *virtine_to_clean = 0xdeadbeef;
     printf("Will write \"virtine\" addr: %p with size %zd\n", virtine_to_clean,
-           sizeof(virtine_to_clean));
+           sizeof(*virtine_to_clean));
 
-    int virtine_fd = open("/dev/virtine_fpga", O_RDWR | O_SYNC | O_DSYNC);
-    if(virtine_fd < 0) {
-        printf("Could not open Virtine FPGA character device!\n");
+    struct vfpga *dev = vfpga_open(NULL, 0);
+    if(!dev) {
+        perror("Could not open Virtine FPGA character device");
         printf("Are you sure you loaded the fpga_char kernel module?\n");
-        printf("errno value %d. errno is also the return value.\n", errno);
-        return errno;
+        return EXIT_FAILURE;
     }
 
-    unsigned long offset = 0x8; // Location of RQ TAIL register
-    int bytes_handled = pwrite(virtine_fd, &virtine_to_clean, sizeof(&virtine_to_clean), offset);
+    /* The device cannot use our virtual address. Register the virtine's memory
+     * so the driver pins and DMA-maps it once, then refer to it by handle. */
+    uint64_t handle;
+    int ret = vfpga_register(dev, virtine_to_clean, sysconf(_SC_PAGESIZE), &handle);
+    if(ret < 0) {
+        printf("Could not register \"virtine\" memory!\n");
+        goto fail_exit;
+    }
+    printf("Registered \"virtine\" memory as handle %llu\n",
+           (unsigned long long) handle);
 
-    if(bytes_handled < 0) {
-        printf("WRITE FAILED! Address not in FPGA. Exiting!\n");
+    ret = vfpga_submit_fixed(dev, handle, 0);
+    if(ret < 0) {
+        printf("SUBMIT FAILED! Exiting!\n");
         goto fail_exit;
     }
     else {
-        printf("Write \"virtine\" addr %p succeeded!\n", virtine_to_clean);
+        printf("Submit \"virtine\" addr %p succeeded!\n", virtine_to_clean);
     }
 
-    /* long ioctl_ret_val = ioctl(virtine_fd, FPGA_CHAR_RING_DOORBELL); */
-    /* if(ioctl_ret_val >= 0) { */
-    /*     printf("Doorbell has been rung!\n"); */
-    /* } else { */
-    /*     printf("Could not ring doorbell!\n"); */
-    /*     goto fail_exit; */
-    /* } */
+    // Wait for our virtine to come back on this file's completion queue
+    struct virtine_completion completion;
+    ret = vfpga_reap(dev, &completion, 1, 1);
+    if(ret != 1) {
+        printf("Could not reap the \"virtine\"!\n");
+        goto fail_exit;
+    }
+    printf("\"Virtine\" addr 0x%llx cleaned with status %d\n",
+           (unsigned long long) completion.virtine, completion.status);
 
+    vfpga_close(dev);
     return EXIT_SUCCESS;
 
 fail_exit:
-    close(virtine_fd);
-    printf("Printing and returning errno: %d\n\n", errno);
+    vfpga_close(dev);
+    printf("Error: %s\n\n", strerror(ret < 0 ? -ret : 0));
     return EXIT_FAILURE;
 }
@@ -28,7 +28,7 @@ int main(int argc, char **argv) {
         printf("\tmax_virtines - Fetch the maximum number of virtines each queue supports\n");
         printf("\tchange_batch_factor - Change batch factor before interrupt raised\n");
         printf("\tring_doorbell - Ring the doorbell, telling card to begin processing\n");
-        printf("\tset_snapshot - Set the virtine snapshot size and physical address\n");
+        printf("\tset_snapshot - Set the virtine snapshot size and the byte it is filled with\n");
         return EXIT_FAILURE;
     }
 
@@ -89,11 +89,15 @@ int main(int argc, char **argv) {
     case SET_SNAPSHOT: {
         if(argc != 4) {
             printf("Incorrect number of arguments passed for setting snapshot!\n");
-            printf("Format: test-ioctls set_snapshot <size> <address>\n");
+            printf("Format: test-ioctls set_snapshot <size> <fill-byte>\n");
             goto fail_exit;
         }
-        struct virtine_snapshot snapshot = { .size = strtoul(argv[2], NULL, 0),
-            .addr = strtoul(argv[3], NULL, 16) };
+        /* The driver copies the snapshot out of our memory, so build one
+         * filled with the requested byte. */
+        struct virtine_snapshot snapshot = { .size = strtoul(argv[2], NULL, 0) };
+        void *contents = malloc(snapshot.size);
+        memset(contents, strtoul(argv[3], NULL, 0), snapshot.size);
+        snapshot.addr = (unsigned long) contents;
         ioctl_ret_val = ioctl(virtine_fd, FPGA_CHAR_SET_SNAPSHOT, &snapshot);
         break;
     }
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "ioctls.h"
+
+/* Invoke with test-pool <num-virtines> <virtine-size> <low-watermark> */
+int main(int argc, char **argv) {
+    if(argc != 4) {
+        printf("Incorrect number of arguments!\n");
+        printf("Invoke with test-pool <num-virtines> <virtine-size> <low-watermark>\n");
+        return EXIT_FAILURE;
+    }
+
+    int virtine_fd = open("/dev/virtine_fpga", O_RDWR | O_SYNC | O_DSYNC);
+    if(virtine_fd < 0) {
+        printf("Could not open Virtine FPGA character device!\n");
+        printf("Are you sure you loaded the fpga_char kernel module?\n");
+        printf("errno value %d. errno is also the return value.\n", errno);
+        return errno;
+    }
+
+    struct virtine_pool_create create = {
+        .nr_virtines = strtoul(argv[1], NULL, 0),
+        .virtine_size = strtoull(argv[2], NULL, 0),
+        .low_watermark = strtoul(argv[3], NULL, 0),
+    };
+    if(ioctl(virtine_fd, FPGA_CHAR_CREATE_POOL, &create) < 0) {
+        printf("Could not create virtine pool!\n");
+        goto fail_exit;
+    }
+    printf("Created pool of %u virtines, %llu bytes apart\n", create.nr_virtines,
+           (unsigned long long) create.stride);
+
+    uint8_t *pool = mmap(NULL, create.nr_virtines * create.stride,
+                         PROT_READ | PROT_WRITE, MAP_SHARED, virtine_fd, 0);
+    if(pool == MAP_FAILED) {
+        printf("Could not mmap virtine pool!\n");
+        goto fail_exit;
+    }
+
+    /* Take every virtine out, dirty it, and give it back. Then they should all
+     * come back clean again. */
+    for(uint32_t i = 0; i < create.nr_virtines; i++) {
+        int idx = ioctl(virtine_fd, FPGA_CHAR_POOL_GET, 0);
+        if(idx < 0) {
+            printf("Could not get a clean virtine!\n");
+            goto fail_exit;
+        }
+        uint64_t *virtine = (uint64_t *) (pool + idx * create.stride);
+        printf("Got virtine %d @ %p, first word 0x%lx\n", idx, virtine, *virtine);
+        *virtine = 0xdeadbeef;
+        if(ioctl(virtine_fd, FPGA_CHAR_POOL_PUT, idx) < 0) {
+            printf("Could not give back virtine %d!\n", idx);
+            goto fail_exit;
+        }
+    }
+
+    munmap(pool, create.nr_virtines * create.stride);
+    close(virtine_fd);
+    return EXIT_SUCCESS;
+
+fail_exit:
+    close(virtine_fd);
+    printf("Printing and returning errno: %d\n\n", errno);
+    return EXIT_FAILURE;
+}
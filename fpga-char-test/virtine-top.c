@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "virtine_fpga_regs.h"
+
+/* Invoke with virtine-top [options]
+ *
+ * Watch a card's rings live. The card's registers are sampled many times a
+ * second through its character device, and once every refresh interval a line
+ * is printed with how full the RQ and CQ were, how fast the card drained the
+ * RQ and the host reaped the CQ, and how much of the time the card was busy.
+ * Every sample can also be logged to a CSV file.
+ *
+ * Only registers that can be read without side effects are sampled; reading
+ * the CQ head itself would pop it out from under the driver. */
+
+#define BAR_WIDTH 20
+#define HEADER_EVERY 20
+
+struct sample {
+    uint64_t ns;
+    unsigned int rq_head, rq_tail, cq_head, cq_tail;
+    unsigned int rq_used, cq_used;
+    uint32_t processing;
+    uint32_t doorbell;
+    uint32_t batch_factor;
+    uint32_t cq_produced;
+    uint32_t cq_consumed;
+};
+
+// What was seen over one refresh interval
+struct interval {
+    uint64_t samples;
+    uint64_t busy; // Samples that caught the card processing
+    uint64_t rung; // Samples with the doorbell rung but not yet picked up
+    uint64_t rq_sum, cq_sum;
+    unsigned int rq_max, cq_max;
+};
+
+static volatile sig_atomic_t stopping;
+
+static void stop(int sig)
+{
+    (void) sig;
+    stopping = 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(void)
+{
+    printf("Invoke with virtine-top [options]\n");
+    printf("  -p <path>   Card to watch (default: /dev/virtine_fpga0)\n");
+    printf("  -i <us>     Time between samples (default: 100)\n");
+    printf("  -r <ms>     Time between printed lines (default: 1000)\n");
+    printf("  -n <count>  Stop after this many lines, 0 to run until interrupted (default: 0)\n");
+    printf("  -o <file>   Log every sample to FILE as CSV\n");
+}
+
+static int read_reg(int fd, unsigned long reg, uint32_t *val)
+{
+    ssize_t ret = pread(fd, val, sizeof(*val), reg);
+    if(ret != sizeof(*val)) {
+        return ret < 0 ? -errno : -EIO;
+    }
+    return 0;
+}
+
+static unsigned int ring_used(unsigned int head, unsigned int tail, int full)
+{
+    if(full) {
+        return NUM_POSSIBLE_VIRTINES;
+    }
+    return (tail + NUM_POSSIBLE_VIRTINES - head) % NUM_POSSIBLE_VIRTINES;
+}
+
+static int take_sample(int fd, struct sample *s)
+{
+    uint32_t index, status;
+    int ret;
+
+    s->ns = now_ns();
+    if((ret = read_reg(fd, RING_INDEX_REG, &index)) ||
+       (ret = read_reg(fd, RING_STATUS_REG, &status)) ||
+       (ret = read_reg(fd, IS_PROCESSING_REG, &s->processing)) ||
+       (ret = read_reg(fd, DOORBELL_REG, &s->doorbell)) ||
+       (ret = read_reg(fd, BATCH_FACTOR_REG, &s->batch_factor)) ||
+       (ret = read_reg(fd, CQ_PRODUCED_REG, &s->cq_produced)) ||
+       (ret = read_reg(fd, CQ_CONSUMED_REG, &s->cq_consumed))) {
+        return ret;
+    }
+
+    s->rq_head = index & 0xff;
+    s->rq_tail = (index >> 8) & 0xff;
+    s->cq_head = (index >> 16) & 0xff;
+    s->cq_tail = (index >> 24) & 0xff;
+    s->rq_used = ring_used(s->rq_head, s->rq_tail, status & RING_STATUS_RQ_FULL);
+    s->cq_used = ring_used(s->cq_head, s->cq_tail, status & RING_STATUS_CQ_FULL);
+    return 0;
+}
+
+static void account(struct interval *in, const struct sample *s)
+{
+    in->samples++;
+    in->busy += !!s->processing;
+    in->rung += !!s->doorbell;
+    in->rq_sum += s->rq_used;
+    in->cq_sum += s->cq_used;
+    if(s->rq_used > in->rq_max) {
+        in->rq_max = s->rq_used;
+    }
+    if(s->cq_used > in->cq_max) {
+        in->cq_max = s->cq_used;
+    }
+}
+
+static void log_sample(FILE *csv, const struct sample *s, uint64_t start)
+{
+    fprintf(csv, "%llu,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u\n",
+            (unsigned long long) (s->ns - start), s->rq_head, s->rq_tail, s->cq_head,
+            s->cq_tail, s->rq_used, s->cq_used, s->processing, s->doorbell,
+            s->batch_factor, s->cq_produced, s->cq_consumed);
+}
+
+static void print_header(void)
+{
+    printf("%8s %8s %7s %6s %7s %6s %10s %10s %6s %6s %6s  %-*s\n", "time(s)", "samples",
+           "rq avg", "max", "cq avg", "max", "drained/s", "reaped/s", "busy", "bell",
+           "batch", BAR_WIDTH + 2, "rq");
+}
+
+/* One line for the interval IN, which ran from FIRST to LAST. */
+static void print_interval(const struct interval *in, const struct sample *first,
+                           const struct sample *last, uint64_t start)
+{
+    double seconds = (last->ns - first->ns) / 1e9;
+    double rq_avg = (double) in->rq_sum / in->samples;
+    double cq_avg = (double) in->cq_sum / in->samples;
+    // Both counters are free-running, so this is right across a wrap too
+    uint32_t drained = last->cq_produced - first->cq_produced;
+    uint32_t reaped = last->cq_consumed - first->cq_consumed;
+    char bar[BAR_WIDTH + 1];
+    int filled = (int) (rq_avg * BAR_WIDTH / NUM_POSSIBLE_VIRTINES + 0.5);
+
+    memset(bar, ' ', BAR_WIDTH);
+    memset(bar, '#', filled);
+    bar[BAR_WIDTH] = '\0';
+
+    printf("%8.1f %8llu %7.1f %6u %7.1f %6u %10.0f %10.0f %5.1f%% %5.1f%% %6u  [%s]\n",
+           (last->ns - start) / 1e9, (unsigned long long) in->samples, rq_avg, in->rq_max,
+           cq_avg, in->cq_max, seconds > 0 ? drained / seconds : 0,
+           seconds > 0 ? reaped / seconds : 0, 100.0 * in->busy / in->samples,
+           100.0 * in->rung / in->samples, last->batch_factor, bar);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    const char *path = "/dev/virtine_fpga0", *csv_path = NULL;
+    unsigned long sample_us = 100, refresh_ms = 1000, lines = 0, printed = 0;
+    struct sample first, s;
+    struct interval in = { 0 };
+    uint64_t start, next_sample, next_refresh;
+    struct timespec ts;
+    FILE *csv = NULL;
+    int opt, fd, ret;
+
+    while((opt = getopt(argc, argv, "p:i:r:n:o:h")) != -1) {
+        switch(opt) {
+        case 'p': path = optarg; break;
+        case 'i': sample_us = strtoul(optarg, NULL, 0); break;
+        case 'r': refresh_ms = strtoul(optarg, NULL, 0); break;
+        case 'n': lines = strtoul(optarg, NULL, 0); break;
+        case 'o': csv_path = optarg; break;
+        default:
+            usage();
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if(!sample_us || !refresh_ms) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        perror("Could not open Virtine FPGA character device");
+        printf("Are you sure you loaded the fpga_char kernel module?\n");
+        printf("The aggregate device has no registers, name a card with -p.\n");
+        return EXIT_FAILURE;
+    }
+    if(csv_path) {
+        csv = fopen(csv_path, "w");
+        if(!csv) {
+            perror(csv_path);
+            return EXIT_FAILURE;
+        }
+        fprintf(csv, "ns,rq_head,rq_tail,cq_head,cq_tail,rq_used,cq_used,processing,"
+                "doorbell,batch_factor,cq_produced,cq_consumed\n");
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    ret = take_sample(fd, &first);
+    if(ret < 0) {
+        printf("Could not read %s: %s\n", path, strerror(-ret));
+        return EXIT_FAILURE;
+    }
+    start = first.ns;
+    next_sample = start;
+    next_refresh = start + refresh_ms * 1000000ull;
+    print_header();
+
+    while(!stopping) {
+        // Keep to the schedule, but never try to catch up on missed samples
+        next_sample += sample_us * 1000ull;
+        if(next_sample > now_ns()) {
+            ts.tv_sec = next_sample / 1000000000ull;
+            ts.tv_nsec = next_sample % 1000000000ull;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        } else {
+            next_sample = now_ns();
+        }
+
+        ret = take_sample(fd, &s);
+        if(ret < 0) {
+            printf("Could not read %s: %s\n", path, strerror(-ret));
+            break;
+        }
+        account(&in, &s);
+        if(csv) {
+            log_sample(csv, &s, start);
+        }
+
+        if(s.ns >= next_refresh) {
+            if(printed && !(printed % HEADER_EVERY)) {
+                print_header();
+            }
+            print_interval(&in, &first, &s, start);
+            printed++;
+            if(lines && printed >= lines) {
+                break;
+            }
+            memset(&in, 0, sizeof(in));
+            first = s;
+            next_refresh += refresh_ms * 1000000ull;
+        }
+    }
+
+    if(csv) {
+        fclose(csv);
+    }
+    close(fd);
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,4 +1,33 @@
+#include <linux/xarray.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/version.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+/* io_uring passthrough only exists from 5.19. Its API has moved around since,
+ * so the differences are kept here. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#define FPGA_CHAR_URING_CMD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define fpga_uring_cmd_payload(ioucmd) io_uring_sqe_cmd((ioucmd)->sqe)
+#else
+#define fpga_uring_cmd_payload(ioucmd) ((ioucmd)->cmd)
+#endif
+#endif
+
 #include "chardev.h"
+#include "umem.h"
+#include "pool.h"
+#include "dma_engine.h"
+#include "fpga_char_trace.h"
 
 static int fpga_char_open(struct inode *inode, struct file *filep);
 static int fpga_char_release(struct inode *inode, struct file *filep);
@@ -7,6 +36,18 @@ static ssize_t fpga_char_read(struct file *filep, char *buffer, size_t length,
 static ssize_t fpga_char_write(struct file *filep, const char *buffer,
                                size_t length, loff_t *offset);
 static long fpga_char_ioctl(struct file *filep, unsigned int cmd, unsigned long args);
+static __poll_t fpga_char_poll(struct file *filep, poll_table *wait);
+static int fpga_char_mmap(struct file *filep, struct vm_area_struct *vma);
+#ifdef FPGA_CHAR_URING_CMD
+static int fpga_char_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+#endif
+
+struct fpga_char_private_data;
+static struct fpga_umem *fpga_char_find_umem(struct fpga_char_private_data *priv,
+                                             unsigned long uaddr);
+static int fpga_char_submit(struct fpga_char_private_data *priv,
+                            struct fpga_umem *umem, unsigned long offset,
+                            bool nowait);
 
 static const struct file_operations fops = {
         .owner = THIS_MODULE,
@@ -15,27 +56,80 @@ static const struct file_operations fops = {
         .read = fpga_char_read,
         .write = fpga_char_write,
         .unlocked_ioctl = fpga_char_ioctl,
+        .poll = fpga_char_poll,
+        .mmap = fpga_char_mmap,
+#ifdef FPGA_CHAR_URING_CMD
+        .uring_cmd = fpga_char_uring_cmd,
+#endif
 };
 
-static struct fpga_char_device_data {
-        struct device *fpga_device;
-        struct cdev cdev;
-} fpga_dev_data;
-
 /* The character driver's private struct is responsible for keeping track of the
  * FPGA character device's minor device number (in case there are multiple streams
  * attached to the FPGA on separate files), and the hardware struct of the FPGA,
- * so that one can read/write from/to the FPGA's BAR-mapped memory. */
+ * so that one can read/write from/to the FPGA's BAR-mapped memory.
+ * Files opened on the aggregate device are not tied to one FPGA, so their
+ * fpga_hw is NULL.
+ * Each open file is also its own submission context, with its own completion
+ * queue, so processes sharing the card never see each other's virtines. */
 struct fpga_char_private_data {
         u8 minor_device_number;
         struct fpga_device *fpga_hw;
+
+        // User memory registered through this file, indexed by its handle.
+        struct xarray umems;
+
+        /* Requests the cards finished, waiting for this file to reap them.
+         * Filled from the IRQ handler. Once the file is closed, finished
+         * requests are freed instead of queued. */
+        spinlock_t cq_lock;
+        struct list_head completed;
+        unsigned int nr_completed;
+        wait_queue_head_t cq_wait;
+        bool closed;
+
+        // Held by the open file and by each of its outstanding requests
+        struct kref ref;
+
+        // Driver-owned clean virtines, once FPGA_CHAR_CREATE_POOL is called
+        struct fpga_pool *pool;
+
+        /* This file's share of the cards, and its queue on each of them,
+         * indexed by minor. Pool virtines are charged to the card instead,
+         * because they outlive the file. */
+        struct fpga_tenant tenant;
+        struct fpga_tenant_queue queues[MAX_MINOR_DEVICES];
+        struct list_head tenant_node; // On fpga_tenants
+        pid_t tgid;
+        char comm[TASK_COMM_LEN];
 };
 
 static struct class *fpga_dev_class;
 static int major_device_number;
 
-/* Keep track of which FPGA device this device file is connected to. */
-static struct fpga_device *fpga_dev;
+/* The aggregate device, /dev/virtine_fpga, is not backed by any one FPGA. */
+static struct cdev aggregate_cdev;
+static struct device *aggregate_device;
+
+/* Keep track of every FPGA that has created a character device, indexed by its
+ * minor number. Only changed when cards come and go, so a mutex is plenty. */
+static struct fpga_device *fpga_devs[MAX_MINOR_DEVICES];
+static DEFINE_MUTEX(fpga_devs_lock);
+static DEFINE_IDA(fpga_minor_ida);
+
+// Every open file, for listing in debugfs
+static LIST_HEAD(fpga_tenants);
+static DEFINE_MUTEX(fpga_tenants_lock);
+static struct dentry *fpga_debugfs_dir;
+
+static struct kmem_cache *fpga_request_cache;
+/* Requests that finish after their file was closed still have to unpin their
+ * memory, which sleeps, so that is pushed off of the IRQ handler. */
+struct workqueue_struct *fpga_char_wq;
+
+/* Spinning burns a CPU for as long as userspace asks, so it is capped. */
+static unsigned int poll_spin_max_us = 1000;
+module_param(poll_spin_max_us, uint, 0644);
+MODULE_PARM_DESC(poll_spin_max_us, "Longest a polling reap spins before it sleeps, in microseconds (default: 1000)");
 
 /* Changes the RWX bits of the /dev file created by the device_create call in
  * create_char_devs. */
@@ -46,7 +140,50 @@ static int fpga_uevent(struct device *dev, struct kobj_uevent_env *env)
         return 0;
 }
 
-int create_char_devs(struct fpga_device *fpga)
+static void fpga_tenant_stats(struct fpga_tenant *tenant,
+                              struct virtine_tenant_stats *stats)
+{
+        memset(stats, 0, sizeof(*stats));
+        stats->dispatched = atomic64_read(&tenant->dispatched);
+        stats->completed = atomic64_read(&tenant->completed);
+        stats->bytes = atomic64_read(&tenant->bytes);
+        stats->queue_delay_ns = atomic64_read(&tenant->queue_delay_ns);
+        stats->max_queue_delay_ns = atomic64_read(&tenant->max_queue_delay_ns);
+        stats->elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), tenant->start));
+        stats->weight = READ_ONCE(tenant->weight);
+}
+
+/* One line per open file: who opened it, its weight, and what it has been
+ * given. Throughput is in bytes of snapshot restored per second. */
+static int fpga_tenants_show(struct seq_file *s, void *unused)
+{
+        struct fpga_char_private_data *priv;
+        struct virtine_tenant_stats stats;
+        u64 elapsed_ms;
+
+        seq_puts(s, "pid\tcomm\tweight\tdispatched\tcompleted\tbytes\tbytes/s\tavg_delay_ns\tmax_delay_ns\n");
+        mutex_lock(&fpga_tenants_lock);
+        list_for_each_entry(priv, &fpga_tenants, tenant_node) {
+                fpga_tenant_stats(&priv->tenant, &stats);
+                elapsed_ms = div_u64(stats.elapsed_ns, NSEC_PER_MSEC);
+                seq_printf(s, "%d\t%s\t%u\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\n",
+                           priv->tgid, priv->comm, stats.weight,
+                           stats.dispatched, stats.completed, stats.bytes,
+                           elapsed_ms ? div64_u64(stats.bytes, elapsed_ms) * MSEC_PER_SEC : 0,
+                           stats.dispatched ? div64_u64(stats.queue_delay_ns,
+                                                        stats.dispatched) : 0,
+                           stats.max_queue_delay_ns);
+        }
+        mutex_unlock(&fpga_tenants_lock);
+
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fpga_tenants);
+
+/* Set up everything that is shared between all of the FPGAs: the range of
+ * major:minor numbers, the device class, and the aggregate device. This is
+ * done once, when the module is loaded, before any FPGA is probed. */
+int fpga_char_init(void)
 {
         int error;
         /* u32 partitioned integer. top (32-MINORBITS) are the device's major
@@ -54,7 +191,18 @@ int create_char_devs(struct fpga_device *fpga)
          * By default, MINORBITS is #define-d to be 20. */
         dev_t char_dev;
 
-        pr_debug("fpga_char: creating the interactive character devices\n");
+        pr_debug("fpga_char: creating the aggregate character device\n");
+
+        fpga_request_cache = KMEM_CACHE(fpga_request, 0);
+        if(!fpga_request_cache) {
+                return -ENOMEM;
+        }
+
+        fpga_char_wq = alloc_workqueue("fpga_char", WQ_UNBOUND, 0);
+        if(!fpga_char_wq) {
+                error = -ENOMEM;
+                goto could_not_alloc_wq;
+        }
 
         /* Allocate a major device and minor numbers for this module. */
         error = alloc_chrdev_region(&char_dev, 0, MAX_MINOR_DEVICES, MODULE_NAME);
@@ -66,60 +214,235 @@ int create_char_devs(struct fpga_device *fpga)
         pr_info("fpga_char: Major Device Number: %d", major_device_number);
 
         fpga_dev_class = class_create(THIS_MODULE, "PCIe FPGA Char Class");
-        if(!fpga_dev_class) { // error? ERR_PTR() returned
-                goto could_not_alloc_chr_region;
+        if(IS_ERR(fpga_dev_class)) { // error? ERR_PTR() returned
+                error = PTR_ERR(fpga_dev_class);
+                goto could_not_create_class;
         }
         fpga_dev_class->dev_uevent = fpga_uevent;
 
         // Initialize c-dev with these possible file operations.
-        cdev_init(&fpga_dev_data.cdev, &fops);
-        fpga_dev_data.cdev.owner = THIS_MODULE;
-        /* Add char device to system. Use MKDEV to create a new dev_t integer
-         * with the device's corresponding minor device number. In the case of a
-         * single minor device, it is the same as using the dev_t directly. */
-        error = cdev_add(&fpga_dev_data.cdev,
-                         MKDEV(major_device_number, MAX_MINOR_DEVICES - 1), 1);
+        cdev_init(&aggregate_cdev, &fops);
+        aggregate_cdev.owner = THIS_MODULE;
+        error = cdev_add(&aggregate_cdev, MKDEV(major_device_number, AGGREGATE_MINOR), 1);
         if(error) { // error? negative number returned
                 goto could_not_add_cdev;
         }
 
         /* Create the device and register with sysfs, also creating the entry in
          * /dev mapping to the proper major,minor number. */
-        fpga_dev_data.fpga_device = device_create(fpga_dev_class, NULL,
-                                                  MKDEV(major_device_number, 0),
-                                                  NULL, "virtine_fpga");
-        // Keep track of the FPGA that just created the character device(s)
-        fpga_dev = fpga;
+        aggregate_device = device_create(fpga_dev_class, NULL,
+                                         MKDEV(major_device_number, AGGREGATE_MINOR),
+                                         NULL, "virtine_fpga");
+        if(IS_ERR(aggregate_device)) {
+                error = PTR_ERR(aggregate_device);
+                goto could_not_create_device;
+        }
+
+        // Nothing in debugfs is needed to work, so failing there is fine
+        fpga_debugfs_dir = debugfs_create_dir("fpga_char", NULL);
+        debugfs_create_file("tenants", 0444, fpga_debugfs_dir, NULL, &fpga_tenants_fops);
         return 0;
 
         /* If things fail, have a roll-back area to jump to with goto */
+could_not_create_device:
+        cdev_del(&aggregate_cdev);
 could_not_add_cdev:
-        cdev_del(&fpga_dev_data.cdev);
         class_destroy(fpga_dev_class);
+could_not_create_class:
+        unregister_chrdev_region(MKDEV(major_device_number, 0), MAX_MINOR_DEVICES);
 could_not_alloc_chr_region:
+        destroy_workqueue(fpga_char_wq);
+could_not_alloc_wq:
+        kmem_cache_destroy(fpga_request_cache);
+        return error;
+}
+
+void fpga_char_exit(void)
+{
+        debugfs_remove_recursive(fpga_debugfs_dir);
+
+        pr_debug("fpga_char: Destroying the aggregate character device\n");
+        device_destroy(fpga_dev_class, MKDEV(major_device_number, AGGREGATE_MINOR));
+        cdev_del(&aggregate_cdev);
+
+        pr_debug("fpga_char: Unregistering and Destroying character device class\n");
+        class_destroy(fpga_dev_class);
+
+        pr_debug("fpga_char: Unregistering and destroying %d character devices with major number %d region\n", MAX_MINOR_DEVICES, major_device_number);
         unregister_chrdev_region(MKDEV(major_device_number, 0), MAX_MINOR_DEVICES);
+        ida_destroy(&fpga_minor_ida);
+
+        // Every card is gone by now, so nothing can queue more work
+        destroy_workqueue(fpga_char_wq);
+        kmem_cache_destroy(fpga_request_cache);
+}
+
+static void fpga_device_release(struct kref *ref)
+{
+        struct fpga_device *fpga = container_of(ref, struct fpga_device, ref);
+
+        put_device(fpga->dma_dev);
+        kfree(fpga);
+}
+
+/* Drop a reference to FPGA. Whoever removes the device drops the driver's
+ * instead of freeing it, and the last one frees it. Process context only. */
+void fpga_device_put(struct fpga_device *fpga)
+{
+        kref_put(&fpga->ref, fpga_device_release);
+}
+
+/* Give a newly probed FPGA its own /dev/virtine_fpgaN and make it available to
+ * the aggregate device. From here on FPGA is reference counted, and the
+ * driver's reference is dropped with fpga_device_put once it is removed. */
+int create_char_devs(struct fpga_device *fpga)
+{
+        int error;
+
+        pr_debug("fpga_char: creating the interactive character devices\n");
+
+        mutex_lock(&fpga_devs_lock);
+        error = ida_alloc_range(&fpga_minor_ida, AGGREGATE_MINOR + 1,
+                                MAX_MINOR_DEVICES - 1, GFP_KERNEL);
+        if(error < 0) { // error? -ENOSPC returned if every minor is taken
+                goto could_not_alloc_minor;
+        }
+        fpga->minor = error;
+
+        cdev_init(&fpga->cdev, &fops);
+        fpga->cdev.owner = THIS_MODULE;
+        error = cdev_add(&fpga->cdev, MKDEV(major_device_number, fpga->minor), 1);
+        if(error) { // error? negative number returned
+                goto could_not_add_cdev;
+        }
+
+        fpga->char_device = device_create_with_groups(fpga_dev_class, fpga->dma_dev,
+                                                      MKDEV(major_device_number, fpga->minor),
+                                                      fpga, fpga_dev_groups,
+                                                      "virtine_fpga%d", fpga->minor - 1);
+        if(IS_ERR(fpga->char_device)) {
+                error = PTR_ERR(fpga->char_device);
+                goto could_not_create_device;
+        }
+
+        // Maps for the device may outlive it, so it has to stay around too
+        kref_init(&fpga->ref);
+        get_device(fpga->dma_dev);
+        fpga_devs[fpga->minor] = fpga;
+        mutex_unlock(&fpga_devs_lock);
+        return 0;
+
+could_not_create_device:
+        cdev_del(&fpga->cdev);
+could_not_add_cdev:
+        ida_free(&fpga_minor_ida, fpga->minor);
+could_not_alloc_minor:
+        mutex_unlock(&fpga_devs_lock);
         return error;
 }
 
-int destroy_char_devs(void)
+int destroy_char_devs(struct fpga_device *fpga)
 {
         pr_debug("fpga_char: Destroying interactive character devices\n");
 
+        mutex_lock(&fpga_devs_lock);
+        fpga_devs[fpga->minor] = NULL;
+        WRITE_ONCE(fpga->removed, true);
+
         // Destroy the major:minor device
-        device_destroy(fpga_dev_class, MKDEV(major_device_number, 0));
+        device_destroy(fpga_dev_class, MKDEV(major_device_number, fpga->minor));
 
         pr_debug("fpga_char: Deleting kernel's cdev of device\n");
-        cdev_del(&fpga_dev_data.cdev);
+        cdev_del(&fpga->cdev);
 
-        pr_debug("fpga_char: Unregistering and Destroying character device class\n");
-        class_destroy(fpga_dev_class);
+        ida_free(&fpga_minor_ida, fpga->minor);
+        mutex_unlock(&fpga_devs_lock);
 
-        pr_debug("fpga_char: Unregistering and destroying %d character devices with major number %d region\n", MAX_MINOR_DEVICES, major_device_number);
-        unregister_chrdev_region(MKDEV(major_device_number, 0), MAX_MINOR_DEVICES);
+        /* Wait out submitters and register accesses that saw the device
+         * before it was marked removed, and kick anyone waiting for room on
+         * it, so the caller can tear it down. */
+        synchronize_rcu();
+        wake_up(&fpga->sq_wait);
 
         return 0;
 }
 
+/* Collect the FPGAs a file talks to into CARDS: its own FPGA, or every FPGA if
+ * it was opened through the aggregate device. Returns how many there are.
+ * Must be called with fpga_devs_lock held. */
+static unsigned int fpga_char_cards(struct fpga_char_private_data *priv,
+                                    struct fpga_device **cards)
+{
+        unsigned int nr_cards = 0;
+        int minor;
+
+        lockdep_assert_held(&fpga_devs_lock);
+
+        if(priv->fpga_hw) {
+                if(priv->fpga_hw->removed) {
+                        return 0;
+                }
+                cards[0] = priv->fpga_hw;
+                return 1;
+        }
+
+        for(minor = AGGREGATE_MINOR + 1; minor < MAX_MINOR_DEVICES; minor++) {
+                if(fpga_devs[minor]) {
+                        cards[nr_cards++] = fpga_devs[minor];
+                }
+        }
+
+        return nr_cards;
+}
+
+static void fpga_char_free_private_data(struct kref *ref)
+{
+        struct fpga_char_private_data *priv =
+                container_of(ref, struct fpga_char_private_data, ref);
+
+        if(priv->fpga_hw) {
+                fpga_device_put(priv->fpga_hw);
+        }
+        kfree(priv);
+}
+
+/* Drop everything a finished request was holding on to. This unpins memory,
+ * so it must be called from process context. */
+static void fpga_char_free_request(struct fpga_request *req)
+{
+        fpga_umem_put(req->umem);
+        kref_put(&req->ctx->ref, fpga_char_free_private_data);
+        kmem_cache_free(fpga_request_cache, req);
+}
+
+static void fpga_char_free_request_work(struct work_struct *work)
+{
+        fpga_char_free_request(container_of(work, struct fpga_request, free_work));
+}
+
+/* Called from the IRQ handler when a card is done with REQ. The request is
+ * queued on the completion queue of the file that submitted it, and anyone
+ * waiting there is woken up. */
+static void fpga_char_end_io(struct fpga_request *req)
+{
+        struct fpga_char_private_data *priv = req->ctx;
+        unsigned long flags;
+        bool closed;
+
+        spin_lock_irqsave(&priv->cq_lock, flags);
+        closed = priv->closed;
+        if(!closed) {
+                list_add_tail(&req->list, &priv->completed);
+                priv->nr_completed++;
+                wake_up_interruptible(&priv->cq_wait);
+        }
+        spin_unlock_irqrestore(&priv->cq_lock, flags);
+
+        if(closed) {
+                queue_work(fpga_char_wq, &req->free_work);
+        }
+}
+
 /* Because the the corresponding device file in /dev is backed by the PCI driver
  * and is connected to an FPGA's memory, "opening" the FPGA file is tantamount
  * to allocating the memory for the FPGA character device's private struct and
@@ -129,6 +452,7 @@ static int fpga_char_open(struct inode *inode, struct file *filep)
 {
         // NOTE: llseek is NOT supported by this device. Call appropriately.
         struct fpga_char_private_data *fpga_char_priv;
+        unsigned int i;
 
         pr_info("fpga_char: Opening character device file\n");
 
@@ -138,8 +462,34 @@ static int fpga_char_open(struct inode *inode, struct file *filep)
         }
 
         fpga_char_priv->minor_device_number = iminor(inode);
-        fpga_char_priv->fpga_hw = fpga_dev;
-        fpga_dev->filep = filep;
+        if(iminor(inode) != AGGREGATE_MINOR) {
+                // The card may be on its way out, so only take it if it is listed
+                mutex_lock(&fpga_devs_lock);
+                if(fpga_devs[iminor(inode)]) {
+                        fpga_char_priv->fpga_hw = fpga_device_get(fpga_devs[iminor(inode)]);
+                }
+                mutex_unlock(&fpga_devs_lock);
+                if(!fpga_char_priv->fpga_hw) {
+                        kfree(fpga_char_priv);
+                        return -ENODEV;
+                }
+        }
+        // Handle 0 is never given out, so userspace can use it as "no region"
+        xa_init_flags(&fpga_char_priv->umems, XA_FLAGS_ALLOC1);
+        spin_lock_init(&fpga_char_priv->cq_lock);
+        INIT_LIST_HEAD(&fpga_char_priv->completed);
+        init_waitqueue_head(&fpga_char_priv->cq_wait);
+        kref_init(&fpga_char_priv->ref);
+
+        fpga_tenant_init(&fpga_char_priv->tenant);
+        for(i = 0; i < MAX_MINOR_DEVICES; i++) {
+                fpga_tenant_queue_init(&fpga_char_priv->queues[i], &fpga_char_priv->tenant);
+        }
+        fpga_char_priv->tgid = task_tgid_nr(current);
+        get_task_comm(fpga_char_priv->comm, current);
+        mutex_lock(&fpga_tenants_lock);
+        list_add_tail(&fpga_char_priv->tenant_node, &fpga_tenants);
+        mutex_unlock(&fpga_tenants_lock);
 
         // Give the file struct access to the character device's private struct
         filep->private_data = fpga_char_priv;
@@ -158,12 +508,40 @@ static int fpga_char_open(struct inode *inode, struct file *filep)
 static int fpga_char_release(struct inode *inode, struct file *filep)
 {
         struct fpga_char_private_data *fpga_char_priv;
+        struct fpga_request *req, *tmp;
+        struct fpga_umem *umem;
+        unsigned long handle;
+        LIST_HEAD(unreaped);
 
         pr_info("fpga_char: Closing character device file\n");
 
         fpga_char_priv = filep->private_data;
         if(fpga_char_priv) {
-                kfree(fpga_char_priv);
+                mutex_lock(&fpga_tenants_lock);
+                list_del(&fpga_char_priv->tenant_node);
+                mutex_unlock(&fpga_tenants_lock);
+
+                /* Throw away whatever was never reaped. Requests still on a
+                 * card keep the private struct (and their memory) alive until
+                 * the card is done with them. */
+                spin_lock_irq(&fpga_char_priv->cq_lock);
+                fpga_char_priv->closed = true;
+                list_splice_init(&fpga_char_priv->completed, &unreaped);
+                spin_unlock_irq(&fpga_char_priv->cq_lock);
+                list_for_each_entry_safe(req, tmp, &unreaped, list) {
+                        fpga_char_free_request(req);
+                }
+
+                // Unpin and unmap anything the process forgot to unregister
+                xa_for_each(&fpga_char_priv->umems, handle, umem) {
+                        xa_erase(&fpga_char_priv->umems, handle);
+                        fpga_umem_put(umem);
+                }
+                xa_destroy(&fpga_char_priv->umems);
+                if(fpga_char_priv->pool) {
+                        fpga_pool_destroy(fpga_char_priv->pool);
+                }
+                kref_put(&fpga_char_priv->ref, fpga_char_free_private_data);
                 fpga_char_priv = NULL;
         }
 
@@ -182,7 +560,6 @@ static int fpga_char_release(struct inode *inode, struct file *filep)
 ssize_t _fpga_char_read(struct file *filep, char *buffer, size_t length, loff_t *offset)
 {
         struct fpga_char_private_data *priv = filep->private_data;
-        u8 __iomem *to_read_from = priv->fpga_hw->dev_mem + *offset;
         ssize_t bytes_read = 0;
         u32 clean_virtine_addr;
 
@@ -190,17 +567,13 @@ ssize_t _fpga_char_read(struct file *filep, char *buffer, size_t length, loff_t
         if((*offset % 4) != 0) {
                 return bytes_read;
         }
-
         pr_debug("fpga_char: Kernel buffer @ 0x%p\n", buffer);
 
         while(bytes_read < length) {
-                pr_debug("fpga_char: Read %zd bytes so far\n", bytes_read);
-                pr_debug("fpga_char: Requested read length: %zu\n", length);
                 // Read from the FPGA
-                clean_virtine_addr = readl(to_read_from + bytes_read);
-                pr_info("fpga_char: Reading %lu bytes from 0x%p (val: 0x%x) into buffer of size %lu",
-                        sizeof(clean_virtine_addr), to_read_from + bytes_read,
-                        clean_virtine_addr, sizeof(buffer));
+                clean_virtine_addr = fpga_read_reg32(priv->fpga_hw, *offset + bytes_read);
+                trace_fpga_mmio_read(priv->fpga_hw, *offset + bytes_read,
+                                     clean_virtine_addr);
                 memcpy(buffer + bytes_read, &clean_virtine_addr, sizeof(clean_virtine_addr));
                 bytes_read += sizeof(clean_virtine_addr);
         }
@@ -214,21 +587,28 @@ static ssize_t fpga_char_read(struct file *filep, char __user *buffer, size_t le
                               loff_t *offset)
 {
         struct fpga_char_private_data *priv = filep->private_data;
-        u8 __iomem *to_read_from = priv->fpga_hw->dev_mem + *offset;
         unsigned long clean_virtine_addr;
 
         ssize_t bytes_read = 0;
 
+        /* The aggregate device has no registers of its own to read, and
+         * neither do devices backed by a DMA engine. */
+        if(!priv->fpga_hw || !fpga_has_regs(priv->fpga_hw)) {
+                return -ENXIO;
+        }
+
+        rcu_read_lock();
+        if(READ_ONCE(priv->fpga_hw->removed)) {
+                rcu_read_unlock();
+                return -ENODEV;
+        }
         bytes_read = _fpga_char_read(filep, (char *) &clean_virtine_addr, length, offset);
+        rcu_read_unlock();
         pr_debug("fpga_char: Clean Virtine Addr: 0x%lx\n", clean_virtine_addr);
         if(!bytes_read) {
                 return -EIO;
         }
 
-        pr_info("fpga_char: Reading %lu bytes from 0x%p (val: 0x%lx) into USER buffer of size %lu",
-                sizeof(clean_virtine_addr), to_read_from + bytes_read,
-                clean_virtine_addr, sizeof(buffer));
-
         // Copy the value to the provided user buffer.
         if(copy_to_user(buffer, &clean_virtine_addr,
                         sizeof(clean_virtine_addr))) {
@@ -238,17 +618,75 @@ static ssize_t fpga_char_read(struct file *filep, char __user *buffer, size_t le
         return bytes_read;
 }
 
+/* Writes to the RQ tail are how virtines are handed to the card, but the card
+ * can only use DMA addresses. Each 64-bit value in BUFFER is taken to be the
+ * user virtual address of a virtine inside a region registered with
+ * FPGA_CHAR_REGISTER_UMEM, and is translated before it is pushed. If the
+ * card's submission ring fills up part way through, NOWAIT writers get back
+ * what was written so far (or -EAGAIN), and everyone else waits for room. */
+static ssize_t fpga_char_write_rq(struct fpga_char_private_data *priv,
+                                  const char __user *buffer, size_t length,
+                                  bool nowait)
+{
+        ssize_t bytes_written = 0;
+        struct fpga_umem *umem;
+        u64 dirty_virtine;
+        int error;
+
+        while(length - bytes_written >= sizeof(dirty_virtine)) {
+                if(copy_from_user(&dirty_virtine, buffer + bytes_written,
+                                  sizeof(dirty_virtine))) {
+                        error = -EFAULT;
+                        goto out;
+                }
+
+                umem = fpga_char_find_umem(priv, dirty_virtine);
+                if(!umem) {
+                        error = -EFAULT;
+                        goto out;
+                }
+                error = fpga_char_submit(priv, umem, dirty_virtine - umem->uaddr,
+                                         nowait);
+                fpga_umem_put(umem);
+                if(error) {
+                        goto out;
+                }
+
+                bytes_written += sizeof(dirty_virtine);
+        }
+
+        return bytes_written;
+
+out:
+        // Report partial progress, like write(2) does
+        return bytes_written ? bytes_written : error;
+}
+
+/* Registers userspace may write straight to. None of them hold an address, so
+ * nothing written through here can point the card at memory the DMA API did
+ * not hand out. Virtines go through RQ_TAIL_OFFSET_REG, which translates
+ * them, and snapshots through FPGA_CHAR_SET_SNAPSHOT. The batch factor goes
+ * through FPGA_CHAR_MODIFY_BATCH_FACTOR, since a raw write would just be
+ * undone the next time interrupt moderation retunes it. */
+static bool fpga_char_reg_writable(loff_t reg)
+{
+        switch(reg & ~7) {
+        case DOORBELL_REG:
+        case SCRATCH_REG:
+                return true;
+        default:
+                return false;
+        }
+}
+
 /* NOTE: When opening this file in Python 3, you MUST pass buffering=0 to open.
  * This is because this file device does not support seek operations. */
 static ssize_t fpga_char_write(struct file *filep, const char __user *buffer,
                                size_t length, loff_t *offset)
 {
         struct fpga_char_private_data *priv = filep->private_data;
-        u8 __iomem *to_write_to = priv->fpga_hw->dev_mem + *offset;
         unsigned int dirty_virtine_addr;
 
-        unsigned long bytes_from_user;
-
         ssize_t bytes_written = 0;
 
         pr_debug("fpga_char: OFFSET=%llu\n", *offset);
@@ -256,15 +694,39 @@ static ssize_t fpga_char_write(struct file *filep, const char __user *buffer,
                 return bytes_written;
         }
 
-        while(bytes_written < length) {
-                 bytes_from_user = copy_from_user(&dirty_virtine_addr,
-                                                  buffer + bytes_written,
-                                                  sizeof(dirty_virtine_addr));
-                 pr_info("fpga_char: Writing %lu bytes to 0x%p (val: 0x%x) from buffer of size %lu",
-                        sizeof(dirty_virtine_addr), to_write_to + bytes_written,
-                        dirty_virtine_addr, sizeof(buffer));
+        BUILD_BUG_ON(VIRTINE_FPGA_RQ_OFFSET != RQ_TAIL_OFFSET_REG);
+        if(*offset == RQ_TAIL_OFFSET_REG) {
+                return fpga_char_write_rq(priv, buffer, length,
+                                          filep->f_flags & O_NONBLOCK);
+        }
 
-                 iowrite32(dirty_virtine_addr, to_write_to + bytes_written);
+        // Only per-card files can poke at the other registers
+        if(!priv->fpga_hw || !fpga_has_regs(priv->fpga_hw)) {
+                return -ENXIO;
+        }
+        for(bytes_written = 0; bytes_written < length; bytes_written += 4) {
+                if(!fpga_char_reg_writable(*offset + bytes_written)) {
+                        return -EPERM;
+                }
+        }
+
+        bytes_written = 0;
+        while(length - bytes_written >= sizeof(dirty_virtine_addr)) {
+                 if(copy_from_user(&dirty_virtine_addr, buffer + bytes_written,
+                                   sizeof(dirty_virtine_addr))) {
+                         return bytes_written ? bytes_written : -EFAULT;
+                 }
+                 trace_fpga_mmio_write(priv->fpga_hw, *offset + bytes_written,
+                                       dirty_virtine_addr);
+
+                 rcu_read_lock();
+                 if(READ_ONCE(priv->fpga_hw->removed)) {
+                         rcu_read_unlock();
+                         return bytes_written ? bytes_written : -ENODEV;
+                 }
+                 fpga_write_reg32(priv->fpga_hw, *offset + bytes_written,
+                                  dirty_virtine_addr);
+                 rcu_read_unlock();
                  bytes_written += sizeof(dirty_virtine_addr);
         }
 
@@ -276,41 +738,778 @@ static ssize_t fpga_char_write(struct file *filep, const char __user *buffer,
         return bytes_written;
 }
 
+/* Choose which card cleans the next virtine from UMEM. A region registered on
+ * a per-card file is only mapped for that card. A region registered on the
+ * aggregate device is mapped for every card, and the card with the fewest
+ * outstanding virtines gets the work. Each map holds a reference on its card,
+ * so the cards stay valid while UMEM does; removed ones are skipped here, and
+ * fpga_queue_request turns away any that go while we are choosing. Returns
+ * NULL if every card is gone. */
+static struct fpga_device *fpga_char_pick_card(struct fpga_umem *umem)
+{
+        struct fpga_device *best = NULL;
+        int best_occupancy = INT_MAX;
+        unsigned int i;
+
+        for(i = 0; i < umem->nr_maps; i++) {
+                struct fpga_device *fpga = umem->maps[i].fpga;
+                int occupancy = atomic_read(&fpga->rq_occupancy);
+
+                if(READ_ONCE(fpga->removed)) {
+                        continue;
+                }
+                if(occupancy < best_occupancy) {
+                        best = fpga;
+                        best_occupancy = occupancy;
+                }
+        }
+
+        return best;
+}
+
+/* Send the virtine OFFSET bytes into UMEM to be cleaned, on behalf of the
+ * file PRIV. END_IO is called with the request once the card is done with
+ * it, and END_IO_DATA is left in the request for it. With NOWAIT, a full
+ * submission ring fails with -EAGAIN, otherwise we sleep until it has room. */
+static int __fpga_char_submit(struct fpga_char_private_data *priv,
+                              struct fpga_umem *umem, unsigned long offset,
+                              void (*end_io)(struct fpga_request *),
+                              void *end_io_data, bool nowait)
+{
+        struct fpga_device *fpga = fpga_char_pick_card(umem);
+        struct fpga_request *req;
+        int error;
+
+        if(!fpga) {
+                return -ENODEV;
+        }
+        req = kmem_cache_alloc(fpga_request_cache, nowait ? GFP_NOWAIT : GFP_KERNEL);
+        if(!req) {
+                return -ENOMEM;
+        }
+
+        /* The snapshot can still grow before the request reaches an engine,
+         * so what it was checked against goes along with it. */
+        req->max_bytes = max_t(u64, READ_ONCE(fpga->snapshot_size), 1);
+        error = fpga_umem_dma_addr(umem, fpga, offset, req->max_bytes,
+                                   &req->dma_addr);
+        if(error) {
+                kmem_cache_free(fpga_request_cache, req);
+                return error;
+        }
+        fpga_umem_sync_for_device(umem, fpga, offset, req->max_bytes);
+
+        req->virtine = umem->uaddr + offset;
+        req->status = 0;
+        req->umem = fpga_umem_get(umem);
+        kref_get(&priv->ref);
+        req->ctx = priv;
+        req->end_io = end_io;
+        req->end_io_data = end_io_data;
+        req->tq = &priv->queues[fpga->minor];
+        INIT_WORK(&req->free_work, fpga_char_free_request_work);
+
+        if(nowait) {
+                error = fpga_queue_request(fpga, req);
+        } else {
+                error = fpga_queue_request_wait(fpga, req);
+        }
+        if(error) { // error? -EAGAIN/-ERESTARTSYS returned if the ring was full
+                fpga_char_free_request(req);
+        }
+        return error;
+}
+
+/* Its completion will be queued on PRIV's completion queue. */
+static int fpga_char_submit(struct fpga_char_private_data *priv,
+                            struct fpga_umem *umem, unsigned long offset,
+                            bool nowait)
+{
+        return __fpga_char_submit(priv, umem, offset, fpga_char_end_io, NULL,
+                                  nowait);
+}
+
+static long fpga_char_register_umem(struct fpga_char_private_data *priv,
+                                    struct virtine_umem_reg __user *ureg)
+{
+        struct fpga_device *cards[MAX_MINOR_DEVICES];
+        unsigned int nr_cards;
+        struct virtine_umem_reg reg;
+        struct fpga_umem *umem;
+        u32 handle;
+        long ret;
+
+        if(copy_from_user(&reg, ureg, sizeof(reg))) {
+                return -EFAULT;
+        }
+
+        /* Map the region for every card this file can send work to, so the
+         * aggregate device is free to pick any of them per request. */
+        mutex_lock(&fpga_devs_lock);
+        nr_cards = fpga_char_cards(priv, cards);
+        umem = nr_cards ? fpga_umem_register(cards, nr_cards, reg.addr, reg.size)
+                        : ERR_PTR(-ENODEV);
+        mutex_unlock(&fpga_devs_lock);
+        if(IS_ERR(umem)) {
+                return PTR_ERR(umem);
+        }
+
+        ret = xa_alloc(&priv->umems, &handle, umem, xa_limit_31b, GFP_KERNEL);
+        if(ret) {
+                fpga_umem_put(umem);
+                return ret;
+        }
+
+        reg.handle = handle;
+        if(copy_to_user(ureg, &reg, sizeof(reg))) {
+                xa_erase(&priv->umems, handle);
+                fpga_umem_put(umem);
+                return -EFAULT;
+        }
+
+        return 0;
+}
+
+static long fpga_char_unregister_umem(struct fpga_char_private_data *priv,
+                                      unsigned long handle)
+{
+        struct fpga_umem *umem = xa_erase(&priv->umems, handle);
+
+        if(!umem) {
+                return -ENOENT;
+        }
+
+        fpga_umem_put(umem);
+        return 0;
+}
+
+/* Take a reference to the region registered as HANDLE. This is on the hot
+ * path, so no locks are taken; unregistering defers the free past RCU. */
+static struct fpga_umem *fpga_char_get_umem(struct fpga_char_private_data *priv,
+                                            u64 handle)
+{
+        struct fpga_umem *umem;
+
+        rcu_read_lock();
+        umem = xa_load(&priv->umems, handle);
+        if(umem && !kref_get_unless_zero(&umem->ref)) {
+                umem = NULL;
+        }
+        rcu_read_unlock();
+
+        return umem;
+}
+
+/* Find and take a reference to the region containing the user address UADDR.
+ * Processes register a handful of large regions, so a walk is cheap enough. */
+static struct fpga_umem *fpga_char_find_umem(struct fpga_char_private_data *priv,
+                                             unsigned long uaddr)
+{
+        struct fpga_umem *umem, *found = NULL;
+        unsigned long handle;
+
+        rcu_read_lock();
+        xa_for_each(&priv->umems, handle, umem) {
+                if(uaddr - umem->uaddr < umem->size) {
+                        if(kref_get_unless_zero(&umem->ref)) {
+                                found = umem;
+                        }
+                        break;
+                }
+        }
+        rcu_read_unlock();
+
+        return found;
+}
+
+/* Before FPGA latches a snapshot of SIZE bytes, wait for the card to be done
+ * with every virtine on its RQ that was only checked to hold a smaller one,
+ * and stop any more of those from being pushed. Called with snapshot_lock
+ * held. Returns -ERESTARTSYS if a signal arrives first. */
+static int fpga_char_drain_unfit(struct fpga_device *fpga, u64 size)
+{
+        struct fpga_request *req;
+        unsigned long flags;
+        int error;
+
+        spin_lock_irqsave(&fpga->rq_lock, flags);
+        fpga->snapshot_next = size;
+        fpga->nr_unfit = 0;
+        list_for_each_entry(req, &fpga->inflight, list) {
+                if(req->max_bytes < size) {
+                        fpga->nr_unfit++;
+                }
+        }
+        spin_unlock_irqrestore(&fpga->rq_lock, flags);
+
+        /* Submitters that found rq_lock taken left their requests for us to
+         * push. The unfit ones may be sitting on the RQ waiting for a
+         * doorbell. */
+        if(fpga_kick_requests(fpga) || READ_ONCE(fpga->nr_unfit)) {
+                fpga_ring_doorbell(fpga);
+        }
+        error = wait_event_interruptible(fpga->drain_wait, !READ_ONCE(fpga->nr_unfit));
+        if(error) {
+                spin_lock_irqsave(&fpga->rq_lock, flags);
+                fpga->snapshot_next = 0;
+                fpga->nr_unfit = 0;
+                spin_unlock_irqrestore(&fpga->rq_lock, flags);
+                if(fpga_kick_requests(fpga)) {
+                        fpga_ring_doorbell(fpga);
+                }
+        }
+        return error;
+}
+
+/* Replace the snapshot FPGA restores virtines from. The contents are copied
+ * out of the user buffer into coherent DMA memory, and it is the DMA address
+ * of that copy the card is given, never a user or physical address. */
+static long fpga_char_load_snapshot(struct fpga_device *fpga,
+                                    struct virtine_snapshot snapshot)
+{
+        dma_addr_t snapshot_dma, old_dma;
+        void *new_snapshot, *old_snapshot;
+        unsigned long flags;
+        u64 old_size;
+        int error;
+
+        new_snapshot = dma_alloc_coherent(fpga->dma_dev, snapshot.size,
+                                          &snapshot_dma, GFP_KERNEL);
+        if(!new_snapshot) {
+                return -ENOMEM;
+        }
+        if(copy_from_user(new_snapshot, (void __user *) snapshot.addr, snapshot.size)) {
+                dma_free_coherent(fpga->dma_dev, snapshot.size,
+                                  new_snapshot, snapshot_dma);
+                return -EFAULT;
+        }
+
+        mutex_lock(&fpga->snapshot_lock);
+        old_snapshot = fpga->snapshot;
+        old_dma = fpga->snapshot_dma;
+        old_size = fpga->snapshot_size;
+
+        if(fpga_has_regs(fpga)) {
+                if(snapshot.size > old_size) {
+                        error = fpga_char_drain_unfit(fpga, snapshot.size);
+                        if(error) {
+                                mutex_unlock(&fpga->snapshot_lock);
+                                dma_free_coherent(fpga->dma_dev, snapshot.size,
+                                                  new_snapshot, snapshot_dma);
+                                return error;
+                        }
+                }
+                fpga_write_reg64(fpga, SNAPSHOT_SIZE_REG, snapshot.size);
+                fpga_write_reg64(fpga, SNAPSHOT_ADDR_REG, snapshot_dma);
+                // Flush the posted writes, so the card has latched the new snapshot
+                fpga_read_reg32(fpga, SNAPSHOT_ADDR_REG);
+        }
+
+        // DMA engine submissions pick up the snapshot under rq_lock
+        spin_lock_irqsave(&fpga->rq_lock, flags);
+        fpga->snapshot = new_snapshot;
+        fpga->snapshot_dma = snapshot_dma;
+        fpga->snapshot_size = snapshot.size;
+        fpga->snapshot_next = 0;
+        spin_unlock_irqrestore(&fpga->rq_lock, flags);
+        mutex_unlock(&fpga->snapshot_lock);
+
+        // Push what submitters left for us while we held rq_lock
+        if(fpga_kick_requests(fpga)) {
+                fpga_ring_doorbell(fpga);
+        }
+
+        /* Copies the DMA engine already started may still be reading the old
+         * snapshot. */
+        if(fpga->dma_chan) {
+                fpga_dma_engine_quiesce(fpga);
+        }
+
+        if(old_snapshot) {
+                dma_free_coherent(fpga->dma_dev, old_size, old_snapshot, old_dma);
+        }
+
+        return 0;
+}
+
+/* The aggregate device may send a virtine to any card, so every card has to
+ * be restoring from the same snapshot. */
+static long fpga_char_set_snapshot(struct fpga_char_private_data *priv,
+                                   struct virtine_snapshot __user *usnapshot)
+{
+        struct fpga_device *cards[MAX_MINOR_DEVICES];
+        struct virtine_snapshot snapshot;
+        unsigned int nr_cards, i;
+        long ret = 0;
+
+        if(copy_from_user(&snapshot, usnapshot, sizeof(snapshot))) {
+                return -EFAULT;
+        }
+        if(!snapshot.size || snapshot.size > VIRTINE_FPGA_MAX_SNAPSHOT) {
+                return -EINVAL;
+        }
+
+        mutex_lock(&fpga_devs_lock);
+        nr_cards = fpga_char_cards(priv, cards);
+        for(i = 0; i < nr_cards && !ret; i++) {
+                ret = fpga_char_load_snapshot(cards[i], snapshot);
+        }
+        mutex_unlock(&fpga_devs_lock);
+
+        return ret;
+}
+
+static long fpga_char_submit_fixed(struct fpga_char_private_data *priv,
+                                   struct virtine_fixed_submit __user *usubmit,
+                                   bool nowait)
+{
+        struct virtine_fixed_submit submit;
+        struct fpga_umem *umem;
+        long ret;
+
+        if(copy_from_user(&submit, usubmit, sizeof(submit))) {
+                return -EFAULT;
+        }
+
+        umem = fpga_char_get_umem(priv, submit.handle);
+        if(!umem) {
+                return -ENOENT;
+        }
+
+        ret = fpga_char_submit(priv, umem, submit.offset, nowait);
+        fpga_umem_put(umem);
+        return ret;
+}
+
+#ifdef FPGA_CHAR_URING_CMD
+/* What a pending io_uring command remembers about its virtine. */
+struct fpga_char_uring_pdu {
+        struct fpga_request *req;
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+static void fpga_char_uring_task_cb(struct io_uring_cmd *ioucmd,
+                                    unsigned int issue_flags)
+#else
+static void fpga_char_uring_task_cb(struct io_uring_cmd *ioucmd)
+#endif
+{
+        struct fpga_char_uring_pdu *pdu = (struct fpga_char_uring_pdu *) ioucmd->pdu;
+        struct fpga_request *req = pdu->req;
+
+        trace_fpga_request_stages(req, ktime_get());
+        /* The CQE's res is the status, and its second word (with
+         * IORING_SETUP_CQE32) is the virtine's user address. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+        io_uring_cmd_done(ioucmd, req->status, req->virtine, issue_flags);
+#else
+        io_uring_cmd_done(ioucmd, req->status, req->virtine);
+#endif
+        fpga_char_free_request(req);
+}
+
+/* Called from the IRQ handler. Posting the CQE and unpinning the memory both
+ * have to happen in the submitting task, so bounce over there. */
+static void fpga_char_uring_end_io(struct fpga_request *req)
+{
+        struct io_uring_cmd *ioucmd = req->end_io_data;
+        struct fpga_char_uring_pdu *pdu = (struct fpga_char_uring_pdu *) ioucmd->pdu;
+
+        pdu->req = req;
+        io_uring_cmd_complete_in_task(ioucmd, fpga_char_uring_task_cb);
+}
+
+/* io_uring passthrough. FPGA_CHAR_SUBMIT_FIXED takes a struct
+ * virtine_fixed_submit in the SQE's command area and stays pending until the
+ * card has cleaned the virtine, so its CQE doubles as the completion.
+ * Submissions never go through the file's completion queue. */
+static int fpga_char_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+        struct fpga_char_private_data *priv = ioucmd->file->private_data;
+        const struct virtine_fixed_submit *submit = fpga_uring_cmd_payload(ioucmd);
+        struct fpga_umem *umem;
+        u64 handle, offset;
+        int ret;
+
+        BUILD_BUG_ON(sizeof(struct fpga_char_uring_pdu) > sizeof(ioucmd->pdu));
+
+        if(ioucmd->cmd_op != FPGA_CHAR_SUBMIT_FIXED) {
+                return -ENOTTY;
+        }
+
+        // The SQE is shared with userspace, so only read it once
+        handle = READ_ONCE(submit->handle);
+        offset = READ_ONCE(submit->offset);
+
+        umem = fpga_char_get_umem(priv, handle);
+        if(!umem) {
+                return -ENOENT;
+        }
+
+        /* When io_uring asks us not to block, it retries from a worker if
+         * we return -EAGAIN, and the worker is allowed to wait for room. */
+        ret = __fpga_char_submit(priv, umem, offset, fpga_char_uring_end_io, ioucmd,
+                                 issue_flags & IO_URING_F_NONBLOCK);
+        fpga_umem_put(umem);
+        if(ret) {
+                return ret;
+        }
+
+        return -EIOCBQUEUED;
+}
+#endif
+
+/* Take up to NR finished requests off of PRIV's completion queue. */
+static unsigned int fpga_char_take_completed(struct fpga_char_private_data *priv,
+                                             struct list_head *taken,
+                                             unsigned int nr)
+{
+        unsigned int nr_taken = 0;
+
+        spin_lock_irq(&priv->cq_lock);
+        while(nr_taken < nr && !list_empty(&priv->completed)) {
+                list_move_tail(priv->completed.next, taken);
+                nr_taken++;
+        }
+        priv->nr_completed -= nr_taken;
+        spin_unlock_irq(&priv->cq_lock);
+
+        return nr_taken;
+}
+
+/* Put the NR requests on TAKEN back at the front of PRIV's completion queue,
+ * in the order they were taken. */
+static void fpga_char_untake_completed(struct fpga_char_private_data *priv,
+                                       struct list_head *taken,
+                                       unsigned int nr)
+{
+        spin_lock_irq(&priv->cq_lock);
+        list_splice_init(taken, &priv->completed);
+        priv->nr_completed += nr;
+        wake_up_interruptible(&priv->cq_wait);
+        spin_unlock_irq(&priv->cq_lock);
+}
+
+/* Spin for up to SPIN_US microseconds (at most poll_spin_max_us), reaping the
+ * cards PRIV talks to by hand, until PRIV has MIN_COMPLETE completions
+ * waiting. This is the busy half of blk-mq style hybrid polling; the caller
+ * sleeps if it runs out. */
+static void fpga_char_spin(struct fpga_char_private_data *priv,
+                           unsigned int min_complete, unsigned int spin_us)
+{
+        struct fpga_device *cards[MAX_MINOR_DEVICES];
+        unsigned int nr_cards, i;
+        ktime_t deadline;
+
+        spin_us = min(spin_us, READ_ONCE(poll_spin_max_us));
+        if(!spin_us || READ_ONCE(priv->nr_completed) >= min_complete) {
+                return;
+        }
+
+        /* Cards can come and go while we spin, so only hold on to the ones
+         * there are now, and not to the lock that keeps them from going. */
+        mutex_lock(&fpga_devs_lock);
+        nr_cards = fpga_char_cards(priv, cards);
+        for(i = 0; i < nr_cards; i++) {
+                fpga_device_get(cards[i]);
+        }
+        mutex_unlock(&fpga_devs_lock);
+
+        deadline = ktime_add_us(ktime_get(), spin_us);
+        while(READ_ONCE(priv->nr_completed) < min_complete) {
+                for(i = 0; i < nr_cards; i++) {
+                        // A removed card's registers are unmapped once removal is past RCU
+                        rcu_read_lock();
+                        if(!READ_ONCE(cards[i]->removed)) {
+                                fpga_reap_completions(cards[i]);
+                        }
+                        rcu_read_unlock();
+                }
+                if(signal_pending(current) || need_resched() ||
+                   ktime_after(ktime_get(), deadline)) {
+                        break;
+                }
+                cpu_relax();
+        }
+
+        for(i = 0; i < nr_cards; i++) {
+                fpga_device_put(cards[i]);
+        }
+}
+
+/* Copy REQ's completion out to UCOMPLETION, which is a struct
+ * virtine_completion_ts if TIMESTAMPED, or a plain struct virtine_completion. */
+static int fpga_char_copy_completion(struct fpga_request *req, void __user *ucompletion,
+                                     bool timestamped)
+{
+        const struct fpga_card_stamps *card = &req->stages.card;
+        struct virtine_completion_ts completion_ts = { 0 };
+        struct virtine_completion completion = { 0 };
+
+        if(!timestamped) {
+                completion.virtine = req->virtine;
+                completion.status = req->status;
+                return copy_to_user(ucompletion, &completion, sizeof(completion)) ? -EFAULT : 0;
+        }
+
+        completion_ts.virtine = req->virtine;
+        completion_ts.status = req->status;
+        completion_ts.bytes = req->bytes;
+        if(card->virtine) { // Only set when the card's stamps were for this virtine
+                completion_ts.flags = VIRTINE_COMPLETION_TIMESTAMPS;
+                completion_ts.queued_ns = le64_to_cpu(card->enqueue);
+                completion_ts.started_ns = le64_to_cpu(card->dma_start);
+                completion_ts.finished_ns = le64_to_cpu(card->dma_end);
+                completion_ts.bytes = le64_to_cpu(card->bytes);
+        }
+        return copy_to_user(ucompletion, &completion_ts, sizeof(completion_ts)) ? -EFAULT : 0;
+}
+
+/* Copy up to REAP->nr completions out to userspace, waiting for at least
+ * REAP->min_complete of them. Spins for SPIN_US microseconds first.
+ * TIMESTAMPED completions are struct virtine_completion_ts. */
+static long fpga_char_do_reap(struct fpga_char_private_data *priv,
+                              struct virtine_reap *reap, unsigned int spin_us,
+                              bool timestamped)
+{
+        size_t size = timestamped ? sizeof(struct virtine_completion_ts) :
+                                    sizeof(struct virtine_completion);
+        struct fpga_request *req, *tmp;
+        unsigned int nr_taken, i = 0;
+        char __user *ucompletions;
+        LIST_HEAD(taken);
+        long ret;
+
+        if(reap->min_complete > reap->nr) {
+                return -EINVAL;
+        }
+        ucompletions = u64_to_user_ptr(reap->completions);
+        if(!access_ok(ucompletions, reap->nr * size)) {
+                return -EFAULT;
+        }
+
+        if(reap->min_complete) {
+                fpga_char_spin(priv, reap->min_complete, spin_us);
+                ret = wait_event_interruptible(priv->cq_wait,
+                                               READ_ONCE(priv->nr_completed) >= reap->min_complete);
+                if(ret) {
+                        return ret;
+                }
+        }
+
+        nr_taken = fpga_char_take_completed(priv, &taken, reap->nr);
+        list_for_each_entry_safe(req, tmp, &taken, list) {
+                if(fpga_char_copy_completion(req, ucompletions + i * size, timestamped)) {
+                        /* Whatever could not be copied out stays queued for
+                         * the next reap, instead of being lost. */
+                        fpga_char_untake_completed(priv, &taken, nr_taken - i);
+                        return i ? i : -EFAULT;
+                }
+                trace_fpga_request_stages(req, ktime_get());
+                list_del(&req->list);
+                fpga_char_free_request(req);
+                i++;
+        }
+
+        return nr_taken;
+}
+
+static long fpga_char_reap(struct fpga_char_private_data *priv,
+                           struct virtine_reap __user *ureap, bool timestamped)
+{
+        struct virtine_reap reap;
+
+        if(copy_from_user(&reap, ureap, sizeof(reap))) {
+                return -EFAULT;
+        }
+
+        return fpga_char_do_reap(priv, &reap, 0, timestamped);
+}
+
+static long fpga_char_poll_completions(struct fpga_char_private_data *priv,
+                                       struct virtine_poll __user *upoll,
+                                       bool timestamped)
+{
+        struct virtine_reap reap;
+        struct virtine_poll poll;
+
+        if(copy_from_user(&poll, upoll, sizeof(poll))) {
+                return -EFAULT;
+        }
+
+        reap.completions = poll.completions;
+        reap.nr = poll.nr;
+        reap.min_complete = poll.min_complete;
+        return fpga_char_do_reap(priv, &reap, poll.spin_us, timestamped);
+}
+
+/* A file's pool lives on whichever card it was opened for. Pools made through
+ * the aggregate device go to the least loaded card, like single virtines. */
+static long fpga_char_create_pool(struct fpga_char_private_data *priv,
+                                  struct virtine_pool_create __user *ucreate)
+{
+        struct fpga_device *cards[MAX_MINOR_DEVICES];
+        struct virtine_pool_create create;
+        struct fpga_device *fpga = NULL;
+        struct fpga_pool *pool;
+        unsigned int nr_cards, i;
+
+        if(copy_from_user(&create, ucreate, sizeof(create))) {
+                return -EFAULT;
+        }
+
+        mutex_lock(&fpga_devs_lock);
+        nr_cards = fpga_char_cards(priv, cards);
+        for(i = 0; i < nr_cards; i++) {
+                if(!fpga || atomic_read(&cards[i]->rq_occupancy) <
+                            atomic_read(&fpga->rq_occupancy)) {
+                        fpga = cards[i];
+                }
+        }
+        if(!fpga) {
+                mutex_unlock(&fpga_devs_lock);
+                return -ENODEV;
+        }
+        pool = fpga_pool_create(fpga, create.virtine_size, create.nr_virtines,
+                                create.low_watermark);
+        mutex_unlock(&fpga_devs_lock);
+        if(IS_ERR(pool)) {
+                return PTR_ERR(pool);
+        }
+
+        if(cmpxchg(&priv->pool, NULL, pool)) {
+                fpga_pool_destroy(pool);
+                return -EBUSY;
+        }
+
+        create.stride = pool->stride;
+        if(copy_to_user(ucreate, &create, sizeof(create))) {
+                return -EFAULT; // The pool stays, it can still be mmapped
+        }
+        return 0;
+}
+
+static int fpga_char_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+        struct fpga_char_private_data *priv = filep->private_data;
+        struct fpga_pool *pool = READ_ONCE(priv->pool);
+
+        if(!pool) {
+                return -ENXIO;
+        }
+        return fpga_pool_mmap(pool, vma);
+}
+
+static __poll_t fpga_char_poll(struct file *filep, poll_table *wait)
+{
+        struct fpga_char_private_data *priv = filep->private_data;
+        __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+        poll_wait(filep, &priv->cq_wait, wait);
+        if(READ_ONCE(priv->nr_completed)) {
+                mask |= EPOLLIN | EPOLLRDNORM;
+        }
+
+        return mask;
+}
+
+/* Register-level ioctls act on every card a file talks to. For the aggregate
+ * device, the maximum number of virtines is the sum over all of the cards,
+ * because that is how many it can have outstanding at once. */
 static long fpga_char_ioctl(struct file *filep, unsigned int cmd, unsigned long args)
 {
         struct fpga_char_private_data *priv = filep->private_data;
+        struct fpga_device *cards[MAX_MINOR_DEVICES];
+        unsigned int nr_cards, i;
 
         long ret;
         switch(cmd) {
         case FPGA_CHAR_MODIFY_BATCH_FACTOR:
-                // args is just the integer to write to the batch factor register
-                iowrite32(args, priv->fpga_hw->dev_mem + BATCH_FACTOR_REG);
+                /* args is just the integer to write to the batch factor
+                 * register, or 0 to go back to adaptive moderation. */
+                mutex_lock(&fpga_devs_lock);
+                nr_cards = fpga_char_cards(priv, cards);
+                for(i = 0; i < nr_cards; i++) {
+                        fpga_set_batch_factor(cards[i], args);
+                }
+                mutex_unlock(&fpga_devs_lock);
                 ret = 0;
                 break;
         case FPGA_CHAR_GET_MAX_NUM_VIRTINES: {
-                unsigned long *num_virtines = (unsigned long*) args;
-                *num_virtines = ioread32(priv->fpga_hw->dev_mem + MAX_NUM_VIRTINES_REG);
-                pr_debug("fpga_char: Max Num Virtines: %lu\n", *num_virtines);
-                ret = 0;
+                unsigned long num_virtines = 0;
+                mutex_lock(&fpga_devs_lock);
+                nr_cards = fpga_char_cards(priv, cards);
+                for(i = 0; i < nr_cards; i++) {
+                        num_virtines += cards[i]->dma_chan ? NUM_POSSIBLE_VIRTINES :
+                                fpga_read_reg32(cards[i], MAX_NUM_VIRTINES_REG);
+                }
+                mutex_unlock(&fpga_devs_lock);
+                pr_debug("fpga_char: Max Num Virtines: %lu\n", num_virtines);
+                ret = put_user(num_virtines, (unsigned long __user *) args);
                 break;
         }
         case FPGA_CHAR_RING_DOORBELL:
                 pr_debug("fpga_char: Ringing doorbell!\n");
-                // 1 informs card it can begin processing
-                iowrite32(1, priv->fpga_hw->dev_mem + DOORBELL_REG);
+                mutex_lock(&fpga_devs_lock);
+                nr_cards = fpga_char_cards(priv, cards);
+                for(i = 0; i < nr_cards; i++) {
+                        fpga_ring_doorbell(cards[i]);
+                }
+                mutex_unlock(&fpga_devs_lock);
+                ret = 0;
+                break;
+        case FPGA_CHAR_SET_SNAPSHOT:
+                ret = fpga_char_set_snapshot(priv, (struct virtine_snapshot __user *) args);
+                break;
+        case FPGA_CHAR_REGISTER_UMEM:
+                ret = fpga_char_register_umem(priv, (struct virtine_umem_reg __user *) args);
+                break;
+        case FPGA_CHAR_UNREGISTER_UMEM:
+                // args is just the handle returned when registering
+                ret = fpga_char_unregister_umem(priv, args);
+                break;
+        case FPGA_CHAR_SUBMIT_FIXED:
+                ret = fpga_char_submit_fixed(priv, (struct virtine_fixed_submit __user *) args,
+                                             filep->f_flags & O_NONBLOCK);
+                break;
+        case FPGA_CHAR_REAP_COMPLETIONS:
+        case FPGA_CHAR_REAP_TIMESTAMPED:
+                ret = fpga_char_reap(priv, (struct virtine_reap __user *) args,
+                                     cmd == FPGA_CHAR_REAP_TIMESTAMPED);
+                break;
+        case FPGA_CHAR_POLL_COMPLETIONS:
+        case FPGA_CHAR_POLL_TIMESTAMPED:
+                ret = fpga_char_poll_completions(priv, (struct virtine_poll __user *) args,
+                                                 cmd == FPGA_CHAR_POLL_TIMESTAMPED);
+                break;
+        case FPGA_CHAR_CREATE_POOL:
+                ret = fpga_char_create_pool(priv, (struct virtine_pool_create __user *) args);
+                break;
+        case FPGA_CHAR_POOL_GET: {
+                // args is just the flags
+                struct fpga_pool *pool = READ_ONCE(priv->pool);
+                ret = pool ? fpga_pool_get(pool, args & FPGA_POOL_NOWAIT) : -ENXIO;
+                break;
+        }
+        case FPGA_CHAR_POOL_PUT: {
+                // args is just the index handed out by FPGA_CHAR_POOL_GET
+                struct fpga_pool *pool = READ_ONCE(priv->pool);
+                ret = pool ? fpga_pool_put(pool, args) : -ENXIO;
+                break;
+        }
+        case FPGA_CHAR_SET_WEIGHT:
+                if(args < 1 || args > FPGA_TENANT_MAX_WEIGHT) {
+                        ret = -EINVAL;
+                        break;
+                }
+                // Cards pick the new weight up on this tenant's next turn
+                WRITE_ONCE(priv->tenant.weight, args);
                 ret = 0;
                 break;
-        case FPGA_CHAR_SET_SNAPSHOT: {
-                struct virtine_snapshot *snapshot = (struct virtine_snapshot*) args;
-                // Write the 64-bit value snapshot size
-                loff_t offset = SNAPSHOT_SIZE_REG;
-                ret = fpga_char_write(filep, (char*) &snapshot->size,
-                                      sizeof(snapshot->size), &offset);
-                // Write 64-bit value of snapshot address
-                offset = SNAPSHOT_ADDR_REG;
-                ret = fpga_char_write(filep, (char*) &snapshot->addr,
-                                      sizeof(snapshot->addr), &offset);
-                // TODO: Combine the return values of both writes.
+        case FPGA_CHAR_GET_TENANT_STATS: {
+                struct virtine_tenant_stats stats;
+                fpga_tenant_stats(&priv->tenant, &stats);
+                ret = copy_to_user((void __user *) args, &stats, sizeof(stats)) ? -EFAULT : 0;
                 break;
         }
         default:
@@ -9,35 +9,28 @@
 
 #include "modinfo.h"
 #include "fpga_char_main.h"
+#include "uapi/virtine_fpga.h"
 
-#define MAX_MINOR_DEVICES 1
+/* Minor 0 is the aggregate device. Every other minor belongs to one card. */
+#define MAX_MINOR_DEVICES 16
+#define AGGREGATE_MINOR 0
 
+/* For freeing things that the IRQ handler drops the last reference to. */
+extern struct workqueue_struct *fpga_char_wq;
+
+int fpga_char_init(void);
+void fpga_char_exit(void);
 int create_char_devs(struct fpga_device *fpga);
-int destroy_char_devs(void);
+int destroy_char_devs(struct fpga_device *fpga);
 
-ssize_t _fpga_char_read(struct file *filep, char *buffer, size_t length, loff_t *offset);
+static inline struct fpga_device *fpga_device_get(struct fpga_device *fpga)
+{
+        kref_get(&fpga->ref);
+        return fpga;
+}
 
-/* The magic 'F' has MANY drivers. Some other sequence numbers (the second param)
- * are taken. I use between 0x30 and 0x80 to give myself room to experiment.
- * To define a new ioctl number, I recommend you use one of the 4 macros below:
- * _IO(magic, number) - No inputs/outputs
- * _IOR(magic, number, input_data_type) - ioctl with input
- * _IOW(magic, number, output_data_type) - ioctl with output
- * _IORW(magic, number, in_out_data_type) - ioctl with input and output
- * ALL ioctls THAT TAKE DATATYPE PARAMETERS ONLY TAKE THE PARAMETER!!
- * i.e. _IOR(magic, number, struct struct_name), NOT
- *      _IOR(magic, number, sizeof(struct struct_name)).
- * Note that the struct is limited to a maximum of 16KiB (14 address bits) */
-#define IOCTL_MAGIC 'F'
-
-struct virtine_snapshot {
-        unsigned long addr;
-        unsigned long size;
-};
-
-#define FPGA_CHAR_MODIFY_BATCH_FACTOR _IOR(IOCTL_MAGIC, 0x30, unsigned long)
-#define FPGA_CHAR_GET_MAX_NUM_VIRTINES _IOW(IOCTL_MAGIC, 0x31, unsigned long*)
-#define FPGA_CHAR_RING_DOORBELL _IO(IOCTL_MAGIC, 0x32)
-#define FPGA_CHAR_SET_SNAPSHOT _IOR(IOCTL_MAGIC, 0x33, struct virtine_snapshot*)
+void fpga_device_put(struct fpga_device *fpga);
+
+ssize_t _fpga_char_read(struct file *filep, char *buffer, size_t length, loff_t *offset);
 
 #endif
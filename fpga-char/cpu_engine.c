@@ -0,0 +1,118 @@
+#include <linux/highmem.h>
+#include <linux/string.h>
+#include <linux/workqueue.h>
+
+#include "cpu_engine.h"
+#include "umem.h"
+#include "fpga_char_trace.h"
+
+static struct workqueue_struct *fpga_cpu_wq;
+
+static unsigned int cpu_spill_max = NUM_POSSIBLE_VIRTINES;
+module_param(cpu_spill_max, uint, 0644);
+MODULE_PARM_DESC(cpu_spill_max, "Virtines each card may have queued to the CPU at once (default: 100)");
+
+/* Copy FPGA's snapshot over the virtine REQ names, like the card would.
+ * Returns the number of bytes restored, or a negative errno. */
+static long fpga_cpu_clean(struct fpga_device *fpga, struct fpga_request *req)
+{
+        struct fpga_umem *umem = req->umem;
+        unsigned long offset = req->virtine - umem->uaddr;
+        unsigned long pos = offset_in_page(umem->uaddr) + offset;
+        unsigned int page_off, len;
+        u64 done = 0, size;
+        void *dst;
+
+        mutex_lock(&fpga->snapshot_lock);
+        size = fpga->snapshot_size;
+        // The snapshot may have grown since the request was checked
+        if(size > umem->size - offset) {
+                mutex_unlock(&fpga->snapshot_lock);
+                return -EINVAL;
+        }
+
+        while(done < size) {
+                page_off = offset_in_page(pos + done);
+                len = min_t(u64, PAGE_SIZE - page_off, size - done);
+
+                /* Non-temporal stores, so restoring a large virtine does not
+                 * push everything else out of the cache. The virtine is not
+                 * going to be touched again until it is handed out anyway. */
+                dst = kmap_local_page(umem->pages[(pos + done) >> PAGE_SHIFT]);
+                memcpy_flushcache(dst + page_off, fpga->snapshot + done, len);
+                kunmap_local(dst);
+
+                done += len;
+                cond_resched();
+        }
+        mutex_unlock(&fpga->snapshot_lock);
+
+        // Drain the non-temporal stores before anyone is told it is clean
+        wmb();
+        return done;
+}
+
+static void fpga_cpu_work(struct work_struct *work)
+{
+        struct fpga_request *req = container_of(work, struct fpga_request, cpu_work);
+        struct fpga_device *fpga = req->fpga;
+        long cleaned;
+
+        cleaned = fpga_cpu_clean(fpga, req);
+        if(cleaned >= 0) {
+                atomic_long_add(cleaned, &fpga->cpu_stats.bytes);
+        }
+        atomic_long_inc(&fpga->cpu_stats.completed);
+        atomic_dec(&fpga->nr_cpu_queued);
+        req->bytes = max_t(long, cleaned, 0);
+        fpga_tenant_done(req, req->bytes);
+
+        req->status = cleaned < 0 ? cleaned : 0;
+        if(trace_fpga_request_stages_enabled()) {
+                req->stages.done = ktime_get();
+        }
+        trace_fpga_request_done(fpga, req);
+        req->end_io(req);
+}
+
+/* Clean REQ on the CPU instead of on FPGA. REQ must name a virtine inside of a
+ * registered region. Never sleeps. Returns -EAGAIN if FPGA already has
+ * cpu_spill_max virtines queued to the CPU, so the CPU engine pushes back on
+ * submitters just like a full card does. */
+int fpga_cpu_queue_request(struct fpga_device *fpga, struct fpga_request *req)
+{
+        if(atomic_inc_return(&fpga->nr_cpu_queued) > READ_ONCE(cpu_spill_max)) {
+                atomic_dec(&fpga->nr_cpu_queued);
+                return -EAGAIN;
+        }
+
+        req->fpga = fpga;
+        atomic_long_inc(&fpga->cpu_stats.submitted);
+        fpga_tenant_dispatch(req);
+        INIT_WORK(&req->cpu_work, fpga_cpu_work);
+        queue_work(fpga_cpu_wq, &req->cpu_work);
+        return 0;
+}
+
+/* Wait for every virtine spilled so far to be cleaned. Called when a card goes
+ * away, before its snapshot is freed. */
+void fpga_cpu_engine_drain(void)
+{
+        flush_workqueue(fpga_cpu_wq);
+}
+
+int fpga_cpu_engine_init(void)
+{
+        /* Unbound, so spilled virtines are spread over every CPU instead of
+         * piling up on whichever one submitted them. */
+        fpga_cpu_wq = alloc_workqueue("fpga_char_cpu", WQ_UNBOUND | WQ_SYSFS, 0);
+        if(!fpga_cpu_wq) {
+                return -ENOMEM;
+        }
+        return 0;
+}
+
+void fpga_cpu_engine_exit(void)
+{
+        destroy_workqueue(fpga_cpu_wq);
+}
@@ -0,0 +1,20 @@
+#ifndef CPU_ENGINE_H
+#define CPU_ENGINE_H
+
+#include <linux/kernel.h>
+
+#include "fpga_char_main.h"
+
+/* The CPU cleanup engine restores virtines in software, from a kernel
+ * workqueue, for when a card is too backed up to take more work. It copies
+ * from the same snapshot the card uses, into the same pinned pages the card
+ * would have written, and completes requests the same way, so a submitter
+ * cannot tell which engine cleaned a virtine. Only virtines in registered
+ * regions can be spilled, because those are the only ones the kernel has
+ * the pages of. */
+int fpga_cpu_engine_init(void);
+void fpga_cpu_engine_exit(void);
+int fpga_cpu_queue_request(struct fpga_device *fpga, struct fpga_request *req);
+void fpga_cpu_engine_drain(void);
+
+#endif
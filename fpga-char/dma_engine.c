@@ -0,0 +1,190 @@
+#include <linux/slab.h>
+#include <linux/version.h>
+
+#include "dma_engine.h"
+#include "chardev.h"
+#include "cpu_engine.h"
+
+static unsigned int dma_channels;
+module_param(dma_channels, uint, 0444);
+MODULE_PARM_DESC(dma_channels, "How many dmaengine memcpy channels to clean virtines with (default: 0)");
+
+#define FPGA_MAX_DMA_CHANNELS 8
+
+static struct fpga_device *fpga_dma_devs[FPGA_MAX_DMA_CHANNELS];
+static unsigned int nr_fpga_dma_devs;
+
+static void fpga_dma_engine_done(void *param, const struct dmaengine_result *result)
+{
+        struct fpga_request *req = param;
+        struct fpga_device *fpga = req->fpga;
+        unsigned long flags;
+
+        spin_lock_irqsave(&fpga->rq_lock, flags);
+        list_del(&req->list);
+        fpga->nr_inflight--;
+        spin_unlock_irqrestore(&fpga->rq_lock, flags);
+
+        fpga_end_request(fpga, req,
+                         result->result == DMA_TRANS_NOERROR ? 0 : -EIO);
+
+        /* A descriptor is free again. Push whatever was waiting for one, and
+         * let blocked submitters retry. */
+        fpga_kick_requests(fpga);
+        wake_up(&fpga->sq_wait);
+}
+
+/* Queue a copy of FPGA's snapshot over the virtine REQ names on FPGA's
+ * channel. This is the DMA engine's RQ tail write: it is called by the
+ * flusher, with rq_lock held so the snapshot cannot be swapped out before the
+ * copy is on the channel, and the copy starts once the flusher issues it.
+ * Returns -EAGAIN if the channel is out of descriptors, and the request is
+ * retried when a copy completes. */
+int fpga_dma_engine_submit(struct fpga_device *fpga, struct fpga_request *req)
+{
+        struct dma_async_tx_descriptor *tx;
+        dma_cookie_t cookie;
+
+        lockdep_assert_held(&fpga->rq_lock);
+
+        if(!fpga->snapshot_size) { // Nothing to copy from yet
+                return -ENODATA;
+        }
+
+        tx = dmaengine_prep_dma_memcpy(fpga->dma_chan, req->dma_addr,
+                                       fpga->snapshot_dma, fpga->snapshot_size,
+                                       DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+        if(!tx) { // Out of descriptors
+                return -EAGAIN;
+        }
+        tx->callback_result = fpga_dma_engine_done;
+        tx->callback_param = req;
+
+        cookie = dmaengine_submit(tx);
+        if(dma_submit_error(cookie)) {
+                return -EIO;
+        }
+        WRITE_ONCE(fpga->dma_cookie, cookie);
+        return 0;
+}
+
+/* Wait for every copy submitted to FPGA's channel so far to finish. A channel
+ * completes its descriptors in cookie order, so that is just the last one. */
+void fpga_dma_engine_quiesce(struct fpga_device *fpga)
+{
+        dma_cookie_t cookie = READ_ONCE(fpga->dma_cookie);
+
+        if(cookie > 0 && dma_sync_wait(fpga->dma_chan, cookie) != DMA_COMPLETE) {
+                dev_warn(fpga->dma_dev, "Timed out waiting for copies to finish\n");
+        }
+}
+
+static struct fpga_device *fpga_dma_engine_create(struct dma_chan *chan)
+{
+        struct fpga_device *fpga;
+        int error;
+
+        fpga = kzalloc(sizeof(struct fpga_device), GFP_KERNEL);
+        if(!fpga) {
+                return ERR_PTR(-ENOMEM);
+        }
+        fpga->dma_chan = chan;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+        fpga->dma_dev = dmaengine_get_dma_device(chan);
+#else
+        fpga->dma_dev = chan->device->dev;
+#endif
+
+        mutex_init(&fpga->snapshot_lock);
+        atomic_set(&fpga->rq_occupancy, 0);
+        atomic_set(&fpga->nr_cpu_queued, 0);
+        spin_lock_init(&fpga->rq_lock);
+        INIT_LIST_HEAD(&fpga->inflight);
+        INIT_LIST_HEAD(&fpga->active_queues);
+        fpga_tenant_init(&fpga->tenant);
+        fpga_tenant_queue_init(&fpga->tenant_queue, &fpga->tenant);
+        init_waitqueue_head(&fpga->sq_wait);
+        init_waitqueue_head(&fpga->drain_wait);
+        // Requests are queued and shared out between tenants like a card's
+        error = fpga_sq_init(&fpga->sq, FPGA_SQ_DEPTH);
+        if(error) {
+                goto sq_init_failed;
+        }
+
+        error = create_char_devs(fpga);
+        if(error) {
+                goto char_devs_failed;
+        }
+
+        dev_info(fpga->dma_dev, "Cleaning virtines with DMA channel %s as virtine_fpga%d\n",
+                 dma_chan_name(chan), fpga->minor - 1);
+        return fpga;
+
+char_devs_failed:
+        fpga_sq_free(&fpga->sq);
+sq_init_failed:
+        kfree(fpga);
+        return ERR_PTR(error);
+}
+
+static void fpga_dma_engine_destroy(struct fpga_device *fpga)
+{
+        destroy_char_devs(fpga);
+
+        /* Terminating drops the copies still on the channel without calling
+         * back, so fail their requests by hand. */
+        dmaengine_terminate_sync(fpga->dma_chan);
+        fpga_abort_requests(fpga);
+        // The CPU engine copies from this device's snapshot too
+        fpga_cpu_engine_drain();
+
+        fpga_sq_free(&fpga->sq);
+        if(fpga->snapshot) {
+                dma_free_coherent(fpga->dma_dev, fpga->snapshot_size,
+                                  fpga->snapshot, fpga->snapshot_dma);
+        }
+        dma_release_channel(fpga->dma_chan);
+        fpga_device_put(fpga);
+}
+
+int fpga_dma_engine_init(void)
+{
+        struct fpga_device *fpga;
+        struct dma_chan *chan;
+        dma_cap_mask_t mask;
+
+        if(dma_channels > FPGA_MAX_DMA_CHANNELS) {
+                pr_warn("fpga_char: Only using %d of %u DMA channels\n",
+                        FPGA_MAX_DMA_CHANNELS, dma_channels);
+                dma_channels = FPGA_MAX_DMA_CHANNELS;
+        }
+
+        dma_cap_zero(mask);
+        dma_cap_set(DMA_MEMCPY, mask);
+        while(nr_fpga_dma_devs < dma_channels) {
+                chan = dma_request_chan_by_mask(&mask);
+                if(IS_ERR(chan)) {
+                        // Use however many channels there are
+                        pr_warn("fpga_char: Only found %u of %u DMA channels\n",
+                                nr_fpga_dma_devs, dma_channels);
+                        break;
+                }
+
+                fpga = fpga_dma_engine_create(chan);
+                if(IS_ERR(fpga)) {
+                        dma_release_channel(chan);
+                        fpga_dma_engine_exit();
+                        return PTR_ERR(fpga);
+                }
+                fpga_dma_devs[nr_fpga_dma_devs++] = fpga;
+        }
+
+        return 0;
+}
+
+void fpga_dma_engine_exit(void)
+{
+        while(nr_fpga_dma_devs) {
+                fpga_dma_engine_destroy(fpga_dma_devs[--nr_fpga_dma_devs]);
+        }
+}
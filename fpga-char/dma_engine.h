@@ -0,0 +1,19 @@
+#ifndef DMA_ENGINE_H
+#define DMA_ENGINE_H
+
+#include <linux/kernel.h>
+#include <linux/dmaengine.h>
+
+#include "fpga_char_main.h"
+
+/* Devices backed by a generic dmaengine memcpy channel (ioat, dw-edma, ...)
+ * instead of a card. Each channel the module is told to use shows up as one
+ * more /dev/virtine_fpgaN, and joins the aggregate device like a card would.
+ * Virtines are cleaned by having the channel copy the snapshot over them, and
+ * complete through the same end_io as the card's. */
+int fpga_dma_engine_init(void);
+void fpga_dma_engine_exit(void);
+int fpga_dma_engine_submit(struct fpga_device *fpga, struct fpga_request *req);
+void fpga_dma_engine_quiesce(struct fpga_device *fpga);
+
+#endif
@@ -1,6 +1,13 @@
 #include "modinfo.h"
 #include "fpga_char_main.h"
 #include "chardev.h"
+#include "cpu_engine.h"
+#include "dma_engine.h"
+#include "sim.h"
+#include "umem.h"
+
+#define CREATE_TRACE_POINTS
+#include "fpga_char_trace.h"
 
 // TODO: Change these values to their real ones.
 #define VENDOR_ID 0x1172
@@ -8,7 +15,37 @@
 
 static int fpga_probe(struct pci_dev *dev, const struct pci_device_id *id);
 static void fpga_remove(struct pci_dev *dev);
-static irqreturn_t fetch_clean_virtines(int irq, void *cookie);
+static enum hrtimer_restart fpga_poll_timer_fn(struct hrtimer *timer);
+static void fpga_start_polling(struct fpga_device *fpga);
+
+/* Bounds for the batch factor chosen by the interrupt moderation loop. */
+static bool dim_enable = true;
+module_param(dim_enable, bool, 0444);
+MODULE_PARM_DESC(dim_enable, "Retune each card's batch factor as load changes (default: Y)");
+static unsigned int dim_min = 1;
+module_param(dim_min, uint, 0444);
+MODULE_PARM_DESC(dim_min, "Smallest batch factor the moderation loop picks (default: 1)");
+static unsigned int dim_max = 64;
+module_param(dim_max, uint, 0444);
+MODULE_PARM_DESC(dim_max, "Largest batch factor the moderation loop picks (default: 64)");
+
+static int completion_mode = FPGA_COMPLETION_HYBRID;
+module_param(completion_mode, int, 0444);
+MODULE_PARM_DESC(completion_mode, "0: interrupts, 1: hrtimer polling, 2: switch between them with load (default: 2)");
+static unsigned int poll_interval_us = 50;
+module_param(poll_interval_us, uint, 0444);
+MODULE_PARM_DESC(poll_interval_us, "How often a polling card's CQ is checked (default: 50)");
+
+/* Past this many virtines queued to a card, more are cleaned on the CPU. */
+static unsigned int cpu_spill_threshold = NUM_POSSIBLE_VIRTINES;
+module_param(cpu_spill_threshold, uint, 0644);
+MODULE_PARM_DESC(cpu_spill_threshold, "Card occupancy at which cleaning spills to the CPU, 0 to never spill (default: 100)");
+
+/* Reading a completion's timestamps off of the card costs as many register
+ * reads again as the completion itself. */
+static bool completion_timestamps = true;
+module_param(completion_timestamps, bool, 0644);
+MODULE_PARM_DESC(completion_timestamps, "Read the card's timestamps for every completion (default: Y)");
 
 /* This macro is used to create a struct pci_device_id that matches a
  * specific device.  The subvendor and subdevice fields will be set to
@@ -43,6 +80,7 @@ static int fpga_probe(struct pci_dev *dev, const struct pci_device_id *id)
 {
         int error;
         int bar;
+        int irq;
         unsigned long dev_mmio_start, dev_mmio_len;
 
         /* Allocate memory and initialize to zero for the driver's private
@@ -54,6 +92,7 @@ static int fpga_probe(struct pci_dev *dev, const struct pci_device_id *id)
                 return -ENOMEM;
         }
         fpga->pdev = dev;
+        fpga->dma_dev = &dev->dev;
 
         /* We must enable the PCI device. This wakes the device up,
          * allocates I/O and memory regions.
@@ -91,8 +130,19 @@ static int fpga_probe(struct pci_dev *dev, const struct pci_device_id *id)
                 goto could_not_request_region;
         }
 
-        /* NOTE: To allow MSI/MSI-X to work, DMA MUST also be enabled! */
-        pci_set_dma_mask(dev, DMA_BIT_MASK(32)); // Give DMA a 32-bit mask.
+        /* NOTE: To allow MSI/MSI-X to work, DMA MUST also be enabled!
+         * Ask for the full 64-bit address space first, so virtines above 4GiB
+         * do not need to be bounced through swiotlb. Only fall back to 32 bits
+         * if the platform cannot do that. */
+        error = dma_set_mask_and_coherent(&dev->dev, DMA_BIT_MASK(64));
+        if(error) {
+                dev_warn(&dev->dev, "No 64-bit DMA, falling back to 32-bit\n");
+                error = dma_set_mask_and_coherent(&dev->dev, DMA_BIT_MASK(32));
+        }
+        if(error) { // error? -EIO returned
+                dev_err(&dev->dev, "No usable DMA configuration\n");
+                goto could_not_set_dma_mask;
+        }
         pci_set_master(dev); // Register this device as the master in the DMA request.
         /* Allocate MSI and/or MSI-X IRQ vectors. */
         /* params: device, minimum vectors, max vectors, type of interrupt flags */
@@ -100,19 +150,20 @@ static int fpga_probe(struct pci_dev *dev, const struct pci_device_id *id)
         error = pci_alloc_irq_vectors(dev, 1, NUM_IRQ_VECTORS, PCI_IRQ_MSI | PCI_IRQ_MSIX);
         if(error < NUM_IRQ_VECTORS) { // error? -1 or less than num IRQ vecs requested
                 dev_err(&dev->dev, "Could not allocate MSI/MSI-X IRQs\n");
-                goto could_not_request_region;
+                goto could_not_set_dma_mask;
         }
         /* Get Linux IRQ num for THIS device's IRQ num with index 0.
-         * Linux IRQ num is used for requesting IRQ callbacks. */
-        error = pci_irq_vector(dev, 0); // Use error here for simplicity
-        dev_dbg(&dev->dev, "MSI/MSI-X IRQ is: %d\n", error);
+         * Linux IRQ num is used for requesting IRQ callbacks. Every card has
+         * its own vector, and the cookie tells the handler which card. */
+        irq = pci_irq_vector(dev, 0);
+        dev_dbg(&dev->dev, "MSI/MSI-X IRQ is: %d\n", irq);
         /* Assign callback function to grabbed Linux IRQ */
         dev_info(&dev->dev, "Assigning callback to MSI/MSI-X IRQ\n");
-        error = request_irq(dev->irq, fetch_clean_virtines, error,
+        error = request_irq(irq, fetch_clean_virtines, 0,
                             "fpga_char-clean_virtine_IRQ", (void *) fpga);
         if(error < 0) {
                 dev_err(&dev->dev, "Could not assign callback to MSI IRQ\n");
-                goto could_not_alloc_irq_vectors;
+                goto could_not_request_irq;
         }
 
         /* Get start of BAR0 memory offset, and the length of BAR0. */
@@ -132,11 +183,11 @@ static int fpga_probe(struct pci_dev *dev, const struct pci_device_id *id)
         dev_dbg(&dev->dev, "Remapping the PCI BAR memory and marking as uncachable\n");
         fpga->dev_mem = ioremap_uc(dev_mmio_start, dev_mmio_len);
         if(!(fpga->dev_mem)) { // error? NULL pointer returned
+                error = -ENOMEM;
                 goto ioremap_failed;
         }
 
         dev_dbg(&dev->dev, "Remapped BAR 0 from 0x%lx to 0x%p\n", dev_mmio_start, fpga->dev_mem);
-        // NOTE: Likely need to set up DMA. fpga_set_dma_mask()
 
         /* Read device configuration information from the config registers,
          * which is almost always safe to do. */
@@ -145,37 +196,95 @@ static int fpga_probe(struct pci_dev *dev, const struct pci_device_id *id)
         dev_info(&dev->dev, "Vendor: 0x%X. Device: 0x%X\n",
                  fpga->vendor_id, fpga->device_id);
 
-        fpga->batch_factor = ioread32(fpga->dev_mem + BATCH_FACTOR_REG);
-        dev_dbg(&dev->dev, "Batch factor: %u\n", fpga->batch_factor);
-
-        error = create_char_devs(fpga);
-        if(error) { // error? non-zero returned
-                goto char_devs_failed;
-        }
-
         /* Defined in pci.h. Adds pointer to private struct to the DEVICE
          * struct that backs all other (sub)types device structs. */
         pci_set_drvdata(dev, fpga);
 
+        error = fpga_card_init(fpga);
+        if(error) {
+                goto card_init_failed;
+        }
+
         return 0;
 
-char_devs_failed:
+card_init_failed:
         iounmap(fpga->dev_mem);
 ioremap_failed:
-        dev_err(&dev->dev, "Releasing PCI device's BARs\n");
-        pci_release_region(dev, pci_select_bars(dev, IORESOURCE_MEM));
-could_not_alloc_irq_vectors:
         dev_err(&dev->dev, "Removing IRQ handlers\n");
-        free_irq(dev->irq, (void *) fpga);
+        free_irq(irq, (void *) fpga);
+could_not_request_irq:
         pci_free_irq_vectors(dev);
+could_not_set_dma_mask:
+        dev_err(&dev->dev, "Releasing PCI device's BARs\n");
+        pci_release_region(dev, bar);
 could_not_request_region:
         dev_err(&dev->dev, "Disabling PCI device, for safety\n");
         pci_disable_device(dev);
 could_not_enable_device:
         dev_crit(&dev->dev, "Not installing this driver for this device with error code: %d", error);
+        kfree(fpga);
         return error;
 };
 
+/* Everything about bringing up a card that is the same for a real card and a
+ * simulated one. */
+int fpga_card_init(struct fpga_device *fpga)
+{
+        int error;
+
+        fpga->batch_factor = fpga_read_reg32(fpga, BATCH_FACTOR_REG);
+        dev_dbg(fpga->dma_dev, "Batch factor: %u\n", fpga->batch_factor);
+        fpga->dim.enabled = dim_enable;
+        fpga->dim.dir = 1;
+        fpga->dim.start = ktime_get();
+
+        spin_lock_init(&fpga->cq_lock);
+        /* Switch the CQ over to bulk reads. Cards that do not know about
+         * CQ_MODE_REG will not read back the mode, and keep popping. */
+        fpga_write_reg32(fpga, CQ_MODE_REG, CQ_MODE_BULK);
+        fpga->cq_bulk = fpga_read_reg32(fpga, CQ_MODE_REG) == CQ_MODE_BULK;
+        if(fpga->cq_bulk) {
+                fpga->cq_consumed = fpga_read_reg32(fpga, CQ_CONSUMED_REG);
+        }
+        dev_dbg(fpga->dma_dev, "CQ is read in %s mode\n", fpga->cq_bulk ? "bulk" : "pop");
+        hrtimer_init(&fpga->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        fpga->poll_timer.function = fpga_poll_timer_fn;
+        fpga->last_irq = ktime_get();
+        fpga->irq_gap_ns = U64_MAX;
+
+        mutex_init(&fpga->snapshot_lock);
+        atomic_set(&fpga->rq_occupancy, 0);
+        atomic_set(&fpga->nr_cpu_queued, 0);
+        spin_lock_init(&fpga->rq_lock);
+        INIT_LIST_HEAD(&fpga->inflight);
+        INIT_LIST_HEAD(&fpga->active_queues);
+        fpga_tenant_init(&fpga->tenant);
+        fpga_tenant_queue_init(&fpga->tenant_queue, &fpga->tenant);
+        init_waitqueue_head(&fpga->sq_wait);
+        init_waitqueue_head(&fpga->drain_wait);
+        /* Cards with flow-control registers report a completely free RQ
+         * right after reset. Older cards do not decode the register. */
+        fpga->ring_status = fpga_read_reg32(fpga, RQ_FREE_REG) == NUM_POSSIBLE_VIRTINES;
+        dev_dbg(fpga->dma_dev, "RQ flow control %s\n",
+                fpga->ring_status ? "supported" : "not supported");
+        error = fpga_sq_init(&fpga->sq, FPGA_SQ_DEPTH);
+        if(error) {
+                return error;
+        }
+
+        error = create_char_devs(fpga);
+        if(error) { // error? non-zero returned
+                fpga_sq_free(&fpga->sq);
+                return error;
+        }
+
+        if(completion_mode == FPGA_COMPLETION_POLL) {
+                fpga_start_polling(fpga);
+        }
+
+        return 0;
+}
+
 /* This function is called whenever a PCIe device being handled by this driver
  * is removed (or lost) from this system.
  */
@@ -183,72 +292,934 @@ static void fpga_remove(struct pci_dev *dev)
 {
         struct fpga_device *fpga = pci_get_drvdata(dev);
 
-        destroy_char_devs();
+        destroy_char_devs(fpga);
 
-        /* Release the allocated address space from the kernel used by the FPGA */
-        iounmap(fpga->dev_mem);
-        /* Free the FPGA private information struct */
-        if(fpga) {
-                kfree(fpga);
+        /* An MSI handled after the timer is cancelled could start polling
+         * again, so keep the IRQ handler out first. Then stop polling, and
+         * undo the disable it left on the IRQ. */
+        fpga_disable_irq(fpga);
+        fpga_synchronize_irq(fpga);
+        hrtimer_cancel(&fpga->poll_timer);
+        if(fpga->polling) {
+                fpga_enable_irq(fpga);
         }
 
         /* Remove the callback from the main IRQ mapping */
-        free_irq(dev->irq, (void *) fpga);
+        free_irq(pci_irq_vector(dev, 0), (void *) fpga);
         /* Free the MSI/MSI-X interrupts that were allocated */
         pci_free_irq_vectors(dev);
+        /* Nothing will ever complete the requests still on the card */
+        fpga_abort_requests(fpga);
+        /* The CPU engine copies from this card's snapshot */
+        fpga_cpu_engine_drain();
+
+        fpga_sq_free(&fpga->sq);
+
+        /* Release the allocated address space from the kernel used by the FPGA */
+        iounmap(fpga->dev_mem);
+        /* Release the snapshot the device was restoring virtines from */
+        if(fpga->snapshot) {
+                dma_free_coherent(&dev->dev, fpga->snapshot_size,
+                                  fpga->snapshot, fpga->snapshot_dma);
+        }
+        /* Files, pools and registered regions may still point at it */
+        fpga_device_put(fpga);
+
         /* Free memory region */
         pci_release_region(dev, pci_select_bars(dev, IORESOURCE_MEM));
         /* Disable the device. */
         pci_disable_device(dev);
 }
 
-/* An IRQ handler function for fetching the clean virtines from the coprocessor
- * when it raises an interrupt on its MSI lines. */
-static irqreturn_t fetch_clean_virtines(int irq, void *cookie)
+/* Sort what is waiting in the submission ring onto the queues of the tenants
+ * that sent it. The ring is only drained while the tenant queues hold less
+ * than a ring's worth, so a card that falls behind still fills up its ring
+ * and pushes back on submitters. */
+static void fpga_sort_requests(struct fpga_device *fpga)
 {
-        struct fpga_device *fpga = (struct fpga_device *) cookie;
-        irqreturn_t ret;
-        unsigned long clean_virtines[NUM_POSSIBLE_VIRTINES];
+        struct fpga_tenant_queue *tq;
+        struct fpga_request *req;
+        unsigned int nr = 0;
+
+        while(fpga->nr_queued < FPGA_SQ_DEPTH) {
+                req = fpga_sq_pop(&fpga->sq);
+                if(!req) {
+                        break;
+                }
+                tq = req->tq;
+                if(list_empty(&tq->pending)) { // Joins the round at the back
+                        tq->deficit = 0;
+                        list_add_tail(&tq->active, &fpga->active_queues);
+                }
+                list_add_tail(&req->list, &tq->pending);
+                fpga->nr_queued++;
+                nr++;
+        }
+
+        if(nr) {
+                // Every request taken off of the ring frees a slot
+                wake_up(&fpga->sq_wait);
+        }
+}
+
+/* Pick the next request to give the card, by deficit round robin over the
+ * tenants with work queued. The tenant at the front keeps sending until it
+ * runs out of deficit, and is then topped up by its weight's worth of bytes
+ * and moved to the back. Every virtine costs a whole snapshot. */
+static struct fpga_request *fpga_next_request(struct fpga_device *fpga)
+{
+        u64 cost = max_t(u64, READ_ONCE(fpga->snapshot_size), 1);
+        struct fpga_tenant_queue *tq;
+        struct fpga_request *req;
+
+        for(;;) {
+                tq = list_first_entry_or_null(&fpga->active_queues,
+                                              struct fpga_tenant_queue, active);
+                if(!tq) {
+                        return NULL;
+                }
+                if(tq->deficit >= cost) {
+                        break;
+                }
+                tq->deficit += max_t(u64, FPGA_DRR_QUANTUM, cost) *
+                               READ_ONCE(tq->tenant->weight) /
+                               FPGA_TENANT_DEFAULT_WEIGHT;
+                list_move_tail(&tq->active, &fpga->active_queues);
+        }
+
+        tq->deficit -= cost;
+        req = list_first_entry(&tq->pending, struct fpga_request, list);
+        list_del(&req->list);
+        if(list_empty(&tq->pending)) { // Gives up the rest of its turn
+                list_del_init(&tq->active);
+        }
+        fpga->nr_queued--;
+
+        return req;
+}
+
+/* Undo fpga_next_request for REQ, which the engine had no room for after all.
+ * It goes back to the front of its tenant's queue, with the deficit it was
+ * charged, so it is the next one picked. */
+static void fpga_requeue_request(struct fpga_device *fpga, struct fpga_request *req)
+{
+        struct fpga_tenant_queue *tq = req->tq;
+
+        if(list_empty(&tq->pending)) {
+                list_add(&tq->active, &fpga->active_queues);
+        }
+        list_add(&req->list, &tq->pending);
+        tq->deficit += max_t(u64, READ_ONCE(fpga->snapshot_size), 1);
+        fpga->nr_queued++;
+}
+
+/* Move as many queued requests onto the RQ as the card has room for. The
+ * requests are put on the inflight list before their DMA address is pushed,
+ * so the list is always in RQ order. Devices backed by a DMA engine have each
+ * one turned into a copy on their channel instead, which starts once the
+ * caller issues it. Requests whose virtine was checked against a smaller
+ * snapshot than the card now has, or is about to latch, and requests the
+ * channel refused, are moved to FAILED with their status set, for the caller
+ * to end once it drops the lock. How many were pushed is added to PUSHED.
+ * Returns false if the channel ran out of descriptors, in which case the
+ * request it refused stays queued until a copy completes and kicks again.
+ * Must be called with rq_lock held, which makes this the ring's only
+ * consumer. Anyone else who takes rq_lock has to call fpga_kick_requests
+ * after dropping it, because a submitter that finds the lock taken leaves its
+ * requests to whoever holds it. */
+static bool fpga_flush_requests(struct fpga_device *fpga, struct list_head *failed,
+                                unsigned int *pushed)
+{
+        u64 size = max(fpga->snapshot_size, fpga->snapshot_next);
+        struct fpga_request *req;
+        unsigned int nr = 0, room;
+        bool more = true;
+        ktime_t now = 0;
+        int error;
+
+        fpga_sort_requests(fpga);
+        if(trace_fpga_request_stages_enabled()) {
+                now = ktime_get();
+        }
+
+        room = NUM_POSSIBLE_VIRTINES - fpga->nr_inflight;
+        if(room && fpga->ring_status) {
+                /* The inflight count already keeps us off of a full RQ, but
+                 * the card is the one that knows for sure. One read per
+                 * batch, not per request. */
+                room = min_t(unsigned int, room,
+                             fpga_read_reg32(fpga, RQ_FREE_REG));
+        }
+
+        while(nr < room) {
+                req = fpga_next_request(fpga);
+                if(!req) {
+                        break;
+                }
+                if(req->max_bytes < size) { // Card would write past the virtine
+                        req->status = -EINVAL;
+                        list_add_tail(&req->list, failed);
+                        continue;
+                }
+                if(fpga->dma_chan) {
+                        error = fpga_dma_engine_submit(fpga, req);
+                        if(error == -EAGAIN) {
+                                fpga_requeue_request(fpga, req);
+                                more = false;
+                                break;
+                        }
+                        if(error) {
+                                req->status = error;
+                                list_add_tail(&req->list, failed);
+                                continue;
+                        }
+                }
+                list_add_tail(&req->list, &fpga->inflight);
+                fpga->nr_inflight++;
+                fpga_tenant_dispatch(req);
+                req->stages.flush = now;
+                if(!fpga->dma_chan) {
+                        fpga_write_reg64(fpga, RQ_TAIL_OFFSET_REG, req->dma_addr);
+                }
+                nr++;
+        }
+
+        if(nr) {
+                trace_fpga_flush(fpga, nr);
+        }
+        *pushed += nr;
+
+        // Room was made on the tenant queues for more of the ring
+        fpga_sort_requests(fpga);
+        return more;
+}
+
+static void fpga_fail_request_work(struct work_struct *work)
+{
+        struct fpga_request *req = container_of(work, struct fpga_request, fail_work);
+
+        fpga_end_request(req->fpga, req, req->status);
+}
+
+/* Push whatever is waiting in the submission ring to the card. If somebody
+ * else holds rq_lock we do not wait for it: a flusher will see our requests
+ * before it lets go of the lock, and the IRQ handler (or, for a DMA engine,
+ * each finished copy) kicks the ring again on its way out. So submitters
+ * never queue up behind each other on the lock. Returns how many requests
+ * this call pushed. */
+unsigned int fpga_kick_requests(struct fpga_device *fpga)
+{
+        struct fpga_request *req, *tmp;
+        unsigned int pushed = 0;
+        unsigned long flags;
+        LIST_HEAD(failed);
+        bool more;
+
+        /* A card that is full gets kicked again by its IRQ handler once it
+         * hands back some completions. */
+        do {
+                /* Orders a submitter's publish against its trylock, and a
+                 * flusher's unlock against its re-check, so a request
+                 * published while the lock is held is always seen by one of
+                 * the two. */
+                smp_mb();
+                if(!fpga_sq_pending(&fpga->sq) && !READ_ONCE(fpga->nr_queued)) {
+                        break;
+                }
+                if(!spin_trylock_irqsave(&fpga->rq_lock, flags)) {
+                        break;
+                }
+                more = fpga_flush_requests(fpga, &failed, &pushed);
+                spin_unlock_irqrestore(&fpga->rq_lock, flags);
+                if(fpga->dma_chan) { // Start the copies that were just queued
+                        dma_async_issue_pending(fpga->dma_chan);
+                }
+        } while(more && READ_ONCE(fpga->nr_inflight) < NUM_POSSIBLE_VIRTINES);
+
+        /* Ended from the workqueue, because whoever kicked may be holding
+         * a lock the submitter's end_io takes, like a pool refilling. */
+        list_for_each_entry_safe(req, tmp, &failed, list) {
+                list_del(&req->list);
+                INIT_WORK(&req->fail_work, fpga_fail_request_work);
+                queue_work(fpga_char_wq, &req->fail_work);
+        }
+
+        return pushed;
+}
+
+/* Tell FPGA it can start cleaning what is on its RQ. */
+void fpga_ring_doorbell(struct fpga_device *fpga)
+{
+        struct fpga_request *req;
+        unsigned long flags;
+        ktime_t now;
+
+        if(fpga->dma_chan) { // Copies start as soon as they are submitted
+                return;
+        }
+        rcu_read_lock();
+        if(READ_ONCE(fpga->removed)) { // Pools can outlive their card
+                rcu_read_unlock();
+                return;
+        }
+        trace_fpga_doorbell(fpga);
+        if(trace_fpga_request_stages_enabled()) {
+                // This is the doorbell for whatever went onto the RQ since the last one
+                now = ktime_get();
+                spin_lock_irqsave(&fpga->rq_lock, flags);
+                list_for_each_entry(req, &fpga->inflight, list) {
+                        if(req->stages.flush && !req->stages.doorbell) {
+                                req->stages.doorbell = now;
+                        }
+                }
+                spin_unlock_irqrestore(&fpga->rq_lock, flags);
+                // Submitters may have left requests for us while we held rq_lock
+                fpga_kick_requests(fpga);
+        }
+        // 1 informs card it can begin processing
+        fpga_write_reg32(fpga, DOORBELL_REG, 1);
+        rcu_read_unlock();
+}
+
+/* Should REQ be cleaned by the CPU engine instead of by FPGA? Only virtines in
+ * registered regions can be, and only once the card is backed up. */
+static bool fpga_should_spill(struct fpga_device *fpga, struct fpga_request *req,
+                              bool ring_full)
+{
+        unsigned int threshold = READ_ONCE(cpu_spill_threshold);
+
+        if(!threshold || !req->umem) {
+                return false;
+        }
+        return ring_full || atomic_read(&fpga->rq_occupancy) >= threshold;
+}
+
+/* Hand the dirty virtine in REQ to FPGA. The request goes onto the card's
+ * submission ring, which is pushed to the RQ in batches. If the card is
+ * backed up, the request is cleaned on the CPU instead, as long as the CPU
+ * engine is not backed up too. Returns -EAGAIN if the ring is full and the
+ * request could not be spilled. */
+int fpga_queue_request(struct fpga_device *fpga, struct fpga_request *req)
+{
+        int error;
+
+        /* Removal waits for us to get out of here before it tears down the
+         * card, so a card that is not removed now stays up until we are done
+         * with it. */
+        rcu_read_lock();
+        if(READ_ONCE(fpga->removed)) {
+                rcu_read_unlock();
+                return -ENODEV;
+        }
+
+        req->submit_time = ktime_get();
+        req->fpga = fpga;
+        memset(&req->stages, 0, sizeof(req->stages));
+        if(!req->tq) {
+                req->tq = &fpga->tenant_queue;
+        }
+        trace_fpga_submit(fpga, req);
+
+        if(fpga_should_spill(fpga, req, false) && !fpga_cpu_queue_request(fpga, req)) {
+                rcu_read_unlock();
+                return 0;
+        }
+
+        atomic_inc(&fpga->rq_occupancy);
+        error = fpga_sq_push(&fpga->sq, req);
+        if(!error) {
+                atomic_long_inc(&fpga->hw_stats.submitted);
+        } else {
+                atomic_dec(&fpga->rq_occupancy);
+                if(fpga_should_spill(fpga, req, true) &&
+                   !fpga_cpu_queue_request(fpga, req)) {
+                        error = 0;
+                }
+        }
+
+        fpga_kick_requests(fpga);
+        rcu_read_unlock();
+        return error;
+}
+
+/* Is there room in FPGA's submission ring, or is it gone? The ring is freed
+ * when the card is removed, so it is only looked at under RCU. */
+static bool fpga_sq_has_room(struct fpga_device *fpga)
+{
+        bool room;
+
+        rcu_read_lock();
+        room = READ_ONCE(fpga->removed) || !fpga_sq_full(&fpga->sq);
+        rcu_read_unlock();
+
+        return room;
+}
+
+/* Like fpga_queue_request, but sleeps until the submission ring has room
+ * instead of failing with -EAGAIN. Returns -ERESTARTSYS if a signal arrives
+ * first. Process context only. */
+int fpga_queue_request_wait(struct fpga_device *fpga, struct fpga_request *req)
+{
+        int error;
+
+        for(;;) {
+                error = fpga_queue_request(fpga, req);
+                if(error != -EAGAIN) {
+                        return error;
+                }
+
+                /* Room only comes back as the card cleans what it has, and
+                 * the submitter cannot ring the doorbell while we sleep. */
+                fpga_ring_doorbell(fpga);
+                error = wait_event_interruptible(fpga->sq_wait,
+                                                 fpga_sq_has_room(fpga));
+                if(error) {
+                        return error;
+                }
+        }
+}
+
+/* Match the DMA address the card just reported clean with the request that
+ * sent it. That is the oldest inflight request, unless the card skipped
+ * something, in which case we go looking for it. */
+static struct fpga_request *fpga_find_request(struct fpga_device *fpga,
+                                              dma_addr_t clean_virtine)
+{
+        struct fpga_request *req;
+        unsigned long flags;
+
+        spin_lock_irqsave(&fpga->rq_lock, flags);
+        list_for_each_entry(req, &fpga->inflight, list) {
+                if(req->dma_addr != clean_virtine) {
+                        continue;
+                }
+                if(req != list_first_entry(&fpga->inflight, struct fpga_request, list)) {
+                        dev_warn_ratelimited(fpga->dma_dev,
+                                             "Card completed 0x%llx out of order\n",
+                                             (u64) clean_virtine);
+                }
+                list_del(&req->list);
+                fpga->nr_inflight--;
+                if(req->max_bytes < fpga->snapshot_next && !--fpga->nr_unfit) {
+                        wake_up(&fpga->drain_wait); // RQ holds nothing too small
+                }
+                spin_unlock_irqrestore(&fpga->rq_lock, flags);
+                return req;
+        }
+        spin_unlock_irqrestore(&fpga->rq_lock, flags);
 
-        dev_dbg(&fpga->pdev->dev, "IRQ %d: Clean Virtines! Fetching\n", irq);
+        return NULL;
+}
 
+/* Charge REQ's tenant for the time REQ spent queued, now that it is being
+ * handed to a cleanup engine. */
+void fpga_tenant_dispatch(struct fpga_request *req)
+{
+        struct fpga_tenant *tenant = req->tq->tenant;
+        s64 delay = ktime_to_ns(ktime_sub(ktime_get(), req->submit_time));
+        s64 max = atomic64_read(&tenant->max_queue_delay_ns);
+
+        atomic64_inc(&tenant->dispatched);
+        atomic64_add(delay, &tenant->queue_delay_ns);
+        while(delay > max) {
+                max = atomic64_cmpxchg(&tenant->max_queue_delay_ns, max, delay);
+        }
+}
+
+/* REQ is clean, and BYTES of snapshot were restored for it. */
+void fpga_tenant_done(struct fpga_request *req, u64 bytes)
+{
+        struct fpga_tenant *tenant = req->tq->tenant;
+
+        atomic64_inc(&tenant->completed);
+        atomic64_add(bytes, &tenant->bytes);
+}
+
+/* Complete REQ with STATUS, handing it back to whoever submitted it. */
+void fpga_end_request(struct fpga_device *fpga, struct fpga_request *req, int status)
+{
+        if(req->umem) { // The card is done writing the virtine
+                fpga_umem_sync_for_cpu(req->umem, fpga, req->virtine - req->umem->uaddr,
+                                       req->max_bytes);
+        }
+        atomic_dec(&fpga->rq_occupancy);
+        atomic_long_inc(&fpga->hw_stats.completed);
+        if(!status) {
+                atomic_long_add(READ_ONCE(fpga->snapshot_size), &fpga->hw_stats.bytes);
+        }
+        req->bytes = status ? 0 : READ_ONCE(fpga->snapshot_size);
+        fpga_tenant_done(req, req->bytes);
+        req->status = status;
+        if(trace_fpga_request_stages_enabled()) {
+                req->stages.done = ktime_get();
+        }
+        trace_fpga_request_done(fpga, req);
+        req->end_io(req);
+}
+
+/* When a card goes away, fail everything that it was still holding, and
+ * everything still waiting to be pushed to it. */
+void fpga_abort_requests(struct fpga_device *fpga)
+{
+        struct fpga_tenant_queue *tq, *tq_tmp;
+        struct fpga_request *req, *tmp;
+        unsigned long flags;
+        LIST_HEAD(aborted);
+
+        spin_lock_irqsave(&fpga->rq_lock, flags);
+        list_splice_init(&fpga->inflight, &aborted);
+        fpga->nr_inflight = 0;
+        list_for_each_entry_safe(tq, tq_tmp, &fpga->active_queues, active) {
+                list_splice_tail_init(&tq->pending, &aborted);
+                list_del_init(&tq->active);
+        }
+        fpga->nr_queued = 0;
+        while((req = fpga_sq_pop(&fpga->sq))) {
+                list_add_tail(&req->list, &aborted);
+        }
+        fpga->nr_unfit = 0;
+        spin_unlock_irqrestore(&fpga->rq_lock, flags);
+        wake_up(&fpga->drain_wait);
+
+        list_for_each_entry_safe(req, tmp, &aborted, list) {
+                list_del(&req->list);
+                fpga_end_request(fpga, req, -ENODEV);
+        }
+}
+
+/* Move the batch factor one step in direction DIR. Steps are powers of two,
+ * so the loop covers the whole range in a handful of samples. */
+static u32 fpga_dim_step(u32 batch_factor, int dir)
+{
+        u32 next = dir > 0 ? batch_factor * 2 : batch_factor / 2;
+
+        return clamp_t(u32, next, dim_min, dim_max);
+}
+
+/* Account for one interrupt that reaped NR_REAPED virtines, and retune the
+ * batch factor once a full sample has been collected. Called from the IRQ
+ * handler. */
+static void fpga_dim_sample(struct fpga_device *fpga, unsigned int nr_reaped)
+{
+        struct fpga_dim *dim = &fpga->dim;
+        u32 batch_factor = fpga->batch_factor;
+        u32 next = batch_factor;
+        u64 elapsed, rate;
+        ktime_t now;
+
+        if(!READ_ONCE(dim->enabled)) {
+                return;
+        }
+
+        dim->nr_irqs++;
+        dim->nr_completions += nr_reaped;
+        if(dim->nr_irqs < FPGA_DIM_NR_IRQS) {
+                return;
+        }
+
+        now = ktime_get();
+        elapsed = max_t(u64, ktime_to_ns(ktime_sub(now, dim->start)), 1);
+        rate = div64_u64((u64) dim->nr_completions * NSEC_PER_MSEC, elapsed);
+
+        if(dim->nr_completions * 2 < dim->nr_irqs * batch_factor) {
+                /* Most interrupts came from the card running dry before a
+                 * batch filled up. Batching buys nothing at this load, so go
+                 * back to reporting virtines as soon as they are clean. */
+                dim->dir = -1;
+                next = fpga_dim_step(batch_factor, -1);
+        } else if(rate * 100 < dim->prev_rate * (100 - FPGA_DIM_TOLERANCE)) {
+                // Last step made things worse, turn around
+                dim->dir = -dim->dir;
+                next = fpga_dim_step(batch_factor, dim->dir);
+        } else if(rate * 100 > dim->prev_rate * (100 + FPGA_DIM_TOLERANCE)) {
+                // Last step helped, keep going
+                next = fpga_dim_step(batch_factor, dim->dir);
+        } else {
+                /* Same throughput: prefer fewer interrupts for the same work.
+                 * The draining check above pulls this back down if it goes
+                 * too far. */
+                dim->dir = 1;
+                next = fpga_dim_step(batch_factor, 1);
+        }
+
+        if(next != batch_factor) {
+                dev_dbg(fpga->dma_dev, "DIM: %llu virtines/ms, batch factor %u -> %u\n",
+                        rate, batch_factor, next);
+                fpga->batch_factor = next;
+                fpga_write_reg32(fpga, BATCH_FACTOR_REG, next);
+        }
+
+        dim->prev_rate = rate;
+        dim->nr_irqs = 0;
+        dim->nr_completions = 0;
+        dim->start = now;
+}
+
+/* Pin FPGA's batch factor to BATCH_FACTOR, taking it away from the moderation
+ * loop. A BATCH_FACTOR of 0 hands it back to the loop instead, if the loop is
+ * enabled. */
+void fpga_set_batch_factor(struct fpga_device *fpga, u32 batch_factor)
+{
+        /* Make sure the IRQ handler is not in the middle of retuning, or it
+         * could overwrite us. */
+        if(fpga->dma_chan) { // Every copy raises its own completion
+                return;
+        }
+        WRITE_ONCE(fpga->dim.enabled, false);
+        fpga_synchronize_irq(fpga);
+
+        if(!batch_factor) { // Start sampling from scratch
+                fpga->dim.dir = 1;
+                fpga->dim.nr_irqs = 0;
+                fpga->dim.nr_completions = 0;
+                fpga->dim.prev_rate = 0;
+                fpga->dim.start = ktime_get();
+                WRITE_ONCE(fpga->dim.enabled, dim_enable);
+                return;
+        }
+
+        fpga->batch_factor = batch_factor;
+        fpga_write_reg32(fpga, BATCH_FACTOR_REG, batch_factor);
+}
+
+/* Should the card's timestamps be read along with its completions? */
+static bool fpga_want_card_stamps(void)
+{
+        return READ_ONCE(completion_timestamps) || trace_fpga_request_stages_enabled();
+}
+
+/* Route the completion of CLEAN_VIRTINE back to the file that submitted it.
+ * STAMPS are the card's timestamps for it, if they were read. */
+static void fpga_complete_virtine(struct fpga_device *fpga, dma_addr_t clean_virtine,
+                                  const struct fpga_card_stamps *stamps)
+{
+        struct fpga_request *req;
+
+        req = fpga_find_request(fpga, clean_virtine);
+        if(!req) {
+                dev_warn_ratelimited(fpga->dma_dev,
+                                     "Card cleaned 0x%llx, which nobody submitted\n",
+                                     (u64) clean_virtine);
+                return;
+        }
+        req->stages.reap = fpga->reap_time;
+        if(stamps && le64_to_cpu(stamps->virtine) == clean_virtine) {
+                req->stages.card = *stamps;
+        }
+        fpga_end_request(fpga, req, 0);
+}
+
+/* Pop-mode reaping, for cards without bulk CQ reads. Every entry costs two
+ * trapped reads of CQ_HEAD_OFFSET_REG. */
+static unsigned int fpga_reap_pop(struct fpga_device *fpga)
+{
         /* To fetch all virtines, read from CQ_HEAD_OFFSET until reading from
          * CQ stops returning useful stuff. CQ_HEAD_OFFSET will not change, but
          * the pointer it redirects to will iterate forwards through the array
          * that stores virtine hwaddrs. */
+        struct fpga_card_stamps *stamps;
         unsigned long clean_virtine = 0;
         unsigned i = 0;
-        ssize_t bytes_read;
-        loff_t read_offset = CQ_HEAD_OFFSET_REG;
-        dev_dbg(&fpga->pdev->dev, "Reading all clean virtines!\n");
-        while((bytes_read = _fpga_char_read(fpga->filep, (char *) &clean_virtine,
-                                            sizeof(clean_virtine), &read_offset))) {
-                dev_dbg(&fpga->pdev->dev, "Most recently fetched clean virtine addr: 0x%lx\n", clean_virtine);
+        dev_dbg(fpga->dma_dev, "Reading all clean virtines!\n");
+        while(i < NUM_POSSIBLE_VIRTINES) {
+                clean_virtine = fpga_read_reg64(fpga, CQ_HEAD_OFFSET_REG);
+                dev_dbg(fpga->dma_dev, "Most recently fetched clean virtine addr: 0x%lx\n", clean_virtine);
                 if(!clean_virtine) {
-                        dev_dbg(&fpga->pdev->dev, "After fetching %u virtines, there are no more clean virtines!\n", i);
+                        dev_dbg(fpga->dma_dev, "After fetching %u virtines, there are no more clean virtines!\n", i);
                         break;
                 }
-                dev_dbg(&fpga->pdev->dev, "Newly cleaned virtine: 0x%lx\n", clean_virtine);
-                clean_virtines[i] = clean_virtine;
                 i += 1;
+
+                /* The slot may already be getting reused, but then its stamps
+                 * will not be for this virtine, and are thrown away. */
+                stamps = NULL;
+                if(fpga_want_card_stamps()) {
+                        stamps = &fpga->cq_stamps[0];
+                        fpga_read_regs(fpga, stamps, CQ_STAMP_BASE +
+                                       (fpga->cq_consumed % NUM_POSSIBLE_VIRTINES) * sizeof(*stamps),
+                                       sizeof(*stamps));
+                }
+                fpga->cq_consumed++;
+
+                fpga_complete_virtine(fpga, clean_virtine, stamps);
+        }
+
+        return i;
+}
+
+/* Bulk-mode reaping. Read how far the card has filled the CQ, copy every
+ * ready entry out of the CQ window at once, and hand them all back with a
+ * single write. However many entries are ready, that is one read, one copy
+ * (two if the ring wrapped) and one write. */
+static unsigned int fpga_reap_bulk(struct fpga_device *fpga)
+{
+        bool stamped = fpga_want_card_stamps();
+        u32 produced, start, first;
+        unsigned int nr, i;
+
+        // Stamps are copied straight out of the card's CQ_STAMP_BASE slots
+        BUILD_BUG_ON(sizeof(struct fpga_card_stamps) != CQ_STAMP_SIZE);
+
+        produced = fpga_read_reg32(fpga, CQ_PRODUCED_REG);
+        nr = produced - fpga->cq_consumed;
+        if(!nr) {
+                return 0;
+        }
+        if(nr > NUM_POSSIBLE_VIRTINES) {
+                dev_err_ratelimited(fpga->dma_dev,
+                                    "CQ claims %u entries, but only holds %u\n",
+                                    nr, NUM_POSSIBLE_VIRTINES);
+                return 0;
+        }
+
+        start = fpga->cq_consumed % NUM_POSSIBLE_VIRTINES;
+        first = min_t(u32, nr, NUM_POSSIBLE_VIRTINES - start);
+        fpga_read_regs(fpga, fpga->cq_entries, CQ_BASE_ADDR + start * sizeof(u64),
+                       first * sizeof(u64));
+        if(first < nr) {
+                fpga_read_regs(fpga, fpga->cq_entries + first, CQ_BASE_ADDR,
+                               (nr - first) * sizeof(u64));
+        }
+        if(stamped) { // Same slots, so they have to be read before the ack too
+                fpga_read_regs(fpga, fpga->cq_stamps, CQ_STAMP_BASE +
+                               start * sizeof(struct fpga_card_stamps),
+                               first * sizeof(struct fpga_card_stamps));
+                if(first < nr) {
+                        fpga_read_regs(fpga, fpga->cq_stamps + first, CQ_STAMP_BASE,
+                                       (nr - first) * sizeof(struct fpga_card_stamps));
+                }
+        }
+
+        // The entries are ours now, let the card reuse their slots
+        fpga->cq_consumed = produced;
+        fpga_write_reg32(fpga, CQ_CONSUMED_REG, produced);
+
+        for(i = 0; i < nr; i++) {
+                fpga_complete_virtine(fpga, le64_to_cpu(fpga->cq_entries[i]),
+                                      stamped ? &fpga->cq_stamps[i] : NULL);
+        }
+
+        return nr;
+}
+
+/* Fetch every clean virtine off of FPGA's CQ and hand each one back to whoever
+ * submitted it. Returns how many were reaped. Safe to call from the IRQ
+ * handler, the poll timer, and process context alike. */
+unsigned int fpga_reap_completions(struct fpga_device *fpga)
+{
+        unsigned long flags;
+        unsigned int i;
+
+        if(fpga->dma_chan) { // Completions come from the DMA engine's callbacks
+                return 0;
+        }
+
+        spin_lock_irqsave(&fpga->cq_lock, flags);
+        if(trace_fpga_request_stages_enabled()) {
+                fpga->reap_time = ktime_get();
+        }
+        if(fpga->cq_bulk) {
+                i = fpga_reap_bulk(fpga);
+        } else {
+                i = fpga_reap_pop(fpga);
+        }
+        spin_unlock_irqrestore(&fpga->cq_lock, flags);
+
+        /* The card has room again, push whatever queued up while it was full.
+         * Their submitters rang the doorbell back when the requests were only
+         * on the submission ring, so ring it again or the card leaves them on
+         * the RQ. */
+        if(i) {
+                trace_fpga_reap(fpga, i);
+                if(fpga_kick_requests(fpga)) {
+                        fpga_ring_doorbell(fpga);
+                }
+        }
+
+        return i;
+}
+
+/* Hand FPGA's completions over to the poll timer. Its IRQ stays disabled until
+ * polling stops, so the card's MSIs cost nothing while it is busy. */
+static void fpga_start_polling(struct fpga_device *fpga)
+{
+        dev_dbg(fpga->dma_dev, "Switching to polled completions\n");
+        fpga->polling = true;
+        fpga->idle_polls = 0;
+        fpga_disable_irq(fpga);
+        hrtimer_start(&fpga->poll_timer, ns_to_ktime(poll_interval_us * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart fpga_poll_timer_fn(struct hrtimer *timer)
+{
+        struct fpga_device *fpga = container_of(timer, struct fpga_device, poll_timer);
+
+        if(fpga_reap_completions(fpga)) {
+                fpga->idle_polls = 0;
+        } else if(completion_mode == FPGA_COMPLETION_HYBRID &&
+                  ++fpga->idle_polls >= FPGA_POLL_IDLE_LIMIT) {
+                /* Load dropped off. Go back to sleeping until the card
+                 * interrupts us. An MSI that came in while the IRQ was
+                 * disabled is replayed when it is enabled again. */
+                dev_dbg(fpga->dma_dev, "Switching to interrupt-driven completions\n");
+                fpga->polling = false;
+                fpga->last_irq = ktime_get();
+                fpga->irq_gap_ns = U64_MAX;
+                fpga_enable_irq(fpga);
+                return HRTIMER_NORESTART;
+        }
+
+        hrtimer_forward_now(timer, ns_to_ktime(poll_interval_us * NSEC_PER_USEC));
+        return HRTIMER_RESTART;
+}
+
+/* An IRQ handler function for fetching the clean virtines from the coprocessor
+ * when it raises an interrupt on its MSI lines. */
+irqreturn_t fetch_clean_virtines(int irq, void *cookie)
+{
+        struct fpga_device *fpga = (struct fpga_device *) cookie;
+        ktime_t now = ktime_get();
+        u64 gap;
+
+        trace_fpga_irq(fpga, irq);
+
+        fpga_dim_sample(fpga, fpga_reap_completions(fpga));
+
+        if(fpga->ring_status &&
+           (fpga_read_reg32(fpga, RING_STATUS_REG) & RING_STATUS_RQ_DROPPED)) {
+                /* Should never happen, the flusher checks RQ_FREE_REG first.
+                 * Whatever was dropped will never come back clean. */
+                dev_err_ratelimited(fpga->dma_dev, "Card dropped RQ entries\n");
+                fpga_write_reg32(fpga, RING_STATUS_REG, RING_STATUS_RQ_DROPPED);
+        }
+
+        if(completion_mode != FPGA_COMPLETION_HYBRID || fpga->polling) {
+                return IRQ_HANDLED;
+        }
+
+        /* When interrupts arrive faster than the poll interval, a timer
+         * would find the same work with fewer wake-ups than the card is
+         * costing us. */
+        gap = ktime_to_ns(ktime_sub(now, fpga->last_irq));
+        fpga->last_irq = now;
+        if(fpga->irq_gap_ns == U64_MAX) {
+                fpga->irq_gap_ns = gap;
+        } else {
+                fpga->irq_gap_ns = (fpga->irq_gap_ns * 7 + gap) / 8;
+        }
+        if(fpga->irq_gap_ns < poll_interval_us * NSEC_PER_USEC) {
+                fpga_start_polling(fpga);
         }
 
         return IRQ_HANDLED;
 }
 
+/* Per-engine counters, in /sys/class/virtine_fpga/virtine_fpgaN/engines/. */
+#define FPGA_ENGINE_ATTR(engine, counter)                                       \
+static ssize_t engine##_##counter##_show(struct device *dev,                   \
+                                         struct device_attribute *attr,        \
+                                         char *buf)                            \
+{                                                                               \
+        struct fpga_device *fpga = dev_get_drvdata(dev);                        \
+                                                                                \
+        return sysfs_emit(buf, "%ld\n",                                        \
+                          atomic_long_read(&fpga->engine##_stats.counter));     \
+}                                                                               \
+static DEVICE_ATTR_RO(engine##_##counter)
+
+FPGA_ENGINE_ATTR(hw, submitted);
+FPGA_ENGINE_ATTR(hw, completed);
+FPGA_ENGINE_ATTR(hw, bytes);
+FPGA_ENGINE_ATTR(cpu, submitted);
+FPGA_ENGINE_ATTR(cpu, completed);
+FPGA_ENGINE_ATTR(cpu, bytes);
+
+static struct attribute *fpga_engine_attrs[] = {
+        &dev_attr_hw_submitted.attr,
+        &dev_attr_hw_completed.attr,
+        &dev_attr_hw_bytes.attr,
+        &dev_attr_cpu_submitted.attr,
+        &dev_attr_cpu_completed.attr,
+        &dev_attr_cpu_bytes.attr,
+        NULL,
+};
+
+static const struct attribute_group fpga_engine_group = {
+        .name = "engines",
+        .attrs = fpga_engine_attrs,
+};
+
+const struct attribute_group *fpga_dev_groups[] = {
+        &fpga_engine_group,
+        NULL,
+};
+
 static int __init fpga_char_main_init(void)
 {
+        int error;
+
         pr_info("fpga_char_main: FPGA character driver starting\n");
 
+        if(completion_mode < FPGA_COMPLETION_IRQ ||
+           completion_mode > FPGA_COMPLETION_HYBRID) {
+                pr_warn("fpga_char_main: Unknown completion_mode %d, using interrupts\n",
+                        completion_mode);
+                completion_mode = FPGA_COMPLETION_IRQ;
+        }
+        poll_interval_us = max(poll_interval_us, 1U);
+        dim_min = max(dim_min, 1U);
+        dim_max = clamp_t(unsigned int, dim_max, dim_min, NUM_POSSIBLE_VIRTINES);
+
+        /* The character device region and the aggregate device are shared by
+         * every card, so they must exist before the first probe. */
+        error = fpga_char_init();
+        if(error) {
+                return error;
+        }
+
+        error = fpga_cpu_engine_init();
+        if(error) {
+                goto could_not_init_cpu_engine;
+        }
+
+        error = fpga_dma_engine_init();
+        if(error) {
+                goto could_not_init_dma_engine;
+        }
+
+        error = fpga_sim_init();
+        if(error) {
+                goto could_not_init_sim;
+        }
+
         /* Register the fpga_driver struct with the kernel fields that handle
          * this. The function returns a negative value on errors. */
-        return pci_register_driver(&fpga_driver);
+        error = pci_register_driver(&fpga_driver);
+        if(error) {
+                goto could_not_register_driver;
+        }
+        return 0;
+
+could_not_register_driver:
+        fpga_sim_exit();
+could_not_init_sim:
+        fpga_dma_engine_exit();
+could_not_init_dma_engine:
+        fpga_cpu_engine_exit();
+could_not_init_cpu_engine:
+        fpga_char_exit();
+        return error;
 }
 
 static void __exit fpga_char_main_exit(void)
 {
         pr_info("fpga_char_main: FPGA character driver exiting\n");
         pci_unregister_driver(&fpga_driver);
+        fpga_sim_exit();
+        fpga_dma_engine_exit();
+        fpga_cpu_engine_exit();
+        fpga_char_exit();
 }
 
 module_init(fpga_char_main_init);
@@ -5,6 +5,143 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/pci.h>
+#include <linux/cdev.h>
+#include <linux/atomic.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
+#include <linux/io-64-nonatomic-lo-hi.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/dmaengine.h>
+#include <linux/wait.h>
+
+#include "uapi/virtine_fpga_regs.h"
+#include "sq.h"
+#include "sim.h"
+
+struct fpga_umem;
+struct fpga_char_private_data;
+
+/* A tenant sharing the cleanup engines, which is an open file, or a card's own
+ * pool traffic. Cards hand out RQ slots between tenants with deficit round
+ * robin, in proportion to their weights and measured in snapshot bytes
+ * restored. Virtines spilled to the CPU engine never wait on the tenant
+ * queues, so they are not charged against the tenant's share of the card;
+ * cpu_spill_max bounds how much that can add up to. The counters are what the
+ * tenant has been given, for checking that against its SLO. */
+struct fpga_tenant {
+        unsigned int weight;
+        ktime_t start;
+        atomic64_t dispatched; // Virtines handed to a cleanup engine
+        atomic64_t completed;
+        atomic64_t bytes; // Of snapshot restored
+        atomic64_t queue_delay_ns; // Total time spent waiting to be dispatched
+        atomic64_t max_queue_delay_ns;
+};
+
+/* One tenant's requests waiting for one card. Only touched under that card's
+ * rq_lock. */
+struct fpga_tenant_queue {
+        struct list_head active; // On the card's active_queues while non-empty
+        struct list_head pending;
+        u64 deficit; // Bytes the tenant may still send in its current turn
+        struct fpga_tenant *tenant;
+};
+
+/* When the card saw a virtine go through each of its stages, in the card's own
+ * clock, and how much of the snapshot it restored. Read out of CQ_STAMP_BASE,
+ * one per CQ slot, when completion timestamps or the fpga_request_stages
+ * tracepoint are on. A stage the card never went through for the virtine
+ * reads as 0. */
+struct fpga_card_stamps {
+        __le64 virtine; // The stamps are only good if this is the reaped virtine
+        __le64 enqueue;
+        __le64 doorbell;
+        __le64 dequeue;
+        __le64 dma_start;
+        __le64 dma_end;
+        __le64 msi;
+        __le64 bytes;
+};
+
+/* When the driver saw a request go through each stage, for the
+ * fpga_request_stages tracepoint. Only filled in while it is on, apart from
+ * the card's stamps, which completion timestamps want too. card.virtine is
+ * left 0 when there are none. */
+struct fpga_request_stages {
+        ktime_t flush; // Pushed onto the RQ
+        ktime_t doorbell;
+        ktime_t reap; // The IRQ, or poll, that took it off of the CQ
+        ktime_t done;
+        struct fpga_card_stamps card;
+};
+
+/* One virtine handed to a card to be cleaned. The request is the tag that
+ * lets a completion find its way back to whoever submitted it: the card only
+ * reports the DMA address it cleaned, so the request remembers which file
+ * submitted it and which user address that DMA address stands for. */
+struct fpga_request {
+        struct list_head list; // On the card's inflight list, then the file's CQ
+        dma_addr_t dma_addr;
+        u64 virtine; // User address of the virtine, reported on completion
+        int status;
+        u64 max_bytes; // Most snapshot the virtine was checked to hold
+        u64 bytes; // Of snapshot restored, once it is done
+
+        struct fpga_umem *umem; // Keeps the pages pinned while the card writes
+        struct fpga_char_private_data *ctx;
+        /* Called from the IRQ handler when the card is done with the request,
+         * or when the card goes away before it got to it. */
+        void (*end_io)(struct fpga_request *req);
+        void *end_io_data; // Whatever end_io needs to find the submitter
+        ktime_t submit_time;
+        struct fpga_request_stages stages;
+        struct work_struct free_work;
+        struct fpga_tenant_queue *tq; // Who this is charged to, NULL for the card itself
+
+        struct fpga_device *fpga; // The card it was queued on
+
+        // Only used when the request was failed
+        struct work_struct fail_work;
+        // Only used when the request was spilled to the CPU engine
+        struct work_struct cpu_work;
+};
+
+/* What one cleanup engine (the card, or the CPU engine standing in for it)
+ * has done for a card. Exported in the card's engines/ sysfs directory. */
+struct fpga_engine_stats {
+        atomic_long_t submitted;
+        atomic_long_t completed;
+        atomic_long_t bytes; // Of snapshot restored
+};
+
+/* State for dynamic interrupt moderation, in the style of net DIM. The IRQ
+ * handler samples how many completions each interrupt brought in, and after
+ * every FPGA_DIM_NR_IRQS interrupts retunes the batch factor: it keeps moving
+ * in whichever direction raised the completion rate, turns around when the
+ * rate drops, and backs off towards one interrupt per virtine when the card
+ * keeps draining before a full batch is ready. Only the IRQ handler touches
+ * this, apart from enabled. */
+struct fpga_dim {
+        bool enabled; // Cleared when someone sets the batch factor by hand
+        int dir; // +1 while growing the batch factor, -1 while shrinking it
+        unsigned int nr_irqs;
+        unsigned int nr_completions;
+        ktime_t start; // Of the current sampling window
+        u64 prev_rate; // Completions per millisecond in the last window
+};
+
+/* How completions are noticed. Hybrid starts out interrupt-driven, switches to
+ * polling the CQ from an hrtimer once interrupts come in faster than the poll
+ * interval, and switches back once polls keep coming up empty. */
+enum fpga_completion_mode {
+        FPGA_COMPLETION_IRQ = 0,
+        FPGA_COMPLETION_POLL = 1,
+        FPGA_COMPLETION_HYBRID = 2,
+};
 
 /* This is a "private" struct, meaning the kernel does not provide or interact
  * with this struct in any way. This is supposed to be a software-side definition
@@ -17,60 +154,263 @@ struct fpga_device {
         struct pci_dev *pdev;
         u8 __iomem *dev_mem; // Pointer to mmap-ed device BAR in host's memory.
 
+        /* Devices backed by a dmaengine channel instead of a card have no
+         * pdev, BAR or IRQ, only dma_chan. dma_dev is whatever does the DMA,
+         * which is what buffers get mapped for: the card itself, or the DMA
+         * controller behind the channel. */
+        struct dma_chan *dma_chan;
+        dma_cookie_t dma_cookie; // Of the last copy submitted to dma_chan
+        struct device *dma_dev;
+
+        /* Simulated cards have no pdev or BAR either, but do have every
+         * register a card has, in sim. Register accesses go through the
+         * fpga_*_reg* helpers below, which send them to whichever one the
+         * device has. */
+        struct fpga_sim *sim;
+
+        /* Every card gets its own /dev/virtine_fpgaN, using minor number N+1.
+         * Minor 0 is the aggregate /dev/virtine_fpga, which spreads work over
+         * all the cards. */
+        int minor;
+        struct cdev cdev;
+        struct device *char_device;
+
+        /* Held by the driver until the device goes away, and by every file
+         * opened on it, region mapped for it and pool on it, all of which can
+         * outlive it. removed is set under fpga_devs_lock before any of the
+         * device is torn down. Submitters and register accesses that do not
+         * hold fpga_devs_lock check it under RCU, which removal waits out. */
+        struct kref ref;
+        bool removed;
+
+        /* Number of virtines submitted to this card that have not been
+         * reaped from the CQ yet, whether they are still waiting in the
+         * submission ring or already on the card. The aggregate device sends
+         * work to the least occupied card. */
+        atomic_t rq_occupancy;
+
+        /* Submitters queue requests here without taking any lock. Whoever
+         * manages to grab rq_lock flushes the ring onto the RQ in batches. */
+        struct fpga_sq sq;
+
+        /* Requests the card has been given, in the order they were pushed
+         * onto the RQ. The card cleans in order, so the CQ comes back in this
+         * order too. rq_lock is held by the one thread flushing the
+         * submission ring, which also keeps the two halves of each RQ tail
+         * write together. nr_inflight never goes past NUM_POSSIBLE_VIRTINES,
+         * because the card silently drops anything past that. */
+        spinlock_t rq_lock;
+        struct list_head inflight;
+        unsigned int nr_inflight;
+
+        /* Requests the flusher took off of the submission ring but has not
+         * given the card yet, sorted by tenant. Which tenant goes next is up
+         * to the deficit round robin over active_queues. Covered by rq_lock.
+         * Requests without a tenant are charged to the card's own. */
+        struct list_head active_queues;
+        unsigned int nr_queued;
+        struct fpga_tenant tenant;
+        struct fpga_tenant_queue tenant_queue;
+
+        /* Once rq_occupancy reaches the spill threshold, or the submission
+         * ring is full, cleaning is spilled over to the CPU engine. */
+        struct fpga_engine_stats hw_stats;
+        struct fpga_engine_stats cpu_stats;
+        atomic_t nr_cpu_queued; // Spilled and not cleaned yet, up to cpu_spill_max
+
+        /* Blocking submitters sleep here while the submission ring is full.
+         * Woken whenever the flusher moves requests from the ring to the RQ.
+         * Cards that report RING_STATUS_REG also have their free RQ slots
+         * checked before each flush, and dropped RQ writes reported. */
+        wait_queue_head_t sq_wait;
+        bool ring_status;
+
         /* Batch factor is the number of virtines the FPGA will clean before
-         * raising an interrupt. This value is a design-time constant, so it
-         * will never change. We read this value when the device is first
-         * probed. */
+         * raising an interrupt. It is read when the device is first probed,
+         * and from then on retuned by the moderation loop, unless it was set
+         * by hand. */
         u32 batch_factor;
+        struct fpga_dim dim;
+
+        /* The CQ head is popped by reading it, in two halves, so only one of
+         * the IRQ handler, the poll timer and polling files reaps at a time.
+         * Cards that support it have their CQ read in bulk instead, and then
+         * cq_lock covers the entries copied out and the consumed count. */
+        spinlock_t cq_lock;
+        bool cq_bulk;
+        u32 cq_consumed; // Free-running, like the card's CQ_CONSUMED_REG
+        __le64 cq_entries[NUM_POSSIBLE_VIRTINES];
+        struct fpga_card_stamps cq_stamps[NUM_POSSIBLE_VIRTINES];
+        ktime_t reap_time; // When the current reap started
+
+        /* Polling instead of interrupts. While polling is set, the card's IRQ
+         * is disabled and poll_timer reaps the CQ every poll interval. */
+        bool polling;
+        struct hrtimer poll_timer;
+        unsigned int idle_polls; // Polls in a row that found nothing
+        ktime_t last_irq;
+        u64 irq_gap_ns; // Moving average of the time between interrupts
 
-        // Used for reading/writing from character device file during interrupt
-        struct file *filep;
+        /* The snapshot the device restores virtines from. It lives in
+         * coherent DMA memory so the card can fetch it through the IOMMU like
+         * any other buffer. Fixed submissions are checked against the size so
+         * the device never writes past the end of a registered region. */
+        struct mutex snapshot_lock;
+        void *snapshot;
+        dma_addr_t snapshot_dma;
+        u64 snapshot_size;
+
+        /* A card has to be done with every virtine on its RQ that was only
+         * checked to hold the old snapshot before it latches a bigger one.
+         * While that happens, snapshot_next is the size being loaded, the
+         * flusher fails requests that do not fit it, and nr_unfit counts the
+         * ones already on the RQ. Covered by rq_lock. The load sleeps on
+         * drain_wait until nr_unfit drops to 0. */
+        u64 snapshot_next;
+        unsigned int nr_unfit;
+        wait_queue_head_t drain_wait;
 };
 
 #define NUM_IRQ_VECTORS 1
 
-/* MMIO DESIGN (Remember PCI is little-endian):
- * 0x0                               0x8
- * +-----------------------------------+
- * |    Ready Queue (RQ) Head offset   |
- * +-----------------------------------+
- * |    Ready Queue (RQ) Tail offset   |
- * +-----------------------------------+
- * |           RQ Virtine 1            |
- * +-----------------------------------+
- * |           RQ Virtine 2            |
- * +-----------------------------------+
- * |               .....               |
- * +-----------------------------------+
- * |              Doorbell             |
- * +-----------------------------------+
- * |          isCardProcessing         |
- * +-----------------------------------+
- * |  Complete Queue (CQ) Head offset  |
- * +-----------------------------------+
- * |  Complete Queue (CQ) Tail offset  |
- * +-----------------------------------+
- * |           CQ Virtine 1            |
- * +-----------------------------------+
- * |               .....               |
- * +-----------------------------------+
- * |            Batch Factor           |
- * +-----------------------------------+ */
-
-#define MMIO_BASE_ADDR 0x0
-#define NUM_POSSIBLE_VIRTINES 100
-
-#define RQ_HEAD_OFFSET_REG MMIO_BASE_ADDR
-#define RQ_TAIL_OFFSET_REG RQ_HEAD_OFFSET_REG + sizeof(unsigned long)
-#define RQ_BASE_ADDR RQ_TAIL_OFFSET_REG + sizeof(unsigned long)
-#define DOORBELL_REG RQ_BASE_ADDR + (NUM_POSSIBLE_VIRTINES * sizeof(unsigned long))
-#define IS_PROCESSING_REG DOORBELL_REG + sizeof(unsigned long)
-#define CQ_HEAD_OFFSET_REG IS_PROCESSING_REG + sizeof(unsigned long)
-#define CQ_TAIL_OFFSET_REG CQ_HEAD_OFFSET_REG + sizeof(unsigned long)
-#define CQ_BASE_ADDR CQ_TAIL_OFFSET_REG + sizeof(unsigned long)
-#define BATCH_FACTOR_REG CQ_BASE_ADDR + (NUM_POSSIBLE_VIRTINES * sizeof(unsigned long))
-#define MAX_NUM_VIRTINES_REG BATCH_FACTOR_REG + sizeof(unsigned long)
-#define SNAPSHOT_SIZE_REG MAX_NUM_VIRTINES_REG + sizeof(unsigned long)
-#define SNAPSHOT_ADDR_REG SNAPSHOT_SIZE_REG + sizeof(unsigned long)
+/* Number of requests each card's submission ring can hold before submitters
+ * get -EAGAIN. Must be a power of two. */
+#define FPGA_SQ_DEPTH 1024
+
+/* Interrupts per moderation sample, and how much the completion rate must
+ * change (in percent) between samples before it counts as a change. */
+#define FPGA_DIM_NR_IRQS 16
+#define FPGA_DIM_TOLERANCE 10
+
+/* A hybrid-mode card goes back to interrupts after this many empty polls. */
+#define FPGA_POLL_IDLE_LIMIT 8
+
+/* A tenant of the default weight may send FPGA_DRR_QUANTUM bytes per round,
+ * or one virtine, if the snapshot is bigger than that. Other weights get
+ * proportionally more or less. */
+#define FPGA_DRR_QUANTUM (64 * 1024)
+#define FPGA_TENANT_DEFAULT_WEIGHT 100
+#define FPGA_TENANT_MAX_WEIGHT 10000
+
+/* Does FPGA have registers at all? The aggregate device and devices backed by
+ * a DMA engine do not. */
+static inline bool fpga_has_regs(struct fpga_device *fpga)
+{
+        return fpga->dev_mem || fpga->sim;
+}
+
+static inline u32 fpga_read_reg32(struct fpga_device *fpga, unsigned long reg)
+{
+        if(unlikely(fpga->sim)) {
+                return fpga_sim_read32(fpga->sim, reg);
+        }
+        return ioread32(fpga->dev_mem + reg);
+}
+
+static inline void fpga_write_reg32(struct fpga_device *fpga, unsigned long reg,
+                                    u32 val)
+{
+        if(unlikely(fpga->sim)) {
+                fpga_sim_write32(fpga->sim, reg, val);
+                return;
+        }
+        iowrite32(val, fpga->dev_mem + reg);
+}
+
+/* The card decodes its 64-bit registers as two 32-bit halves and only acts on
+ * a value once the upper half lands, so always write low-then-high. */
+static inline void fpga_write_reg64(struct fpga_device *fpga, unsigned long reg,
+                                    u64 val)
+{
+        if(unlikely(fpga->sim)) {
+                fpga_sim_write64(fpga->sim, reg, val);
+                return;
+        }
+        lo_hi_writeq(val, fpga->dev_mem + reg);
+}
+
+/* Reading the low half of a popping register (CQ head) is what pops it, and
+ * the card then hands back the upper half of that same value. */
+static inline u64 fpga_read_reg64(struct fpga_device *fpga, unsigned long reg)
+{
+        if(unlikely(fpga->sim)) {
+                return fpga_sim_read64(fpga->sim, reg);
+        }
+        return lo_hi_readq(fpga->dev_mem + reg);
+}
+
+/* Copy LEN bytes of registers starting at REG, for the CQ window and stamps. */
+static inline void fpga_read_regs(struct fpga_device *fpga, void *dst,
+                                  unsigned long reg, size_t len)
+{
+        if(unlikely(fpga->sim)) {
+                fpga_sim_read_regs(fpga->sim, dst, reg, len);
+                return;
+        }
+        memcpy_fromio(dst, fpga->dev_mem + reg, len);
+}
+
+/* The card's MSI, or the simulated one. */
+static inline void fpga_disable_irq(struct fpga_device *fpga)
+{
+        if(fpga->sim) {
+                fpga_sim_mask_msi(fpga->sim);
+                return;
+        }
+        disable_irq_nosync(pci_irq_vector(fpga->pdev, 0));
+}
+
+static inline void fpga_enable_irq(struct fpga_device *fpga)
+{
+        if(fpga->sim) {
+                fpga_sim_unmask_msi(fpga->sim);
+                return;
+        }
+        enable_irq(pci_irq_vector(fpga->pdev, 0));
+}
+
+static inline void fpga_synchronize_irq(struct fpga_device *fpga)
+{
+        if(fpga->sim) {
+                fpga_sim_sync_msi(fpga->sim);
+                return;
+        }
+        synchronize_irq(pci_irq_vector(fpga->pdev, 0));
+}
+
+extern const struct attribute_group *fpga_dev_groups[];
+
+static inline void fpga_tenant_init(struct fpga_tenant *tenant)
+{
+        tenant->weight = FPGA_TENANT_DEFAULT_WEIGHT;
+        tenant->start = ktime_get();
+}
+
+static inline void fpga_tenant_queue_init(struct fpga_tenant_queue *tq,
+                                          struct fpga_tenant *tenant)
+{
+        INIT_LIST_HEAD(&tq->active);
+        INIT_LIST_HEAD(&tq->pending);
+        tq->deficit = 0;
+        tq->tenant = tenant;
+}
+
+void fpga_tenant_dispatch(struct fpga_request *req);
+void fpga_tenant_done(struct fpga_request *req, u64 bytes);
+
+int fpga_queue_request(struct fpga_device *fpga, struct fpga_request *req);
+int fpga_queue_request_wait(struct fpga_device *fpga, struct fpga_request *req);
+void fpga_end_request(struct fpga_device *fpga, struct fpga_request *req, int status);
+void fpga_abort_requests(struct fpga_device *fpga);
+void fpga_set_batch_factor(struct fpga_device *fpga, u32 batch_factor);
+unsigned int fpga_reap_completions(struct fpga_device *fpga);
+void fpga_ring_doorbell(struct fpga_device *fpga);
+unsigned int fpga_kick_requests(struct fpga_device *fpga);
+
+/* Bring up the parts of a card that do not care what bus it is on, once its
+ * registers can be reached and its interrupt will be delivered to
+ * fetch_clean_virtines. Ends by creating the card's character device. */
+int fpga_card_init(struct fpga_device *fpga);
+irqreturn_t fetch_clean_virtines(int irq, void *cookie);
 
 #endif
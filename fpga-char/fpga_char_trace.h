@@ -0,0 +1,228 @@
+/* Tracepoints for the FPGA character driver. They cost a predicted branch
+ * when nobody is tracing, so they are safe to leave in the hot paths. Find
+ * them under events/fpga_char/ in tracefs, or use them from perf and BPF. */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fpga_char
+
+#if !defined(FPGA_CHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define FPGA_CHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "fpga_char_main.h"
+
+/* A request was put on a card's submission ring. */
+TRACE_EVENT(fpga_submit,
+        TP_PROTO(struct fpga_device *fpga, struct fpga_request *req),
+        TP_ARGS(fpga, req),
+
+        TP_STRUCT__entry(
+                __field(int, minor)
+                __field(u64, virtine)
+                __field(u64, dma_addr)
+        ),
+
+        TP_fast_assign(
+                __entry->minor = fpga->minor;
+                __entry->virtine = req->virtine;
+                __entry->dma_addr = req->dma_addr;
+        ),
+
+        TP_printk("card=%d virtine=0x%llx dma=0x%llx",
+                  __entry->minor, __entry->virtine, __entry->dma_addr)
+);
+
+/* NR requests were flushed from the submission ring onto a card's RQ. */
+TRACE_EVENT(fpga_flush,
+        TP_PROTO(struct fpga_device *fpga, unsigned int nr),
+        TP_ARGS(fpga, nr),
+
+        TP_STRUCT__entry(
+                __field(int, minor)
+                __field(unsigned int, nr)
+                __field(unsigned int, nr_inflight)
+        ),
+
+        TP_fast_assign(
+                __entry->minor = fpga->minor;
+                __entry->nr = nr;
+                __entry->nr_inflight = fpga->nr_inflight;
+        ),
+
+        TP_printk("card=%d nr=%u inflight=%u",
+                  __entry->minor, __entry->nr, __entry->nr_inflight)
+);
+
+TRACE_EVENT(fpga_doorbell,
+        TP_PROTO(struct fpga_device *fpga),
+        TP_ARGS(fpga),
+
+        TP_STRUCT__entry(
+                __field(int, minor)
+        ),
+
+        TP_fast_assign(
+                __entry->minor = fpga->minor;
+        ),
+
+        TP_printk("card=%d", __entry->minor)
+);
+
+TRACE_EVENT(fpga_irq,
+        TP_PROTO(struct fpga_device *fpga, int irq),
+        TP_ARGS(fpga, irq),
+
+        TP_STRUCT__entry(
+                __field(int, minor)
+                __field(int, irq)
+                __field(u32, batch_factor)
+        ),
+
+        TP_fast_assign(
+                __entry->minor = fpga->minor;
+                __entry->irq = irq;
+                __entry->batch_factor = fpga->batch_factor;
+        ),
+
+        TP_printk("card=%d irq=%d batch_factor=%u",
+                  __entry->minor, __entry->irq, __entry->batch_factor)
+);
+
+/* NR virtines were taken off of a card's CQ, from an interrupt or a poll. */
+TRACE_EVENT(fpga_reap,
+        TP_PROTO(struct fpga_device *fpga, unsigned int nr),
+        TP_ARGS(fpga, nr),
+
+        TP_STRUCT__entry(
+                __field(int, minor)
+                __field(unsigned int, nr)
+                __field(bool, polling)
+        ),
+
+        TP_fast_assign(
+                __entry->minor = fpga->minor;
+                __entry->nr = nr;
+                __entry->polling = fpga->polling;
+        ),
+
+        TP_printk("card=%d nr=%u polling=%d",
+                  __entry->minor, __entry->nr, __entry->polling)
+);
+
+/* A request finished. Latency runs from submission to completion. */
+TRACE_EVENT(fpga_request_done,
+        TP_PROTO(struct fpga_device *fpga, struct fpga_request *req),
+        TP_ARGS(fpga, req),
+
+        TP_STRUCT__entry(
+                __field(int, minor)
+                __field(u64, virtine)
+                __field(int, status)
+                __field(s64, latency_ns)
+        ),
+
+        TP_fast_assign(
+                __entry->minor = fpga->minor;
+                __entry->virtine = req->virtine;
+                __entry->status = req->status;
+                __entry->latency_ns = ktime_to_ns(ktime_sub(ktime_get(), req->submit_time));
+        ),
+
+        TP_printk("card=%d virtine=0x%llx status=%d latency=%lldns",
+                  __entry->minor, __entry->virtine, __entry->status,
+                  __entry->latency_ns)
+);
+
+/* A request was handed back to its submitter at USER: reaped by userspace, or
+ * returned to its pool. Every stage it went through, for fpga-stages to work
+ * out where its latency went. Host times are ktime, the card's are in its own
+ * clock, and a stage that never happened is 0. */
+TRACE_EVENT(fpga_request_stages,
+        TP_PROTO(struct fpga_request *req, ktime_t user),
+        TP_ARGS(req, user),
+
+        TP_STRUCT__entry(
+                __field(int, minor)
+                __field(u64, virtine)
+                __field(int, status)
+                __field(s64, submit)
+                __field(s64, flush)
+                __field(s64, doorbell)
+                __field(s64, reap)
+                __field(s64, done)
+                __field(s64, user)
+                __field(u64, card_enqueue)
+                __field(u64, card_doorbell)
+                __field(u64, card_dequeue)
+                __field(u64, card_dma_start)
+                __field(u64, card_dma_end)
+                __field(u64, card_msi)
+        ),
+
+        TP_fast_assign(
+                __entry->minor = req->fpga->minor;
+                __entry->virtine = req->virtine;
+                __entry->status = req->status;
+                __entry->submit = ktime_to_ns(req->submit_time);
+                __entry->flush = ktime_to_ns(req->stages.flush);
+                __entry->doorbell = ktime_to_ns(req->stages.doorbell);
+                __entry->reap = ktime_to_ns(req->stages.reap);
+                __entry->done = ktime_to_ns(req->stages.done);
+                __entry->user = ktime_to_ns(user);
+                __entry->card_enqueue = le64_to_cpu(req->stages.card.enqueue);
+                __entry->card_doorbell = le64_to_cpu(req->stages.card.doorbell);
+                __entry->card_dequeue = le64_to_cpu(req->stages.card.dequeue);
+                __entry->card_dma_start = le64_to_cpu(req->stages.card.dma_start);
+                __entry->card_dma_end = le64_to_cpu(req->stages.card.dma_end);
+                __entry->card_msi = le64_to_cpu(req->stages.card.msi);
+        ),
+
+        TP_printk("card=%d virtine=0x%llx status=%d submit=%lld flush=%lld doorbell=%lld "
+                  "reap=%lld done=%lld user=%lld card_enqueue=%llu card_doorbell=%llu "
+                  "card_dequeue=%llu card_dma_start=%llu card_dma_end=%llu card_msi=%llu",
+                  __entry->minor, __entry->virtine, __entry->status, __entry->submit,
+                  __entry->flush, __entry->doorbell, __entry->reap, __entry->done,
+                  __entry->user, __entry->card_enqueue, __entry->card_doorbell,
+                  __entry->card_dequeue, __entry->card_dma_start, __entry->card_dma_end,
+                  __entry->card_msi)
+);
+
+/* Raw register accesses through read(2) and write(2) on a card's file. */
+DECLARE_EVENT_CLASS(fpga_mmio,
+        TP_PROTO(struct fpga_device *fpga, loff_t offset, u32 val),
+        TP_ARGS(fpga, offset, val),
+
+        TP_STRUCT__entry(
+                __field(int, minor)
+                __field(loff_t, offset)
+                __field(u32, val)
+        ),
+
+        TP_fast_assign(
+                __entry->minor = fpga->minor;
+                __entry->offset = offset;
+                __entry->val = val;
+        ),
+
+        TP_printk("card=%d offset=0x%llx val=0x%x",
+                  __entry->minor, __entry->offset, __entry->val)
+);
+
+DEFINE_EVENT(fpga_mmio, fpga_mmio_read,
+        TP_PROTO(struct fpga_device *fpga, loff_t offset, u32 val),
+        TP_ARGS(fpga, offset, val)
+);
+
+DEFINE_EVENT(fpga_mmio, fpga_mmio_write,
+        TP_PROTO(struct fpga_device *fpga, loff_t offset, u32 val),
+        TP_ARGS(fpga, offset, val)
+);
+
+#endif /* FPGA_CHAR_TRACE_H */
+
+// The module is built out of tree, so tell define_trace.h where this lives
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fpga_char_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,260 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/dma-mapping.h>
+
+#include "pool.h"
+#include "chardev.h"
+#include "fpga_char_trace.h"
+
+static void fpga_pool_free(struct work_struct *work)
+{
+        struct fpga_pool *pool = container_of(work, struct fpga_pool, free_work);
+
+        dma_free_coherent(pool->dev, pool->size, pool->cpu_addr, pool->dma_addr);
+        put_device(pool->dev);
+        fpga_device_put(pool->fpga);
+        kvfree(pool->reqs);
+        kvfree(pool->dirty);
+        kvfree(pool->free);
+        kvfree(pool->state);
+        kfree(pool);
+}
+
+/* The last reference can be dropped by the IRQ handler, but freeing DMA
+ * memory has to happen in process context. */
+static void fpga_pool_release(struct kref *ref)
+{
+        struct fpga_pool *pool = container_of(ref, struct fpga_pool, ref);
+
+        INIT_WORK(&pool->free_work, fpga_pool_free);
+        queue_work(fpga_char_wq, &pool->free_work);
+}
+
+/* Send dirty virtines to the card until the pool is back above its low
+ * watermark, or everything dirty has been sent. Sending them all at once,
+ * followed by a single doorbell, keeps the card busy with whole batches.
+ * Must be called with the pool's lock held. */
+static void fpga_pool_refill(struct fpga_pool *pool)
+{
+        unsigned int sent = 0, idx;
+
+        if(pool->nr_free + pool->nr_cleaning >= pool->low_watermark ||
+           !pool->nr_dirty) {
+                return;
+        }
+        if(pool->fpga->snapshot_size > pool->stride) {
+                dev_warn_ratelimited(pool->dev,
+                                     "Snapshot no longer fits in a pool virtine\n");
+                return;
+        }
+
+        while(pool->nr_dirty) {
+                idx = pool->dirty[pool->nr_dirty - 1];
+                kref_get(&pool->ref);
+                if(fpga_queue_request(pool->fpga, &pool->reqs[idx])) {
+                        // Card's ring is full, try again on the next put
+                        kref_put(&pool->ref, fpga_pool_release);
+                        break;
+                }
+                pool->state[idx] = FPGA_POOL_CLEANING;
+                pool->nr_dirty--;
+                pool->nr_cleaning++;
+                sent++;
+        }
+
+        if(sent) {
+                fpga_ring_doorbell(pool->fpga);
+        }
+}
+
+/* Called from the IRQ handler once the card is done with a pool virtine. */
+static void fpga_pool_end_io(struct fpga_request *req)
+{
+        struct fpga_pool *pool = req->end_io_data;
+        unsigned int idx = req->virtine / pool->stride;
+        unsigned long flags;
+
+        // Pool virtines are back in userspace's hands as soon as they are free
+        trace_fpga_request_stages(req, ktime_get());
+        spin_lock_irqsave(&pool->lock, flags);
+        pool->nr_cleaning--;
+        if(req->status) { // Not cleaned, it has to go around again
+                pool->state[idx] = FPGA_POOL_DIRTY;
+                pool->dirty[pool->nr_dirty++] = idx;
+                // It never will if the card is gone, so let waiters give up
+                if(READ_ONCE(pool->fpga->removed)) {
+                        wake_up(&pool->wait);
+                }
+        } else {
+                pool->state[idx] = FPGA_POOL_FREE;
+                pool->free[pool->nr_free++] = idx;
+                wake_up(&pool->wait);
+        }
+        spin_unlock_irqrestore(&pool->lock, flags);
+
+        kref_put(&pool->ref, fpga_pool_release);
+}
+
+/* Allocate NR_VIRTINES virtines of VIRTINE_SIZE bytes for FPGA. They all start
+ * out dirty, and are cleaned by the card before they can be handed out. */
+struct fpga_pool *fpga_pool_create(struct fpga_device *fpga,
+                                   unsigned long virtine_size,
+                                   unsigned int nr_virtines,
+                                   unsigned int low_watermark)
+{
+        struct fpga_pool *pool;
+        unsigned long flags;
+        unsigned int i;
+        int error = -ENOMEM;
+
+        // A watermark of 0 would never send anything to be cleaned
+        if(!virtine_size || !nr_virtines || !low_watermark ||
+           low_watermark > nr_virtines) {
+                return ERR_PTR(-EINVAL);
+        }
+        // Every virtine gets its own pages, so the card never writes past one
+        virtine_size = PAGE_ALIGN(virtine_size);
+        if(virtine_size < fpga->snapshot_size ||
+           virtine_size > SIZE_MAX / nr_virtines) {
+                return ERR_PTR(-EINVAL);
+        }
+
+        pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+        if(!pool) {
+                return ERR_PTR(-ENOMEM);
+        }
+        kref_init(&pool->ref);
+        spin_lock_init(&pool->lock);
+        init_waitqueue_head(&pool->wait);
+        pool->fpga = fpga_device_get(fpga);
+        pool->dev = get_device(fpga->dma_dev);
+        pool->stride = virtine_size;
+        pool->nr_virtines = nr_virtines;
+        pool->low_watermark = low_watermark;
+        pool->size = virtine_size * nr_virtines;
+
+        pool->state = kvcalloc(nr_virtines, sizeof(*pool->state), GFP_KERNEL);
+        pool->free = kvcalloc(nr_virtines, sizeof(*pool->free), GFP_KERNEL);
+        pool->dirty = kvcalloc(nr_virtines, sizeof(*pool->dirty), GFP_KERNEL);
+        pool->reqs = kvcalloc(nr_virtines, sizeof(*pool->reqs), GFP_KERNEL);
+        if(!pool->state || !pool->free || !pool->dirty || !pool->reqs) {
+                goto could_not_alloc;
+        }
+
+        pool->cpu_addr = dma_alloc_coherent(pool->dev, pool->size,
+                                            &pool->dma_addr, GFP_KERNEL);
+        if(!pool->cpu_addr) {
+                goto could_not_alloc;
+        }
+
+        for(i = 0; i < nr_virtines; i++) {
+                struct fpga_request *req = &pool->reqs[i];
+
+                req->dma_addr = pool->dma_addr + i * pool->stride;
+                req->virtine = i * pool->stride; // Offset into the mapping
+                req->max_bytes = pool->stride;
+                req->end_io = fpga_pool_end_io;
+                req->end_io_data = pool;
+
+                pool->state[i] = FPGA_POOL_DIRTY;
+                pool->dirty[i] = nr_virtines - 1 - i;
+        }
+        pool->nr_dirty = nr_virtines;
+
+        // Get the first batch cleaned right away
+        spin_lock_irqsave(&pool->lock, flags);
+        fpga_pool_refill(pool);
+        spin_unlock_irqrestore(&pool->lock, flags);
+
+        return pool;
+
+could_not_alloc:
+        kvfree(pool->reqs);
+        kvfree(pool->dirty);
+        kvfree(pool->free);
+        kvfree(pool->state);
+        put_device(pool->dev);
+        fpga_device_put(pool->fpga);
+        kfree(pool);
+        return ERR_PTR(error);
+}
+
+/* Drop the owner's reference. Virtines still on the card keep the memory
+ * around until the card is done writing to it. */
+void fpga_pool_destroy(struct fpga_pool *pool)
+{
+        kref_put(&pool->ref, fpga_pool_release);
+}
+
+/* Take a clean virtine out of the pool and return its index. If there are
+ * none, wait for the card to clean one unless NOWAIT is set. Fails with
+ * -ENODEV once none are left and the card is gone, since nothing will ever be
+ * cleaned again. */
+int fpga_pool_get(struct fpga_pool *pool, bool nowait)
+{
+        unsigned long flags;
+        int idx;
+        int error;
+
+        for(;;) {
+                spin_lock_irqsave(&pool->lock, flags);
+                if(pool->nr_free) {
+                        idx = pool->free[--pool->nr_free];
+                        pool->state[idx] = FPGA_POOL_OUT;
+                        fpga_pool_refill(pool);
+                        spin_unlock_irqrestore(&pool->lock, flags);
+                        return idx;
+                }
+                // Nothing clean. Make sure whatever is dirty is on its way.
+                fpga_pool_refill(pool);
+                spin_unlock_irqrestore(&pool->lock, flags);
+
+                if(READ_ONCE(pool->fpga->removed)) {
+                        return -ENODEV;
+                }
+                if(nowait) {
+                        return -EAGAIN;
+                }
+                error = wait_event_interruptible(pool->wait,
+                                                 READ_ONCE(pool->nr_free) ||
+                                                 READ_ONCE(pool->fpga->removed));
+                if(error) {
+                        return error;
+                }
+        }
+}
+
+/* Give virtine IDX back to the pool, dirty. */
+int fpga_pool_put(struct fpga_pool *pool, unsigned int idx)
+{
+        unsigned long flags;
+        int error = 0;
+
+        if(idx >= pool->nr_virtines) {
+                return -EINVAL;
+        }
+
+        spin_lock_irqsave(&pool->lock, flags);
+        if(pool->state[idx] != FPGA_POOL_OUT) { // Not handed out, or given back twice
+                error = -EINVAL;
+        } else {
+                pool->state[idx] = FPGA_POOL_DIRTY;
+                pool->dirty[pool->nr_dirty++] = idx;
+                fpga_pool_refill(pool);
+        }
+        spin_unlock_irqrestore(&pool->lock, flags);
+
+        return error;
+}
+
+/* Map the whole pool into userspace. The mapping is of the same memory the
+ * card cleans, so nothing is ever copied. */
+int fpga_pool_mmap(struct fpga_pool *pool, struct vm_area_struct *vma)
+{
+        if(vma->vm_pgoff || vma->vm_end - vma->vm_start > pool->size) {
+                return -EINVAL;
+        }
+
+        return dma_mmap_coherent(pool->dev, vma, pool->cpu_addr,
+                                 pool->dma_addr, vma->vm_end - vma->vm_start);
+}
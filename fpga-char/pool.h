@@ -0,0 +1,63 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/mm_types.h>
+
+#include "fpga_char_main.h"
+
+/* Where each virtine in a pool is. */
+enum fpga_pool_state {
+        FPGA_POOL_FREE, // Clean, on the free list
+        FPGA_POOL_OUT, // Handed out to userspace
+        FPGA_POOL_DIRTY, // Given back, waiting to be sent for cleaning
+        FPGA_POOL_CLEANING, // On the card
+};
+
+/* A pool of virtines the driver owns, so that getting a clean virtine is a
+ * pop off of a free list instead of a round trip through the card. All of the
+ * virtines live in one physically contiguous DMA allocation, which comes out
+ * of CMA when it is big enough to need it, and which userspace mmaps. Virtine
+ * I sits I * stride bytes into the mapping. Dirty virtines given back are
+ * sent to the card in batches, whenever the number of clean (and
+ * being-cleaned) virtines drops below the low watermark. */
+struct fpga_pool {
+        struct kref ref; // Held by the file and by each virtine on the card
+        struct fpga_device *fpga;
+        struct device *dev; // Whoever the memory was allocated for, kept alive with it
+
+        void *cpu_addr;
+        dma_addr_t dma_addr;
+        size_t size;
+        unsigned long stride;
+        unsigned int nr_virtines;
+        unsigned int low_watermark;
+
+        spinlock_t lock;
+        u8 *state;
+        unsigned int *free; // Stack, so the most recently cleaned goes out first
+        unsigned int nr_free;
+        unsigned int *dirty;
+        unsigned int nr_dirty;
+        unsigned int nr_cleaning;
+        wait_queue_head_t wait;
+
+        // One preallocated request per virtine, so refilling never allocates
+        struct fpga_request *reqs;
+        struct work_struct free_work;
+};
+
+struct fpga_pool *fpga_pool_create(struct fpga_device *fpga,
+                                   unsigned long virtine_size,
+                                   unsigned int nr_virtines,
+                                   unsigned int low_watermark);
+void fpga_pool_destroy(struct fpga_pool *pool);
+int fpga_pool_get(struct fpga_pool *pool, bool nowait);
+int fpga_pool_put(struct fpga_pool *pool, unsigned int idx);
+int fpga_pool_mmap(struct fpga_pool *pool, struct vm_area_struct *vma);
+
+#endif
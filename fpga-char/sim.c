@@ -0,0 +1,743 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/irq_work.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/dma-direct.h>
+#include <linux/version.h>
+
+#include "sim.h"
+#include "chardev.h"
+#include "cpu_engine.h"
+
+static unsigned int sim_cards;
+module_param(sim_cards, uint, 0444);
+MODULE_PARM_DESC(sim_cards, "How many simulated cards to create (default: 0)");
+
+/* Without the copy, a simulated card costs next to nothing per virtine, and
+ * whatever is left is the driver. */
+static bool sim_copy = true;
+module_param(sim_copy, bool, 0644);
+MODULE_PARM_DESC(sim_copy, "Have simulated cards copy the snapshot over every virtine (default: Y)");
+
+#define FPGA_MAX_SIM_CARDS 8
+
+/* One of the card's rings. Slots keep their values after being popped, since
+ * the CQ window can be read whenever. */
+struct fpga_sim_ring {
+        u64 slots[NUM_POSSIBLE_VIRTINES];
+        unsigned int head;
+        unsigned int count;
+};
+
+struct fpga_sim {
+        struct platform_device *pdev;
+        struct fpga_device *fpga;
+
+        /* Covers every register below. Taken with interrupts off, because
+         * the driver reaches the registers from its IRQ handler and its poll
+         * timer too. */
+        spinlock_t lock;
+        struct fpga_sim_ring rq;
+        struct fpga_sim_ring cq;
+        bool doorbell;
+        bool processing;
+        bool rq_dropped; // Sticky RING_STATUS_RQ_DROPPED
+        u32 batch_factor;
+        u32 cq_mode;
+        u32 cq_produced;
+        u32 cq_consumed;
+        u64 snapshot_size;
+        u64 snapshot_addr;
+        u64 scratch;
+        // Halves of 64-bit registers accessed 32 bits at a time
+        u64 split_read;
+        u64 split_write;
+
+        /* A virtine's stamps follow its RQ slot until it is dequeued, and
+         * its CQ slot after that. Entries from msi_stamped up to cq_produced
+         * have not been covered by an MSI yet. */
+        struct fpga_card_stamps rq_stamps[NUM_POSSIBLE_VIRTINES];
+        struct fpga_card_stamps cq_stamps[NUM_POSSIBLE_VIRTINES];
+        u32 msi_stamped;
+        unsigned int cleaned; // Since the last MSI
+
+        /* The card's own copy of the snapshot, latched when the upper half of
+         * SNAPSHOT_ADDR_REG is written. The engine holds snapshot_lock for as
+         * long as it copies from it. */
+        struct mutex snapshot_lock;
+        void *snapshot;
+        u64 snapshot_len;
+
+        struct task_struct *engine;
+        wait_queue_head_t engine_wait; // Doorbell rung, or CQ slots freed
+
+        /* The card's MSI. irq_work runs the driver's handler in hard interrupt
+         * context, like a real one. Once stopped, nothing is delivered. */
+        struct irq_work msi_work;
+        bool msi_masked;
+        bool msi_pending;
+        bool msi_stopped;
+};
+
+static struct fpga_sim *fpga_sims[FPGA_MAX_SIM_CARDS];
+static unsigned int nr_fpga_sims;
+
+static bool fpga_sim_ring_full(struct fpga_sim_ring *ring)
+{
+        return ring->count == NUM_POSSIBLE_VIRTINES;
+}
+
+static unsigned int fpga_sim_ring_tail(struct fpga_sim_ring *ring)
+{
+        return (ring->head + ring->count) % NUM_POSSIBLE_VIRTINES;
+}
+
+static void fpga_sim_ring_push(struct fpga_sim_ring *ring, u64 val)
+{
+        ring->slots[fpga_sim_ring_tail(ring)] = val;
+        ring->count++;
+}
+
+// Returns 0 for an empty ring, like the card
+static u64 fpga_sim_ring_pop(struct fpga_sim_ring *ring)
+{
+        u64 val;
+
+        if(!ring->count) {
+                return 0;
+        }
+        val = ring->slots[ring->head];
+        ring->head = (ring->head + 1) % NUM_POSSIBLE_VIRTINES;
+        ring->count--;
+        return val;
+}
+
+/* Move LEN bytes between BUF and host memory at DMA address ADDR, like the
+ * card's DMA engine would. Nothing translates a sim card's DMA addresses, so
+ * they are physical ones, and are walked a page at a time. This assumes the
+ * platform's DMA is cache coherent, as it is on x86. */
+static void fpga_sim_dma(struct fpga_sim *sim, dma_addr_t addr, void *buf,
+                         size_t len, bool to_host)
+{
+        phys_addr_t phys = dma_to_phys(&sim->pdev->dev, addr);
+        struct page *page;
+        size_t off, chunk;
+        void *va;
+
+        while(len) {
+                if(!pfn_valid(PHYS_PFN(phys))) { // What an IOMMU fault would be
+                        dev_err_ratelimited(&sim->pdev->dev,
+                                            "DMA to 0x%llx, which is not memory\n",
+                                            (u64) addr);
+                        return;
+                }
+                page = pfn_to_page(PHYS_PFN(phys));
+                off = offset_in_page(phys);
+                chunk = min_t(size_t, len, PAGE_SIZE - off);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+                va = kmap_local_page(page);
+#else
+                va = kmap_atomic(page);
+#endif
+                if(to_host) {
+                        memcpy(va + off, buf, chunk);
+                } else {
+                        memcpy(buf, va + off, chunk);
+                }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+                kunmap_local(va);
+#else
+                kunmap_atomic(va);
+#endif
+                if(to_host) {
+                        flush_dcache_page(page);
+                }
+
+                phys += chunk;
+                buf += chunk;
+                len -= chunk;
+        }
+}
+
+/* Interrupt the host for everything on the CQ, and stamp the entries that had
+ * not been covered by an MSI yet. Called with lock held. */
+static void fpga_sim_raise_msi(struct fpga_sim *sim)
+{
+        __le64 now = cpu_to_le64(ktime_get_ns());
+
+        if(sim->msi_masked) {
+                sim->msi_pending = true;
+        } else if(!sim->msi_stopped) {
+                // Runs once lock is dropped and interrupts are back on
+                irq_work_queue(&sim->msi_work);
+        }
+        for(; sim->msi_stamped != sim->cq_produced; sim->msi_stamped++) {
+                sim->cq_stamps[sim->msi_stamped % NUM_POSSIBLE_VIRTINES].msi = now;
+        }
+        sim->cleaned = 0;
+}
+
+static void fpga_sim_msi(struct irq_work *work)
+{
+        struct fpga_sim *sim = container_of(work, struct fpga_sim, msi_work);
+
+        // There is no Linux IRQ number behind a sim card
+        fetch_clean_virtines(0, sim->fpga);
+}
+
+void fpga_sim_mask_msi(struct fpga_sim *sim)
+{
+        unsigned long flags;
+
+        spin_lock_irqsave(&sim->lock, flags);
+        sim->msi_masked = true;
+        spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+void fpga_sim_unmask_msi(struct fpga_sim *sim)
+{
+        unsigned long flags;
+
+        spin_lock_irqsave(&sim->lock, flags);
+        sim->msi_masked = false;
+        if(sim->msi_pending && !sim->msi_stopped) {
+                irq_work_queue(&sim->msi_work);
+        }
+        sim->msi_pending = false;
+        spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+void fpga_sim_sync_msi(struct fpga_sim *sim)
+{
+        irq_work_sync(&sim->msi_work);
+}
+
+/* Stop delivering MSIs for good, and wait out the one being handled. What
+ * freeing the IRQ is on a card. */
+static void fpga_sim_stop_msi(struct fpga_sim *sim)
+{
+        unsigned long flags;
+
+        spin_lock_irqsave(&sim->lock, flags);
+        sim->msi_stopped = true;
+        spin_unlock_irqrestore(&sim->lock, flags);
+        irq_work_sync(&sim->msi_work);
+}
+
+/* The value of the 8-byte register slot SLOT. CQ_HEAD_OFFSET_REG is not in
+ * here, reading it has side effects. Called with lock held. */
+static u64 fpga_sim_read_slot(struct fpga_sim *sim, unsigned long slot)
+{
+        switch(slot) {
+        case RQ_HEAD_OFFSET_REG:
+                return sim->rq.slots[sim->rq.head];
+        case DOORBELL_REG:
+                return sim->doorbell;
+        case IS_PROCESSING_REG:
+                return sim->processing;
+        case CQ_TAIL_OFFSET_REG:
+                return sim->cq.slots[fpga_sim_ring_tail(&sim->cq)];
+        case BATCH_FACTOR_REG:
+                return sim->batch_factor;
+        case MAX_NUM_VIRTINES_REG:
+                return NUM_POSSIBLE_VIRTINES;
+        case SNAPSHOT_SIZE_REG:
+                return sim->snapshot_size;
+        case SNAPSHOT_ADDR_REG:
+                return sim->snapshot_addr;
+        case CQ_MODE_REG:
+                return sim->cq_mode;
+        case CQ_PRODUCED_REG:
+                return sim->cq_produced;
+        case CQ_CONSUMED_REG:
+                return sim->cq_consumed;
+        case RING_STATUS_REG:
+                return (fpga_sim_ring_full(&sim->rq) ? RING_STATUS_RQ_FULL : 0) |
+                       (fpga_sim_ring_full(&sim->cq) ? RING_STATUS_CQ_FULL : 0) |
+                       (sim->rq_dropped ? RING_STATUS_RQ_DROPPED : 0);
+        case RQ_FREE_REG:
+                return NUM_POSSIBLE_VIRTINES - sim->rq.count;
+        case RING_INDEX_REG:
+                return sim->rq.head | fpga_sim_ring_tail(&sim->rq) << 8 |
+                       sim->cq.head << 16 | fpga_sim_ring_tail(&sim->cq) << 24;
+        case SCRATCH_REG:
+                return sim->scratch;
+        }
+
+        if(slot >= CQ_BASE_ADDR && slot < BATCH_FACTOR_REG) {
+                return sim->cq.slots[(slot - (CQ_BASE_ADDR)) / sizeof(u64)];
+        }
+        if(slot >= CQ_STAMP_BASE && slot < RING_INDEX_REG) {
+                return le64_to_cpu(((__le64 *) sim->cq_stamps)[(slot - (CQ_STAMP_BASE)) /
+                                                               sizeof(__le64)]);
+        }
+        return ~0ULL; // Nothing decodes it
+}
+
+/* Reading CQ_HEAD_OFFSET_REG pops the CQ in pop mode, and only peeks at it in
+ * bulk mode. Called with lock held. */
+static u64 fpga_sim_read_cq_head(struct fpga_sim *sim)
+{
+        u64 val;
+
+        if(sim->cq_mode == CQ_MODE_BULK) {
+                return sim->cq.slots[sim->cq.head];
+        }
+        val = fpga_sim_ring_pop(&sim->cq);
+        if(val) {
+                sim->cq_consumed++;
+                wake_up(&sim->engine_wait); // May be waiting for CQ space
+        }
+        return val;
+}
+
+u32 fpga_sim_read32(struct fpga_sim *sim, unsigned long reg)
+{
+        unsigned long flags;
+        u64 val;
+
+        spin_lock_irqsave(&sim->lock, flags);
+        if(reg == CQ_HEAD_OFFSET_REG) {
+                sim->split_read = fpga_sim_read_cq_head(sim);
+                val = sim->split_read;
+        } else if(reg == CQ_HEAD_OFFSET_REG + 4) {
+                val = sim->split_read >> 32;
+                sim->split_read = 0;
+        } else {
+                val = fpga_sim_read_slot(sim, reg & ~7UL) >> ((reg & 4) ? 32 : 0);
+        }
+        spin_unlock_irqrestore(&sim->lock, flags);
+
+        return val;
+}
+
+u64 fpga_sim_read64(struct fpga_sim *sim, unsigned long reg)
+{
+        unsigned long flags;
+        u64 val;
+
+        spin_lock_irqsave(&sim->lock, flags);
+        if(reg == CQ_HEAD_OFFSET_REG) {
+                val = fpga_sim_read_cq_head(sim);
+        } else {
+                val = fpga_sim_read_slot(sim, reg);
+        }
+        spin_unlock_irqrestore(&sim->lock, flags);
+
+        return val;
+}
+
+/* The driver only ever copies whole 8-byte slots of the CQ window and the
+ * stamps, into arrays of them. */
+void fpga_sim_read_regs(struct fpga_sim *sim, void *dst, unsigned long reg, size_t len)
+{
+        unsigned long flags;
+
+        if(WARN_ON_ONCE((reg | len) % sizeof(u64))) {
+                memset(dst, 0xff, len);
+                return;
+        }
+
+        spin_lock_irqsave(&sim->lock, flags);
+        for(; len; len -= sizeof(u64), reg += sizeof(u64), dst += sizeof(u64)) {
+                *(__le64 *) dst = cpu_to_le64(fpga_sim_read_slot(sim, reg));
+        }
+        spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+/* Put VIRTINE on the RQ, or drop it if the RQ is full. Called with lock
+ * held. */
+static void fpga_sim_enqueue(struct fpga_sim *sim, u64 virtine)
+{
+        struct fpga_card_stamps *stamps;
+
+        if(fpga_sim_ring_full(&sim->rq)) {
+                sim->rq_dropped = true;
+                return;
+        }
+        stamps = &sim->rq_stamps[fpga_sim_ring_tail(&sim->rq)];
+        memset(stamps, 0, sizeof(*stamps));
+        stamps->virtine = cpu_to_le64(virtine);
+        stamps->enqueue = cpu_to_le64(ktime_get_ns());
+        fpga_sim_ring_push(&sim->rq, virtine);
+}
+
+/* Everything on the RQ that had not been rung for yet is now. Called with
+ * lock held. */
+static void fpga_sim_ring_doorbell(struct fpga_sim *sim)
+{
+        __le64 now = cpu_to_le64(ktime_get_ns());
+        unsigned int slot = sim->rq.head;
+        unsigned int i;
+
+        for(i = 0; i < sim->rq.count; i++) {
+                if(!sim->rq_stamps[slot].doorbell) {
+                        sim->rq_stamps[slot].doorbell = now;
+                }
+                slot = (slot + 1) % NUM_POSSIBLE_VIRTINES;
+        }
+        sim->doorbell = true;
+        wake_up(&sim->engine_wait);
+}
+
+/* Free every CQ entry up to the host's new CONSUMED count. Called with lock
+ * held. */
+static void fpga_sim_consume(struct fpga_sim *sim, u32 consumed)
+{
+        u32 to_free = consumed - sim->cq_consumed;
+
+        if(to_free > sim->cq_produced - sim->cq_consumed) {
+                dev_warn_ratelimited(&sim->pdev->dev, "Host consumed past the CQ tail\n");
+                return;
+        }
+        while(to_free--) {
+                fpga_sim_ring_pop(&sim->cq);
+                sim->cq_consumed++;
+        }
+        wake_up(&sim->engine_wait);
+}
+
+/* Write the whole 8-byte register REG. Returns true if the snapshot has to be
+ * latched, which cannot be done under lock. Called with lock held. */
+static bool fpga_sim_write_slot(struct fpga_sim *sim, unsigned long reg, u64 val)
+{
+        switch(reg) {
+        case RQ_TAIL_OFFSET_REG:
+                fpga_sim_enqueue(sim, val);
+                break;
+        case DOORBELL_REG:
+                fpga_sim_ring_doorbell(sim);
+                break;
+        case BATCH_FACTOR_REG:
+                sim->batch_factor = val;
+                break;
+        case CQ_MODE_REG:
+                sim->cq_mode = (val == CQ_MODE_BULK) ? CQ_MODE_BULK : CQ_MODE_POP;
+                break;
+        case CQ_CONSUMED_REG:
+                fpga_sim_consume(sim, val);
+                break;
+        case RING_STATUS_REG:
+                // Only the sticky bit can be cleared, the others are live state
+                if(val & RING_STATUS_RQ_DROPPED) {
+                        sim->rq_dropped = false;
+                }
+                break;
+        case SNAPSHOT_SIZE_REG:
+                sim->snapshot_size = val;
+                break;
+        case SNAPSHOT_ADDR_REG:
+                sim->snapshot_addr = val;
+                return true;
+        case SCRATCH_REG:
+                sim->scratch = val;
+                break;
+        default: // Read-only, or nothing decodes it
+                break;
+        }
+        return false;
+}
+
+/* Pull the snapshot at SNAPSHOT_ADDR_REG onto the card, like the card does
+ * as soon as the whole address is known. */
+static void fpga_sim_latch_snapshot(struct fpga_sim *sim)
+{
+        void *snapshot = NULL, *old;
+        unsigned long flags;
+        u64 addr, size;
+
+        might_sleep();
+
+        spin_lock_irqsave(&sim->lock, flags);
+        addr = sim->snapshot_addr;
+        size = sim->snapshot_size;
+        spin_unlock_irqrestore(&sim->lock, flags);
+
+        if(size) {
+                snapshot = kvmalloc(size, GFP_KERNEL);
+                if(snapshot) {
+                        fpga_sim_dma(sim, addr, snapshot, size, false);
+                } else {
+                        dev_warn(&sim->pdev->dev, "No memory to latch a %llu byte snapshot\n",
+                                 size);
+                        size = 0;
+                }
+        }
+
+        mutex_lock(&sim->snapshot_lock);
+        old = sim->snapshot;
+        sim->snapshot = snapshot;
+        sim->snapshot_len = size;
+        mutex_unlock(&sim->snapshot_lock);
+        kvfree(old);
+}
+
+void fpga_sim_write32(struct fpga_sim *sim, unsigned long reg, u32 val)
+{
+        unsigned long slot = reg & ~7UL;
+        unsigned long flags;
+        bool latch = false;
+        u64 old;
+
+        spin_lock_irqsave(&sim->lock, flags);
+        switch(slot) {
+        case RQ_TAIL_OFFSET_REG:
+        case SNAPSHOT_ADDR_REG:
+                // Only acted on once the upper half lands
+                if(!(reg & 4)) {
+                        sim->split_write = val;
+                        break;
+                }
+                latch = fpga_sim_write_slot(sim, slot, ((u64) val << 32) | sim->split_write);
+                break;
+        case SNAPSHOT_SIZE_REG:
+        case SCRATCH_REG:
+                old = fpga_sim_read_slot(sim, slot);
+                if(reg & 4) {
+                        fpga_sim_write_slot(sim, slot, (old & 0xffffffffULL) | ((u64) val << 32));
+                } else {
+                        fpga_sim_write_slot(sim, slot, (old & ~0xffffffffULL) | val);
+                }
+                break;
+        default: // 32-bit registers, whose upper halves do nothing
+                if(!(reg & 4)) {
+                        latch = fpga_sim_write_slot(sim, slot, val);
+                }
+                break;
+        }
+        spin_unlock_irqrestore(&sim->lock, flags);
+
+        if(latch) {
+                fpga_sim_latch_snapshot(sim);
+        }
+}
+
+void fpga_sim_write64(struct fpga_sim *sim, unsigned long reg, u64 val)
+{
+        unsigned long flags;
+        bool latch;
+
+        spin_lock_irqsave(&sim->lock, flags);
+        latch = fpga_sim_write_slot(sim, reg, val);
+        spin_unlock_irqrestore(&sim->lock, flags);
+
+        if(latch) {
+                fpga_sim_latch_snapshot(sim);
+        }
+}
+
+/* Take the next virtine to clean off of the RQ, or 0 if there is nothing left
+ * to do. A virtine is only taken once there is room to post it to the CQ;
+ * while the CQ is full, the host is interrupted for what is there and the
+ * engine sleeps until it frees some. Called with lock held, which is dropped
+ * while sleeping. */
+static u64 fpga_sim_next_virtine(struct fpga_sim *sim, struct fpga_card_stamps *stamps)
+{
+        while(sim->rq.count && fpga_sim_ring_full(&sim->cq)) {
+                fpga_sim_raise_msi(sim);
+                spin_unlock_irq(&sim->lock);
+                wait_event_interruptible(sim->engine_wait,
+                                         READ_ONCE(sim->cq.count) < NUM_POSSIBLE_VIRTINES ||
+                                         kthread_should_stop());
+                spin_lock_irq(&sim->lock);
+                if(kthread_should_stop()) {
+                        return 0;
+                }
+        }
+        if(!sim->rq.count) {
+                return 0;
+        }
+
+        *stamps = sim->rq_stamps[sim->rq.head];
+        stamps->dequeue = cpu_to_le64(ktime_get_ns());
+        return fpga_sim_ring_pop(&sim->rq);
+}
+
+/* Copy the snapshot over VIRTINE. */
+static void fpga_sim_clean(struct fpga_sim *sim, u64 virtine, struct fpga_card_stamps *stamps)
+{
+        u64 bytes = 0;
+
+        mutex_lock(&sim->snapshot_lock);
+        stamps->dma_start = cpu_to_le64(ktime_get_ns());
+        if(sim->snapshot && READ_ONCE(sim_copy)) {
+                fpga_sim_dma(sim, virtine, sim->snapshot, sim->snapshot_len, true);
+                bytes = sim->snapshot_len;
+        }
+        stamps->dma_end = cpu_to_le64(ktime_get_ns());
+        stamps->bytes = cpu_to_le64(bytes);
+        mutex_unlock(&sim->snapshot_lock);
+}
+
+/* The card's cleanup engine. Once the doorbell is rung, clean everything on
+ * the RQ, raising an MSI every batch factor's worth, and once more if the RQ
+ * runs dry part way through a batch. */
+static int fpga_sim_engine(void *data)
+{
+        struct fpga_sim *sim = data;
+        struct fpga_card_stamps stamps;
+        u64 virtine;
+
+        while(!kthread_should_stop()) {
+                wait_event_interruptible(sim->engine_wait,
+                                         READ_ONCE(sim->doorbell) || kthread_should_stop());
+
+                spin_lock_irq(&sim->lock);
+                if(!sim->doorbell) {
+                        spin_unlock_irq(&sim->lock);
+                        continue;
+                }
+                sim->processing = true;
+                sim->doorbell = false;
+
+                while((virtine = fpga_sim_next_virtine(sim, &stamps))) {
+                        spin_unlock_irq(&sim->lock);
+                        fpga_sim_clean(sim, virtine, &stamps);
+                        cond_resched();
+                        spin_lock_irq(&sim->lock);
+
+                        // The CQ can only have emptied out since it was checked
+                        sim->cq_stamps[sim->cq_produced % NUM_POSSIBLE_VIRTINES] = stamps;
+                        fpga_sim_ring_push(&sim->cq, virtine);
+                        sim->cq_produced++;
+                        if(++sim->cleaned >= sim->batch_factor) {
+                                fpga_sim_raise_msi(sim);
+                        }
+                }
+                sim->processing = false;
+
+                /* Report what is on the CQ now rather than holding it until
+                 * more work shows up, which may never happen. */
+                if(sim->cleaned) {
+                        fpga_sim_raise_msi(sim);
+                }
+                spin_unlock_irq(&sim->lock);
+        }
+
+        return 0;
+}
+
+static struct fpga_sim *fpga_sim_create(int id)
+{
+        /* Nothing binds to the platform device. It is only there to map
+         * buffers for, and to name the card in the logs. */
+        struct platform_device_info info = {
+                .name = "virtine_fpga_sim",
+                .id = id,
+                .dma_mask = DMA_BIT_MASK(64),
+        };
+        struct fpga_device *fpga;
+        struct fpga_sim *sim;
+        int error;
+
+        sim = kzalloc(sizeof(struct fpga_sim), GFP_KERNEL);
+        if(!sim) {
+                return ERR_PTR(-ENOMEM);
+        }
+        fpga = kzalloc(sizeof(struct fpga_device), GFP_KERNEL);
+        if(!fpga) {
+                error = -ENOMEM;
+                goto could_not_alloc_fpga;
+        }
+
+        sim->pdev = platform_device_register_full(&info);
+        if(IS_ERR(sim->pdev)) {
+                error = PTR_ERR(sim->pdev);
+                goto could_not_register_pdev;
+        }
+
+        // Same state the QEMU device comes out of reset with
+        spin_lock_init(&sim->lock);
+        sim->batch_factor = 1;
+        sim->cq_mode = CQ_MODE_POP;
+        mutex_init(&sim->snapshot_lock);
+        init_waitqueue_head(&sim->engine_wait);
+        init_irq_work(&sim->msi_work, fpga_sim_msi);
+        sim->fpga = fpga;
+        fpga->sim = sim;
+        fpga->dma_dev = &sim->pdev->dev;
+
+        sim->engine = kthread_run(fpga_sim_engine, sim, "virtine_sim%d", id);
+        if(IS_ERR(sim->engine)) {
+                error = PTR_ERR(sim->engine);
+                goto could_not_start_engine;
+        }
+
+        error = fpga_card_init(fpga);
+        if(error) {
+                goto could_not_init_card;
+        }
+
+        dev_info(fpga->dma_dev, "Simulating a card as virtine_fpga%d\n", fpga->minor - 1);
+        return sim;
+
+could_not_init_card:
+        kthread_stop(sim->engine);
+could_not_start_engine:
+        platform_device_unregister(sim->pdev);
+could_not_register_pdev:
+        kfree(fpga);
+could_not_alloc_fpga:
+        kfree(sim);
+        return ERR_PTR(error);
+}
+
+static void fpga_sim_destroy(struct fpga_sim *sim)
+{
+        struct fpga_device *fpga = sim->fpga;
+
+        destroy_char_devs(fpga);
+
+        /* With the engine and its MSIs gone, only the poll timer is left, and
+         * nothing can start it again. */
+        kthread_stop(sim->engine);
+        fpga_sim_stop_msi(sim);
+        hrtimer_cancel(&fpga->poll_timer);
+        // Nothing will ever complete the requests still on the card
+        fpga_abort_requests(fpga);
+        // The CPU engine copies from this card's snapshot too
+        fpga_cpu_engine_drain();
+
+        fpga_sq_free(&fpga->sq);
+        if(fpga->snapshot) {
+                dma_free_coherent(fpga->dma_dev, fpga->snapshot_size,
+                                  fpga->snapshot, fpga->snapshot_dma);
+        }
+        kvfree(sim->snapshot);
+        fpga_device_put(fpga);
+        platform_device_unregister(sim->pdev);
+        kfree(sim);
+}
+
+int fpga_sim_init(void)
+{
+        struct fpga_sim *sim;
+
+        if(sim_cards > FPGA_MAX_SIM_CARDS) {
+                pr_warn("fpga_char: Only simulating %d of %u cards\n",
+                        FPGA_MAX_SIM_CARDS, sim_cards);
+                sim_cards = FPGA_MAX_SIM_CARDS;
+        }
+
+        while(nr_fpga_sims < sim_cards) {
+                sim = fpga_sim_create(nr_fpga_sims);
+                if(IS_ERR(sim)) {
+                        fpga_sim_exit();
+                        return PTR_ERR(sim);
+                }
+                fpga_sims[nr_fpga_sims++] = sim;
+        }
+
+        return 0;
+}
+
+void fpga_sim_exit(void)
+{
+        while(nr_fpga_sims) {
+                fpga_sim_destroy(fpga_sims[--nr_fpga_sims]);
+        }
+}
@@ -0,0 +1,38 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <linux/kernel.h>
+
+struct fpga_sim;
+
+/* A simulated card. The card's whole register map lives in kernel memory
+ * instead of behind a BAR, and a kthread plays the card's cleanup engine: it
+ * takes virtines off of the RQ once the doorbell is rung, copies the snapshot
+ * over them, posts them to the CQ with their stamps, and raises an "MSI" by
+ * calling the driver's IRQ handler from irq_work, after every batch factor's
+ * worth or when the RQ runs dry, like the QEMU device does. Each sim card the
+ * module is told to make is a platform device of its own, and shows up as
+ * one more /dev/virtine_fpgaN that goes through every line of the card's
+ * submission, interrupt and reaping code, so the driver can be load-tested
+ * and profiled on any machine. */
+int fpga_sim_init(void);
+void fpga_sim_exit(void);
+
+/* Register accesses, what ioread32, lo_hi_readq and friends are on a card.
+ * Offsets are the same as on the card. Writing the upper half of
+ * SNAPSHOT_ADDR_REG latches the snapshot, which may sleep, so that register is
+ * only written from process context. Everything else is safe from any
+ * context. */
+u32 fpga_sim_read32(struct fpga_sim *sim, unsigned long reg);
+u64 fpga_sim_read64(struct fpga_sim *sim, unsigned long reg);
+void fpga_sim_read_regs(struct fpga_sim *sim, void *dst, unsigned long reg, size_t len);
+void fpga_sim_write32(struct fpga_sim *sim, unsigned long reg, u32 val);
+void fpga_sim_write64(struct fpga_sim *sim, unsigned long reg, u64 val);
+
+/* What disable_irq_nosync, enable_irq and synchronize_irq are on a card. An
+ * MSI raised while masked is delivered once it is unmasked. */
+void fpga_sim_mask_msi(struct fpga_sim *sim);
+void fpga_sim_unmask_msi(struct fpga_sim *sim);
+void fpga_sim_sync_msi(struct fpga_sim *sim);
+
+#endif
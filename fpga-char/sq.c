@@ -0,0 +1,89 @@
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/atomic.h>
+
+#include "sq.h"
+
+/* Set up SQ to hold DEPTH requests. DEPTH must be a power of two. */
+int fpga_sq_init(struct fpga_sq *sq, unsigned int depth)
+{
+        unsigned int i;
+
+        if(!is_power_of_2(depth)) {
+                return -EINVAL;
+        }
+
+        sq->slots = kvcalloc(depth, sizeof(*sq->slots), GFP_KERNEL);
+        if(!sq->slots) {
+                return -ENOMEM;
+        }
+
+        // Slot i is first free for position i
+        for(i = 0; i < depth; i++) {
+                sq->slots[i].seq = i;
+        }
+        sq->mask = depth - 1;
+        sq->head = 0;
+        sq->tail = 0;
+
+        return 0;
+}
+
+void fpga_sq_free(struct fpga_sq *sq)
+{
+        kvfree(sq->slots);
+        sq->slots = NULL;
+}
+
+/* Queue REQ at the tail of SQ. Safe to call from any number of threads at
+ * once. Returns -EAGAIN if the ring is full. */
+int fpga_sq_push(struct fpga_sq *sq, struct fpga_request *req)
+{
+        struct fpga_sq_slot *slot;
+        unsigned int pos, seq, old;
+
+        pos = READ_ONCE(sq->tail);
+        for(;;) {
+                slot = &sq->slots[pos & sq->mask];
+                seq = smp_load_acquire(&slot->seq);
+
+                if(seq == pos) { // Free on this lap, try to claim it
+                        old = cmpxchg(&sq->tail, pos, pos + 1);
+                        if(old == pos) {
+                                break;
+                        }
+                        pos = old; // Somebody else got it first
+                } else if((int) (seq - pos) < 0) {
+                        /* Still holds (or is about to hold) a request from
+                         * the previous lap that has not been taken yet. */
+                        return -EAGAIN;
+                } else { // Our view of the tail is stale
+                        pos = READ_ONCE(sq->tail);
+                }
+        }
+
+        slot->req = req;
+        smp_store_release(&slot->seq, pos + 1);
+        return 0;
+}
+
+/* Take the request at the head of SQ. Must only be called by the single
+ * consumer. Returns NULL when the ring is empty, or when the next producer in
+ * line has reserved its slot but not filled it in yet. */
+struct fpga_request *fpga_sq_pop(struct fpga_sq *sq)
+{
+        unsigned int head = sq->head;
+        struct fpga_sq_slot *slot = &sq->slots[head & sq->mask];
+        struct fpga_request *req;
+
+        if(smp_load_acquire(&slot->seq) != head + 1) {
+                return NULL;
+        }
+
+        req = slot->req;
+        // Hand the slot to whoever reserves it on the next lap
+        smp_store_release(&slot->seq, head + sq->mask + 1);
+        WRITE_ONCE(sq->head, head + 1);
+
+        return req;
+}
@@ -0,0 +1,57 @@
+#ifndef SQ_H
+#define SQ_H
+
+#include <linux/kernel.h>
+#include <linux/cache.h>
+#include <asm/barrier.h>
+
+struct fpga_request;
+
+struct fpga_sq_slot {
+        /* Which lap of the ring this slot is on. A producer may claim the slot
+         * for position pos once seq == pos, and publishes it by setting
+         * seq = pos + 1. Taking the request hands the slot on to the next lap. */
+        unsigned int seq;
+        struct fpga_request *req;
+};
+
+/* A bounded multi-producer, single-consumer ring of requests waiting to be
+ * pushed onto a card's RQ. Submitters reserve slots with cmpxchg and never
+ * take a lock, so any number of threads can queue work at once. The single
+ * consumer is whoever holds the card's rq_lock; it takes requests strictly in
+ * reservation order and stops at the first slot that is not published yet, so
+ * the card sees requests in the order they were reserved. */
+struct fpga_sq {
+        // Next position a producer will reserve. Producers race on this.
+        unsigned int tail ____cacheline_aligned_in_smp;
+        // Next position the consumer will take. Only the consumer moves this.
+        unsigned int head ____cacheline_aligned_in_smp;
+        unsigned int mask;
+        struct fpga_sq_slot *slots;
+};
+
+int fpga_sq_init(struct fpga_sq *sq, unsigned int depth);
+void fpga_sq_free(struct fpga_sq *sq);
+int fpga_sq_push(struct fpga_sq *sq, struct fpga_request *req);
+struct fpga_request *fpga_sq_pop(struct fpga_sq *sq);
+
+/* Is there a published request waiting at the head of the ring? This is only
+ * a hint when called without being the consumer. */
+static inline bool fpga_sq_pending(struct fpga_sq *sq)
+{
+        unsigned int head = READ_ONCE(sq->head);
+
+        return smp_load_acquire(&sq->slots[head & sq->mask].seq) == head + 1;
+}
+
+/* Would a push right now return -EAGAIN? Like fpga_sq_pending, only a hint,
+ * but it never reports full for a ring the consumer has made room in. */
+static inline bool fpga_sq_full(struct fpga_sq *sq)
+{
+        unsigned int tail = READ_ONCE(sq->tail);
+        unsigned int seq = smp_load_acquire(&sq->slots[tail & sq->mask].seq);
+
+        return (int) (seq - tail) < 0;
+}
+
+#endif
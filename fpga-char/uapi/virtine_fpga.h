@@ -0,0 +1,170 @@
+/* The interface between the fpga_char module and userspace: the ioctls, the
+ * structs they take, and where RQ writes go. This is the only copy; the
+ * module, libvirtinefpga and the test tools all include it, so nothing has to
+ * hard-code ioctl numbers. Only depends on the kernel's own UAPI headers. */
+#ifndef _UAPI_VIRTINE_FPGA_H
+#define _UAPI_VIRTINE_FPGA_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* The aggregate device. Each card is also /dev/virtine_fpgaN. */
+#define VIRTINE_FPGA_DEV "/dev/virtine_fpga"
+
+/* Writing an array of u64 virtine user addresses (inside of registered
+ * regions) at this file offset submits them all in one call. This is the
+ * card's RQ tail register, but the driver translates every address first. */
+#define VIRTINE_FPGA_RQ_OFFSET 0x8
+
+/* The magic 'F' has MANY drivers. Some other sequence numbers (the second param)
+ * are taken. I use between 0x30 and 0x80 to give myself room to experiment.
+ * To define a new ioctl number, I recommend you use one of the 4 macros below:
+ * _IO(magic, number) - No inputs/outputs
+ * _IOR(magic, number, input_data_type) - ioctl with input
+ * _IOW(magic, number, output_data_type) - ioctl with output
+ * _IOWR(magic, number, in_out_data_type) - ioctl with input and output
+ * ALL ioctls THAT TAKE DATATYPE PARAMETERS ONLY TAKE THE PARAMETER!!
+ * i.e. _IOR(magic, number, struct struct_name), NOT
+ *      _IOR(magic, number, sizeof(struct struct_name)).
+ * Note that the struct is limited to a maximum of 16KiB (14 address bits) */
+#define IOCTL_MAGIC 'F'
+
+/* ADDR is the user address of the snapshot's contents. The driver copies them
+ * into DMA-able memory and hands the card that copy. */
+struct virtine_snapshot {
+        unsigned long addr;
+        unsigned long size;
+};
+
+/* Largest snapshot FPGA_CHAR_SET_SNAPSHOT accepts, in bytes. */
+#define VIRTINE_FPGA_MAX_SNAPSHOT (64UL << 20)
+
+/* Register the user virtual range [addr, addr + size) with the device. The
+ * range is pinned and DMA-mapped once, and the handle written back is used to
+ * name virtines inside of it until the region is unregistered or the file is
+ * closed. */
+struct virtine_umem_reg {
+        __u64 addr;
+        __u64 size;
+        __u64 handle; // Filled in by the driver
+};
+
+/* Clean the virtine that starts OFFSET bytes into registered region HANDLE.
+ * This can also be sent as an io_uring passthrough command (IORING_OP_URING_CMD
+ * with cmd_op FPGA_CHAR_SUBMIT_FIXED and this struct in the SQE's cmd area).
+ * Then there is no separate reap: the command's CQE is posted once the virtine
+ * is clean, with res set to the status. On a ring set up with IORING_SETUP_CQE32,
+ * big_cqe[0] holds the virtine's user address.
+ * When the card is backed up, submissions (this ioctl and RQ writes alike)
+ * sleep until it catches up. Files opened O_NONBLOCK get EAGAIN instead, and
+ * should reap some completions before trying again. */
+struct virtine_fixed_submit {
+        __u64 handle;
+        __u64 offset;
+};
+
+/* Every open file has its own completion queue. Only the virtines submitted
+ * through a file are ever reported back to it. */
+struct virtine_completion {
+        __u64 virtine; // User address of the virtine, as it was submitted
+        __s32 status; // 0, or a negative errno if the virtine was not cleaned
+        __u32 reserved;
+};
+
+/* What FPGA_CHAR_REAP_TIMESTAMPED and FPGA_CHAR_POLL_TIMESTAMPED copy out
+ * instead. Cards also report when they were handed the virtine, and when
+ * they started and finished restoring it, in ns of their own clock, so only
+ * differences between the three mean anything. VIRTINE_COMPLETION_TIMESTAMPS
+ * is set in FLAGS when they are there: virtines cleaned by the CPU or DMA
+ * engines, or by cards that do not keep timestamps, only have BYTES. */
+struct virtine_completion_ts {
+        __u64 virtine;
+        __s32 status;
+        __u32 flags;
+        __u64 queued_ns; // Written onto the card's RQ
+        __u64 started_ns;
+        __u64 finished_ns;
+        __u64 bytes; // Of snapshot restored
+};
+
+#define VIRTINE_COMPLETION_TIMESTAMPS 0x1
+
+/* Copy up to NR completions into the array at COMPLETIONS. Sleeps until at
+ * least MIN_COMPLETE are available; 0 never sleeps. Returns the number of
+ * completions copied. */
+struct virtine_reap {
+        __u64 completions;
+        __u32 nr;
+        __u32 min_complete;
+};
+
+/* Like struct virtine_reap, but before going to sleep, spin for up to SPIN_US
+ * microseconds checking the cards for completions directly. The module's
+ * poll_spin_max_us parameter caps SPIN_US. This is worth it when virtines are
+ * expected back within about a context switch. */
+struct virtine_poll {
+        __u64 completions;
+        __u32 nr;
+        __u32 min_complete;
+        __u32 spin_us;
+        __u32 reserved;
+};
+
+/* Create this file's virtine pool: NR_VIRTINES virtines of at least
+ * VIRTINE_SIZE bytes each, kept clean by the card. The pool is then mmapped at
+ * offset 0 of the file, and virtine I starts I * STRIDE bytes into it. Dirty
+ * virtines are sent for cleaning whenever fewer than LOW_WATERMARK are clean
+ * or being cleaned, so it must be between 1 and NR_VIRTINES. A file can only
+ * have one pool. */
+struct virtine_pool_create {
+        __u64 virtine_size;
+        __u32 nr_virtines;
+        __u32 low_watermark;
+        __u64 stride; // Filled in by the driver
+};
+
+/* FPGA_CHAR_POOL_GET returns the index of a clean virtine. It sleeps until one
+ * is clean, unless it is passed FPGA_POOL_NOWAIT, in which case it fails with
+ * EAGAIN. Once the card is removed, it fails with ENODEV instead of waiting
+ * for virtines that will never be cleaned. FPGA_CHAR_POOL_PUT takes the index
+ * of a virtine to give back. */
+#define FPGA_POOL_NOWAIT 0x1
+
+/* Every open file is a tenant, and when tenants compete for a card, each gets
+ * a share of its cleanup bandwidth (in snapshot bytes restored) proportional
+ * to its weight. Virtines cleaned on the CPU because a card was backed up do
+ * not count against that share. FPGA_CHAR_SET_WEIGHT takes a weight between 1
+ * and 10000, and files start out at 100. FPGA_CHAR_GET_TENANT_STATS reports what this
+ * file has been given so far. Every tenant is listed in
+ * /sys/kernel/debug/fpga_char/tenants. */
+struct virtine_tenant_stats {
+        __u64 dispatched; // Virtines handed to a card (or the CPU/DMA engines)
+        __u64 completed;
+        __u64 bytes; // Of snapshot restored
+        __u64 queue_delay_ns; // Total time virtines waited before dispatch
+        __u64 max_queue_delay_ns;
+        __u64 elapsed_ns; // Since the file was opened
+        __u32 weight;
+        __u32 reserved;
+};
+
+/* Setting a batch factor turns off the driver's adaptive interrupt moderation
+ * for those cards. Setting 0 turns it back on. */
+#define FPGA_CHAR_MODIFY_BATCH_FACTOR _IOR(IOCTL_MAGIC, 0x30, unsigned long)
+#define FPGA_CHAR_GET_MAX_NUM_VIRTINES _IOW(IOCTL_MAGIC, 0x31, unsigned long*)
+#define FPGA_CHAR_RING_DOORBELL _IO(IOCTL_MAGIC, 0x32)
+#define FPGA_CHAR_SET_SNAPSHOT _IOR(IOCTL_MAGIC, 0x33, struct virtine_snapshot*)
+#define FPGA_CHAR_REGISTER_UMEM _IOWR(IOCTL_MAGIC, 0x34, struct virtine_umem_reg)
+#define FPGA_CHAR_UNREGISTER_UMEM _IOR(IOCTL_MAGIC, 0x35, __u64)
+#define FPGA_CHAR_SUBMIT_FIXED _IOR(IOCTL_MAGIC, 0x36, struct virtine_fixed_submit)
+#define FPGA_CHAR_REAP_COMPLETIONS _IOR(IOCTL_MAGIC, 0x37, struct virtine_reap)
+#define FPGA_CHAR_POLL_COMPLETIONS _IOR(IOCTL_MAGIC, 0x38, struct virtine_poll)
+#define FPGA_CHAR_CREATE_POOL _IOWR(IOCTL_MAGIC, 0x39, struct virtine_pool_create)
+#define FPGA_CHAR_POOL_GET _IOR(IOCTL_MAGIC, 0x3a, __u32)
+#define FPGA_CHAR_POOL_PUT _IOR(IOCTL_MAGIC, 0x3b, __u32)
+#define FPGA_CHAR_SET_WEIGHT _IOR(IOCTL_MAGIC, 0x3c, __u32)
+#define FPGA_CHAR_GET_TENANT_STATS _IOW(IOCTL_MAGIC, 0x3d, struct virtine_tenant_stats)
+#define FPGA_CHAR_REAP_TIMESTAMPED _IOR(IOCTL_MAGIC, 0x3e, struct virtine_reap)
+#define FPGA_CHAR_POLL_TIMESTAMPED _IOR(IOCTL_MAGIC, 0x3f, struct virtine_poll)
+
+#endif
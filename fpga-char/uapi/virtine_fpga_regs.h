@@ -0,0 +1,82 @@
+/* The virtine-fpga card's register layout. The module, pcie-echo and
+ * virtine-top all include this copy, so the offsets can never drift apart.
+ * Every register sits in an 8-byte slot, and PCI is little-endian. */
+#ifndef _UAPI_VIRTINE_FPGA_REGS_H
+#define _UAPI_VIRTINE_FPGA_REGS_H
+
+/* Depth of the card's RQ and CQ, in virtines. */
+#define NUM_POSSIBLE_VIRTINES 100
+
+/* MMIO DESIGN:
+ * 0x0                               0x8
+ * +-----------------------------------+
+ * |    Ready Queue (RQ) Head offset   |
+ * +-----------------------------------+
+ * |    Ready Queue (RQ) Tail offset   |
+ * +-----------------------------------+
+ * |           RQ Virtine 1            |
+ * +-----------------------------------+
+ * |           RQ Virtine 2            |
+ * +-----------------------------------+
+ * |               .....               |
+ * +-----------------------------------+
+ * |              Doorbell             |
+ * +-----------------------------------+
+ * |          isCardProcessing         |
+ * +-----------------------------------+
+ * |  Complete Queue (CQ) Head offset  |
+ * +-----------------------------------+
+ * |  Complete Queue (CQ) Tail offset  |
+ * +-----------------------------------+
+ * |           CQ Virtine 1            |
+ * +-----------------------------------+
+ * |               .....               |
+ * +-----------------------------------+
+ * |            Batch Factor           |
+ * +-----------------------------------+ */
+
+#define MMIO_BASE_ADDR 0x0
+#define MMIO_REG_SIZE 8UL
+/* Each CQ slot's timestamps, struct fpga_card_stamps in the module. */
+#define CQ_STAMP_SIZE (8 * MMIO_REG_SIZE)
+
+#define RQ_HEAD_OFFSET_REG MMIO_BASE_ADDR
+#define RQ_TAIL_OFFSET_REG (RQ_HEAD_OFFSET_REG + MMIO_REG_SIZE)
+#define RQ_BASE_ADDR (RQ_TAIL_OFFSET_REG + MMIO_REG_SIZE)
+#define DOORBELL_REG (RQ_BASE_ADDR + NUM_POSSIBLE_VIRTINES * MMIO_REG_SIZE)
+#define IS_PROCESSING_REG (DOORBELL_REG + MMIO_REG_SIZE)
+#define CQ_HEAD_OFFSET_REG (IS_PROCESSING_REG + MMIO_REG_SIZE)
+#define CQ_TAIL_OFFSET_REG (CQ_HEAD_OFFSET_REG + MMIO_REG_SIZE)
+#define CQ_BASE_ADDR (CQ_TAIL_OFFSET_REG + MMIO_REG_SIZE)
+#define BATCH_FACTOR_REG (CQ_BASE_ADDR + NUM_POSSIBLE_VIRTINES * MMIO_REG_SIZE)
+#define MAX_NUM_VIRTINES_REG (BATCH_FACTOR_REG + MMIO_REG_SIZE)
+#define SNAPSHOT_SIZE_REG (MAX_NUM_VIRTINES_REG + MMIO_REG_SIZE)
+#define SNAPSHOT_ADDR_REG (SNAPSHOT_SIZE_REG + MMIO_REG_SIZE)
+#define CQ_MODE_REG (SNAPSHOT_ADDR_REG + MMIO_REG_SIZE)
+#define CQ_PRODUCED_REG (CQ_MODE_REG + MMIO_REG_SIZE)
+#define CQ_CONSUMED_REG (CQ_PRODUCED_REG + MMIO_REG_SIZE)
+#define RING_STATUS_REG (CQ_CONSUMED_REG + MMIO_REG_SIZE)
+#define RQ_FREE_REG (RING_STATUS_REG + MMIO_REG_SIZE)
+#define CQ_STAMP_BASE (RQ_FREE_REG + MMIO_REG_SIZE)
+#define RING_INDEX_REG (CQ_STAMP_BASE + NUM_POSSIBLE_VIRTINES * CQ_STAMP_SIZE)
+#define SCRATCH_REG (RING_INDEX_REG + MMIO_REG_SIZE)
+
+/* CQ_MODE_REG values. In bulk mode, reading CQ_HEAD_OFFSET_REG no longer pops.
+ * Instead, the free-running CQ_PRODUCED_REG says how many entries the card has
+ * ever put on the CQ, entry N lives in CQ slot N % NUM_POSSIBLE_VIRTINES, and
+ * writing the host's own count to CQ_CONSUMED_REG frees everything before it. */
+#define CQ_MODE_POP 0
+#define CQ_MODE_BULK 1
+
+/* RING_STATUS_REG bits. RQ_DROPPED sticks until it is written back as 1. */
+#define RING_STATUS_RQ_FULL (1 << 0)
+#define RING_STATUS_CQ_FULL (1 << 1)
+#define RING_STATUS_RQ_DROPPED (1 << 2)
+
+/* RING_INDEX_REG is the slot of the RQ head, RQ tail, CQ head and CQ tail, a
+ * byte each from the bottom up. Only monitors like virtine-top read it. */
+
+/* SCRATCH_REG stores whatever is written to it and does nothing else. The
+ * driver never touches it; pcie-echo times MMIO accesses against it. */
+
+#endif
@@ -0,0 +1,344 @@
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/overflow.h>
+
+#include "umem.h"
+#include "chardev.h"
+
+static int fpga_umem_build_segs(struct fpga_umem_map *map)
+{
+        struct scatterlist *sg;
+        struct fpga_umem_seg *seg = NULL;
+        unsigned long offset = 0;
+        unsigned int i;
+
+        map->segs = kvcalloc(map->sgt.nents, sizeof(*map->segs), GFP_KERNEL);
+        if(!map->segs) {
+                return -ENOMEM;
+        }
+
+        /* Merge DMA segments that ended up back-to-back, so that a virtine
+         * that straddles two pages the IOMMU placed contiguously can still be
+         * handed to the device as one address. */
+        map->nr_segs = 0;
+        for_each_sgtable_dma_sg(&map->sgt, sg, i) {
+                dma_addr_t dma_addr = sg_dma_address(sg);
+                unsigned long len = sg_dma_len(sg);
+
+                if(seg && (seg->dma_addr + seg->len == dma_addr)) {
+                        seg->len += len;
+                } else {
+                        seg = &map->segs[map->nr_segs++];
+                        seg->offset = offset;
+                        seg->len = len;
+                        seg->dma_addr = dma_addr;
+                }
+                offset += len;
+        }
+
+        return 0;
+}
+
+/* Find out whether MAP has to be synced, and if so, index its CPU-side
+ * scatterlist by region offset so a single virtine can be. */
+static int fpga_umem_build_sgs(struct fpga_umem_map *map)
+{
+        struct scatterlist *sg;
+        unsigned long offset = 0;
+        unsigned int i;
+
+        for_each_sgtable_dma_sg(&map->sgt, sg, i) {
+                if(dma_need_sync(map->fpga->dma_dev, sg_dma_address(sg))) {
+                        map->need_sync = true;
+                        break;
+                }
+        }
+        if(!map->need_sync) {
+                return 0;
+        }
+
+        map->sgs = kvcalloc(map->sgt.orig_nents, sizeof(*map->sgs), GFP_KERNEL);
+        if(!map->sgs) {
+                return -ENOMEM;
+        }
+        for_each_sgtable_sg(&map->sgt, sg, i) {
+                map->sgs[i].offset = offset;
+                map->sgs[i].sg = sg;
+                offset += sg->length;
+        }
+        map->nr_sgs = map->sgt.orig_nents;
+
+        return 0;
+}
+
+static int fpga_umem_map_card(struct fpga_umem *umem, struct fpga_umem_map *map,
+                              struct fpga_device *fpga)
+{
+        int error;
+
+        map->fpga = fpga;
+        error = sg_alloc_table_from_pages(&map->sgt, umem->pages, umem->nr_pages,
+                                          offset_in_page(umem->uaddr), umem->size,
+                                          GFP_KERNEL);
+        if(error) {
+                return error;
+        }
+
+        error = dma_map_sgtable(fpga->dma_dev, &map->sgt, DMA_BIDIRECTIONAL, 0);
+        if(error) {
+                goto could_not_map;
+        }
+
+        error = fpga_umem_build_segs(map);
+        if(error) {
+                goto could_not_build_segs;
+        }
+
+        error = fpga_umem_build_sgs(map);
+        if(error) {
+                goto could_not_build_sgs;
+        }
+
+        dev_dbg(fpga->dma_dev, "Mapped 0x%lx+%lu as %u DMA segment(s)%s\n",
+                umem->uaddr, umem->size, map->nr_segs,
+                map->need_sync ? ", synced per virtine" : "");
+        // Unmapping needs the card, even if it has been removed by then
+        fpga_device_get(fpga);
+        return 0;
+
+could_not_build_sgs:
+        kvfree(map->segs);
+could_not_build_segs:
+        dma_unmap_sgtable(fpga->dma_dev, &map->sgt, DMA_BIDIRECTIONAL, 0);
+could_not_map:
+        sg_free_table(&map->sgt);
+        return error;
+}
+
+static void fpga_umem_unmap_card(struct fpga_umem_map *map)
+{
+        kvfree(map->sgs);
+        kvfree(map->segs);
+        /* Every virtine the card wrote was synced back when it completed.
+         * Syncing the whole region now would copy stale bounce buffers over
+         * whatever userspace has written since. */
+        dma_unmap_sgtable(map->fpga->dma_dev, &map->sgt, DMA_BIDIRECTIONAL,
+                          DMA_ATTR_SKIP_CPU_SYNC);
+        sg_free_table(&map->sgt);
+        fpga_device_put(map->fpga);
+}
+
+/* Pin the user range [UADDR, UADDR + SIZE) of the calling process and map it
+ * for DMA by each of the NR_FPGAS cards in FPGAS. The pages are only pinned
+ * once, no matter how many cards they are mapped for. Returns the region with
+ * a single reference held, or an ERR_PTR. */
+struct fpga_umem *fpga_umem_register(struct fpga_device **fpgas,
+                                     unsigned int nr_fpgas,
+                                     unsigned long uaddr, unsigned long size)
+{
+        struct fpga_umem *umem;
+        unsigned long end;
+        long pinned;
+        int error;
+
+        if(!size || !nr_fpgas || check_add_overflow(uaddr, size, &end)) {
+                return ERR_PTR(-EINVAL);
+        }
+
+        umem = kzalloc(struct_size(umem, maps, nr_fpgas), GFP_KERNEL);
+        if(!umem) {
+                return ERR_PTR(-ENOMEM);
+        }
+        kref_init(&umem->ref);
+        umem->uaddr = uaddr;
+        umem->size = size;
+        umem->nr_pages = DIV_ROUND_UP(offset_in_page(uaddr) + size, PAGE_SIZE);
+
+        /* Pinned regions are charged against RLIMIT_MEMLOCK of whoever
+         * registered them, the same way io_uring charges its fixed buffers. */
+        umem->mm = current->mm;
+        mmgrab(umem->mm);
+        error = account_locked_vm(umem->mm, umem->nr_pages, true);
+        if(error) { // error? -ENOMEM returned if over RLIMIT_MEMLOCK
+                goto could_not_account;
+        }
+
+        umem->pages = kvcalloc(umem->nr_pages, sizeof(struct page *), GFP_KERNEL);
+        if(!umem->pages) {
+                error = -ENOMEM;
+                goto could_not_alloc_pages;
+        }
+
+        /* FOLL_LONGTERM because the pages stay pinned until the region is
+         * unregistered, which also migrates them out of ZONE_MOVABLE/CMA. */
+        pinned = pin_user_pages_fast(uaddr & PAGE_MASK, umem->nr_pages,
+                                     FOLL_WRITE | FOLL_LONGTERM, umem->pages);
+        if(pinned != umem->nr_pages) {
+                if(pinned > 0) {
+                        unpin_user_pages(umem->pages, pinned);
+                }
+                error = pinned < 0 ? pinned : -EFAULT;
+                goto could_not_pin;
+        }
+
+        for(umem->nr_maps = 0; umem->nr_maps < nr_fpgas; umem->nr_maps++) {
+                error = fpga_umem_map_card(umem, &umem->maps[umem->nr_maps],
+                                           fpgas[umem->nr_maps]);
+                if(error) {
+                        goto could_not_map;
+                }
+        }
+
+        return umem;
+
+could_not_map:
+        while(umem->nr_maps--) {
+                fpga_umem_unmap_card(&umem->maps[umem->nr_maps]);
+        }
+        unpin_user_pages(umem->pages, umem->nr_pages);
+could_not_pin:
+        kvfree(umem->pages);
+could_not_alloc_pages:
+        account_locked_vm(umem->mm, umem->nr_pages, false);
+could_not_account:
+        mmdrop(umem->mm);
+        kfree(umem);
+        return ERR_PTR(error);
+}
+
+static struct fpga_umem_map *fpga_umem_find_map(struct fpga_umem *umem,
+                                                struct fpga_device *fpga)
+{
+        unsigned int i;
+
+        for(i = 0; i < umem->nr_maps; i++) {
+                if(umem->maps[i].fpga == fpga) {
+                        return &umem->maps[i];
+                }
+        }
+        return NULL;
+}
+
+/* Translate OFFSET into the registered region to the DMA address FPGA should
+ * use. The LEN bytes starting there must not cross a DMA segment, because the
+ * device only accepts a single address per virtine.
+ * This is the per-request path, so it is just a binary search over the
+ * segments computed at registration time. */
+int fpga_umem_dma_addr(struct fpga_umem *umem, struct fpga_device *fpga,
+                       unsigned long offset, unsigned long len,
+                       dma_addr_t *dma_addr)
+{
+        struct fpga_umem_map *map;
+        struct fpga_umem_seg *seg;
+        unsigned int lo = 0, hi;
+
+        if(offset >= umem->size || len > umem->size - offset) {
+                return -EINVAL;
+        }
+
+        map = fpga_umem_find_map(umem, fpga);
+        if(!map) { // Card was probed after the region was registered
+                return -ENODEV;
+        }
+
+        // Find the last segment that starts at or before offset
+        hi = map->nr_segs;
+        while(hi - lo > 1) {
+                unsigned int mid = lo + (hi - lo) / 2;
+                if(map->segs[mid].offset <= offset) {
+                        lo = mid;
+                } else {
+                        hi = mid;
+                }
+        }
+
+        seg = &map->segs[lo];
+        if(offset + len > seg->offset + seg->len) {
+                return -EINVAL;
+        }
+
+        *dma_addr = seg->dma_addr + (offset - seg->offset);
+        return 0;
+}
+
+/* Sync the scatterlist entries of FPGA's mapping of UMEM that hold the LEN
+ * bytes at OFFSET, which fpga_umem_dma_addr already checked, for whoever is
+ * about to touch them. Only the one virtine is synced, not the whole region. */
+static void fpga_umem_sync(struct fpga_umem *umem, struct fpga_device *fpga,
+                           unsigned long offset, unsigned long len,
+                           bool for_device)
+{
+        struct fpga_umem_map *map = fpga_umem_find_map(umem, fpga);
+        unsigned int lo = 0, hi, nents;
+
+        if(!map || !map->need_sync) {
+                return;
+        }
+
+        // Find the last entry that starts at or before offset
+        hi = map->nr_sgs;
+        while(hi - lo > 1) {
+                unsigned int mid = lo + (hi - lo) / 2;
+                if(map->sgs[mid].offset <= offset) {
+                        lo = mid;
+                } else {
+                        hi = mid;
+                }
+        }
+        for(nents = 1; lo + nents < map->nr_sgs; nents++) {
+                if(map->sgs[lo + nents].offset >= offset + len) {
+                        break;
+                }
+        }
+
+        if(for_device) {
+                dma_sync_sg_for_device(fpga->dma_dev, map->sgs[lo].sg, nents,
+                                       DMA_BIDIRECTIONAL);
+        } else {
+                dma_sync_sg_for_cpu(fpga->dma_dev, map->sgs[lo].sg, nents,
+                                    DMA_BIDIRECTIONAL);
+        }
+}
+
+/* Hand the virtine at OFFSET over to FPGA before it is queued. Safe from
+ * atomic context. */
+void fpga_umem_sync_for_device(struct fpga_umem *umem, struct fpga_device *fpga,
+                               unsigned long offset, unsigned long len)
+{
+        fpga_umem_sync(umem, fpga, offset, len, true);
+}
+
+/* Take the virtine at OFFSET back from FPGA once it is done with it. Safe from
+ * atomic context. */
+void fpga_umem_sync_for_cpu(struct fpga_umem *umem, struct fpga_device *fpga,
+                            unsigned long offset, unsigned long len)
+{
+        fpga_umem_sync(umem, fpga, offset, len, false);
+}
+
+static void fpga_umem_release(struct kref *ref)
+{
+        struct fpga_umem *umem = container_of(ref, struct fpga_umem, ref);
+        unsigned int i;
+
+        for(i = 0; i < umem->nr_maps; i++) {
+                fpga_umem_unmap_card(&umem->maps[i]);
+        }
+        // The device wrote to these pages behind the kernel's back.
+        unpin_user_pages_dirty_lock(umem->pages, umem->nr_pages, true);
+        kvfree(umem->pages);
+        account_locked_vm(umem->mm, umem->nr_pages, false);
+        mmdrop(umem->mm);
+
+        // Lookups on the submission path happen under RCU
+        kfree_rcu(umem, rcu);
+}
+
+/* Drop a reference to the region. The final put unmaps and unpins everything,
+ * which can sleep, so this must be called from process context. */
+void fpga_umem_put(struct fpga_umem *umem)
+{
+        might_sleep();
+        kref_put(&umem->ref, fpga_umem_release);
+}
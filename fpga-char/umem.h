@@ -0,0 +1,79 @@
+#ifndef UMEM_H
+#define UMEM_H
+
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/scatterlist.h>
+#include <linux/dma-mapping.h>
+
+#include "fpga_char_main.h"
+
+/* A run of DMA address space inside of a registered region that the device can
+ * treat as a single contiguous buffer. With an IOMMU, a whole region usually
+ * collapses into a single segment. */
+struct fpga_umem_seg {
+        unsigned long offset; // Byte offset of this run from the start of the region
+        unsigned long len;
+        dma_addr_t dma_addr;
+};
+
+/* A CPU-side entry of a mapping's scatterlist, and where it starts in the
+ * region. Only kept for mappings that have to be synced. */
+struct fpga_umem_sg {
+        unsigned long offset;
+        struct scatterlist *sg;
+};
+
+/* One card's view of a registered region. Each card sits behind its own
+ * IOMMU domain, so every card a region may be sent to gets its own mapping. */
+struct fpga_umem_map {
+        struct fpga_device *fpga;
+        struct sg_table sgt;
+        unsigned int nr_segs;
+        struct fpga_umem_seg *segs;
+        /* Set if the card is not cache coherent, or the mapping bounces. Then
+         * every virtine is synced on its way to the card and back. */
+        bool need_sync;
+        unsigned int nr_sgs;
+        struct fpga_umem_sg *sgs;
+};
+
+/* A user virtual address range that was pinned and DMA-mapped ONCE when it
+ * was registered. Cleanup requests name a virtine inside of the region by
+ * (handle, offset), like io_uring's fixed buffers, so submitting never has to
+ * walk page tables or map/unmap anything in the IOMMU. */
+struct fpga_umem {
+        struct kref ref;
+        struct rcu_head rcu;
+        struct mm_struct *mm; // Whose locked_vm the pinned pages are charged to
+
+        unsigned long uaddr;
+        unsigned long size;
+        unsigned long nr_pages;
+        struct page **pages;
+
+        unsigned int nr_maps;
+        struct fpga_umem_map maps[];
+};
+
+struct fpga_umem *fpga_umem_register(struct fpga_device **fpgas,
+                                     unsigned int nr_fpgas,
+                                     unsigned long uaddr, unsigned long size);
+int fpga_umem_dma_addr(struct fpga_umem *umem, struct fpga_device *fpga,
+                       unsigned long offset, unsigned long len,
+                       dma_addr_t *dma_addr);
+void fpga_umem_sync_for_device(struct fpga_umem *umem, struct fpga_device *fpga,
+                               unsigned long offset, unsigned long len);
+void fpga_umem_sync_for_cpu(struct fpga_umem *umem, struct fpga_device *fpga,
+                            unsigned long offset, unsigned long len);
+
+static inline struct fpga_umem *fpga_umem_get(struct fpga_umem *umem)
+{
+        kref_get(&umem->ref);
+        return umem;
+}
+
+void fpga_umem_put(struct fpga_umem *umem);
+
+#endif
@@ -0,0 +1,20 @@
+LIBVIRTINEFPGA_VERSION = 1.0
+LIBVIRTINEFPGA_SITE = $(BR2_EXTERNAL_LIBVIRTINEFPGA_PATH)
+LIBVIRTINEFPGA_SITE_METHOD = local
+LIBVIRTINEFPGA_INSTALL_STAGING = YES
+
+define LIBVIRTINEFPGA_BUILD_CMDS
+	$(MAKE) $(TARGET_CONFIGURE_OPTS) -C $(@D) \
+		UAPI_DIR=$(BR2_EXTERNAL_FPGA_CHAR_PATH)/uapi all
+endef
+
+define LIBVIRTINEFPGA_INSTALL_STAGING_CMDS
+	$(MAKE) $(TARGET_CONFIGURE_OPTS) -C $(@D) \
+		UAPI_DIR=$(BR2_EXTERNAL_FPGA_CHAR_PATH)/uapi DESTDIR=$(STAGING_DIR) install
+endef
+
+define LIBVIRTINEFPGA_INSTALL_TARGET_CMDS
+	$(INSTALL) -m 0755 -D $(@D)/libvirtinefpga.so.1 $(TARGET_DIR)/usr/lib/libvirtinefpga.so.1
+endef
+
+$(eval $(generic-package))
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "vfpga_private.h"
+
+/* Addresses are handed to the kernel this many at a time, off of the stack. */
+#define VFPGA_SUBMIT_CHUNK 64
+
+// ioctl(2) returns -1 and sets errno, we return -errno
+static int vfpga_ioctl(struct vfpga *dev, unsigned long request, void *arg)
+{
+    int ret = ioctl(dev->fd, request, arg);
+    return ret < 0 ? -errno : ret;
+}
+
+struct vfpga *vfpga_open(const char *path, int flags)
+{
+    struct vfpga *dev = calloc(1, sizeof(*dev));
+    const char *trace_prefix = getenv("VFPGA_TRACE");
+    if(!dev) {
+        return NULL;
+    }
+
+    int open_flags = O_RDWR | O_CLOEXEC;
+    if(flags & VFPGA_NONBLOCK) {
+        open_flags |= O_NONBLOCK;
+    }
+    dev->fd = open(path ? path : VIRTINE_FPGA_DEV, open_flags);
+    if(dev->fd < 0) {
+        int saved_errno = errno;
+        free(dev);
+        errno = saved_errno;
+        return NULL;
+    }
+    dev->flags = flags;
+    dev->snapshot_id = -1;
+    pthread_mutex_init(&dev->trace_lock, NULL);
+
+    if(trace_prefix && *trace_prefix) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s.%d.%d", trace_prefix, (int) getpid(), dev->fd);
+        vfpga_trace_start(dev, path); // Tracing is best-effort
+    }
+
+    return dev;
+}
+
+void vfpga_close(struct vfpga *dev)
+{
+    if(dev) {
+        if(dev->trace) {
+            vfpga_trace_stop(dev);
+        }
+        if(dev->pool) {
+            munmap(dev->pool, dev->pool_size);
+        }
+        close(dev->fd);
+        pthread_mutex_destroy(&dev->trace_lock);
+        free(dev->regions);
+        free(dev);
+    }
+}
+
+int vfpga_fd(const struct vfpga *dev)
+{
+    return dev->fd;
+}
+
+int vfpga_set_snapshot(struct vfpga *dev, const void *snapshot, size_t size)
+{
+    struct virtine_snapshot arg = { .addr = (unsigned long) snapshot, .size = size };
+    int ret = vfpga_ioctl(dev, FPGA_CHAR_SET_SNAPSHOT, &arg);
+    if(ret == 0) {
+        vfpga_trace_snapshot(dev, size);
+    }
+    return ret;
+}
+
+int vfpga_register(struct vfpga *dev, void *addr, size_t size, uint64_t *handle)
+{
+    struct virtine_umem_reg reg = { .addr = (uintptr_t) addr, .size = size };
+    struct vfpga_region *regions;
+    int ret;
+
+    regions = realloc(dev->regions, (dev->nr_regions + 1) * sizeof(*regions));
+    if(!regions) {
+        return -ENOMEM;
+    }
+    dev->regions = regions;
+
+    ret = vfpga_ioctl(dev, FPGA_CHAR_REGISTER_UMEM, &reg);
+    if(ret < 0) {
+        return ret;
+    }
+    regions[dev->nr_regions++] = (struct vfpga_region) { .handle = reg.handle,
+        .addr = (uintptr_t) addr, .size = size };
+    *handle = reg.handle;
+    return 0;
+}
+
+int vfpga_unregister(struct vfpga *dev, uint64_t handle)
+{
+    int ret = vfpga_ioctl(dev, FPGA_CHAR_UNREGISTER_UMEM, (void *) (uintptr_t) handle);
+    if(ret < 0) {
+        return ret;
+    }
+    for(unsigned int i = 0; i < dev->nr_regions; i++) {
+        if(dev->regions[i].handle == handle) {
+            dev->regions[i] = dev->regions[--dev->nr_regions];
+            break;
+        }
+    }
+    return 0;
+}
+
+int vfpga_submit(struct vfpga *dev, void *const *virtines, unsigned int nr)
+{
+    uint64_t addrs[VFPGA_SUBMIT_CHUNK];
+    unsigned int submitted = 0, chunk, i;
+    ssize_t written;
+    int ret = 0;
+
+    while(submitted < nr) {
+        chunk = nr - submitted < VFPGA_SUBMIT_CHUNK ? nr - submitted : VFPGA_SUBMIT_CHUNK;
+        for(i = 0; i < chunk; i++) {
+            addrs[i] = (uintptr_t) virtines[submitted + i];
+        }
+
+        // The driver takes as many as it can, and says how many that was
+        written = pwrite(dev->fd, addrs, chunk * sizeof(addrs[0]), VIRTINE_FPGA_RQ_OFFSET);
+        if(written < 0) {
+            ret = -errno;
+            break;
+        }
+        vfpga_trace_submit(dev, addrs, written / sizeof(addrs[0]));
+        submitted += written / sizeof(addrs[0]);
+        if((size_t) written < chunk * sizeof(addrs[0])) {
+            break;
+        }
+    }
+
+    if(submitted && !(dev->flags & VFPGA_MANUAL_DOORBELL)) {
+        vfpga_ring_doorbell(dev);
+    }
+
+    return submitted ? (int) submitted : ret;
+}
+
+int vfpga_submit_fixed(struct vfpga *dev, uint64_t handle, uint64_t offset)
+{
+    struct virtine_fixed_submit submit = { .handle = handle, .offset = offset };
+    int ret = vfpga_ioctl(dev, FPGA_CHAR_SUBMIT_FIXED, &submit);
+
+    if(ret == 0 && dev->trace) {
+        for(unsigned int i = 0; i < dev->nr_regions; i++) {
+            if(dev->regions[i].handle == handle) {
+                uint64_t virtine = dev->regions[i].addr + offset;
+                vfpga_trace_submit(dev, &virtine, 1);
+                break;
+            }
+        }
+    }
+    if(ret == 0 && !(dev->flags & VFPGA_MANUAL_DOORBELL)) {
+        vfpga_ring_doorbell(dev);
+    }
+    return ret;
+}
+
+int vfpga_ring_doorbell(struct vfpga *dev)
+{
+    return vfpga_ioctl(dev, FPGA_CHAR_RING_DOORBELL, NULL);
+}
+
+int vfpga_reap(struct vfpga *dev, struct virtine_completion *completions,
+               unsigned int nr, unsigned int min_complete)
+{
+    struct virtine_reap reap = { .completions = (uintptr_t) completions,
+        .nr = nr, .min_complete = min_complete };
+    int ret = vfpga_ioctl(dev, FPGA_CHAR_REAP_COMPLETIONS, &reap);
+    vfpga_trace_complete(dev, completions, sizeof(*completions), ret);
+    return ret;
+}
+
+int vfpga_poll(struct vfpga *dev, struct virtine_completion *completions,
+               unsigned int nr, unsigned int min_complete, unsigned int spin_us)
+{
+    struct virtine_poll poll = { .completions = (uintptr_t) completions,
+        .nr = nr, .min_complete = min_complete, .spin_us = spin_us };
+    int ret = vfpga_ioctl(dev, FPGA_CHAR_POLL_COMPLETIONS, &poll);
+    vfpga_trace_complete(dev, completions, sizeof(*completions), ret);
+    return ret;
+}
+
+int vfpga_reap_ts(struct vfpga *dev, struct virtine_completion_ts *completions,
+                  unsigned int nr, unsigned int min_complete)
+{
+    struct virtine_reap reap = { .completions = (uintptr_t) completions,
+        .nr = nr, .min_complete = min_complete };
+    int ret = vfpga_ioctl(dev, FPGA_CHAR_REAP_TIMESTAMPED, &reap);
+    vfpga_trace_complete(dev, completions, sizeof(*completions), ret);
+    return ret;
+}
+
+int vfpga_poll_ts(struct vfpga *dev, struct virtine_completion_ts *completions,
+                  unsigned int nr, unsigned int min_complete, unsigned int spin_us)
+{
+    struct virtine_poll poll = { .completions = (uintptr_t) completions,
+        .nr = nr, .min_complete = min_complete, .spin_us = spin_us };
+    int ret = vfpga_ioctl(dev, FPGA_CHAR_POLL_TIMESTAMPED, &poll);
+    vfpga_trace_complete(dev, completions, sizeof(*completions), ret);
+    return ret;
+}
+
+int vfpga_pool_create(struct vfpga *dev, unsigned int nr_virtines, size_t virtine_size,
+                      unsigned int low_watermark, void **pool, size_t *stride)
+{
+    struct virtine_pool_create create = { .virtine_size = virtine_size,
+        .nr_virtines = nr_virtines, .low_watermark = low_watermark };
+    int ret;
+
+    if(dev->pool) {
+        return -EBUSY;
+    }
+
+    ret = vfpga_ioctl(dev, FPGA_CHAR_CREATE_POOL, &create);
+    if(ret < 0) {
+        return ret;
+    }
+
+    dev->pool_size = nr_virtines * create.stride;
+    dev->pool = mmap(NULL, dev->pool_size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if(dev->pool == MAP_FAILED) {
+        dev->pool = NULL;
+        return -errno;
+    }
+
+    dev->pool_stride = create.stride;
+    *pool = dev->pool;
+    *stride = create.stride;
+    return 0;
+}
+
+int vfpga_pool_get(struct vfpga *dev, int flags)
+{
+    return vfpga_ioctl(dev, FPGA_CHAR_POOL_GET, (void *) (uintptr_t) flags);
+}
+
+int vfpga_pool_put(struct vfpga *dev, unsigned int idx)
+{
+    int ret = vfpga_ioctl(dev, FPGA_CHAR_POOL_PUT, (void *) (uintptr_t) idx);
+
+    // The pool never reports when it is clean again, so this is just a submit
+    if(ret == 0 && dev->trace) {
+        uint64_t virtine = (uintptr_t) dev->pool + idx * dev->pool_stride;
+        vfpga_trace_submit(dev, &virtine, 1);
+    }
+    return ret;
+}
+
+int vfpga_max_virtines(struct vfpga *dev, unsigned long *max_virtines)
+{
+    return vfpga_ioctl(dev, FPGA_CHAR_GET_MAX_NUM_VIRTINES, max_virtines);
+}
+
+int vfpga_set_batch_factor(struct vfpga *dev, unsigned long batch_factor)
+{
+    // These take their argument by value, not by pointer
+    return vfpga_ioctl(dev, FPGA_CHAR_MODIFY_BATCH_FACTOR, (void *) batch_factor);
+}
+
+int vfpga_set_weight(struct vfpga *dev, uint32_t weight)
+{
+    return vfpga_ioctl(dev, FPGA_CHAR_SET_WEIGHT, (void *) (uintptr_t) weight);
+}
+
+int vfpga_tenant_stats(struct vfpga *dev, struct virtine_tenant_stats *stats)
+{
+    return vfpga_ioctl(dev, FPGA_CHAR_GET_TENANT_STATS, stats);
+}
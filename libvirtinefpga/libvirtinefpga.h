@@ -0,0 +1,73 @@
+#ifndef LIBVIRTINEFPGA_H
+#define LIBVIRTINEFPGA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "virtine_fpga.h"
+#include "vfpga_trace.h"
+
+/* A client library for the fpga_char module. A struct vfpga is an open
+ * device: open it once, set its snapshot and register memory once, and then
+ * submit and reap as much as you like through it. Everything that can fail
+ * returns a negative errno value, like the kernel does. */
+struct vfpga;
+
+/* vfpga_open flags */
+#define VFPGA_NONBLOCK 0x1 // Submissions fail with -EAGAIN instead of waiting
+#define VFPGA_MANUAL_DOORBELL 0x2 // vfpga_submit does not ring the doorbell
+
+/* Open PATH, or the aggregate device if PATH is NULL. Returns NULL and sets
+ * errno on failure. */
+struct vfpga *vfpga_open(const char *path, int flags);
+void vfpga_close(struct vfpga *dev);
+int vfpga_fd(const struct vfpga *dev);
+
+/* Every virtine is restored from the SIZE bytes at SNAPSHOT. SIZE must be
+ * between 1 and VIRTINE_FPGA_MAX_SNAPSHOT. */
+int vfpga_set_snapshot(struct vfpga *dev, const void *snapshot, size_t size);
+
+/* Pin and map [ADDR, ADDR + SIZE) for the device. Virtines must live in a
+ * registered region to be submitted. */
+int vfpga_register(struct vfpga *dev, void *addr, size_t size, uint64_t *handle);
+int vfpga_unregister(struct vfpga *dev, uint64_t handle);
+
+/* Submit the NR virtines in VIRTINES, in one system call, and ring the
+ * doorbell. Returns how many were submitted, which is only less than NR if
+ * the device is backed up and DEV is non-blocking, or an error stopped it. */
+int vfpga_submit(struct vfpga *dev, void *const *virtines, unsigned int nr);
+// Submit the virtine OFFSET bytes into registered region HANDLE.
+int vfpga_submit_fixed(struct vfpga *dev, uint64_t handle, uint64_t offset);
+int vfpga_ring_doorbell(struct vfpga *dev);
+
+/* Copy up to NR completions into COMPLETIONS, waiting for at least
+ * MIN_COMPLETE of them. vfpga_poll spins for up to SPIN_US microseconds
+ * before it sleeps. Both return how many were reaped. */
+int vfpga_reap(struct vfpga *dev, struct virtine_completion *completions,
+               unsigned int nr, unsigned int min_complete);
+int vfpga_poll(struct vfpga *dev, struct virtine_completion *completions,
+               unsigned int nr, unsigned int min_complete, unsigned int spin_us);
+/* The same, but the completions also carry the card's queued, started and
+ * finished times and the bytes it restored (see struct virtine_completion_ts). */
+int vfpga_reap_ts(struct vfpga *dev, struct virtine_completion_ts *completions,
+                  unsigned int nr, unsigned int min_complete);
+int vfpga_poll_ts(struct vfpga *dev, struct virtine_completion_ts *completions,
+                  unsigned int nr, unsigned int min_complete, unsigned int spin_us);
+
+/* Create this file's pool of NR_VIRTINES clean virtines and map it. Virtine I
+ * lives I * STRIDE bytes into POOL. vfpga_pool_get returns the index of a
+ * clean virtine (flags is 0 or FPGA_POOL_NOWAIT), and vfpga_pool_put hands a
+ * dirty one back to be cleaned. The pool is unmapped by vfpga_close. */
+int vfpga_pool_create(struct vfpga *dev, unsigned int nr_virtines, size_t virtine_size,
+                      unsigned int low_watermark, void **pool, size_t *stride);
+int vfpga_pool_get(struct vfpga *dev, int flags);
+int vfpga_pool_put(struct vfpga *dev, unsigned int idx);
+
+/* Device tuning and accounting. A batch factor of 0 hands it back to the
+ * driver's interrupt moderation. */
+int vfpga_max_virtines(struct vfpga *dev, unsigned long *max_virtines);
+int vfpga_set_batch_factor(struct vfpga *dev, unsigned long batch_factor);
+int vfpga_set_weight(struct vfpga *dev, uint32_t weight);
+int vfpga_tenant_stats(struct vfpga *dev, struct virtine_tenant_stats *stats);
+
+#endif
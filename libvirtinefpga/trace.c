@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/syscall.h>
+
+#include "vfpga_private.h"
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int vfpga_trace_start(struct vfpga *dev, const char *path)
+{
+    struct vfpga_trace_header header = {
+        .version = htole32(VFPGA_TRACE_VERSION),
+        .record_size = htole32(sizeof(struct vfpga_trace_record)),
+        .start_realtime_ns = htole64(clock_ns(CLOCK_REALTIME)),
+        .pid = htole32(getpid()),
+    };
+    FILE *trace;
+
+    if(dev->trace) {
+        return -EBUSY;
+    }
+
+    trace = fopen(path, "we");
+    if(!trace) {
+        return -errno;
+    }
+    memcpy(header.magic, VFPGA_TRACE_MAGIC, sizeof(header.magic));
+    if(fwrite(&header, sizeof(header), 1, trace) != 1) {
+        fclose(trace);
+        return -EIO;
+    }
+
+    dev->trace_start_ns = clock_ns(CLOCK_MONOTONIC);
+    dev->trace = trace;
+    // Whatever snapshot was already set still counts as this trace's first
+    if(dev->snapshot_id >= 0) {
+        dev->snapshot_id--;
+        vfpga_trace_snapshot(dev, dev->snapshot_size);
+    }
+    return 0;
+}
+
+int vfpga_trace_stop(struct vfpga *dev)
+{
+    int ret = 0;
+
+    if(!dev->trace) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&dev->trace_lock);
+    if(fclose(dev->trace)) {
+        ret = -errno;
+    }
+    dev->trace = NULL;
+    pthread_mutex_unlock(&dev->trace_lock);
+    return ret;
+}
+
+static void vfpga_trace_write(struct vfpga *dev, struct vfpga_trace_record *records,
+                              unsigned int nr)
+{
+    pthread_mutex_lock(&dev->trace_lock);
+    if(dev->trace) {
+        /* Records are stdio buffered, and only reach the file a buffer at a
+         * time, so tracing costs about a memcpy per virtine. */
+        fwrite(records, sizeof(*records), nr, dev->trace);
+    }
+    pthread_mutex_unlock(&dev->trace_lock);
+}
+
+static void vfpga_trace_fill(struct vfpga *dev, struct vfpga_trace_record *record,
+                             enum vfpga_trace_type type, uint64_t now, uint32_t tid)
+{
+    // Traces are little-endian, so they can be replayed on any host
+    memset(record, 0, sizeof(*record));
+    record->ns = htole64(now - dev->trace_start_ns);
+    record->size = htole32(dev->snapshot_size);
+    record->submitter = htole32(tid);
+    record->snapshot = htole16(dev->snapshot_id < 0 ? 0 : dev->snapshot_id);
+    record->type = type;
+}
+
+void vfpga_trace_snapshot(struct vfpga *dev, size_t size)
+{
+    struct vfpga_trace_record record;
+
+    dev->snapshot_size = size;
+    dev->snapshot_id++;
+    if(!dev->trace) {
+        return;
+    }
+    vfpga_trace_fill(dev, &record, VFPGA_TRACE_SNAPSHOT, clock_ns(CLOCK_MONOTONIC),
+                     syscall(SYS_gettid));
+    vfpga_trace_write(dev, &record, 1);
+}
+
+void vfpga_trace_submit(struct vfpga *dev, const uint64_t *virtines, unsigned int nr)
+{
+    struct vfpga_trace_record records[64];
+    uint64_t now;
+    uint32_t tid;
+
+    if(!dev->trace) {
+        return;
+    }
+    now = clock_ns(CLOCK_MONOTONIC);
+    tid = syscall(SYS_gettid);
+    while(nr) {
+        unsigned int chunk = nr < 64 ? nr : 64;
+        for(unsigned int i = 0; i < chunk; i++) {
+            vfpga_trace_fill(dev, &records[i], VFPGA_TRACE_SUBMIT, now, tid);
+            records[i].virtine = htole64(virtines[i]);
+        }
+        vfpga_trace_write(dev, records, chunk);
+        virtines += chunk;
+        nr -= chunk;
+    }
+}
+
+void vfpga_trace_complete(struct vfpga *dev, const void *completions, size_t stride,
+                          int nr)
+{
+    const struct virtine_completion *completion;
+    struct vfpga_trace_record records[64];
+    uint64_t now;
+    uint32_t tid;
+
+    if(!dev->trace || nr <= 0) {
+        return;
+    }
+    now = clock_ns(CLOCK_MONOTONIC);
+    tid = syscall(SYS_gettid);
+    while(nr) {
+        int chunk = nr < 64 ? nr : 64;
+        for(int i = 0; i < chunk; i++) {
+            completion = (const void *) ((const char *) completions + i * stride);
+            vfpga_trace_fill(dev, &records[i], VFPGA_TRACE_COMPLETE, now, tid);
+            records[i].virtine = htole64(completion->virtine);
+            records[i].status = (int32_t) htole32((uint32_t) completion->status);
+        }
+        vfpga_trace_write(dev, records, chunk);
+        completions = (const char *) completions + chunk * stride;
+        nr -= chunk;
+    }
+}
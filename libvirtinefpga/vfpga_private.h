@@ -0,0 +1,43 @@
+#ifndef VFPGA_PRIVATE_H
+#define VFPGA_PRIVATE_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "libvirtinefpga.h"
+#include "vfpga_trace.h"
+
+// A registered region, so fixed submissions can be traced by address
+struct vfpga_region {
+    uint64_t handle;
+    uintptr_t addr;
+    size_t size;
+};
+
+struct vfpga {
+    int fd;
+    int flags;
+    void *pool; // Mapping of this file's pool, if it has one
+    size_t pool_size;
+    size_t pool_stride;
+
+    struct vfpga_region *regions;
+    unsigned int nr_regions;
+
+    // Only used while recording a trace
+    FILE *trace;
+    pthread_mutex_t trace_lock;
+    uint64_t trace_start_ns;
+    uint32_t snapshot_size;
+    int snapshot_id; // -1 before the first snapshot
+};
+
+// These only record anything if DEV->trace is set
+void vfpga_trace_snapshot(struct vfpga *dev, size_t size);
+void vfpga_trace_submit(struct vfpga *dev, const uint64_t *virtines, unsigned int nr);
+/* COMPLETIONS are STRIDE bytes apart, so they can be either struct
+ * virtine_completion or struct virtine_completion_ts, which starts the same. */
+void vfpga_trace_complete(struct vfpga *dev, const void *completions, size_t stride,
+                          int nr);
+
+#endif
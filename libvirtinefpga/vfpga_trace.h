@@ -0,0 +1,51 @@
+#ifndef VFPGA_TRACE_H
+#define VFPGA_TRACE_H
+
+#include <stdint.h>
+
+/* The trace format libvirtinefpga records, and fpga-replay replays.
+ *
+ * A trace is one struct vfpga_trace_header, followed by struct
+ * vfpga_trace_records until the end of the file, all little-endian. Records
+ * are written in the order things happened through one device handle, so a
+ * trace is one tenant's view of the device. */
+
+#define VFPGA_TRACE_MAGIC "VFPGATRC"
+#define VFPGA_TRACE_VERSION 1
+
+struct vfpga_trace_header {
+    char magic[8]; // VFPGA_TRACE_MAGIC, not NUL-terminated
+    uint32_t version;
+    uint32_t record_size; // sizeof(struct vfpga_trace_record)
+    uint64_t start_realtime_ns; // CLOCK_REALTIME when recording started
+    uint32_t pid;
+    uint32_t reserved;
+};
+
+enum vfpga_trace_type {
+    VFPGA_TRACE_SNAPSHOT = 1, // A new snapshot of SIZE bytes was set
+    VFPGA_TRACE_SUBMIT = 2, // VIRTINE was submitted for cleaning
+    VFPGA_TRACE_COMPLETE = 3, // VIRTINE was reaped, with STATUS
+};
+
+struct vfpga_trace_record {
+    uint64_t ns; // Since recording started, from CLOCK_MONOTONIC
+    uint64_t virtine; // User address, as it was submitted
+    uint32_t size; // Bytes of snapshot the cleanup restores
+    uint32_t submitter; // Thread ID that submitted or reaped it
+    uint16_t snapshot; // Which snapshot, counting from 0 in the order they were set
+    uint8_t type; // enum vfpga_trace_type
+    uint8_t reserved;
+    int32_t status; // Of VFPGA_TRACE_COMPLETE records
+};
+
+struct vfpga;
+
+/* Record everything done through DEV to the file at PATH, until
+ * vfpga_trace_stop or vfpga_close. Opening a device with the VFPGA_TRACE
+ * environment variable set does this for every device the program opens,
+ * writing to "$VFPGA_TRACE.<pid>.<fd>". */
+int vfpga_trace_start(struct vfpga *dev, const char *path);
+int vfpga_trace_stop(struct vfpga *dev);
+
+#endif
@@ -2,6 +2,16 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/pci.h>
+#include <linux/interrupt.h>
+#include <linux/dma-mapping.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/io-64-nonatomic-lo-hi.h>
+
+#include "virtine_fpga_regs.h"
 
 #define MODULE_NAME "PCIe FPGA Echo"
 
@@ -9,6 +19,31 @@
 #define VENDOR_ID 0x1172
 #define DEVICE_ID 0xe003
 
+/* The fpga_char module binds the same device, so unload it before loading
+ * this. */
+
+/* How the BAR is mapped for the MMIO benchmarks. The WC mapping only covers
+ * the registers up to SCRATCH_REG, which is all that is timed through it. */
+enum echo_mapping {
+        ECHO_MAP_UC,
+        ECHO_MAP_WC,
+        NR_ECHO_MAPPINGS
+};
+static const char *const echo_mapping_names[NR_ECHO_MAPPINGS] = { "uc", "wc" };
+
+static const unsigned int echo_widths[] = { 1, 2, 4, 8 }; // In bytes
+#define NR_ECHO_WIDTHS ARRAY_SIZE(echo_widths)
+
+/* The DMA sweep doubles the transfer from a page up to dma_max_size, and hands
+ * the card this many transfers per doorbell when it writes to the host. */
+#define NR_ECHO_DMA_SIZES 16
+#define ECHO_DMA_BATCH 64
+#define ECHO_DMA_TIMEOUT (5 * HZ)
+
+#define ECHO_DEFAULT_ITERATIONS 10000
+#define ECHO_DEFAULT_DMA_ITERATIONS 256
+#define ECHO_DEFAULT_DMA_MAX_SIZE (4 << 20)
+
 int run_test(struct pci_dev *dev);
 
 static int echo_probe(struct pci_dev *dev, const struct pci_device_id *id);
@@ -38,16 +73,358 @@ static struct pci_driver fpga_driver = {
         .remove = echo_remove,
 };
 
+// Every card gets a directory of its own under this one
+static struct dentry *echo_debugfs_dir;
+
+/* One access width through one mapping of SCRATCH_REG. Latencies are the mean
+ * of every access timed on its own, throughputs are of back-to-back streams. */
+struct echo_mmio_result {
+        u64 read_ns;
+        u64 read_min_ns;
+        u64 write_ns; // A write, and the read that makes sure it landed
+        u64 posted_ns; // Per write of a stream, flushed by one read at the end
+        u64 read_mbps;
+        u64 write_mbps;
+        u32 mismatches; // Read-backs that did not echo what was written
+};
+
+/* One transfer size. to_card is the card reading the snapshot out of host
+ * memory, from_card is it writing the snapshot over a virtine. */
+struct echo_dma_result {
+        u64 size;
+        u64 to_card_ns;
+        u64 to_card_mbps;
+        u64 from_card_ns;
+        u64 from_card_mbps;
+        bool verified; // The card wrote back exactly what it read
+};
+
 /* This is a "private" struct, meaning the kernel does not provide or interact
  * with this struct in any way. This is supposed to be a software-side definition
  * of the required components that the driver/module can/should use to complete
  * its task. */
 struct fpga_echo_device {
+        struct pci_dev *pdev;
         u16 vendor_id;
         u16 device_id;
         u8 __iomem *dev_mem; // Pointer to mmap-ed device BAR in host's memory.
+        u8 __iomem *dev_mem_wc; // The registers again, write-combining
+        int irq;
+        atomic_t irqs; // MSIs seen, the card raises one per finished batch
+        wait_queue_head_t irq_wait;
+
+        struct dentry *debugfs;
+        // Tunables, read at the start of every run
+        u32 iterations;
+        u32 dma_iterations;
+        u32 dma_max_size;
+
+        // Held for a whole run, and while the results are printed
+        struct mutex bench_lock;
+        bool have_results;
+        u32 run_iterations; // What the tunables were for these results
+        u32 run_dma_iterations;
+        int dma_error;
+        struct echo_mmio_result mmio[NR_ECHO_MAPPINGS][NR_ECHO_WIDTHS];
+        struct echo_dma_result dma[NR_ECHO_DMA_SIZES];
+        unsigned int nr_dma;
 };
 
+static irqreturn_t echo_irq(int irq, void *data) {
+        struct fpga_echo_device *fpga = data;
+
+        atomic_inc(&fpga->irqs);
+        wake_up(&fpga->irq_wait);
+        return IRQ_HANDLED;
+}
+
+static u64 echo_read(void __iomem *addr, unsigned int width) {
+        switch(width) {
+        case 1: return readb(addr);
+        case 2: return readw(addr);
+        case 4: return readl(addr);
+        default: return readq(addr);
+        }
+}
+
+static void echo_write(u64 val, void __iomem *addr, unsigned int width) {
+        switch(width) {
+        case 1: writeb(val, addr); break;
+        case 2: writew(val, addr); break;
+        case 4: writel(val, addr); break;
+        default: writeq(val, addr); break;
+        }
+}
+
+// MB (10^6 bytes) per second, for BYTES moved in NS nanoseconds
+static u64 echo_mbps(u64 bytes, u64 ns) {
+        return ns ? div64_u64(bytes * 1000, ns) : 0;
+}
+
+/* Time WIDTH-byte accesses to SCRATCH_REG through the mapping MEM. The card
+ * answers every read itself, so a read's latency is a full round trip. Writes
+ * are posted and the CPU moves on at once; a write is only known to have
+ * reached the card when a read behind it comes back. wmb() keeps a WC
+ * mapping's writes from sitting in the write-combining buffer past that read. */
+static void echo_bench_mmio(struct fpga_echo_device *fpga, u8 __iomem *mem,
+                            unsigned int width, struct echo_mmio_result *result) {
+        void __iomem *scratch = mem + SCRATCH_REG;
+        u64 mask = (width == 8) ? ~0ULL : (1ULL << (width * 8)) - 1;
+        u32 i, n = fpga->run_iterations;
+        u64 start, elapsed, total;
+
+        memset(result, 0, sizeof(*result));
+
+        result->read_min_ns = U64_MAX;
+        for(i = 0, total = 0; i < n; i++) {
+                start = ktime_get_ns();
+                echo_read(scratch, width);
+                elapsed = ktime_get_ns() - start;
+                total += elapsed;
+                result->read_min_ns = min(result->read_min_ns, elapsed);
+        }
+        result->read_ns = div_u64(total, n);
+
+        for(i = 0, total = 0; i < n; i++) {
+                start = ktime_get_ns();
+                echo_write(i, scratch, width);
+                wmb();
+                if(echo_read(scratch, width) != (i & mask)) {
+                        result->mismatches++;
+                }
+                total += ktime_get_ns() - start;
+        }
+        result->write_ns = div_u64(total, n);
+
+        start = ktime_get_ns();
+        for(i = 0; i < n; i++) {
+                echo_read(scratch, width);
+        }
+        result->read_mbps = echo_mbps((u64) n * width, ktime_get_ns() - start);
+
+        start = ktime_get_ns();
+        for(i = 0; i < n; i++) {
+                echo_write(i, scratch, width);
+        }
+        wmb();
+        echo_read(scratch, width);
+        elapsed = ktime_get_ns() - start;
+        result->posted_ns = div_u64(elapsed, n);
+        result->write_mbps = echo_mbps((u64) n * width, elapsed);
+}
+
+/* Have the card write its snapshot over DST NR times, in batches of
+ * ECHO_DMA_BATCH behind a single doorbell, and wait for every one of them to
+ * be posted to the CQ. *PRODUCED is how many entries the card had put on the
+ * CQ before, and is moved past these. */
+static int echo_dma_from_card(struct fpga_echo_device *fpga, dma_addr_t dst,
+                              u32 nr, u32 *produced) {
+        u32 batch, target, i;
+        long left;
+
+        while(nr) {
+                batch = min_t(u32, nr, ECHO_DMA_BATCH);
+                for(i = 0; i < batch; i++) {
+                        lo_hi_writeq(dst, fpga->dev_mem + RQ_TAIL_OFFSET_REG);
+                }
+                iowrite32(1, fpga->dev_mem + DOORBELL_REG);
+
+                target = *produced + batch;
+                left = wait_event_timeout(fpga->irq_wait,
+                                          (s32) (ioread32(fpga->dev_mem + CQ_PRODUCED_REG) - target) >= 0,
+                                          ECHO_DMA_TIMEOUT);
+                if(!left) {
+                        return -ETIMEDOUT;
+                }
+                // Nobody needs the completions, hand the slots straight back
+                iowrite32(target, fpga->dev_mem + CQ_CONSUMED_REG);
+                *produced = target;
+                nr -= batch;
+        }
+        return 0;
+}
+
+/* Sweep DMA transfers from a page up to dma_max_size. The card reads the
+ * snapshot out of host memory as soon as the upper half of SNAPSHOT_ADDR_REG
+ * is written, before it answers the read that follows, and cleaning a virtine
+ * is the card writing that snapshot over it. Both directions are timed end to
+ * end, with the MMIO that starts them, so the smallest sizes mostly measure
+ * the exits. */
+static int echo_bench_dma(struct fpga_echo_device *fpga) {
+        struct device *dev = &fpga->pdev->dev;
+        u32 max_size = clamp_t(u32, fpga->dma_max_size, PAGE_SIZE,
+                               PAGE_SIZE << (NR_ECHO_DMA_SIZES - 1));
+        u32 n = fpga->run_dma_iterations;
+        u32 old_batch_factor, old_cq_mode, produced, i;
+        struct echo_dma_result *result;
+        dma_addr_t src_dma, dst_dma;
+        void *src, *dst;
+        u64 size, start, elapsed;
+        int error = 0;
+
+        fpga->nr_dma = 0;
+        src = dma_alloc_coherent(dev, max_size, &src_dma, GFP_KERNEL);
+        if(!src) {
+                return -ENOMEM;
+        }
+        dst = dma_alloc_coherent(dev, max_size, &dst_dma, GFP_KERNEL);
+        if(!dst) {
+                error = -ENOMEM;
+                goto could_not_alloc_dst;
+        }
+        for(i = 0; i < max_size / sizeof(u32); i++) {
+                ((u32 *) src)[i] = i ^ 0x5a5a5a5a;
+        }
+
+        /* Read the CQ in bulk so it can be acknowledged in one write, and only
+         * have the card interrupt once per batch. */
+        old_cq_mode = ioread32(fpga->dev_mem + CQ_MODE_REG);
+        old_batch_factor = ioread32(fpga->dev_mem + BATCH_FACTOR_REG);
+        iowrite32(CQ_MODE_BULK, fpga->dev_mem + CQ_MODE_REG);
+        if(ioread32(fpga->dev_mem + CQ_MODE_REG) != CQ_MODE_BULK) {
+                error = -EOPNOTSUPP;
+                goto could_not_set_cq_mode;
+        }
+        iowrite32(ECHO_DMA_BATCH, fpga->dev_mem + BATCH_FACTOR_REG);
+        produced = ioread32(fpga->dev_mem + CQ_PRODUCED_REG);
+        iowrite32(produced, fpga->dev_mem + CQ_CONSUMED_REG);
+
+        for(size = PAGE_SIZE; size <= max_size; size <<= 1) {
+                result = &fpga->dma[fpga->nr_dma];
+                memset(result, 0, sizeof(*result));
+                result->size = size;
+
+                lo_hi_writeq(size, fpga->dev_mem + SNAPSHOT_SIZE_REG);
+                start = ktime_get_ns();
+                for(i = 0; i < n; i++) {
+                        lo_hi_writeq(src_dma, fpga->dev_mem + SNAPSHOT_ADDR_REG);
+                        ioread32(fpga->dev_mem + SNAPSHOT_SIZE_REG);
+                }
+                elapsed = ktime_get_ns() - start;
+                result->to_card_ns = div_u64(elapsed, n);
+                result->to_card_mbps = echo_mbps(size * n, elapsed);
+
+                memset(dst, 0, size);
+                start = ktime_get_ns();
+                error = echo_dma_from_card(fpga, dst_dma, n, &produced);
+                elapsed = ktime_get_ns() - start;
+                if(error) {
+                        dev_err(dev, "Card did not finish %llu-byte transfers\n", size);
+                        break;
+                }
+                result->from_card_ns = div_u64(elapsed, n);
+                result->from_card_mbps = echo_mbps(size * n, elapsed);
+                result->verified = !memcmp(src, dst, size);
+                fpga->nr_dma++;
+                cond_resched();
+        }
+
+        iowrite32(old_batch_factor, fpga->dev_mem + BATCH_FACTOR_REG);
+could_not_set_cq_mode:
+        iowrite32(old_cq_mode, fpga->dev_mem + CQ_MODE_REG);
+        dma_free_coherent(dev, max_size, dst, dst_dma);
+could_not_alloc_dst:
+        dma_free_coherent(dev, max_size, src, src_dma);
+        return error;
+}
+
+static void echo_bench(struct fpga_echo_device *fpga) {
+        u8 __iomem *mappings[NR_ECHO_MAPPINGS] = { fpga->dev_mem, fpga->dev_mem_wc };
+        unsigned int map, w;
+
+        fpga->run_iterations = max_t(u32, fpga->iterations, 1);
+        fpga->run_dma_iterations = max_t(u32, fpga->dma_iterations, 1);
+        for(map = 0; map < NR_ECHO_MAPPINGS; map++) {
+                for(w = 0; w < NR_ECHO_WIDTHS; w++) {
+                        echo_bench_mmio(fpga, mappings[map], echo_widths[w],
+                                        &fpga->mmio[map][w]);
+                        cond_resched();
+                }
+        }
+        fpga->dma_error = echo_bench_dma(fpga);
+        fpga->have_results = true;
+}
+
+static int echo_results_show(struct seq_file *s, void *unused) {
+        struct fpga_echo_device *fpga = s->private;
+        const struct echo_mmio_result *mmio;
+        const struct echo_dma_result *dma;
+        unsigned int map, w, i;
+
+        mutex_lock(&fpga->bench_lock);
+        if(!fpga->have_results) {
+                seq_puts(s, "No results yet, write 1 to run\n");
+                goto out;
+        }
+
+        seq_printf(s, "# MMIO to SCRATCH_REG, %u accesses each\n", fpga->run_iterations);
+        seq_puts(s, "map\tbits\tread_ns\tread_min_ns\twrite_ns\tposted_ns\tread_MB/s\twrite_MB/s\tmismatches\n");
+        for(map = 0; map < NR_ECHO_MAPPINGS; map++) {
+                for(w = 0; w < NR_ECHO_WIDTHS; w++) {
+                        mmio = &fpga->mmio[map][w];
+                        seq_printf(s, "%s\t%u\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%u\n",
+                                   echo_mapping_names[map], echo_widths[w] * 8,
+                                   mmio->read_ns, mmio->read_min_ns, mmio->write_ns,
+                                   mmio->posted_ns, mmio->read_mbps, mmio->write_mbps,
+                                   mmio->mismatches);
+                }
+        }
+
+        seq_printf(s, "# DMA, %u transfers each\n", fpga->run_dma_iterations);
+        if(fpga->dma_error) {
+                seq_printf(s, "# Stopped early with error %d\n", fpga->dma_error);
+        }
+        seq_puts(s, "bytes\tto_card_ns\tto_card_MB/s\tfrom_card_ns\tfrom_card_MB/s\tverified\n");
+        for(i = 0; i < fpga->nr_dma; i++) {
+                dma = &fpga->dma[i];
+                seq_printf(s, "%llu\t%llu\t%llu\t%llu\t%llu\t%s\n", dma->size,
+                           dma->to_card_ns, dma->to_card_mbps, dma->from_card_ns,
+                           dma->from_card_mbps, dma->verified ? "yes" : "no");
+        }
+out:
+        mutex_unlock(&fpga->bench_lock);
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(echo_results);
+
+// Writing anything true to run runs every benchmark, and returns once done
+static ssize_t echo_run_write(struct file *file, const char __user *buf,
+                              size_t count, loff_t *ppos) {
+        struct fpga_echo_device *fpga = file->private_data;
+        bool run;
+        int error;
+
+        error = kstrtobool_from_user(buf, count, &run);
+        if(error) {
+                return error;
+        }
+        if(run) {
+                if(mutex_lock_interruptible(&fpga->bench_lock)) {
+                        return -ERESTARTSYS;
+                }
+                echo_bench(fpga);
+                mutex_unlock(&fpga->bench_lock);
+        }
+        return count;
+}
+
+static const struct file_operations echo_run_fops = {
+        .owner = THIS_MODULE,
+        .open = simple_open,
+        .write = echo_run_write,
+        .llseek = noop_llseek,
+};
+
+static void echo_create_debugfs(struct fpga_echo_device *fpga) {
+        fpga->debugfs = debugfs_create_dir(pci_name(fpga->pdev), echo_debugfs_dir);
+        debugfs_create_file("run", 0200, fpga->debugfs, fpga, &echo_run_fops);
+        debugfs_create_file("results", 0444, fpga->debugfs, fpga, &echo_results_fops);
+        debugfs_create_u32("iterations", 0644, fpga->debugfs, &fpga->iterations);
+        debugfs_create_u32("dma_iterations", 0644, fpga->debugfs, &fpga->dma_iterations);
+        debugfs_create_u32("dma_max_size", 0644, fpga->debugfs, &fpga->dma_max_size);
+        debugfs_create_atomic_t("irqs", 0444, fpga->debugfs, &fpga->irqs);
+}
+
 /*
  * @brief When a new PCIe device is detected by the kernel (either newly inserted
  * or at boot), the kernel will iterate over all the (struct pci_driver)::probe
@@ -97,9 +474,45 @@ static int echo_probe(struct pci_dev *dev, const struct pci_device_id *id) {
                 release_device(dev);
                 return -ENOMEM;
         }
+        fpga->pdev = dev;
+        fpga->iterations = ECHO_DEFAULT_ITERATIONS;
+        fpga->dma_iterations = ECHO_DEFAULT_DMA_ITERATIONS;
+        fpga->dma_max_size = ECHO_DEFAULT_DMA_MAX_SIZE;
+        mutex_init(&fpga->bench_lock);
+        init_waitqueue_head(&fpga->irq_wait);
 
-        /* Remap BAR to the local pointer */
-        fpga->dev_mem = ioremap(dev_mmio_start, dev_mmio_len);
+        /* Remap BAR to the local pointer, once uncached like fpga_char does,
+         * and once more write-combining to compare against. */
+        fpga->dev_mem = ioremap_uc(dev_mmio_start, dev_mmio_len);
+        if(!fpga->dev_mem) {
+                error = -ENOMEM;
+                goto could_not_ioremap;
+        }
+        fpga->dev_mem_wc = ioremap_wc(dev_mmio_start, PAGE_ALIGN(SCRATCH_REG + sizeof(u64)));
+        if(!fpga->dev_mem_wc) {
+                error = -ENOMEM;
+                goto could_not_ioremap_wc;
+        }
+
+        /* The card DMAs to and from host memory, and interrupts once it has
+         * cleaned a batch of virtines. */
+        error = dma_set_mask_and_coherent(&dev->dev, DMA_BIT_MASK(64));
+        if(error) {
+                error = dma_set_mask_and_coherent(&dev->dev, DMA_BIT_MASK(32));
+        }
+        if(error) {
+                goto could_not_set_dma_mask;
+        }
+        pci_set_master(dev);
+        error = pci_alloc_irq_vectors(dev, 1, 1, PCI_IRQ_MSI);
+        if(error < 1) {
+                goto could_not_set_dma_mask;
+        }
+        fpga->irq = pci_irq_vector(dev, 0);
+        error = request_irq(fpga->irq, echo_irq, 0, "pcie_fpga_echo", fpga);
+        if(error) {
+                goto could_not_request_irq;
+        }
 
         /* Defined in pci.h. Adds pointer to private struct to the DEVICE
          * struct that backs all other (sub)types device structs. */
@@ -113,9 +526,30 @@ static int echo_probe(struct pci_dev *dev, const struct pci_device_id *id) {
                fpga->vendor_id, fpga->device_id);
 
         /* As this is a testing module, we call the function to test if the device
-         * was set up and works properly at the end of the probe function. */
+         * was set up and works properly at the end of the probe function.
+         * The benchmarks take a while, so they only run when asked to through
+         * debugfs. */
         error = run_test(dev);
         printk(KERN_INFO "Result of test is: %d. (0 = Good, else bad).", error);
+        if(error) {
+                error = -EIO;
+                goto test_failed;
+        }
+        echo_create_debugfs(fpga);
+        return 0;
+
+test_failed:
+        pci_set_drvdata(dev, NULL);
+        free_irq(fpga->irq, fpga);
+could_not_request_irq:
+        pci_free_irq_vectors(dev);
+could_not_set_dma_mask:
+        iounmap(fpga->dev_mem_wc);
+could_not_ioremap_wc:
+        iounmap(fpga->dev_mem);
+could_not_ioremap:
+        kfree(fpga);
+        release_device(dev);
         return error;
 };
 
@@ -125,6 +559,12 @@ static int echo_probe(struct pci_dev *dev, const struct pci_device_id *id) {
 static void echo_remove(struct pci_dev *dev) {
         struct fpga_echo_device *fpga = pci_get_drvdata(dev);
         if(fpga) {
+                // Waits out a run in progress through its file
+                debugfs_remove_recursive(fpga->debugfs);
+                free_irq(fpga->irq, fpga);
+                pci_free_irq_vectors(dev);
+                iounmap(fpga->dev_mem_wc);
+                iounmap(fpga->dev_mem);
                 kfree(fpga);
         }
 
@@ -139,16 +579,26 @@ void release_device(struct pci_dev *dev) {
 }
 
 static int __init echo_init(void) {
+        int error;
+
         printk(KERN_INFO "PCIe FPGA Echo starting\n");
 
+        // Nothing in debugfs is needed to probe, so failing there is fine
+        echo_debugfs_dir = debugfs_create_dir("pcie_fpga_echo", NULL);
+
         /* Register the fpga_driver struct with the kernel fields that handle
          * this. The function returns a negative value on errors. */
-        return pci_register_driver(&fpga_driver);
+        error = pci_register_driver(&fpga_driver);
+        if(error) {
+                debugfs_remove_recursive(echo_debugfs_dir);
+        }
+        return error;
 }
 
 static void __exit echo_exit(void) {
         printk(KERN_INFO "PCIe FPGA Echo exiting\n");
         pci_unregister_driver(&fpga_driver);
+        debugfs_remove_recursive(echo_debugfs_dir);
 }
 
 void write_sample_data(struct pci_dev *dev, unsigned int data) {
@@ -157,8 +607,8 @@ void write_sample_data(struct pci_dev *dev, unsigned int data) {
                 return;
         }
 
-        /* Write 32 bits of data to the device's memory. */
-        iowrite32(data, fpga->dev_mem);
+        /* Write 32 bits of data to the device's scratch register. */
+        iowrite32(data, fpga->dev_mem + SCRATCH_REG);
 }
 
 void read_sample_data(struct pci_dev *dev, unsigned int *data) {
@@ -167,8 +617,8 @@ void read_sample_data(struct pci_dev *dev, unsigned int *data) {
                 return;
         }
 
-        /* Read 32 bits of data from device's memory. */
-        *data = ioread32(fpga->dev_mem);
+        /* Read 32 bits of data from device's scratch register. */
+        *data = ioread32(fpga->dev_mem + SCRATCH_REG);
         return;
 }
 
@@ -187,5 +637,5 @@ int run_test(struct pci_dev *dev) {
 module_init(echo_init);
 module_exit(echo_exit);
 MODULE_AUTHOR("Karl Hallsby <karl@hallsby.com>");
-MODULE_DESCRIPTION("Write data to PCIe FPGA and device echoes it back out.");
+MODULE_DESCRIPTION("Write data to PCIe FPGA and device echoes it back out, and benchmark its MMIO and DMA.");
 MODULE_LICENSE("GPL");
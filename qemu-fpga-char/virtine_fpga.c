@@ -4,6 +4,7 @@
 #include "hw/pci/pci.h" // Creating PCI devices
 #include "hw/pci/msi.h" // MSI interrupts
 #include "qemu/event_notifier.h"
+#include "qemu/timer.h" // Stage timestamps
 
 /* This struct completely defines what the emulated device should have in
  * terms of hardware and signals.
@@ -33,6 +34,12 @@
  * |               .....               |
  * +-----------------------------------+
  * |            Batch Factor           |
+ * +-----------------------------------+
+ * |               .....               |
+ * +-----------------------------------+
+ * |        CQ Slot 1 Timestamps       |
+ * +-----------------------------------+
+ * |               .....               |
  * +-----------------------------------+ */
 
 #define MMIO_BASE_ADDR 0x0
@@ -51,11 +58,74 @@
 #define MAX_NUM_VIRTINES_REG BATCH_FACTOR_REG + sizeof(unsigned long)
 #define SNAPSHOT_SIZE_REG MAX_NUM_VIRTINES_REG + sizeof(unsigned long)
 #define SNAPSHOT_ADDR_REG SNAPSHOT_SIZE_REG + sizeof(unsigned long)
+#define CQ_MODE_REG SNAPSHOT_ADDR_REG + sizeof(unsigned long)
+#define CQ_PRODUCED_REG CQ_MODE_REG + sizeof(unsigned long)
+#define CQ_CONSUMED_REG CQ_PRODUCED_REG + sizeof(unsigned long)
+#define RING_STATUS_REG CQ_CONSUMED_REG + sizeof(unsigned long)
+#define RQ_FREE_REG RING_STATUS_REG + sizeof(unsigned long)
+#define CQ_STAMP_BASE (RQ_FREE_REG + sizeof(unsigned long))
+#define CQ_STAMP_END (CQ_STAMP_BASE + (NUM_POSSIBLE_VIRTINES * sizeof(struct virtine_stamps)))
+#define RING_INDEX_REG CQ_STAMP_END
+#define SCRATCH_REG RING_INDEX_REG + sizeof(unsigned long)
+
+/* CQ_MODE_REG values. In pop mode, every read of CQ_HEAD_OFFSET_REG pops an
+ * entry. In bulk mode, the host instead reads CQ_PRODUCED_REG, copies the ready
+ * entries straight out of the CQ window, and frees them by writing how many it
+ * has consumed in total to CQ_CONSUMED_REG. Both counters are free-running, and
+ * entry N always lives in slot N % NUM_POSSIBLE_VIRTINES. */
+#define CQ_MODE_POP 0
+#define CQ_MODE_BULK 1
+
+/* RING_STATUS_REG bits. RQ_FULL and CQ_FULL reflect the rings right now.
+ * RQ_DROPPED is sticky: it is set when the host wrote to a full RQ and the entry
+ * was thrown away, and stays set until the host writes the bit back. */
+#define RING_STATUS_RQ_FULL (1 << 0)
+#define RING_STATUS_CQ_FULL (1 << 1)
+#define RING_STATUS_RQ_DROPPED (1 << 2)
+
+/* RING_INDEX_REG packs the slot each ring's HEAD and TAIL point at into one
+ * 32-bit read, so they can be watched without popping anything. HEAD == TAIL
+ * is an empty ring, unless RING_STATUS_REG says it is full. */
+#define RING_INDEX_RQ_HEAD_SHIFT 0
+#define RING_INDEX_RQ_TAIL_SHIFT 8
+#define RING_INDEX_CQ_HEAD_SHIFT 16
+#define RING_INDEX_CQ_TAIL_SHIFT 24
+
+/* SCRATCH_REG is 64 bits of plain storage that does nothing when it is read or
+ * written. It is what pcie-echo times MMIO accesses against, so accesses to it
+ * are not logged; printing would take far longer than the exit itself. It can
+ * also be read and written 1 or 2 bytes at a time, which only ever touches its
+ * low bytes. */
+#define SCRATCH_LOGGED(addr) ((addr) < SCRATCH_REG || (addr) >= SCRATCH_REG + sizeof(uint64_t))
 
 #define PCI_CLASS_COPROCESSOR 0x12
 
+/* Largest snapshot the card will latch. The size comes straight from the
+ * guest, so anything bigger, and a size of 0, is ignored and the old snapshot
+ * is kept. */
+#define MAX_SNAPSHOT_SIZE (64 * MiB)
+
 #define PROCESSING 0
 
+/* When a virtine went through each stage of the card, in ns of
+ * QEMU_CLOCK_VIRTUAL, and how many bytes of snapshot were restored into it.
+ * Every CQ slot has one of these, readable at CQ_STAMP_BASE in the same slot
+ * order as the CQ window, so the host can tell queueing from service time for
+ * each virtine it reaps. virtine says which virtine the stamps are
+ * for, in case the slot was reused before the host got to it. A stage that
+ * never happened (a virtine taken off the RQ before any doorbell, or reaped by
+ * polling before an MSI) stays 0. */
+struct virtine_stamps {
+    uint64_t virtine;
+    uint64_t enqueue; // Written onto the RQ
+    uint64_t doorbell; // First doorbell after that
+    uint64_t dequeue; // Taken off the RQ by the cleanup thread
+    uint64_t dma_start;
+    uint64_t dma_end;
+    uint64_t msi; // First MSI after it was put on the CQ
+    uint64_t bytes;
+};
+
 struct virtine_ring_queue {
     hwaddr *base_addr; // Also referred to as BASE
     hwaddr *head_offset; // Also referred to as HEAD
@@ -69,6 +139,8 @@ static hwaddr* next_element(struct virtine_ring_queue *queue, hwaddr *p);
 static hwaddr* peek_previous_element(struct virtine_ring_queue *queue, hwaddr *p) __attribute__((unused));
 static hwaddr pop_head(struct virtine_ring_queue *queue);
 static hwaddr* insert_tail(struct virtine_ring_queue *queue, hwaddr to_insert);
+static inline bool queue_full(struct virtine_ring_queue *queue);
+static uint32_t queue_count(struct virtine_ring_queue *queue);
 
 typedef struct VirtineFpgaDevice {
     PCIDevice pdev;
@@ -106,15 +178,34 @@ typedef struct VirtineFpgaDevice {
 
     // Completed Queue (CQ) Stuff
     struct virtine_ring_queue cq;
+    uint32_t cq_mode;
+    uint32_t cq_produced; // Entries ever inserted into the CQ
+    uint32_t cq_consumed; // Entries ever removed from the CQ
+    bool rq_dropped; // Sticky RING_STATUS_RQ_DROPPED
+
+    /* Stage timestamps. rq_stamps follow the RQ slots until a virtine is
+     * dequeued, after which they move to the CQ slot it is posted to. Entries
+     * from msi_stamped up to cq_produced have not been covered by an MSI yet.
+     * All covered by processing_lock. */
+    struct virtine_stamps rq_stamps[NUM_POSSIBLE_VIRTINES];
+    struct virtine_stamps cq_stamps[NUM_POSSIBLE_VIRTINES];
+    uint32_t msi_stamped;
 
     uint32_t irq_status;
     // Only raise interrupt if cleaned >= batchFactor virtines
     uint32_t batch_factor; // NOTE: For development, set batchFactor = 1
     uint32_t num_virtines_cleaned_already;
 
-    // Store restoration snapshot
+    /* Store restoration snapshot. The host hands us the PCI (DMA) address of
+     * the snapshot, and the card latches a copy of it into its own memory when
+     * the upper half of that address is written. snapshot_size is the
+     * register, snapshot_len the size of what was actually latched. */
     uint64_t snapshot_size;
-    hwaddr *snapshot_addr;
+    hwaddr snapshot_addr;
+    uint8_t *snapshot;
+    uint64_t snapshot_len;
+
+    uint64_t scratch;
 
     // Used for cleaning up co-processor thread before QEMU device is uninit-ed
     bool stopping;
@@ -169,7 +260,16 @@ static uint64_t virtine_fpga_mmio_read(void *opaque, hwaddr addr, unsigned size)
     case CQ_HEAD_OFFSET_REG:
         printf("Virtine FPGA: Read from CQ_HEAD_OFFSET_REG\n");
         qemu_mutex_lock(&fpga->processing_lock);
-        split_return = pop_head(&fpga->cq);
+        if(fpga->cq_mode == CQ_MODE_BULK) {
+            split_return = *fpga->cq.head_offset; // Peek, the host acks later
+        } else {
+            split_return = pop_head(&fpga->cq);
+            if(split_return) {
+                fpga->cq_consumed += 1;
+                // Cleanup may be parked waiting for CQ space
+                qemu_cond_signal(&fpga->processing_condition);
+            }
+        }
         qemu_mutex_unlock(&fpga->processing_lock);
         val = split_return;
         break;
@@ -206,17 +306,76 @@ static uint64_t virtine_fpga_mmio_read(void *opaque, hwaddr addr, unsigned size)
         break;
     case SNAPSHOT_ADDR_REG:
         printf("Virtine FPGA: Returning hwaddr of virtine snapshot\n");
-        val = (uint64_t) fpga->snapshot_addr;
+        val = (uint32_t) fpga->snapshot_addr;
         break;
     case (SNAPSHOT_ADDR_REG + 4):
-        val = (uint64_t) fpga->snapshot_addr >> 32;
+        val = fpga->snapshot_addr >> 32;
+        break;
+    case CQ_MODE_REG:
+        val = fpga->cq_mode;
+        break;
+    case CQ_PRODUCED_REG:
+        qemu_mutex_lock(&fpga->processing_lock);
+        val = fpga->cq_produced;
+        qemu_mutex_unlock(&fpga->processing_lock);
+        break;
+    case CQ_CONSUMED_REG:
+        val = fpga->cq_consumed;
+        break;
+    case RING_STATUS_REG:
+        qemu_mutex_lock(&fpga->processing_lock);
+        val = (queue_full(&fpga->rq) ? RING_STATUS_RQ_FULL : 0) |
+              (queue_full(&fpga->cq) ? RING_STATUS_CQ_FULL : 0) |
+              (fpga->rq_dropped ? RING_STATUS_RQ_DROPPED : 0);
+        qemu_mutex_unlock(&fpga->processing_lock);
+        break;
+    case RQ_FREE_REG:
+        qemu_mutex_lock(&fpga->processing_lock);
+        val = NUM_POSSIBLE_VIRTINES - queue_count(&fpga->rq);
+        qemu_mutex_unlock(&fpga->processing_lock);
+        break;
+    case RING_INDEX_REG:
+        qemu_mutex_lock(&fpga->processing_lock);
+        val = ((uint32_t) (fpga->rq.head_offset - fpga->rq.base_addr) << RING_INDEX_RQ_HEAD_SHIFT) |
+              ((uint32_t) (fpga->rq.tail_offset - fpga->rq.base_addr) << RING_INDEX_RQ_TAIL_SHIFT) |
+              ((uint32_t) (fpga->cq.head_offset - fpga->cq.base_addr) << RING_INDEX_CQ_HEAD_SHIFT) |
+              ((uint32_t) (fpga->cq.tail_offset - fpga->cq.base_addr) << RING_INDEX_CQ_TAIL_SHIFT);
+        qemu_mutex_unlock(&fpga->processing_lock);
+        break;
+    case SCRATCH_REG:
+        val = (size == 8) ? fpga->scratch : (uint32_t) fpga->scratch;
+        break;
+    case (SCRATCH_REG + 4):
+        val = fpga->scratch >> 32;
         break;
     default:
+        if((addr >= CQ_STAMP_BASE) && (addr < CQ_STAMP_END)) {
+            /* Whole 64-bit stamps, or one 32-bit half at a time, like the CQ
+             * window. */
+            uint64_t stamp;
+            qemu_mutex_lock(&fpga->processing_lock);
+            memcpy(&stamp, (uint8_t *) fpga->cq_stamps +
+                   ((addr - CQ_STAMP_BASE) & ~(sizeof(uint64_t) - 1)), sizeof(stamp));
+            qemu_mutex_unlock(&fpga->processing_lock);
+            val = ((addr - CQ_STAMP_BASE) % sizeof(uint64_t)) ? stamp >> 32 :
+                  (size == 8) ? stamp : (uint32_t) stamp;
+            break;
+        }
+        if((addr >= CQ_BASE_ADDR) &&
+           (addr < CQ_BASE_ADDR + (NUM_POSSIBLE_VIRTINES * sizeof(hwaddr)))) {
+            /* The CQ window can be read like plain memory, either whole
+             * entries or one 32-bit half at a time. Reads never pop. */
+            hwaddr entry = fpga->cq.buffer[(addr - (CQ_BASE_ADDR)) / sizeof(hwaddr)];
+            val = ((addr - (CQ_BASE_ADDR)) % sizeof(hwaddr)) ? entry >> 32 : entry;
+            break;
+        }
         printf("Unknown read address. Failing!\n");
         break;
     }
 
-    printf("Virtine FPGA: READ %lu (0x%lx) from 0x%lx of size %u\n", val, val, addr, size);
+    if(SCRATCH_LOGGED(addr)) {
+        printf("Virtine FPGA: READ %lu (0x%lx) from 0x%lx of size %u\n", val, val, addr, size);
+    }
     return val;
 }
 
@@ -226,7 +385,9 @@ static uint64_t virtine_fpga_mmio_read(void *opaque, hwaddr addr, unsigned size)
 static void virtine_fpga_mmio_write(void *opaque, hwaddr addr, uint64_t val,
                                     unsigned size)
 {
-    printf("Virtine FPGA: WRITE %lu (0x%lx) to 0x%lx of size %u\n", val, val, addr, size);
+    if(SCRATCH_LOGGED(addr)) {
+        printf("Virtine FPGA: WRITE %lu (0x%lx) to 0x%lx of size %u\n", val, val, addr, size);
+    }
     VirtineFpgaDevice *fpga = opaque;
 
     static hwaddr split_write = 0;
@@ -252,7 +413,17 @@ static void virtine_fpga_mmio_write(void *opaque, hwaddr addr, uint64_t val,
         printf("Virtine FPGA: Val to write to RQ @ %p: 0x%lx\n", fpga->rq.tail_offset,
                split_write);
         qemu_mutex_lock(&fpga->processing_lock);
-        insert_tail(&fpga->rq, split_write);
+        if(queue_full(&fpga->rq)) {
+            printf("Virtine FPGA: RQ full, dropping 0x%lx\n", split_write);
+            fpga->rq_dropped = true;
+        } else {
+            struct virtine_stamps *stamps =
+                &fpga->rq_stamps[fpga->rq.tail_offset - fpga->rq.base_addr];
+            memset(stamps, 0, sizeof(*stamps));
+            stamps->virtine = split_write;
+            stamps->enqueue = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            insert_tail(&fpga->rq, split_write);
+        }
         qemu_mutex_unlock(&fpga->processing_lock);
         break;
     case CQ_BASE_ADDR:
@@ -271,28 +442,105 @@ static void virtine_fpga_mmio_write(void *opaque, hwaddr addr, uint64_t val,
         printf("Virtine FPGA: Write to BATCH_FACTOR_REG with value %lu\n", val);
         fpga->batch_factor = val;
         break;
-    case DOORBELL_REG:
+    case DOORBELL_REG: {
         printf("Virtine FPGA: Ringing Doorbell to start clean-up\n");
+        // Everything on the RQ that had not been rung for yet is now
+        uint64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        qemu_mutex_lock(&fpga->processing_lock);
+        uint32_t nr = queue_count(&fpga->rq);
+        uint32_t slot = fpga->rq.head_offset - fpga->rq.base_addr;
+        while(nr--) {
+            if(!fpga->rq_stamps[slot].doorbell) {
+                fpga->rq_stamps[slot].doorbell = now;
+            }
+            slot = (slot + 1) % NUM_POSSIBLE_VIRTINES;
+        }
+        qemu_mutex_unlock(&fpga->processing_lock);
         /* Can set to PROCESSING as many times as you want. Will be set to 0
          * inside the processing_lock exclusion zone in virtine_fpga_virtine_cleanup. */
         qatomic_set(&fpga->doorbell, true);
         qemu_cond_signal(&fpga->processing_condition);
         break;
+    }
     case MAX_NUM_VIRTINES_REG:
         printf("Virtine FPGA: Writing max num virtines that can be handled. Failing.\n");
         break;
+    case CQ_MODE_REG:
+        printf("Virtine FPGA: Setting CQ mode to %lu\n", val);
+        fpga->cq_mode = (val == CQ_MODE_BULK) ? CQ_MODE_BULK : CQ_MODE_POP;
+        break;
+    case CQ_CONSUMED_REG: {
+        /* Free every entry up to the host's new consumed count. Never free
+         * more than is actually in the CQ. */
+        qemu_mutex_lock(&fpga->processing_lock);
+        uint32_t to_free = (uint32_t) val - fpga->cq_consumed;
+        if(to_free > fpga->cq_produced - fpga->cq_consumed) {
+            printf("Virtine FPGA: Host consumed past the CQ tail. Failing.\n");
+        } else {
+            while(to_free--) {
+                pop_head(&fpga->cq);
+                fpga->cq_consumed += 1;
+            }
+            qemu_cond_signal(&fpga->processing_condition);
+        }
+        qemu_mutex_unlock(&fpga->processing_lock);
+        break;
+    }
+    case RING_STATUS_REG:
+        // Only the sticky bit can be cleared, the others are live state
+        if(val & RING_STATUS_RQ_DROPPED) {
+            qemu_mutex_lock(&fpga->processing_lock);
+            fpga->rq_dropped = false;
+            qemu_mutex_unlock(&fpga->processing_lock);
+        }
+        break;
+    case RQ_FREE_REG:
+        printf("Virtine FPGA: Attempt to write to RQ_FREE_REG. Failing.\n");
+        break;
+    case RING_INDEX_REG:
+        printf("Virtine FPGA: Attempt to write to RING_INDEX_REG. Failing.\n");
+        break;
+    case SCRATCH_REG:
+        fpga->scratch = (size == 8) ? val :
+                        (fpga->scratch & ~0xffffffffULL) | (uint32_t) val;
+        break;
+    case (SCRATCH_REG + 4):
+        fpga->scratch = (fpga->scratch & 0xffffffffULL) | (val << 32);
+        break;
     case SNAPSHOT_SIZE_REG:
         printf("Virtine FPGA: Setting size of virtine snapshot\n");
         fpga->snapshot_size = val;
         break;
+    case (SNAPSHOT_SIZE_REG + 4):
+        fpga->snapshot_size |= val << 32;
+        break;
     case SNAPSHOT_ADDR_REG:
         printf("Virtine FPGA: Storing hwaddr of virtine snapshot\n");
-        fpga->snapshot_addr = (hwaddr *) val;
+        fpga->snapshot_addr = val;
         break;
     case (SNAPSHOT_ADDR_REG + 4): {
         // Bit shift upper 4 bytes to correct position and bitwise OR old number together
-        uint64_t temp = (uint64_t) fpga->snapshot_addr;
-        fpga->snapshot_addr = (hwaddr *) ((val << 32) | temp);
+        fpga->snapshot_addr = (val << 32) | fpga->snapshot_addr;
+        /* The whole address is known, so pull the snapshot onto the card.
+         * This goes through pci_dma_read, so it is translated by a guest
+         * IOMMU (-device intel-iommu) if there is one. */
+        if(!fpga->snapshot_size || fpga->snapshot_size > MAX_SNAPSHOT_SIZE) {
+            printf("Virtine FPGA: Snapshot size %lu out of range. Ignoring!\n",
+                   fpga->snapshot_size);
+            break;
+        }
+        uint8_t *snapshot = g_try_malloc(fpga->snapshot_size);
+        if(!snapshot) {
+            printf("Virtine FPGA: No memory for a %lu byte snapshot. Ignoring!\n",
+                   fpga->snapshot_size);
+            break;
+        }
+        pci_dma_read(&fpga->pdev, fpga->snapshot_addr, snapshot, fpga->snapshot_size);
+        qemu_mutex_lock(&fpga->processing_lock);
+        g_free(fpga->snapshot);
+        fpga->snapshot = snapshot;
+        fpga->snapshot_len = fpga->snapshot_size;
+        qemu_mutex_unlock(&fpga->processing_lock);
         break;
     }
     default:
@@ -300,6 +548,9 @@ static void virtine_fpga_mmio_write(void *opaque, hwaddr addr, uint64_t val,
            (addr < CQ_BASE_ADDR + NUM_POSSIBLE_VIRTINES)) {
             printf("Virtine FPGA: Attempt to write to Clean Virtine Queue. Failing.\n");
         }
+        else if((addr >= CQ_STAMP_BASE) && (addr < CQ_STAMP_END)) {
+            printf("Virtine FPGA: Attempt to write to CQ timestamps. Failing.\n");
+        }
         else {
             printf("Unknown write address. Failing!\n");
         }
@@ -313,8 +564,10 @@ static const MemoryRegionOps virtine_fpga_mmio_ops = {
     .write = virtine_fpga_mmio_write,
     .endianness = DEVICE_NATIVE_ENDIAN,
     // NOTE: Values below are in BYTES!
+    /* Narrower accesses are widened to 4 bytes by QEMU before they get here,
+     * so only SCRATCH_REG makes sense of them. */
     .valid = {
-        .min_access_size = 4,
+        .min_access_size = 1,
         .max_access_size = 8,
     },
     .impl = {
@@ -323,9 +576,53 @@ static const MemoryRegionOps virtine_fpga_mmio_ops = {
     },
 };
 
+/* Interrupt the host for everything on the CQ, and stamp the entries that
+ * had not been covered by an MSI yet with when it was raised.
+ * Called with processing_lock held. */
+static void virtine_fpga_raise_msi(VirtineFpgaDevice *fpga)
+{
+    qemu_mutex_lock_iothread();
+    msi_notify(&fpga->pdev, 0); // Raise IRQ on device's MSI vector 0
+    qemu_mutex_unlock_iothread();
+
+    uint64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    for(; fpga->msi_stamped != fpga->cq_produced; fpga->msi_stamped++) {
+        fpga->cq_stamps[fpga->msi_stamped % NUM_POSSIBLE_VIRTINES].msi = now;
+    }
+}
+
+/* Pop the next virtine to clean off of the RQ, or 0 if there is nothing left
+ * to do. A virtine is only taken once there is room to post it to the CQ. While
+ * the CQ is full, interrupt the host for what is already there and sleep until
+ * it frees some entries, instead of silently dropping finished virtines.
+ * The virtine's stamps so far are copied to STAMPS.
+ * Called with processing_lock held. */
+static hwaddr next_virtine_to_clean(VirtineFpgaDevice *fpga,
+                                    struct virtine_stamps *stamps)
+{
+    if(!queue_count(&fpga->rq)) {
+        return 0;
+    }
+
+    while(queue_full(&fpga->cq) && !fpga->stopping) {
+        printf("Virtine FPGA: CQ full, waiting for the host to reap\n");
+        virtine_fpga_raise_msi(fpga);
+        fpga->num_virtines_cleaned_already = 0;
+        qemu_cond_wait(&fpga->processing_condition, &fpga->processing_lock);
+    }
+    if(fpga->stopping) {
+        return 0;
+    }
+
+    *stamps = fpga->rq_stamps[fpga->rq.head_offset - fpga->rq.base_addr];
+    stamps->dequeue = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    return pop_head(&fpga->rq);
+}
+
 static void* virtine_fpga_virtine_cleanup(void *opaque)
 {
     VirtineFpgaDevice *fpga = opaque;
+    struct virtine_stamps stamps;
     printf("Virtine FPGA: Starting virtine cleanup co-processor thread!\n");
     while(true) {
         printf("Virtine FPGA: Starting clean-up waiting busy-loop again!\n");
@@ -351,36 +648,36 @@ static void* virtine_fpga_virtine_cleanup(void *opaque)
         printf("Virtine FPGA: Cleaning up virtines!!\n");
 
         // TODO: Convert to do-while loop?
-        hwaddr virtine_to_clean = pop_head(&fpga->rq);
+        hwaddr virtine_to_clean = next_virtine_to_clean(fpga, &stamps);
         while(virtine_to_clean) {
             printf("Virtine FPGA: Cleaning virtine @ 0x%lx\n", virtine_to_clean);
 
             // Copy the snapshot over the old virtine's memory, cleaning the virtine
             // NOTE: QEMU segfaults when dereferencing virtine directly (* operator)
+            stamps.dma_start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
             pci_dma_write(&fpga->pdev, virtine_to_clean,
-                          fpga->snapshot_addr, fpga->snapshot_size);
+                          fpga->snapshot, fpga->snapshot_len);
+            stamps.dma_end = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            stamps.bytes = fpga->snapshot_len;
 
             // Update number of virtines cleaned
             fpga->num_virtines_cleaned_already += 1;
 
-            // Move the clean virtine to clean queue
+            /* Move the clean virtine to clean queue. next_virtine_to_clean only
+             * hands out work once there is a CQ slot for it, so this always
+             * lands. */
+            fpga->cq_stamps[fpga->cq_produced % NUM_POSSIBLE_VIRTINES] = stamps;
             insert_tail(&fpga->cq, (hwaddr) virtine_to_clean);
-            /* TODO: If insert_tail returns == fpga->cq.tail_offset, then raise
-             * interrupt and wait for some of them to be copied out before writing
-             * this newly cleaned virtine to queue. */
+            fpga->cq_produced += 1;
 
             printf("Virtine FPGA: Val @ RQ Base: %lx\n", *fpga->rq.base_addr);
             printf("Virtine FPGA: Val @ RQ HEAD: %lx\n", *fpga->rq.head_offset);
             printf("Virtine FPGA: Val @ CQ HEAD: 0x%lx\n", *fpga->cq.head_offset);
 
-            qatomic_set(&fpga->is_card_processing, false);
-
             // Raise an interrupt to CPU that computation completed
             if(fpga->num_virtines_cleaned_already >= fpga->batch_factor) {
-                qemu_mutex_lock_iothread();
                 printf("Virtine FPGA: Sending MSI notification!\n");
-                msi_notify(&fpga->pdev, 0); // Raise IRQ on device's MSI vector 0
-                qemu_mutex_unlock_iothread();
+                virtine_fpga_raise_msi(fpga);
                 // Reset number of virtines cleaned after raising interrupt
                 /* NOTE: May need to reset number of virtines cleaned already
                  * on the kernel's IRQ handler and have this part of the process
@@ -388,7 +685,18 @@ static void* virtine_fpga_virtine_cleanup(void *opaque)
                  * out of the FPGA. */
                 fpga->num_virtines_cleaned_already = 0;
             }
-            virtine_to_clean = pop_head(&fpga->rq);
+            virtine_to_clean = next_virtine_to_clean(fpga, &stamps);
+        }
+        // Busy for as long as there was anything on the RQ
+        qatomic_set(&fpga->is_card_processing, false);
+
+        /* The RQ ran dry before a whole batch was cleaned. Report what is
+         * there now rather than holding it until more work shows up, which
+         * may never happen. */
+        if(fpga->num_virtines_cleaned_already) {
+            printf("Virtine FPGA: RQ drained, sending MSI notification!\n");
+            virtine_fpga_raise_msi(fpga);
+            fpga->num_virtines_cleaned_already = 0;
         }
         qemu_mutex_unlock(&fpga->processing_lock);
         // Repeat this forever, until the FPGA start stopping.
@@ -427,6 +735,13 @@ static void virtine_fpga_realize(PCIDevice *pci_dev, Error **errp)
     virtine_device->is_card_processing = false;
     virtine_device->batch_factor = 1;
     virtine_device->num_virtines_cleaned_already = 0;
+    virtine_device->cq_mode = CQ_MODE_POP;
+    virtine_device->cq_produced = 0;
+    virtine_device->cq_consumed = 0;
+    virtine_device->rq_dropped = false;
+    memset(virtine_device->rq_stamps, 0, sizeof(virtine_device->rq_stamps));
+    memset(virtine_device->cq_stamps, 0, sizeof(virtine_device->cq_stamps));
+    virtine_device->msi_stamped = 0;
 
     // Set up co-processing thread and its necessary synchronization
     qemu_mutex_init(&virtine_device->processing_lock);
@@ -436,9 +751,11 @@ static void virtine_fpga_realize(PCIDevice *pci_dev, Error **errp)
 
     // Create fake clean restoration virtine image
     virtine_device->snapshot_size = sizeof(uint64_t);
-    hwaddr *clean_state = g_malloc(virtine_device->snapshot_size);
+    uint64_t *clean_state = g_malloc(virtine_device->snapshot_size);
     *clean_state = 0xfeedbeaddeadbeef;
-    virtine_device->snapshot_addr = clean_state;
+    virtine_device->snapshot = (uint8_t *) clean_state;
+    virtine_device->snapshot_len = virtine_device->snapshot_size;
+    virtine_device->snapshot_addr = 0;
 
     printf("Buildroot physical address size: %lu\n", sizeof(hwaddr));
     printf("Virtine FPGA MMIO Addresses:\n");
@@ -454,6 +771,14 @@ static void virtine_fpga_realize(PCIDevice *pci_dev, Error **errp)
     printf("MAX_NUM_VIRTINES_REG: 0x%lx\n", MAX_NUM_VIRTINES_REG);
     printf("SNAPSHOT_SIZE_REG: 0x%lx\n", SNAPSHOT_SIZE_REG);
     printf("SNAPSHOT_ADDR_REG: 0x%lx\n", SNAPSHOT_ADDR_REG);
+    printf("CQ_MODE_REG: 0x%lx\n", CQ_MODE_REG);
+    printf("CQ_PRODUCED_REG: 0x%lx\n", CQ_PRODUCED_REG);
+    printf("CQ_CONSUMED_REG: 0x%lx\n", CQ_CONSUMED_REG);
+    printf("RING_STATUS_REG: 0x%lx\n", RING_STATUS_REG);
+    printf("RQ_FREE_REG: 0x%lx\n", RQ_FREE_REG);
+    printf("CQ_STAMP_BASE: 0x%lx\n", CQ_STAMP_BASE);
+    printf("RING_INDEX_REG: 0x%lx\n", RING_INDEX_REG);
+    printf("SCRATCH_REG: 0x%lx\n", SCRATCH_REG);
 
     printf("\nVirtine FPGA INTERNAL Addresses:\n");
     printf("RQ_HEAD_OFFSET_REG: 0x%p\n", virtine_device->rq.head_offset);
@@ -466,7 +791,7 @@ static void virtine_fpga_realize(PCIDevice *pci_dev, Error **errp)
     printf("CQ_BASE_ADDR: 0x%p\n", virtine_device->cq.base_addr);
     printf("BATCH_FACTOR_REG: 0x%x\n", virtine_device->batch_factor);
     printf("SNAPSHOT_SIZE_REG: 0x%lx\n", virtine_device->snapshot_size);
-    printf("SNAPSHOT_ADDR_REG: 0x%p\n", virtine_device->snapshot_addr);
+    printf("SNAPSHOT_ADDR_REG: 0x%lx\n", virtine_device->snapshot_addr);
     printf("Virtine FPGA loaded\n");
 }
 
@@ -491,7 +816,7 @@ static void virtine_fpga_uninit(PCIDevice *pci_dev)
     qemu_cond_destroy(&virtine_device->processing_condition);
     qemu_mutex_destroy(&virtine_device->processing_lock);
 
-    // TODO: Clean up pointers to virtine snapshot stuff
+    g_free(virtine_device->snapshot);
 
     memory_region_unref(&virtine_device->mmio);
 }
@@ -558,6 +883,24 @@ static inline hwaddr* end_of_queue(struct virtine_ring_queue *queue)
     return &queue->buffer[NUM_POSSIBLE_VIRTINES - 1];
 }
 
+/* A ring is full when HEAD has caught up with TAIL and the slot there still
+ * holds a valid (non-zero) hwaddr. */
+static inline bool queue_full(struct virtine_ring_queue *queue)
+{
+    return (queue->head_offset == queue->tail_offset) &&
+           (*queue->head_offset != 0);
+}
+
+/* Number of entries currently sitting in the ring queue. */
+static uint32_t queue_count(struct virtine_ring_queue *queue)
+{
+    if(queue_full(queue)) {
+        return NUM_POSSIBLE_VIRTINES;
+    }
+    return (queue->tail_offset - queue->head_offset + NUM_POSSIBLE_VIRTINES) %
+           NUM_POSSIBLE_VIRTINES;
+}
+
 /* Validate if pointer p is a pointer to within the ring queue. */
 static inline bool within(hwaddr *p, struct virtine_ring_queue *queue)
 {
@@ -1,61 +1,116 @@
 /*
- * Creates a read-write character device that simply echoes its written input to
- * the output, which can be read.
+ * Creates /dev/virtine_loopback, a character device that speaks the same
+ * submission and completion protocol as /dev/virtine_fpga, but with nothing
+ * behind it. Every virtine submitted is completed on the spot, without its
+ * memory or the snapshot ever being touched, so running the same programs
+ * against both devices separates what the driver interface and userspace cost
+ * from what the card and QEMU cost.
+ *
+ * Each open file has a ring of completions, which can also be mmapped and
+ * consumed without any system calls. uapi/sample_char.h describes it.
  */
 
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/fs.h>
-#include <asm/uaccess.h> // For put_user and get_user
+#include <linux/miscdevice.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/xarray.h>
+#include <linux/uio.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/uaccess.h> // For put_user and get_user
+
+#include "uapi/sample_char.h"
 
 #define MODULE_NAME "SAMPLE_CHAR_DEV"
-#define DRIVER_DESCRIPTION "Sample Character device"
+#define DRIVER_DESCRIPTION "Loopback virtine co-processor character device"
+
+#define DEVICE_NAME "virtine_loopback"
+#define MAX_RING_ENTRIES 65536
+
+static unsigned int ring_entries = 1024;
+module_param(ring_entries, uint, 0444);
+MODULE_PARM_DESC(ring_entries,
+                 "Completions each open file can hold, rounded up to a power of 2 (default: 1024)");
+
+/* Like a card's, the snapshot is shared by every file. Only its size is
+ * kept, to report as the bytes every completion restored. */
+static atomic64_t snapshot_size = ATOMIC64_INIT(sizeof(u64));
 
-#define DEVICE_NAME "echo_chardev"
-#define BUF_LEN 100 // Length of buffer in bytes.
+/* A registered region. Nothing is pinned; submissions are only checked to
+ * fall inside of one, like they are on the real device. */
+struct sample_char_umem {
+        u64 uaddr;
+        u64 size;
+        struct rcu_head rcu;
+};
 
-static int major_num;
-static char msg[BUF_LEN];
-static char *msg_last_char; // Points to last character in string.
+/* Every open file is its own submission context. Submitters are serialized
+ * by submit_lock and are the only ones to move the tail, consumers by
+ * reap_lock and move the head, so the two sides never wait on each other. */
+struct sample_char_file {
+        struct sample_char_ring *ring; // Shared with userspace through mmap
+        u32 mask;
+        u32 tail; // Userspace can scribble over the ring's copy, never trust it
+        struct mutex submit_lock;
+        struct mutex reap_lock;
+        wait_queue_head_t wait; // For completions to reap, and for ring space
+        struct xarray umems;
+};
 
 static int sample_char_open(struct inode *inode, struct file *filep);
 static int sample_char_release(struct inode *inode, struct file *filep);
-static ssize_t sample_char_read(struct file *filep, char *buffer, size_t length,
-                                loff_t *offset);
-static ssize_t sample_char_write(struct file *filep, const char *buffer,
-                                 size_t length, loff_t *offset);
-static loff_t sample_char_llseek(struct file *filep, loff_t off, int whence);
+static ssize_t sample_char_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t sample_char_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static long sample_char_ioctl(struct file *filep, unsigned int cmd, unsigned long args);
+static __poll_t sample_char_poll(struct file *filep, poll_table *wait);
+static int sample_char_mmap(struct file *filep, struct vm_area_struct *vma);
 
 static struct file_operations fops = {
         .owner = THIS_MODULE,
         .open = sample_char_open,
         .release = sample_char_release,
-        .read = sample_char_read,
-        .write = sample_char_write,
-        .llseek = sample_char_llseek,
+        .read_iter = sample_char_read_iter,
+        .write_iter = sample_char_write_iter,
+        .unlocked_ioctl = sample_char_ioctl,
+        .poll = sample_char_poll,
+        .mmap = sample_char_mmap,
+};
+
+static struct miscdevice sample_char_dev = {
+        .minor = MISC_DYNAMIC_MINOR,
+        .name = DEVICE_NAME,
+        .fops = &fops,
+        .mode = 0666,
 };
 
 static int __init sample_char_init(void) {
+        int error;
+
         printk(KERN_INFO "Initializing sample character device driver\n");
 
-        /* Register a character device with the kernel. Creates a new file in
-         * /proc/devices with the name DEVICE_NAME. Also hooks the file_operations
-         * struct into the kernel for the operations supported by character
-         * devices.
-         * Because 0 was passed, the character device will be given a "random"
-         * device number. Not technically random, but the first non-used major
-         * device number. */
-        major_num = register_chrdev(0, DEVICE_NAME, &fops);
-        if(major_num < 0) {
-                printk(KERN_ALERT "Registering char device %s filed with %d\n", DEVICE_NAME, major_num);
-                return major_num;
+        ring_entries = roundup_pow_of_two(clamp(ring_entries, 2U, (unsigned int) MAX_RING_ENTRIES));
+
+        /* Register a misc character device with the kernel, which creates
+         * /dev/DEVICE_NAME and hooks the file_operations struct into it. The
+         * misc major is shared, and the minor is the first free one. */
+        error = misc_register(&sample_char_dev);
+        if(error) {
+                printk(KERN_ALERT "Registering char device %s failed with %d\n", DEVICE_NAME, error);
+                return error;
         }
 
         return 0;
 }
 
 static void __exit sample_char_exit(void) {
-        unregister_chrdev(major_num, DEVICE_NAME);
+        misc_deregister(&sample_char_dev);
         printk(KERN_INFO "Unregistered %s char device. Unloading module.\n", DEVICE_NAME);
 }
 
@@ -64,84 +119,465 @@ static void __exit sample_char_exit(void) {
  * to a certain file, setting up device minor numbers, allocating memory space
  * for the device file's private information, and so on. */
 static int sample_char_open(struct inode *inode, struct file *filep) {
-        char *working_string = "Hello World\0";
-        unsigned int i;
-        printk(KERN_INFO "Opened the example character device file\n");
-        for(i = 0; i < 12; i++) {
-                msg[i] = working_string[i];
-                printk(KERN_INFO "open: i=%du, @ 0x%p\n", i, &(msg[i]));
-        }
-        printk(KERN_INFO "Before: msg @ %p, msg_last_char @ %p\n", msg, msg_last_char);
-        msg_last_char = &(msg[10]); // Pointer math, go 10 chars past msg
-        printk(KERN_INFO "After: msg @ %p, msg_last_char @ %p\n", msg, msg_last_char);
+        struct sample_char_file *sf;
+
+        sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+        if(!sf) {
+                return -ENOMEM;
+        }
+        // Whole pages, because userspace maps it
+        sf->ring = vmalloc_user(PAGE_ALIGN(struct_size(sf->ring, completions, ring_entries)));
+        if(!sf->ring) {
+                kfree(sf);
+                return -ENOMEM;
+        }
+        sf->mask = ring_entries - 1;
+        sf->ring->mask = sf->mask;
+        mutex_init(&sf->submit_lock);
+        mutex_init(&sf->reap_lock);
+        init_waitqueue_head(&sf->wait);
+        xa_init_flags(&sf->umems, XA_FLAGS_ALLOC);
+
+        filep->private_data = sf;
         return 0;
 }
 
 /* The function passed to the release field of the file_operations struct should
  * clean everything up when this instance of the file being opened is closed.
  * This will involve kfree-ing everything that was allocated in the open
- * function. */
+ * function. A mapping of the ring holds the file open, so it is gone too. */
 static int sample_char_release(struct inode *inode, struct file *filep) {
-        printk(KERN_INFO "Closed the example character device file\n");
-        msg_last_char = 0;
+        struct sample_char_file *sf = filep->private_data;
+        struct sample_char_umem *umem;
+        unsigned long handle;
+
+        xa_for_each(&sf->umems, handle, umem) {
+                kfree(umem);
+        }
+        xa_destroy(&sf->umems);
+        vfree(sf->ring);
+        kfree(sf);
         return 0;
 }
 
-/* Called with the read call of file_operations struct is used. This device
- * behaves like a message queue, so the first string that is placed into this
- * device is preserved until it is read. After the read, the data is no longer
- * accessible. */
-static ssize_t sample_char_read(struct file *filep, char *buffer, size_t length,
-                                loff_t *offset) {
-        ssize_t ret;
-        msg_last_char = msg_last_char + 10;
-        /* If the buffer pointer is the same address as the buffer, then whatever
-         * used to be stored here (if anything) has already been returned in an
-         * earlier read call. Do nothing here, returning 0 that nothing happened. */
-        printk(KERN_INFO "Entered %s for reading\n", DEVICE_NAME);
-        printk(KERN_INFO "read: msg @ %p, msg_last_char @ %p\n", msg, msg_last_char);
-        if(msg_last_char == msg) {
-                return 0;
-        }
-
-        printk(KERN_INFO "Copying %s to user buffer @ %p", msg, buffer);
-        ret = copy_to_user(msg, buffer, length);
-
-        /* If reading less than the amount of information written to the device,
-         * the whole original message is lost (reset msg_last_char to msg's
-         * location). */
-        msg_last_char = msg;
-
-        /* To get the number of bytes transferred, subtract the current memory
-         * address of iter from msg (the base). */
-        return ret;
+/* How many completions are waiting on SF's ring. HEAD may have been moved by
+ * userspace, and is only trusted not to claim more than the ring holds. */
+static u32 sample_char_ready(struct sample_char_file *sf) {
+        u32 ready = smp_load_acquire(&sf->tail) - smp_load_acquire(&sf->ring->head);
+
+        return min(ready, sf->mask + 1);
 }
 
-static ssize_t sample_char_write(struct file *filep, const char *buffer,
-                                 size_t length, loff_t *offset) {
-        ssize_t ret;
-        /* If the buffer pointer is at the end of the buffer, then buffer is full
-         * and we cannot safely write. */
-        if(msg_last_char == (msg + (BUF_LEN - 1))) {
-                return 0;
+static bool sample_char_full(struct sample_char_file *sf) {
+        return sample_char_ready(sf) > sf->mask;
+}
+
+/* Complete VIRTINE straight away. With NOWAIT, a full ring fails with
+ * -EAGAIN, otherwise we sleep until it has room. */
+static int sample_char_submit(struct sample_char_file *sf, u64 virtine, bool nowait) {
+        struct virtine_completion_ts *completion;
+        u64 now;
+        int error;
+
+        mutex_lock(&sf->submit_lock);
+        while(sample_char_full(sf)) {
+                mutex_unlock(&sf->submit_lock);
+                if(nowait) {
+                        return -EAGAIN;
+                }
+                error = wait_event_interruptible(sf->wait, !sample_char_full(sf));
+                if(error) {
+                        return error;
+                }
+                mutex_lock(&sf->submit_lock);
         }
 
-        ret = copy_from_user(msg, buffer, length);
-        printk(KERN_INFO "Writing: %s", buffer);
-        msg_last_char = msg + (length - 1);
+        completion = &sf->ring->completions[sf->tail & sf->mask];
+        now = ktime_get_ns();
+        completion->virtine = virtine;
+        completion->status = 0;
+        completion->flags = VIRTINE_COMPLETION_TIMESTAMPS;
+        completion->queued_ns = now;
+        completion->started_ns = now;
+        completion->finished_ns = now;
+        completion->bytes = atomic64_read(&snapshot_size);
+        // Publish the completion before the tail that covers it
+        smp_store_release(&sf->tail, sf->tail + 1);
+        WRITE_ONCE(sf->ring->tail, sf->tail);
+        mutex_unlock(&sf->submit_lock);
 
-        /* To get the number of bytes transferred, subtract the current memory
-         * address of iter from msg (the base). */
-        return ret;
+        if(wq_has_sleeper(&sf->wait)) {
+                wake_up_interruptible(&sf->wait);
+        }
+        return 0;
+}
+
+/* Whether the user address UADDR is inside of a region SF registered. */
+static bool sample_char_in_umem(struct sample_char_file *sf, u64 uaddr) {
+        struct sample_char_umem *umem;
+        unsigned long handle;
+        bool found = false;
+
+        rcu_read_lock();
+        xa_for_each(&sf->umems, handle, umem) {
+                if(uaddr - umem->uaddr < umem->size) {
+                        found = true;
+                        break;
+                }
+        }
+        rcu_read_unlock();
+
+        return found;
 }
 
-/* Regardless of what is provided, we just reset the msg_last_char to the beginning
- * of the message buffer. */
-static loff_t sample_char_llseek(struct file *filep, loff_t off, int whence) {
-        msg_last_char = msg;
+/* Let the consumer of the last completions handed out know that the ring has
+ * room again. */
+static void sample_char_consumed(struct sample_char_file *sf, u32 head) {
+        smp_store_release(&sf->ring->head, head);
+        if(wq_has_sleeper(&sf->wait)) {
+                wake_up_interruptible(&sf->wait);
+        }
+}
+
+/* read(2) hands out completions as an array of struct virtine_completion,
+ * which the card's device does not do, since it has registers there instead.
+ * Waits for at least one, unless the file is non-blocking. */
+static ssize_t sample_char_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+        struct sample_char_file *sf = iocb->ki_filp->private_data;
+        struct virtine_completion completion = { 0 };
+        const struct virtine_completion_ts *ts;
+        size_t nr = iov_iter_count(to) / sizeof(completion);
+        u32 head, ready, i;
+        int error;
+
+        if(!nr) {
+                return -EINVAL;
+        }
+
+        mutex_lock(&sf->reap_lock);
+        for(;;) {
+                head = READ_ONCE(sf->ring->head);
+                ready = min_t(size_t, sample_char_ready(sf), nr);
+                if(ready) {
+                        break;
+                }
+                // Nothing yet, or someone else reaped it while we slept
+                mutex_unlock(&sf->reap_lock);
+                if((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+                        return -EAGAIN;
+                }
+                error = wait_event_interruptible(sf->wait, sample_char_ready(sf));
+                if(error) {
+                        return error;
+                }
+                mutex_lock(&sf->reap_lock);
+        }
+        for(i = 0; i < ready; i++) {
+                ts = &sf->ring->completions[(head + i) & sf->mask];
+                completion.virtine = ts->virtine;
+                completion.status = ts->status;
+                if(copy_to_iter(&completion, sizeof(completion), to) != sizeof(completion)) {
+                        break;
+                }
+        }
+        sample_char_consumed(sf, head + i);
+        mutex_unlock(&sf->reap_lock);
+
+        return i ? i * sizeof(completion) : -EFAULT;
+}
+
+/* Writes at VIRTINE_FPGA_RQ_OFFSET submit the array of u64 virtine user
+ * addresses they carry, each inside of a registered region. If the ring fills
+ * up part way through, non-blocking writers get back what was written so far
+ * (or -EAGAIN), and everyone else waits for room. There are no registers to
+ * write anywhere else. */
+static ssize_t sample_char_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+        struct sample_char_file *sf = iocb->ki_filp->private_data;
+        bool nowait = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+        ssize_t bytes_written = 0;
+        u64 dirty_virtine;
+        int error;
+
+        if(iocb->ki_pos != VIRTINE_FPGA_RQ_OFFSET) {
+                return -ENXIO;
+        }
+
+        while(iov_iter_count(from) >= sizeof(dirty_virtine)) {
+                if(copy_from_iter(&dirty_virtine, sizeof(dirty_virtine), from) !=
+                   sizeof(dirty_virtine)) {
+                        error = -EFAULT;
+                        goto out;
+                }
+                if(!sample_char_in_umem(sf, dirty_virtine)) {
+                        error = -EFAULT;
+                        goto out;
+                }
+                error = sample_char_submit(sf, dirty_virtine, nowait);
+                if(error) {
+                        goto out;
+                }
+                bytes_written += sizeof(dirty_virtine);
+        }
+
+        return bytes_written;
+
+out:
+        // Report partial progress, like write(2) does
+        return bytes_written ? bytes_written : error;
+}
+
+static long sample_char_register_umem(struct sample_char_file *sf,
+                                      struct virtine_umem_reg __user *ureg) {
+        struct sample_char_umem *umem;
+        struct virtine_umem_reg reg;
+        u64 end;
+        u32 handle;
+        long ret;
+
+        if(copy_from_user(&reg, ureg, sizeof(reg))) {
+                return -EFAULT;
+        }
+        if(!reg.size || check_add_overflow(reg.addr, reg.size, &end) ||
+           !access_ok(u64_to_user_ptr(reg.addr), reg.size)) {
+                return -EINVAL;
+        }
+
+        umem = kzalloc(sizeof(*umem), GFP_KERNEL);
+        if(!umem) {
+                return -ENOMEM;
+        }
+        umem->uaddr = reg.addr;
+        umem->size = reg.size;
+
+        ret = xa_alloc(&sf->umems, &handle, umem, xa_limit_31b, GFP_KERNEL);
+        if(ret) {
+                kfree(umem);
+                return ret;
+        }
+
+        reg.handle = handle;
+        if(copy_to_user(ureg, &reg, sizeof(reg))) {
+                xa_erase(&sf->umems, handle);
+                kfree(umem);
+                return -EFAULT;
+        }
+
         return 0;
 }
 
+static long sample_char_unregister_umem(struct sample_char_file *sf,
+                                        unsigned long handle) {
+        struct sample_char_umem *umem = xa_erase(&sf->umems, handle);
+
+        if(!umem) {
+                return -ENOENT;
+        }
+
+        // Submitters may still be walking the regions
+        kfree_rcu(umem, rcu);
+        return 0;
+}
+
+static long sample_char_submit_fixed(struct sample_char_file *sf,
+                                     struct virtine_fixed_submit __user *usubmit,
+                                     bool nowait) {
+        struct virtine_fixed_submit submit;
+        struct sample_char_umem *umem;
+        u64 virtine;
+
+        if(copy_from_user(&submit, usubmit, sizeof(submit))) {
+                return -EFAULT;
+        }
+
+        rcu_read_lock();
+        umem = xa_load(&sf->umems, submit.handle);
+        if(!umem) {
+                rcu_read_unlock();
+                return -ENOENT;
+        }
+        if(submit.offset >= umem->size) {
+                rcu_read_unlock();
+                return -EINVAL;
+        }
+        virtine = umem->uaddr + submit.offset;
+        rcu_read_unlock();
+
+        return sample_char_submit(sf, virtine, nowait);
+}
+
+/* Copy up to REAP->nr completions out to userspace, waiting for at least
+ * REAP->min_complete of them. TIMESTAMPED completions are struct
+ * virtine_completion_ts, which is what the ring holds. */
+static long sample_char_do_reap(struct sample_char_file *sf, struct virtine_reap *reap,
+                                bool timestamped) {
+        size_t size = timestamped ? sizeof(struct virtine_completion_ts) :
+                                    sizeof(struct virtine_completion);
+        struct virtine_completion completion = { 0 };
+        const struct virtine_completion_ts *ts;
+        char __user *ucompletions;
+        u32 head, ready, i;
+        long ret;
+
+        // The ring can never hold more than it has entries
+        if(reap->min_complete > reap->nr || reap->min_complete > sf->mask + 1) {
+                return -EINVAL;
+        }
+        ucompletions = u64_to_user_ptr(reap->completions);
+        if(!access_ok(ucompletions, reap->nr * size)) {
+                return -EFAULT;
+        }
+
+        if(reap->min_complete) {
+                ret = wait_event_interruptible(sf->wait,
+                                               sample_char_ready(sf) >= reap->min_complete);
+                if(ret) {
+                        return ret;
+                }
+        }
+
+        mutex_lock(&sf->reap_lock);
+        head = READ_ONCE(sf->ring->head);
+        ready = min(sample_char_ready(sf), reap->nr);
+        for(i = 0; i < ready; i++) {
+                ts = &sf->ring->completions[(head + i) & sf->mask];
+                if(timestamped) {
+                        ret = copy_to_user(ucompletions + i * size, ts, size);
+                } else {
+                        completion.virtine = ts->virtine;
+                        completion.status = ts->status;
+                        ret = copy_to_user(ucompletions + i * size, &completion, size);
+                }
+                if(ret) {
+                        break;
+                }
+        }
+        sample_char_consumed(sf, head + i);
+        mutex_unlock(&sf->reap_lock);
+
+        return (i == ready) ? i : -EFAULT;
+}
+
+static long sample_char_reap(struct sample_char_file *sf,
+                             struct virtine_reap __user *ureap, bool timestamped) {
+        struct virtine_reap reap;
+
+        if(copy_from_user(&reap, ureap, sizeof(reap))) {
+                return -EFAULT;
+        }
+
+        return sample_char_do_reap(sf, &reap, timestamped);
+}
+
+/* Completions are ready the moment they are submitted, so there is never
+ * anything to spin for. */
+static long sample_char_poll_completions(struct sample_char_file *sf,
+                                         struct virtine_poll __user *upoll,
+                                         bool timestamped) {
+        struct virtine_reap reap;
+        struct virtine_poll poll;
+
+        if(copy_from_user(&poll, upoll, sizeof(poll))) {
+                return -EFAULT;
+        }
+
+        reap.completions = poll.completions;
+        reap.nr = poll.nr;
+        reap.min_complete = poll.min_complete;
+        return sample_char_do_reap(sf, &reap, timestamped);
+}
+
+/* Only the snapshot's size is needed, so nothing is copied in. */
+static long sample_char_set_snapshot(struct virtine_snapshot __user *usnapshot) {
+        struct virtine_snapshot snapshot;
+
+        if(copy_from_user(&snapshot, usnapshot, sizeof(snapshot))) {
+                return -EFAULT;
+        }
+        if(!snapshot.size) {
+                return -EINVAL;
+        }
+        if(!access_ok((void __user *) snapshot.addr, snapshot.size)) {
+                return -EFAULT;
+        }
+
+        atomic64_set(&snapshot_size, snapshot.size);
+        return 0;
+}
+
+/* Only the ioctls that submit and complete virtines mean anything here. The
+ * batch factor is accepted and ignored, and the doorbell wakes submitters
+ * waiting on a ring that was emptied through the mapping. Pools and tenants
+ * are not supported. */
+static long sample_char_ioctl(struct file *filep, unsigned int cmd, unsigned long args) {
+        struct sample_char_file *sf = filep->private_data;
+        long ret;
+
+        switch(cmd) {
+        case FPGA_CHAR_MODIFY_BATCH_FACTOR:
+                ret = 0;
+                break;
+        case FPGA_CHAR_GET_MAX_NUM_VIRTINES:
+                ret = put_user((unsigned long) sf->mask + 1, (unsigned long __user *) args);
+                break;
+        case FPGA_CHAR_RING_DOORBELL:
+                wake_up_interruptible(&sf->wait);
+                ret = 0;
+                break;
+        case FPGA_CHAR_SET_SNAPSHOT:
+                ret = sample_char_set_snapshot((struct virtine_snapshot __user *) args);
+                break;
+        case FPGA_CHAR_REGISTER_UMEM:
+                ret = sample_char_register_umem(sf, (struct virtine_umem_reg __user *) args);
+                break;
+        case FPGA_CHAR_UNREGISTER_UMEM:
+                // args is just the handle returned when registering
+                ret = sample_char_unregister_umem(sf, args);
+                break;
+        case FPGA_CHAR_SUBMIT_FIXED:
+                ret = sample_char_submit_fixed(sf, (struct virtine_fixed_submit __user *) args,
+                                               filep->f_flags & O_NONBLOCK);
+                break;
+        case FPGA_CHAR_REAP_COMPLETIONS:
+        case FPGA_CHAR_REAP_TIMESTAMPED:
+                ret = sample_char_reap(sf, (struct virtine_reap __user *) args,
+                                       cmd == FPGA_CHAR_REAP_TIMESTAMPED);
+                break;
+        case FPGA_CHAR_POLL_COMPLETIONS:
+        case FPGA_CHAR_POLL_TIMESTAMPED:
+                ret = sample_char_poll_completions(sf, (struct virtine_poll __user *) args,
+                                                   cmd == FPGA_CHAR_POLL_TIMESTAMPED);
+                break;
+        default:
+                ret = -ENOTTY;
+        }
+        return ret;
+}
+
+static __poll_t sample_char_poll(struct file *filep, poll_table *wait) {
+        struct sample_char_file *sf = filep->private_data;
+        __poll_t mask = 0;
+
+        poll_wait(filep, &sf->wait, wait);
+        if(sample_char_ready(sf)) {
+                mask |= EPOLLIN | EPOLLRDNORM;
+        }
+        if(!sample_char_full(sf)) {
+                mask |= EPOLLOUT | EPOLLWRNORM;
+        }
+
+        return mask;
+}
+
+// The completion ring is the only thing to map, at offset 0
+static int sample_char_mmap(struct file *filep, struct vm_area_struct *vma) {
+        struct sample_char_file *sf = filep->private_data;
+
+        if(vma->vm_pgoff) {
+                return -EINVAL;
+        }
+        return remap_vmalloc_range(vma, sf->ring, 0);
+}
+
 module_init(sample_char_init);
 module_exit(sample_char_exit);
 MODULE_AUTHOR("Karl Hallsby <karl@hallsby.com>");
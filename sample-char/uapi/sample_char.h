@@ -0,0 +1,26 @@
+/* What sample_char adds on top of the /dev/virtine_fpga interface in
+ * fpga-char/uapi/virtine_fpga.h, which it otherwise speaks unchanged. */
+#ifndef _UAPI_SAMPLE_CHAR_H
+#define _UAPI_SAMPLE_CHAR_H
+
+#include <linux/types.h>
+
+#include "virtine_fpga.h"
+
+#define SAMPLE_CHAR_DEV "/dev/virtine_loopback"
+
+/* Every open file's completion ring, which mmap at offset 0 maps. The driver
+ * fills in completions[tail & mask] and then moves TAIL on; whoever consumes
+ * them moves HEAD on. Completions can be consumed straight out of the mapping,
+ * or through the reap ioctls or read(2), but only one of those at a time.
+ * Once the ring is full, submissions wait for HEAD to move. A consumer that
+ * moved HEAD itself rings the doorbell (FPGA_CHAR_RING_DOORBELL) to wake them. */
+struct sample_char_ring {
+        __u32 head;
+        __u32 tail;
+        __u32 mask; // The ring has mask + 1 entries
+        __u32 reserved;
+        struct virtine_completion_ts completions[];
+};
+
+#endif